@@ -0,0 +1,543 @@
+#define _POSIX_C_SOURCE 200809L /* clock_gettime */
+#include "stegano.h"
+#include <stdio.h> /* printf */
+#include <stdlib.h> /* rand, srand */
+#include <string.h> /* strcmp */
+#include <time.h> /* clock_gettime */
+#include <fcntl.h> /* open, posix_fadvise */
+#include <unistd.h> /* fdatasync, unlink, rmdir */
+
+/* Synthetic cover used by the benchmarks, large enough not to fit in
+the CPU caches. */
+#define BENCHWIDTH 4096
+#define BENCHHEIGHT 4096
+#define BENCHREPEATS 5
+
+/* Message size for the embedding benchmarks. */
+#define BENCHMESSAGE (1 << 20)
+
+/* Message size for the entropy coder benchmark, and the sections its
+mixed message changes content at. */
+#define BENCHCODECMESSAGE (4 << 20)
+#define BENCHSECTION (256 << 10)
+
+/* Covers written to disk for the I/O benchmark, 3 MB each. */
+#define BENCHFILES 32
+#define BENCHFILESIZE 1024
+
+typedef struct
+{
+    const char* name;
+    void (*run)(void);
+} bench_t;
+
+void benchScatter(void);
+void benchCipher(void);
+void benchIo(void);
+void benchEntropy(void);
+
+static const bench_t benches[] =
+{
+    {"scatter", benchScatter},
+    {"cipher", benchCipher},
+    {"io", benchIo},
+    {"entropy", benchEntropy}
+};
+
+/*
+Returns a monotonic timestamp in seconds.
+*/
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+Fills an image with random pixels. The caller frees it with freeImage().
+
+Parameters:
+    - pic (image_t*): the image to fill in.
+    - width, height (int): its size in pixels.
+
+Returns (int):
+    0, or -1 if memory ran out.
+*/
+static int makeImage(image_t* pic, int width, int height)
+{
+    size_t i, bytes = (size_t)width * height * sizeof(rgb_t);
+
+    pic->width = width;
+    pic->height = height;
+    pic->offset = 0;
+    pic->header = NULL;
+    pic->rgb = stegAlloc(bytes);
+    if (!pic->rgb)
+    {
+        return -1;
+    }
+    for (i = 0; i < bytes; i++)
+    {
+        ((unsigned char*)pic->rgb)[i] = (unsigned char)rand();
+    }
+    return 0;
+}
+
+/*
+Fills a message with random bytes, never zero so it stays one string.
+*/
+static void makeMessage(char* message, size_t length)
+{
+    size_t i;
+    for (i = 0; i < length; i++)
+    {
+        message[i] = (char)(1 + rand() % 255);
+    }
+    message[length] = '\0';
+}
+
+/*
+Times embedding and extracting a 1 MiB raw payload in a 4096x4096 image,
+in the plain order and scattered by a key. Scattering shuffles 64 byte
+blocks, so it should stay within a small factor of the plain order.
+*/
+void benchScatter(void)
+{
+    image_t pic;
+    stegctx_t ctx;
+    int pass, i;
+    char* message = stegAlloc(BENCHMESSAGE + 1);
+
+    if (!message || makeImage(&pic, BENCHWIDTH, BENCHHEIGHT) != 0)
+    {
+        printf("scatter: out of memory\n");
+        stegFree(message);
+        return;
+    }
+    makeMessage(message, BENCHMESSAGE);
+
+    initContext(&ctx);
+    ctx.codec = CODEC_RAW;
+    printf("%-10s %12s %12s\n", "order", "embed MB/s", "extract MB/s");
+    for (pass = 0; pass < 2; pass++)
+    {
+        double embed = 0, extract = 0;
+        int status = STATUS_OK;
+
+        setScatterKey(&ctx, pass ? "benchmark key" : NULL);
+        status = buildPayload(&ctx, message);
+        for (i = 0; i < BENCHREPEATS && status == STATUS_OK; i++)
+        {
+            double start = now();
+            status = applyPayload(&ctx, &pic);
+            double middle = now();
+            if (status == STATUS_OK)
+            {
+                status = extractPayload(&ctx, &pic);
+            }
+            embed += middle - start;
+            extract += now() - middle;
+        }
+        if (status != STATUS_OK || strcmp(ctx.message, message) != 0)
+        {
+            printf("scatter: %s\n", statusMessage(status == STATUS_OK ? \
+                ERROR_CORRUPT : status));
+            break;
+        }
+
+        double megabytes = (double)ctx.bit_count / 8 / 1e6 * BENCHREPEATS;
+        printf("%-10s %12.1f %12.1f\n", pass ? "scattered" : "plain", \
+            megabytes / embed, megabytes / extract);
+    }
+
+    freeContext(&ctx);
+    freeImage(&pic);
+    stegFree(message);
+}
+
+/*
+Times building and embedding a 1 MiB raw payload with and without
+ChaCha20 encryption, to show what the cipher adds to an encode.
+*/
+void benchCipher(void)
+{
+    image_t pic;
+    stegctx_t ctx;
+    int pass, i;
+    char* message = stegAlloc(BENCHMESSAGE + 1);
+
+    if (!message || makeImage(&pic, BENCHWIDTH, BENCHHEIGHT) != 0)
+    {
+        printf("cipher: out of memory\n");
+        stegFree(message);
+        return;
+    }
+    makeMessage(message, BENCHMESSAGE);
+
+    initContext(&ctx);
+    ctx.codec = CODEC_RAW;
+    printf("%-10s %12s\n", "payload", "encode MB/s");
+    for (pass = 0; pass < 2; pass++)
+    {
+        double elapsed = 0;
+        int status = STATUS_OK;
+
+        setPassphrase(&ctx, pass ? "benchmark passphrase" : NULL);
+        for (i = 0; i < BENCHREPEATS && status == STATUS_OK; i++)
+        {
+            double start = now();
+            status = buildPayload(&ctx, message);
+            if (status == STATUS_OK)
+            {
+                status = applyPayload(&ctx, &pic);
+            }
+            elapsed += now() - start;
+        }
+        if (status == STATUS_OK)
+        {
+            status = extractPayload(&ctx, &pic);
+        }
+        if (status != STATUS_OK || strcmp(ctx.message, message) != 0)
+        {
+            printf("cipher: %s\n", statusMessage(status == STATUS_OK ? \
+                ERROR_CORRUPT : status));
+            break;
+        }
+
+        double megabytes = (double)BENCHMESSAGE / 1e6 * BENCHREPEATS;
+        printf("%-10s %12.1f\n", pass ? "chacha20" : "plain", \
+            megabytes / elapsed);
+    }
+
+    freeContext(&ctx);
+    freeImage(&pic);
+    stegFree(message);
+}
+
+/*
+Fills a message with sections of text-like words, hex digits and random
+bytes in turn, so the byte statistics change every BENCHSECTION bytes.
+*/
+static void makeMixedMessage(char* message, size_t length)
+{
+    static const char* words[] = {"the ", "of ", "payload ", "and ", \
+        "image ", "to ", "a ", "message ", "in ", "block "};
+    static const char hex[] = "0123456789abcdef";
+    size_t i = 0;
+
+    while (i < length)
+    {
+        int section = (int)(i / BENCHSECTION % 3);
+        if (section == 0)
+        {
+            const char* word = words[rand() % 10];
+            while (*word && i < length)
+            {
+                message[i++] = *word++;
+            }
+        }
+        else if (section == 1)
+        {
+            message[i++] = hex[rand() % 16];
+        }
+        else
+        {
+            message[i++] = (char)(1 + rand() % 255);
+        }
+    }
+    message[length] = '\0';
+}
+
+/*
+Fills a message with letters whose frequencies fall off geometrically, a
+distribution where Huffman codes waste part of a bit on most symbols.
+*/
+static void makeSkewedMessage(char* message, size_t length)
+{
+    size_t i;
+    for (i = 0; i < length; i++)
+    {
+        int letter = 0;
+        while (letter < 25 && rand() % 10 < 3)
+        {
+            letter++;
+        }
+        message[i] = (char)('a' + letter);
+    }
+    message[length] = '\0';
+}
+
+/*
+Times building and extracting a 4 MiB payload with each entropy coder:
+the single-table Huffman codec, the block codec, which gives every block
+its own table and codes the blocks on all CPUs, tANS, and the single pass
+adaptive coder. Each runs on a message of mixed content and on a skewed
+one.
+*/
+void benchEntropy(void)
+{
+    static const int codecs[] = {CODEC_HUFFMAN, CODEC_BLOCKS, CODEC_TANS, \
+        CODEC_ADAPTIVE};
+    int count = sizeof(codecs) / sizeof(codecs[0]);
+    image_t pic;
+    stegctx_t ctx;
+    int kind, pass, i;
+    char* message = stegAlloc(BENCHCODECMESSAGE + 1);
+
+    if (!message || makeImage(&pic, BENCHWIDTH, BENCHHEIGHT) != 0)
+    {
+        printf("entropy: out of memory\n");
+        stegFree(message);
+        return;
+    }
+
+    initContext(&ctx);
+    printf("%-8s %-10s %12s %12s %12s\n", "message", "codec", "build MB/s", \
+        "extract MB/s", "bits/byte");
+    for (kind = 0; kind < 2; kind++)
+    {
+        if (kind == 0)
+        {
+            makeMixedMessage(message, BENCHCODECMESSAGE);
+        }
+        else
+        {
+            makeSkewedMessage(message, BENCHCODECMESSAGE);
+        }
+
+        for (pass = 0; pass < count; pass++)
+        {
+            double build = 0, extract = 0;
+            int status = STATUS_OK;
+
+            ctx.codec = codecs[pass];
+            for (i = 0; i < BENCHREPEATS && status == STATUS_OK; i++)
+            {
+                double start = now();
+                status = buildPayload(&ctx, message);
+                double middle = now();
+                if (status == STATUS_OK)
+                {
+                    status = applyPayload(&ctx, &pic);
+                }
+                double applied = now();
+                if (status == STATUS_OK)
+                {
+                    status = extractPayload(&ctx, &pic);
+                }
+                build += middle - start;
+                extract += now() - applied;
+            }
+            if (status != STATUS_OK || strcmp(ctx.message, message) != 0)
+            {
+                printf("entropy: %s\n", statusMessage(status == STATUS_OK ? \
+                    ERROR_CORRUPT : status));
+                break;
+            }
+
+            double megabytes = (double)BENCHCODECMESSAGE / 1e6 * BENCHREPEATS;
+            printf("%-8s %-10s %12.1f %12.1f %12.2f\n", \
+                kind ? "skewed" : "mixed", codecName(codecs[pass]), \
+                megabytes / build, megabytes / extract, \
+                (double)ctx.payload_bits / BENCHCODECMESSAGE);
+        }
+    }
+
+    freeContext(&ctx);
+    freeImage(&pic);
+    stegFree(message);
+}
+
+/*
+Writes a square BMP of random pixels to path.
+
+Returns (int):
+    0, or -1 if it can't be written.
+*/
+static int writeCover(const char* path, int size)
+{
+    unsigned char header[BMP_HEADERS_SIZE] = {'B', 'M'};
+    size_t i, row = (size_t)size * 3 + calcPadding(size);
+    size_t bytes = row * size;
+    unsigned char* pixels = stegAlloc(bytes);
+    FILE* file;
+
+    if (!pixels)
+    {
+        return -1;
+    }
+    for (i = 0; i < bytes; i++)
+    {
+        pixels[i] = (unsigned char)rand();
+    }
+
+    /* File size, pixel offset, then the BITMAPINFOHEADER fields. */
+    for (i = 0; i < 4; i++)
+    {
+        header[2 + i] = (unsigned char)((bytes + BMP_HEADERS_SIZE) >> (8 * i));
+        header[18 + i] = (unsigned char)(size >> (8 * i));
+        header[22 + i] = (unsigned char)(size >> (8 * i));
+        header[34 + i] = (unsigned char)(bytes >> (8 * i));
+    }
+    header[10] = BMP_HEADERS_SIZE;
+    header[14] = 40;
+    header[26] = 1;
+    header[28] = 24;
+
+    file = fopen(path, "wb");
+    int ok = file && fwrite(header, 1, sizeof(header), file) == sizeof(header) \
+        && fwrite(pixels, 1, bytes, file) == bytes;
+    if (file && fclose(file) != 0)
+    {
+        ok = 0;
+    }
+    stegFree(pixels);
+    return ok ? 0 : -1;
+}
+
+/*
+Flushes files and drops them from the page cache, so the next read comes
+from the disk.
+*/
+static void dropCache(char** paths, int count)
+{
+    int i;
+    for (i = 0; i < count; i++)
+    {
+        int fd = open(paths[i], O_RDONLY);
+        if (fd >= 0)
+        {
+            fdatasync(fd);
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            close(fd);
+        }
+    }
+}
+
+/*
+Times encodeMany over 32 covers of 3 MB on disk with each I/O engine, cold
+(covers dropped from the page cache first) and warm. The figures count the
+bytes read and written. io_uring should win cold, where several reads are
+in flight at once, and roughly tie with pread warm.
+*/
+void benchIo(void)
+{
+    char dir[] = "/tmp/steganobenchXXXXXX";
+    char* infiles[BENCHFILES];
+    char* outfiles[BENCHFILES];
+    int statuses[BENCHFILES];
+    char message[4097];
+    int i, engine, cold, made = 0;
+    stegctx_t ctx;
+
+    if (!mkdtemp(dir))
+    {
+        printf("io: can't create a directory in /tmp\n");
+        return;
+    }
+    for (; made < BENCHFILES; made++)
+    {
+        infiles[made] = stegAlloc(sizeof(dir) + 16);
+        outfiles[made] = stegAlloc(sizeof(dir) + 16);
+        if (!infiles[made] || !outfiles[made])
+        {
+            stegFree(infiles[made]);
+            stegFree(outfiles[made]);
+            break;
+        }
+        sprintf(infiles[made], "%s/in%d.bmp", dir, made);
+        sprintf(outfiles[made], "%s/out%d.bmp", dir, made);
+        if (writeCover(infiles[made], BENCHFILESIZE) != 0)
+        {
+            made++;
+            break;
+        }
+    }
+    makeMessage(message, sizeof(message) - 1);
+
+    initContext(&ctx);
+    double megabytes = 2.0 * BENCHFILES * (BMP_HEADERS_SIZE + \
+        (double)BENCHFILESIZE * (BENCHFILESIZE * 3 + \
+        calcPadding(BENCHFILESIZE))) / 1e6;
+    printf("%-10s %12s %12s\n", "engine", "cold MB/s", "warm MB/s");
+    for (engine = IO_ENGINE_URING; made == BENCHFILES && \
+        engine <= IO_ENGINE_PREAD; engine++)
+    {
+        double elapsed[2] = {0, 0};
+        int status = STATUS_OK;
+
+        ctx.io_engine = engine;
+        for (cold = 1; cold >= 0 && status == STATUS_OK; cold--)
+        {
+            for (i = 0; i < BENCHREPEATS && status == STATUS_OK; i++)
+            {
+                if (cold)
+                {
+                    dropCache(infiles, BENCHFILES);
+                    dropCache(outfiles, BENCHFILES);
+                }
+                double start = now();
+                status = encodeMany(&ctx, message, infiles, outfiles, \
+                    BENCHFILES, statuses, 0);
+                elapsed[cold] += now() - start;
+            }
+        }
+        for (i = 0; i < BENCHFILES && status == STATUS_OK; i++)
+        {
+            status = statuses[i];
+        }
+        if (status != STATUS_OK)
+        {
+            printf("%-10s %s\n", ioEngineName(engine), statusMessage(status));
+            continue;
+        }
+        printf("%-10s %12.1f %12.1f\n", ioEngineName(engine), \
+            megabytes * BENCHREPEATS / elapsed[1], \
+            megabytes * BENCHREPEATS / elapsed[0]);
+    }
+    if (made != BENCHFILES)
+    {
+        printf("io: can't write the covers to %s\n", dir);
+    }
+    freeContext(&ctx);
+
+    for (i = 0; i < made; i++)
+    {
+        unlink(infiles[i]);
+        unlink(outfiles[i]);
+        stegFree(infiles[i]);
+        stegFree(outfiles[i]);
+    }
+    rmdir(dir);
+}
+
+/* - MAIN FUNCTION - */
+int main(int argc, char* argv[])
+{
+    int i, j, ran = 0;
+    int count = sizeof(benches) / sizeof(benches[0]);
+
+    srand(1);
+    for (i = 0; i < count; i++)
+    {
+        /* With arguments, run only the benchmarks named. */
+        int selected = argc < 2;
+        for (j = 1; j < argc; j++)
+        {
+            selected |= strcmp(argv[j], benches[i].name) == 0;
+        }
+        if (selected)
+        {
+            printf("== %s ==\n", benches[i].name);
+            benches[i].run();
+            ran++;
+        }
+    }
+    if (!ran)
+    {
+        printf("Unknown benchmark.\n");
+        return 1;
+    }
+    return 0;
+}
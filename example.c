@@ -0,0 +1,173 @@
+#define _POSIX_C_SOURCE 200809L /* clock_gettime */
+#include "libstegano.h"
+#include <stdio.h> /* printf */
+#include <stdlib.h> /* malloc, atoi */
+#include <string.h> /* memset, strcmp */
+#include <time.h> /* clock_gettime */
+
+/* Example client of libstegano: one process and one handle encoding and
+decoding an in-memory cover over and over, as a service handling jobs
+would, instead of running the CLI for each one.
+
+Usage: example.out [calls] [codec] */
+
+#define EXAMPLEWIDTH 256
+#define EXAMPLEHEIGHT 256
+#define EXAMPLECALLS 5000
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Bytes the library holds from this program, through countAllocate().
+The library's worker threads allocate too, so it is updated atomically. */
+static size_t held_bytes;
+
+static void* countAllocate(size_t size, void* user)
+{
+    (void)user;
+    __sync_fetch_and_add(&held_bytes, size);
+    return malloc(size);
+}
+
+static void countRelease(void* ptr, size_t size, void* user)
+{
+    (void)user;
+    __sync_fetch_and_sub(&held_bytes, size);
+    free(ptr);
+}
+
+static void putLE(unsigned char* bytes, unsigned long value, int size)
+{
+    int i;
+    for (i = 0; i < size; i++)
+    {
+        bytes[i] = (unsigned char)(value >> (8 * i));
+    }
+}
+
+/*
+Builds a 24-bit, bottom-up BMP filled with a gradient.
+
+Parameters:
+    - width (int): image width in pixels.
+    - height (int): image height in pixels.
+    - length (size_t*): receives the size of the BMP in bytes.
+
+Returns (unsigned char*):
+    The BMP, freed with free(), or NULL if out of memory.
+*/
+static unsigned char* makeCover(int width, int height, size_t* length)
+{
+    size_t stride = ((size_t)width * 3 + 3) & ~(size_t)3;
+    size_t size = 54 + stride * height;
+    unsigned char* bmp = malloc(size);
+    size_t i;
+
+    if (!bmp)
+    {
+        return NULL;
+    }
+    memset(bmp, 0, 54);
+    bmp[0] = 'B';
+    bmp[1] = 'M';
+    putLE(bmp + 2, size, 4);
+    putLE(bmp + 10, 54, 4);
+    putLE(bmp + 14, 40, 4);
+    putLE(bmp + 18, width, 4);
+    putLE(bmp + 22, height, 4);
+    putLE(bmp + 26, 1, 2);
+    putLE(bmp + 28, 24, 2);
+    putLE(bmp + 34, stride * height, 4);
+    for (i = 54; i < size; i++)
+    {
+        bmp[i] = (unsigned char)(i * 7);
+    }
+    *length = size;
+    return bmp;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* message = "Meet at the north gate at 06:00, bring the second key.";
+    stegano_allocator_t allocator;
+    stegano_stats_t stats;
+    const char* codec = argc > 2 ? argv[2] : "best";
+    int calls = argc > 1 ? atoi(argv[1]) : EXAMPLECALLS;
+    const unsigned char* encoded;
+    const char* decoded;
+    size_t cover_length, encoded_length, decoded_length;
+    unsigned char* cover;
+    stegano_t* handle;
+    double start, elapsed;
+    int i, status = STEGANO_OK;
+
+    if (steganoVersion() >> 16 != STEGANO_VERSION_MAJOR)
+    {
+        fprintf(stderr, "libstegano %d.%d does not match this header.\n",
+                steganoVersion() >> 16, (steganoVersion() >> 8) & 0xff);
+        return 1;
+    }
+
+    /* The allocator goes in before the first handle. */
+    allocator.allocate = countAllocate;
+    allocator.release = countRelease;
+    allocator.user = NULL;
+    steganoSetAllocator(&allocator);
+
+    cover = makeCover(EXAMPLEWIDTH, EXAMPLEHEIGHT, &cover_length);
+    handle = steganoCreate();
+    if (!cover || !handle || calls < 1)
+    {
+        fprintf(stderr, "%s\n", steganoStatusMessage(cover && handle ?
+                STEGANO_ERROR_ARGUMENT : STEGANO_ERROR_MEMORY));
+        free(cover);
+        steganoDestroy(handle);
+        return 1;
+    }
+    status = steganoSetCodec(handle, codec);
+
+    /* Every call goes through the same handle, whose buffers stay
+    warm, and nothing is printed until the end. */
+    start = now();
+    for (i = 0; i < calls && status == STEGANO_OK; i++)
+    {
+        status = steganoEncodeBuffer(handle, cover, cover_length, message,
+                                     &encoded, &encoded_length);
+        if (status == STEGANO_OK)
+        {
+            status = steganoDecodeBuffer(handle, encoded, encoded_length,
+                                         &decoded, &decoded_length);
+        }
+        if (status == STEGANO_OK && strcmp(decoded, message) != 0)
+        {
+            status = STEGANO_ERROR_CORRUPT;
+        }
+    }
+    elapsed = now() - start;
+
+    if (status != STEGANO_OK)
+    {
+        fprintf(stderr, "Call %d failed: %s\n", i, steganoStatusMessage(status));
+    }
+    else
+    {
+        printf("libstegano %d.%d.%d, %dx%d cover, codec %s\n",
+               STEGANO_VERSION_MAJOR, STEGANO_VERSION_MINOR, STEGANO_VERSION_PATCH,
+               EXAMPLEWIDTH, EXAMPLEHEIGHT, codec);
+        printf("%d encode+decode round trips in %.3f s: %.0f calls/s\n",
+               calls, elapsed, 2 * calls / elapsed);
+        /* The stats cover the last call, the warm handle's steady state. */
+        steganoGetStats(&stats);
+        printf("Last call: %lu allocations, peak %lu bytes, handle holds %lu bytes\n",
+               stats.allocations, (unsigned long)stats.peak_bytes,
+               (unsigned long)held_bytes);
+    }
+
+    free(cover);
+    steganoDestroy(handle);
+    return status == STEGANO_OK ? 0 : 1;
+}
@@ -0,0 +1,173 @@
+#include "libstegano.h"
+#include "stegano.h"
+
+/* The public status codes are the library's own, so they are passed
+   through unchanged. These fail to compile if the two drift apart. */
+typedef char stegano_check_ok[STEGANO_OK == STATUS_OK ? 1 : -1];
+typedef char stegano_check_open[STEGANO_ERROR_OPEN == ERROR_OPEN ? 1 : -1];
+typedef char stegano_check_format[STEGANO_ERROR_FORMAT == ERROR_FORMAT ? 1 : -1];
+typedef char stegano_check_memory[STEGANO_ERROR_MEMORY == ERROR_MEMORY ? 1 : -1];
+typedef char stegano_check_empty[STEGANO_ERROR_EMPTY == ERROR_EMPTY ? 1 : -1];
+typedef char stegano_check_large[STEGANO_ERROR_TOO_LARGE == ERROR_TOO_LARGE ? 1 : -1];
+typedef char stegano_check_small[STEGANO_ERROR_TOO_SMALL == ERROR_TOO_SMALL ? 1 : -1];
+typedef char stegano_check_write[STEGANO_ERROR_WRITE == ERROR_WRITE ? 1 : -1];
+typedef char stegano_check_corrupt[STEGANO_ERROR_CORRUPT == ERROR_CORRUPT ? 1 : -1];
+typedef char stegano_check_passphrase[STEGANO_ERROR_PASSPHRASE == ERROR_PASSPHRASE ? 1 : -1];
+typedef char stegano_check_sharded[STEGANO_ERROR_SHARDED == ERROR_SHARDED ? 1 : -1];
+typedef char stegano_check_shard[STEGANO_ERROR_MISSING_SHARD == ERROR_MISSING_SHARD ? 1 : -1];
+
+/* A handle is a reusable context; the public header keeps it opaque so
+   stegctx_t can change without breaking callers. */
+struct stegano {
+    stegctx_t ctx;
+};
+
+int steganoVersion(void) {
+    return STEGANO_VERSION;
+}
+
+/* Describes a status code, including the ones only the public
+ * interface returns.
+ *
+ * Input:
+ *  - int status: A status returned by a stegano*() function.
+ * Output:
+ *  - const char *: Static string describing the status.
+ */
+const char *steganoStatusMessage(int status) {
+    if(status == STEGANO_ERROR_ARGUMENT) return "Invalid argument.";
+    return statusMessage(status);
+}
+
+/* Installs the allocator every later library allocation goes through.
+ * Blocks already allocated would be released through the wrong one, so
+ * it must come before the first handle.
+ *
+ * Input:
+ *  - const stegano_allocator_t *allocator: The allocator, or NULL for
+ *                                          malloc() and free().
+ * Output:
+ *  - STEGANO_OK, or STEGANO_ERROR_ARGUMENT if either function is missing.
+ */
+int steganoSetAllocator(const stegano_allocator_t *allocator) {
+    allocator_t hook;
+    if(!allocator) {
+        setAllocator(NULL);
+        return STEGANO_OK;
+    }
+    if(!allocator->allocate || !allocator->release) return STEGANO_ERROR_ARGUMENT;
+    hook.allocate = allocator->allocate;
+    hook.release = allocator->release;
+    hook.user = allocator->user;
+    setAllocator(&hook);
+    return STEGANO_OK;
+}
+
+/* Copies the calling thread's allocation counters. Every encode and
+ * decode resets them on entry, so they describe the last call.
+ *
+ * Input:
+ *  - stegano_stats_t *stats: Receives the counters.
+ * Output:
+ *  - STEGANO_OK, or STEGANO_ERROR_ARGUMENT if stats is NULL.
+ */
+int steganoGetStats(stegano_stats_t *stats) {
+    allocstats_t counters;
+    if(!stats) return STEGANO_ERROR_ARGUMENT;
+    counters = getAllocStats();
+    stats->current_bytes = counters.current_bytes;
+    stats->peak_bytes = counters.peak_bytes;
+    stats->allocations = counters.allocations;
+    stats->releases = counters.releases;
+    return STEGANO_OK;
+}
+
+/* Allocates a handle through the library's allocator.
+ *
+ * Output:
+ *  - stegano_t *: The new handle, or NULL if out of memory.
+ */
+stegano_t *steganoCreate(void) {
+    stegano_t *handle = stegAlloc(sizeof(*handle));
+    if(handle) initContext(&handle->ctx);
+    return handle;
+}
+
+/* Frees a handle and every buffer it holds. NULL is ignored. */
+void steganoDestroy(stegano_t *handle) {
+    if(!handle) return;
+    freeContext(&handle->ctx);
+    stegFree(handle);
+}
+
+/* Picks the codec later encodes use.
+ *
+ * Input:
+ *  - stegano_t *handle: The handle to set.
+ *  - const char *name: A codec name, or "best" or "fast".
+ * Output:
+ *  - STEGANO_OK, or STEGANO_ERROR_ARGUMENT for an unknown name.
+ */
+int steganoSetCodec(stegano_t *handle, const char *name) {
+    int codec;
+    if(!handle || !name) return STEGANO_ERROR_ARGUMENT;
+    codec = codecId(name);
+    if(codec == ERROR_FORMAT) return STEGANO_ERROR_ARGUMENT;
+    handle->ctx.codec = codec;
+    return STEGANO_OK;
+}
+
+int steganoSetKey(stegano_t *handle, const char *key) {
+    if(!handle) return STEGANO_ERROR_ARGUMENT;
+    setScatterKey(&handle->ctx, key);
+    return STEGANO_OK;
+}
+
+int steganoSetPassphrase(stegano_t *handle, const char *passphrase) {
+    if(!handle) return STEGANO_ERROR_ARGUMENT;
+    setPassphrase(&handle->ctx, passphrase);
+    return STEGANO_OK;
+}
+
+int steganoSetMatrix(stegano_t *handle, int k) {
+    if(!handle) return STEGANO_ERROR_ARGUMENT;
+    if(k != 0 && (k < MATRIX_MIN_K || k > MATRIX_MAX_K)) return STEGANO_ERROR_ARGUMENT;
+    handle->ctx.matrix_k = k;
+    return STEGANO_OK;
+}
+
+/* encodeContext() through a handle. The library only reads the paths
+ * and message, so dropping const is safe. */
+int steganoEncodeFile(stegano_t *handle, const char *infile, const char *outfile,
+                      const char *message) {
+    if(!handle || !infile || !outfile || !message) return STEGANO_ERROR_ARGUMENT;
+    return encodeContext(&handle->ctx, (char *)infile, (char *)outfile, (char *)message);
+}
+
+int steganoDecodeFile(stegano_t *handle, const char *infile, const char **message,
+                      size_t *length) {
+    int status;
+    if(!handle || !infile || !message) return STEGANO_ERROR_ARGUMENT;
+
+    status = decodeContext(&handle->ctx, (char *)infile, message);
+    if(status == STATUS_OK && length) *length = handle->ctx.message_length;
+    return status;
+}
+
+int steganoEncodeBuffer(stegano_t *handle, const unsigned char *bmp, size_t bmp_length,
+                        const char *message, const unsigned char **out,
+                        size_t *out_length) {
+    if(!handle || !bmp || !message || !out || !out_length) return STEGANO_ERROR_ARGUMENT;
+    return encodeBufferContext(&handle->ctx, bmp, bmp_length, (char *)message, out,
+                               out_length);
+}
+
+int steganoDecodeBuffer(stegano_t *handle, const unsigned char *bmp, size_t bmp_length,
+                        const char **message, size_t *length) {
+    int status;
+    if(!handle || !bmp || !message) return STEGANO_ERROR_ARGUMENT;
+
+    status = decodeBufferContext(&handle->ctx, bmp, bmp_length, message);
+    if(status == STATUS_OK && length) *length = handle->ctx.message_length;
+    return status;
+}
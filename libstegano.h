@@ -0,0 +1,106 @@
+#ifndef LIBSTEGANO_H
+#define LIBSTEGANO_H
+#include <stddef.h>
+
+/* Public interface of libstegano.a and libstegano.so. Only the names in
+   this header are exported, all prefixed with stegano/STEGANO_. The
+   library never prints; every function returns a status code.
+
+   Link with -lstegano -pthread -lm. */
+
+/* Version of this header. A new major version may break the interface,
+   minor versions only add to it. */
+#define STEGANO_VERSION_MAJOR 1
+#define STEGANO_VERSION_MINOR 1
+#define STEGANO_VERSION_PATCH 0
+#define STEGANO_VERSION ((STEGANO_VERSION_MAJOR << 16) | \
+                         (STEGANO_VERSION_MINOR << 8) | STEGANO_VERSION_PATCH)
+
+/* Status codes. */
+#define STEGANO_OK 0
+#define STEGANO_ERROR_OPEN -10
+#define STEGANO_ERROR_FORMAT -11
+#define STEGANO_ERROR_MEMORY -12
+#define STEGANO_ERROR_EMPTY -13
+#define STEGANO_ERROR_TOO_LARGE -14
+#define STEGANO_ERROR_TOO_SMALL -15
+#define STEGANO_ERROR_WRITE -16
+#define STEGANO_ERROR_CORRUPT -17
+#define STEGANO_ERROR_PASSPHRASE -18
+#define STEGANO_ERROR_SHARDED -19
+#define STEGANO_ERROR_MISSING_SHARD -20
+/* Returned for a bad argument, e.g. an unknown codec name. */
+#define STEGANO_ERROR_ARGUMENT -30
+
+/* Encoder/decoder handle. It keeps its buffers between calls, so once
+   warm a handle allocates nothing. A handle must not be used by two
+   threads at once; use one handle per thread. */
+typedef struct stegano stegano_t;
+
+/* Allocator for every allocation the library makes. release() is given
+   the size originally requested, so arenas and pools needn't track it.
+   The library calls it from its own worker threads as well as from the
+   caller's, so both functions must be thread-safe. */
+typedef struct {
+    void *(*allocate)(size_t size, void *user);
+    void (*release)(void *ptr, size_t size, void *user);
+    void *user;
+} stegano_allocator_t;
+
+/* Allocations made by the calling thread during its last call, including
+   work the call ran on other threads. Bytes still held by handles count
+   towards current_bytes and peak_bytes. */
+typedef struct {
+    size_t current_bytes;
+    size_t peak_bytes;
+    unsigned long allocations;
+    unsigned long releases;
+} stegano_stats_t;
+
+/* STEGANO_VERSION of the library linked in, to check against the header. */
+int steganoVersion(void);
+
+/* Readable description of a status code. */
+const char *steganoStatusMessage(int status);
+
+/* Replace the allocator for the whole process, NULL for malloc/free.
+   Must be called before the first handle is created. Since 1.1. */
+int steganoSetAllocator(const stegano_allocator_t *allocator);
+
+/* Fill stats with the calling thread's counters. Since 1.1. */
+int steganoGetStats(stegano_stats_t *stats);
+
+/* Create a handle, NULL if out of memory, and free it. */
+stegano_t *steganoCreate(void);
+void steganoDestroy(stegano_t *handle);
+
+/* Codec to encode with: raw, rle, lz77, huffman, static, blocks, tans,
+   adaptive, best (the default) or fast. */
+int steganoSetCodec(stegano_t *handle, const char *name);
+
+/* Scatter the payload in an order derived from key, NULL for none. */
+int steganoSetKey(stegano_t *handle, const char *key);
+
+/* Encrypt payloads with a key derived from passphrase, NULL for none. */
+int steganoSetPassphrase(stegano_t *handle, const char *passphrase);
+
+/* Matrix embedding code size k (2 to 8), 0 for one bit per byte. */
+int steganoSetMatrix(stegano_t *handle, int k);
+
+/* Encode/decode image files. A decoded message is owned by the handle,
+   valid until its next call, and NUL terminated; length, if not NULL,
+   receives its size. */
+int steganoEncodeFile(stegano_t *handle, const char *infile, const char *outfile,
+                      const char *message);
+int steganoDecodeFile(stegano_t *handle, const char *infile, const char **message,
+                      size_t *length);
+
+/* Encode/decode BMPs held in memory, with no filesystem access. The
+   encoded BMP is owned by the handle, as decoded messages are. */
+int steganoEncodeBuffer(stegano_t *handle, const unsigned char *bmp, size_t bmp_length,
+                        const char *message, const unsigned char **out,
+                        size_t *out_length);
+int steganoDecodeBuffer(stegano_t *handle, const unsigned char *bmp, size_t bmp_length,
+                        const char **message, size_t *length);
+
+#endif
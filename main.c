@@ -1,11 +1,17 @@
+#define _POSIX_C_SOURCE 200809L /* open, close */
 #include "stegano.h"
 #include <stdio.h> /* printf, sscanf, fgets, fopen, fprintf, fclose,  */
+#include <stdlib.h> /* getenv, strtoul, strtol */
 #include <string.h> /* strcmp, strcpy, strlen, strrchr */
+#include <fcntl.h> /* open */
+#include <unistd.h> /* close, STDIN_FILENO, STDOUT_FILENO */
+#include <sys/stat.h> /* mkdir */
 
 /* ERROR CODES */
 #define INVALIDARGUMENTSERROR -1
 #define FILENOTFOUNDERROR -2
 #define INVALIDINPUTERROR -3
+#define DOESNOTFITERROR -4
 
 /* MENU OPTIONS*/
 #define MENUENCODE 1
@@ -19,158 +25,1399 @@
 
 #define DATAFILE "stegano.dat"
 
+/* stegano.dat starts with this, older versions held only a text queue. */
+#define DATAMAGIC "SDAT"
+#define DATAVERSION 1
+
+/* Environment variable setting the interactive image cache budget in MiB. */
+#define CACHEBUDGETENV "STEGANO_CACHE_MB"
+
+/* Passed to -i or -o to use stdin or stdout instead of a file. */
+#define STDIOFILE "-"
+
+/* COMMAND LINE MODES */
+#define ARGNONE 0
+#define ARGHELP 1
+#define ARGENCODE 2
+#define ARGDECODE 3
+#define ARGCAPACITY 4
+#define ARGSCAN 5
+#define ARGSERVE 6
+
+/* Options collected from the command line. */
+typedef struct
+{
+    int mode;
+    char* infile;
+    char** infiles; /* Every file given to -i, infile is the first. */
+    int infile_count;
+    char* outfile;
+    char* outdir;
+    char* message;
+    char* scandir; /* Directory given to --scan. */
+    char* socket; /* Socket given to --serve or --connect. */
+    int connect; /* Send the operation to a server at socket. */
+    int codec; /* A codec id, CODEC_BEST or CODEC_FAST. */
+    char* key; /* Scatter key, NULL for the plain order. */
+    char* passphrase; /* Payload encryption, NULL for none. */
+    size_t max_memory; /* Pixel memory limit in bytes, 0 for none. */
+    int shard; /* Split one payload over every -i image, or join it back. */
+    int matrix; /* Matrix embedding code size k, 0 for none. */
+    int stats;
+} options_t;
+
 void printMenu(void);
-void printHelp(void);
-int menuEncodeSelected(queue_t* queue_p);
-int menuDecodeSelected(queue_t* queue_p);
-int menuViewRecentFiles(queue_t* queue);
+void printHelp(FILE* stream);
+int menuEncodeSelected(queue_t* queue_p, imagecache_t* images);
+int menuDecodeSelected(queue_t* queue_p, imagecache_t* images);
+int menuViewRecentFiles(queue_t* queue, imagecache_t* images);
+size_t imageCacheBudget(void);
 void stringInput(char prompt[], int maxResponseLen, char response[]);
-int processArgs(int argc, char* argv[], queue_t* queue);
-int readQueueFromFile(queue_t *q, const char *filename);
-int writeQueueToFile(queue_t *q, const char *filename);
+int parseArgs(int argc, char* argv[], options_t* options);
+int processArgs(int argc, char* argv[], queue_t* queue, metacache_t* cache);
+void printStats(FILE* stream);
+int readStdinMessage(options_t* options, stegctx_t* ctx);
+int runEncode(options_t* options, queue_t* queue, metacache_t* cache);
+int runDecode(options_t* options, queue_t* queue, metacache_t* cache);
+int runFanOut(options_t* options, queue_t* queue);
+int runDecodeMany(options_t* options);
+int runDecodeShards(options_t* options, queue_t* queue);
+int runCapacity(options_t* options, metacache_t* cache);
+int runScan(options_t* options);
+int runServe(options_t* options);
+int runClient(options_t* options);
+int runStream(options_t* options);
+void rememberFile(queue_t* queue, char* filename);
+int readDataFile(queue_t *q, metacache_t *cache, const char *filename);
+int writeDataFile(queue_t *q, const metacache_t *cache, const char *filename);
+
+/* - MAIN FUNCTION - */
+int main(int argc, char* argv[])
+{
+    /* If no recently accessed file list exists, use a new queue.*/
+    queue_t queue;
+    static metacache_t cache;
+    if (readDataFile(&queue, &cache, DATAFILE) == FILENOTFOUNDERROR)
+    {
+        initialiseQueue(&queue); 
+        initMetaCache(&cache);
+    }
+
+    /* If there are any cmd arguments passed, process them and act on them,
+    saving what was learnt about the files for the next run. The data file
+    is only rewritten when something changed, and a failed write is
+    ignored: it is a cache, and the directory may be read-only. */
+    if (argc > 1)
+    {
+        static queue_t before;
+        before = queue;
+        int status = processArgs(argc, argv, &queue, &cache);
+        if (cache.dirty || memcmp(&before, &queue, sizeof(queue)) != 0)
+        {
+            writeDataFile(&queue, &cache, DATAFILE);
+        }
+        return status;
+    }
+
+    /* Otherwise, run interactively, continuing indefinitely. Images loaded
+    during the session stay in memory for the operations that follow. */
+    static imagecache_t images;
+    initImageCache(&images, imageCacheBudget());
+    printf("Stegano - Image steganography in C.\n");
+    while (1)
+    {
+        int input;
+        char inputStr[3];
+
+        printMenu();
+        
+        /* Process user input for menu option handling. */
+        printf("Select an option: ");
+        fgets(inputStr, 3, stdin);
+        sscanf(inputStr, "%1d", &input);
+        
+        switch (input)
+        {
+            case MENUEXIT:
+                /* Save recently accessed files. */
+                if (writeDataFile(&queue, &cache, DATAFILE) != 0)
+                {
+                    fprintf(stderr, "ERROR: Could not write '%s' file\n", \
+                        DATAFILE);
+                }
+                freeImageCache(&images);
+                return 0;
+            case MENUENCODE:
+                menuEncodeSelected(&queue, &images);
+                break;
+            case MENUDECODE:
+                menuDecodeSelected(&queue, &images);
+                break;
+            case MENUVIEWRECENT:
+                menuViewRecentFiles(&queue, &images);
+                break;
+            default:
+                printf("Invalid item.");
+                break;
+        }
+    }
+    return 0;
+}
+
+/*
+Reads the commandline arguments into an options structure. Flags may be given
+in any order, and flags that take a value consume the argument after them.
+
+Parameters:
+    - argc (int): the number of arguments passed.
+    - argv (char**): an array of pointers to where those arguments 
+    are stored in memory
+    - options (options_t*): a pointer to the options to fill in.
+
+Returns (int):
+    0 if every argument was understood, INVALIDARGUMENTSERROR otherwise.
+*/
+int parseArgs(int argc, char* argv[], options_t* options)
+{
+    int i;
+
+    options->mode = ARGNONE;
+    options->infile = NULL;
+    options->infiles = NULL;
+    options->infile_count = 0;
+    options->outfile = NULL;
+    options->outdir = NULL;
+    options->message = NULL;
+    options->scandir = NULL;
+    options->socket = NULL;
+    options->connect = 0;
+    options->codec = CODEC_BEST;
+    options->key = NULL;
+    options->passphrase = NULL;
+    options->max_memory = 0;
+    options->shard = 0;
+    options->matrix = 0;
+    options->stats = 0;
+
+    for (i = 1; i < argc; i++)
+    {
+        /* Flags that take a value need one more argument after them. */
+        int hasValue = i + 1 < argc;
+
+        if (strcmp(argv[i], "-h") == 0)
+        {
+            options->mode = ARGHELP;
+        }
+        else if (strcmp(argv[i], "-e") == 0)
+        {
+            options->mode = ARGENCODE;
+        }
+        else if (strcmp(argv[i], "-d") == 0)
+        {
+            options->mode = ARGDECODE;
+        }
+        else if (strcmp(argv[i], "--capacity") == 0)
+        {
+            options->mode = ARGCAPACITY;
+        }
+        else if (strcmp(argv[i], "--scan") == 0 && hasValue)
+        {
+            options->mode = ARGSCAN;
+            options->scandir = argv[++i];
+        }
+        else if (strcmp(argv[i], "--serve") == 0 && hasValue)
+        {
+            options->mode = ARGSERVE;
+            options->socket = argv[++i];
+        }
+        else if (strcmp(argv[i], "--connect") == 0 && hasValue)
+        {
+            options->connect = 1;
+            options->socket = argv[++i];
+        }
+        else if (strcmp(argv[i], "-s") == 0 || \
+            strcmp(argv[i], "--stats") == 0)
+        {
+            options->stats = 1;
+        }
+        else if (strcmp(argv[i], "--shard") == 0)
+        {
+            options->shard = 1;
+        }
+        else if (strcmp(argv[i], "-i") == 0 && hasValue)
+        {
+            /* Every following argument up to the next flag is an input. */
+            options->infile = argv[++i];
+            options->infiles = &argv[i];
+            options->infile_count = 1;
+            while (i + 1 < argc && (argv[i + 1][0] != '-' || \
+                strcmp(argv[i + 1], STDIOFILE) == 0))
+            {
+                options->infile_count++;
+                i++;
+            }
+        }
+        else if (strcmp(argv[i], "--codec") == 0 && hasValue)
+        {
+            options->codec = codecId(argv[++i]);
+            if (options->codec == ERROR_FORMAT)
+            {
+                return INVALIDARGUMENTSERROR;
+            }
+        }
+        else if (strcmp(argv[i], "--key") == 0 && hasValue)
+        {
+            options->key = argv[++i];
+        }
+        else if (strcmp(argv[i], "--passphrase") == 0 && hasValue)
+        {
+            options->passphrase = argv[++i];
+        }
+        else if (strcmp(argv[i], "--max-memory") == 0 && hasValue)
+        {
+            char* end;
+            unsigned long megabytes = strtoul(argv[++i], &end, 10);
+            if (*end != '\0' || megabytes == 0)
+            {
+                return INVALIDARGUMENTSERROR;
+            }
+            options->max_memory = (size_t)megabytes << 20;
+        }
+        else if (strcmp(argv[i], "--matrix") == 0 && hasValue)
+        {
+            char* end;
+            long k = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || k < MATRIX_MIN_K || k > MATRIX_MAX_K)
+            {
+                return INVALIDARGUMENTSERROR;
+            }
+            options->matrix = (int)k;
+        }
+        else if (strcmp(argv[i], "-O") == 0 && hasValue)
+        {
+            options->outdir = argv[++i];
+        }
+        else if (strcmp(argv[i], "-o") == 0 && hasValue)
+        {
+            options->outfile = argv[++i];
+        }
+        else if (strcmp(argv[i], "-m") == 0 && hasValue)
+        {
+            options->message = argv[++i];
+        }
+        else
+        {
+            return INVALIDARGUMENTSERROR;
+        }
+    }
+    return 0;
+}
+
+/* 
+Processes the commandline arguments passed to the program.
+
+Should be run at the start of the program, and processes if the program should 
+run in interactive mode or not (and if not, processes what needs to happen 
+based on cmd instructions)
+
+Parameters:
+    - argc (int): the number of arguments passed.
+    - argv (char**): an array of pointers to where those arguments 
+    are stored in memory
+    - queue_p (queue_t*): a pointer to the queue used by the application.
+    - cache_p (metacache_t*): a pointer to the image metadata cache.
+
+Returns (int):
+    The status of argument processing. 0 if everything is successful, 
+    < 0 if there is an error.
+*/
+int processArgs(int argc, char* argv[], queue_t* queue_p, metacache_t* cache_p)
+{
+    options_t options;
+    if (parseArgs(argc, argv, &options) != 0)
+    {
+        printf("Invalid flag, please check and try again.");
+        printHelp(stdout);
+        return INVALIDARGUMENTSERROR;
+    }
+
+    /* Help argument */
+    if (options.mode == ARGHELP)
+    {
+        printHelp(stdout);
+        return 0;
+    }
+
+    /* With -o -, stdout carries the image or message, so argument errors
+       go to stderr. */
+    FILE* errors = options.outfile && \
+        strcmp(options.outfile, STDIOFILE) == 0 ? stderr : stdout;
+
+    /* stegano --connect /tmp/stegano.sock -d -i input.bmp */
+    if (options.connect)
+    {
+        if (options.infile_count != 1 || options.outdir || options.shard || \
+            options.matrix || \
+            (options.mode == ARGENCODE && (!options.outfile || \
+            !options.message)) || (options.mode != ARGENCODE && \
+            options.mode != ARGDECODE && options.mode != ARGCAPACITY) || \
+            (options.message && strcmp(options.message, STDIOFILE) == 0 && \
+            strcmp(options.infile, STDIOFILE) == 0))
+        {
+            fprintf(errors, "Invalid flag, please check and try again.");
+            printHelp(errors);
+            return INVALIDARGUMENTSERROR;
+        }
+        return runClient(&options);
+    }
+
+    /* stegano -e -i input.bmp -o output.bmp -m "Test Message" */
+    if (options.mode == ARGENCODE)
+    {
+        /* stegano -e -m "Test Message" -i a.bmp b.bmp ... -O outdir/ [--shard] */
+        if (options.outdir && options.infile && options.message && \
+            !options.outfile)
+        {
+            return runFanOut(&options, queue_p);
+        }
+
+        /* Find all other arguments */
+        if (!options.infile || !options.outfile || !options.message || \
+            options.outdir || options.infile_count > 1 || options.shard)
+        {
+            fprintf(errors, "Invalid flag, please check and try again.");
+            printHelp(errors);
+            return INVALIDARGUMENTSERROR;
+        }
+
+        /* Reading or writing through a pipe streams the image. */
+        if (strcmp(options.infile, STDIOFILE) == 0 || \
+            strcmp(options.outfile, STDIOFILE) == 0)
+        {
+            /* stdin can't carry both the image and the message. */
+            if (strcmp(options.infile, STDIOFILE) == 0 && \
+                strcmp(options.message, STDIOFILE) == 0)
+            {
+                fprintf(errors, "Invalid flag, please check and try again.");
+                printHelp(errors);
+                return INVALIDARGUMENTSERROR;
+            }
+            return runStream(&options);
+        }
+
+        /* stegano -e -i input.bmp -o output.bmp -m - < message.txt */
+        return runEncode(&options, queue_p, cache_p);
+    }
+
+    /* stegano -d -i input.bmp [-o fileOutput.txt]*/
+    else if (options.mode == ARGDECODE)
+    {
+        /* stegano -d --shard -i a.bmp b.bmp ... [-o fileOutput.txt] */
+        if (options.shard && options.infile && !options.outdir)
+        {
+            return runDecodeShards(&options, queue_p);
+        }
+
+        /* stegano -d -i a.bmp b.bmp ... */
+        if (options.infile_count > 1 && !options.outfile && \
+            !options.outdir && !options.shard)
+        {
+            return runDecodeMany(&options);
+        }
+
+        if (!options.infile || options.infile_count > 1 || options.shard)
+        {
+            fprintf(errors, "Invalid flag, please check and try again.");
+            printHelp(errors);
+            return INVALIDARGUMENTSERROR;
+        }
+
+        if (strcmp(options.infile, STDIOFILE) == 0)
+        {
+            return runStream(&options);
+        }
+
+        return runDecode(&options, queue_p, cache_p);
+    }
+
+    /* stegano --capacity -i cover.bmp [-m "Test Message"] */
+    else if (options.mode == ARGCAPACITY)
+    {
+        if (!options.infile || options.infile_count > 1)
+        {
+            fprintf(errors, "Invalid flag, please check and try again.");
+            printHelp(errors);
+            return INVALIDARGUMENTSERROR;
+        }
+        return runCapacity(&options, cache_p);
+    }
+
+    /* stegano --scan directory/ */
+    else if (options.mode == ARGSCAN)
+    {
+        return runScan(&options);
+    }
+
+    /* stegano --serve /tmp/stegano.sock */
+    else if (options.mode == ARGSERVE)
+    {
+        return runServe(&options);
+    }
+
+    /* If you make it here, assume that the arguments weren't valid. */
+    printHelp(errors);
+    return INVALIDARGUMENTSERROR;
+}
+
+/*
+Reads a message of - from stdin in full, for the modes that need the whole
+message before they start: fan-out, sharding, --capacity, --connect and
+encoding to stdout. Only runEncode() embeds it as it arrives.
+
+Parameters:
+    - options (options_t*): the parsed options, message is pointed at the
+    message read.
+    - ctx (stegctx_t*): an initialised context that holds the message.
+
+Returns (int):
+    STATUS_OK if there was nothing to read or it was read, otherwise the
+    status of the failed read.
+*/
+int readStdinMessage(options_t* options, stegctx_t* ctx)
+{
+    if (!options->message || strcmp(options->message, STDIOFILE) != 0)
+    {
+        return STATUS_OK;
+    }
+    int status = readMessageFd(ctx, STDIN_FILENO);
+    if (status == STATUS_OK)
+    {
+        options->message = ctx->message;
+    }
+    return status;
+}
+
+/*
+Prints the allocation counters of the last library operation.
+
+Parameters:
+    - stream (FILE*): where to print, stderr when stdout carries data.
+
+Returns:
+    void
+*/
+void printStats(FILE* stream)
+{
+    allocstats_t stats = getAllocStats();
+    fprintf(stream, "Allocations: %lu (%lu freed)\n" \
+        "Peak memory: %lu bytes\n" \
+        "Still allocated: %lu bytes\n", \
+        stats.allocations, stats.releases, \
+        (unsigned long)stats.peak_bytes, (unsigned long)stats.current_bytes);
+}
+
+/*
+Looks up an image in the metadata cache, reading its headers only when the
+file is new or changed since it was cached. Prints why the image can't be used.
+
+Parameters:
+    - filename (char*): the image to look up.
+    - cache (metacache_t*): the metadata cache.
+    - usable (int*): set to 1 if the image can be encoded into or decoded.
+
+Returns (metaentry_t*):
+    The cache entry of a usable image, or NULL if the image is unusable or its
+    path is too long to cache.
+*/
+static metaentry_t* cachedImage(char* filename, metacache_t* cache, int* usable)
+{
+    int status;
+    metaentry_t* entry = probeMeta(cache, filename, &status);
+
+    *usable = 0;
+    if (status == ERROR_OPEN)
+    {
+        printf("Couldn't open file %s.\n", filename);
+    }
+    else if (!entry)
+    {
+        status = checkFileType(filename);
+        if (status == ERROR_OPEN)
+        {
+            printf("Couldn't open file %s.\n", filename);
+        }
+        else if (status != STATUS_OK)
+        {
+            printf("%s\n", statusMessage(status));
+        }
+        *usable = status == STATUS_OK;
+    }
+    else if (entry->format_status != STATUS_OK)
+    {
+        printf("%s\n", statusMessage(entry->format_status));
+    }
+    else
+    {
+        *usable = 1;
+    }
+    return *usable ? entry : NULL;
+}
+
+/*
+Encodes a message into an image file. The cover's headers are checked through
+the metadata cache, and the written image is recorded there with its payload.
+A message of - is read from stdin and embedded as it arrives.
+
+Parameters:
+    - options (options_t*): the parsed options, infile, outfile and message
+    must be set.
+    - queue (queue_t*): the recently accessed files.
+    - cache (metacache_t*): the metadata cache.
+
+Returns (int):
+    0 on success, INVALIDINPUTERROR otherwise.
+*/
+int runEncode(options_t* options, queue_t* queue, metacache_t* cache)
+{
+    int usable;
+    stegctx_t ctx;
+
+    /* Add the output file to queue. */
+    rememberFile(queue, options->outfile);
+
+    cachedImage(options->infile, cache, &usable);
+    if (!usable)
+    {
+        return INVALIDINPUTERROR;
+    }
+
+    initContext(&ctx);
+    ctx.codec = options->codec;
+    ctx.memory_limit = options->max_memory;
+    ctx.matrix_k = options->matrix;
+    setScatterKey(&ctx, options->key);
+    setPassphrase(&ctx, options->passphrase);
+    int status;
+    if (strcmp(options->message, STDIOFILE) == 0)
+    {
+        /* Coded and embedded as it arrives on stdin. */
+        status = encodeMessageFd(&ctx, options->infile, options->outfile, \
+            STDIN_FILENO);
+    }
+    else
+    {
+        status = encodeContext(&ctx, options->infile, options->outfile, \
+            options->message);
+    }
+    if (status == STATUS_OK)
+    {
+        recordPayload(cache, options->outfile, PAYLOAD_PRESENT, \
+            (unsigned long)ctx.payload_bits, \
+            (unsigned long)ctx.message_length);
+    }
+    int codec = ctx.codec_used;
+    unsigned long payloadBits = (unsigned long)ctx.payload_bits;
+    unsigned long embedded = (unsigned long)ctx.bit_count;
+    unsigned long changed = (unsigned long)ctx.changed_bytes;
+    freeContext(&ctx);
+
+    if (status == ERROR_OPEN)
+    {
+        printf("Couldn't open image %s.\n", options->infile);
+    }
+    else if (status == ERROR_WRITE)
+    {
+        printf("Couldn't create file %s.\n", options->outfile);
+    }
+    else if (status != STATUS_OK)
+    {
+        printf("%s\n", statusMessage(status));
+    }
+
+    if (options->stats)
+    {
+        if (status == STATUS_OK)
+        {
+            printf("Codec: %s, %lu payload bits\n", codecName(codec), \
+                payloadBits);
+            /* Bits per change is how many embedded bits each changed
+               channel byte carries: about 2 without matrix embedding. */
+            printf("Changed %lu channel bytes, %.2f bits per change\n", \
+                changed, changed ? (double)embedded / changed : 0.0);
+        }
+        printStats(stdout);
+    }
+    return status == STATUS_OK ? 0 : INVALIDINPUTERROR;
+}
+
+/*
+Decodes the message hidden in an image file. An image the metadata cache
+already knows carries no payload is rejected without reading its pixels.
+
+Parameters:
+    - options (options_t*): the parsed options, infile must be set.
+    - queue (queue_t*): the recently accessed files.
+    - cache (metacache_t*): the metadata cache.
+
+Returns (int):
+    0 on success, INVALIDINPUTERROR otherwise.
+*/
+int runDecode(options_t* options, queue_t* queue, metacache_t* cache)
+{
+    int usable;
+    const char* message = "";
+    stegctx_t ctx;
+
+    metaentry_t* entry = cachedImage(options->infile, cache, &usable);
+    if (!usable)
+    {
+        return INVALIDINPUTERROR;
+    }
+
+    /* The cache only knows about payloads readable without a key or
+       passphrase. */
+    initContext(&ctx);
+    ctx.memory_limit = options->max_memory;
+    setScatterKey(&ctx, options->key);
+    setPassphrase(&ctx, options->passphrase);
+    int status = ERROR_CORRUPT;
+    if (!entry || entry->payload_state != PAYLOAD_NONE || options->key)
+    {
+        status = decodeContext(&ctx, options->infile, &message);
+    }
+    if (status == STATUS_OK)
+    {
+        recordPayload(cache, options->infile, PAYLOAD_PRESENT, \
+            (unsigned long)ctx.payload_bits, \
+            (unsigned long)ctx.message_length);
+    }
+    else if (status == ERROR_CORRUPT && !options->key && !options->passphrase)
+    {
+        recordPayload(cache, options->infile, PAYLOAD_NONE, 0, 0);
+    }
+
+    if (status != STATUS_OK)
+    {
+        printf("%s\n", statusMessage(status));
+    }
+    else if (options->outfile && strcmp(options->outfile, STDIOFILE) == 0)
+    {
+        printf("%s", message);
+    }
+    else if (options->outfile)
+    {
+        FILE* file = fopen(options->outfile, "w+");
+        if (!file)
+        {
+            printf("Couldn't create file %s.\n", options->outfile);
+            status = ERROR_WRITE;
+        }
+        else
+        {
+            fprintf(file, "%s", message);
+            fclose(file);
+            rememberFile(queue, options->outfile); /* Adds the output file to the queue. */
+        }
+    }
+    else 
+    {
+        rememberFile(queue, options->infile); /* Adds the input file to the queue. */
+    }
+    freeContext(&ctx);
+
+    if (options->stats)
+    {
+        printStats(options->outfile ? stderr : stdout);
+    }
+    return status == STATUS_OK ? 0 : INVALIDINPUTERROR;
+}
+
+/*
+Encodes the same message into every -i image, writing each result into the -O
+directory under its input's file name. The message is compressed once and the
+covers are processed in parallel. With --shard, the message is instead split
+over the covers in the order given, each carrying one shard of it.
+
+Parameters:
+    - options (options_t*): the parsed options, infiles, outdir and message
+    must be set.
+    - queue (queue_t*): the recently accessed files, the output directory is
+    added to it.
+
+Returns (int):
+    0 if every cover was encoded, INVALIDINPUTERROR if any failed,
+    FILENOTFOUNDERROR if the output directory can't be created,
+    INVALIDARGUMENTSERROR if two inputs share a base name.
+*/
+int runFanOut(options_t* options, queue_t* queue)
+{
+    int count = options->infile_count;
+    int i, j, failed = 0;
+    stegctx_t ctx;
+
+    /* Outputs are named after the inputs' base names, so two inputs
+    sharing one would overwrite each other's output. */
+    for (i = 0; i < count; i++)
+    {
+        const char* base = strrchr(options->infiles[i], '/');
+        base = base ? base + 1 : options->infiles[i];
+        for (j = 0; j < i; j++)
+        {
+            const char* other = strrchr(options->infiles[j], '/');
+            other = other ? other + 1 : options->infiles[j];
+            if (strcmp(base, other) == 0)
+            {
+                printf("%s and %s would both be written to %s in %s.\n", \
+                    options->infiles[j], options->infiles[i], base, \
+                    options->outdir);
+                failed = 1;
+                break;
+            }
+        }
+    }
+    if (failed)
+    {
+        return INVALIDARGUMENTSERROR;
+    }
+
+    if (mkdir(options->outdir, 0755) != 0)
+    {
+        struct stat info;
+        if (stat(options->outdir, &info) != 0 || !S_ISDIR(info.st_mode))
+        {
+            printf("Couldn't create directory %s.\n", options->outdir);
+            return FILENOTFOUNDERROR;
+        }
+    }
+
+    /* Each output is the directory joined with the input's base name. */
+    char** outfiles = stegAlloc(count * sizeof(char*));
+    int* statuses = stegAlloc(count * sizeof(int));
+    size_t dirlen = strlen(options->outdir);
+    int named = 0;
+    while (outfiles && named < count)
+    {
+        const char* base = strrchr(options->infiles[named], '/');
+        base = base ? base + 1 : options->infiles[named];
+        outfiles[named] = stegAlloc(dirlen + strlen(base) + 2);
+        if (!outfiles[named])
+        {
+            break;
+        }
+        strcpy(outfiles[named], options->outdir);
+        if (dirlen == 0 || options->outdir[dirlen - 1] != '/')
+        {
+            strcat(outfiles[named], "/");
+        }
+        strcat(outfiles[named], base);
+        named++;
+    }
+
+    int status = ERROR_MEMORY;
+    if (statuses && named == count)
+    {
+        initContext(&ctx);
+        ctx.codec = options->codec;
+        ctx.matrix_k = options->matrix;
+        setScatterKey(&ctx, options->key);
+        setPassphrase(&ctx, options->passphrase);
+        status = readStdinMessage(options, &ctx);
+        if (status == STATUS_OK && options->shard)
+        {
+            status = encodeSharded(&ctx, options->message, \
+                options->infiles, outfiles, count, statuses, 0);
+        }
+        else if (status == STATUS_OK)
+        {
+            status = encodeMany(&ctx, options->message, options->infiles, \
+                outfiles, count, statuses, 0);
+        }
+        freeContext(&ctx);
+    }
+
+    if (status != STATUS_OK)
+    {
+        printf("%s\n", statusMessage(status));
+        failed = 1;
+    }
+    /* A failed sharded encode still names the covers that caused it. */
+    for (i = 0; (status == STATUS_OK || (options->shard && statuses && \
+        named == count)) && i < count; i++)
+    {
+        if (statuses[i] == STATUS_OK && status == STATUS_OK)
+        {
+            printf("%s -> %s\n", options->infiles[i], outfiles[i]);
+        }
+        else if (statuses[i] != STATUS_OK)
+        {
+            printf("%s: %s\n", options->infiles[i], \
+                statusMessage(statuses[i]));
+            failed = 1;
+        }
+    }
+    rememberFile(queue, options->outdir);
+
+    if (options->stats)
+    {
+        printStats(stdout);
+    }
+    for (i = 0; i < named; i++)
+    {
+        stegFree(outfiles[i]);
+    }
+    stegFree(outfiles);
+    stegFree(statuses);
+    return failed ? INVALIDINPUTERROR : 0;
+}
+
+/*
+Prints the message of one image decoded by runDecodeMany.
+*/
+static void printDecoded(int item, const char* message, void* user)
+{
+    char** infiles = user;
+    printf("%s: %s\n", infiles[item], message);
+}
+
+/*
+Decodes every -i image in parallel, printing each message after its file name
+in the order the files were given, then the errors of those that failed.
+
+Parameters:
+    - options (options_t*): the parsed options, infiles must be set.
+
+Returns (int):
+    0 if every image was decoded, INVALIDINPUTERROR if any failed.
+*/
+int runDecodeMany(options_t* options)
+{
+    int count = options->infile_count;
+    int i, failed = 0;
+    stegctx_t ctx;
+
+    int* statuses = stegAlloc(count * sizeof(int));
+    int status = ERROR_MEMORY;
+    if (statuses)
+    {
+        initContext(&ctx);
+        setScatterKey(&ctx, options->key);
+        setPassphrase(&ctx, options->passphrase);
+        status = decodeMany(&ctx, options->infiles, count, statuses, 0, \
+            printDecoded, options->infiles);
+        freeContext(&ctx);
+    }
+
+    if (status != STATUS_OK)
+    {
+        printf("%s\n", statusMessage(status));
+        failed = 1;
+    }
+    for (i = 0; status == STATUS_OK && i < count; i++)
+    {
+        if (statuses[i] != STATUS_OK)
+        {
+            printf("%s: %s\n", options->infiles[i], \
+                statusMessage(statuses[i]));
+            failed = 1;
+        }
+    }
+
+    if (options->stats)
+    {
+        printStats(stdout);
+    }
+    stegFree(statuses);
+    return failed ? INVALIDINPUTERROR : 0;
+}
+
+/*
+Decodes a message split over the -i images with --shard. The shards are read in
+parallel and joined by their index, so the images can be given in any order.
+The message goes to -o, or to stdout without it.
+
+Parameters:
+    - options (options_t*): the parsed options, infiles must be set.
+    - queue (queue_t*): the recently accessed files, the output file is added
+    to it.
+
+Returns (int):
+    0 if the message was decoded, INVALIDINPUTERROR otherwise.
+*/
+int runDecodeShards(options_t* options, queue_t* queue)
+{
+    int count = options->infile_count;
+    int i;
+    const char* message = "";
+    stegctx_t ctx;
+
+    int* statuses = stegAlloc(count * sizeof(int));
+    int status = ERROR_MEMORY;
+    initContext(&ctx);
+    if (statuses)
+    {
+        setScatterKey(&ctx, options->key);
+        setPassphrase(&ctx, options->passphrase);
+        status = decodeSharded(&ctx, options->infiles, count, statuses, 0, \
+            &message);
+    }
+
+    /* Images that couldn't be read say why, then the overall result. */
+    for (i = 0; statuses && i < count; i++)
+    {
+        if (statuses[i] != STATUS_OK)
+        {
+            printf("%s: %s\n", options->infiles[i], \
+                statusMessage(statuses[i]));
+        }
+    }
+    if (status != STATUS_OK)
+    {
+        printf("%s\n", statusMessage(status));
+    }
+    else if (options->outfile && strcmp(options->outfile, STDIOFILE) != 0)
+    {
+        FILE* file = fopen(options->outfile, "w+");
+        if (file)
+        {
+            fprintf(file, "%s", message);
+            fclose(file);
+        }
+        rememberFile(queue, options->outfile);
+    }
+    else
+    {
+        printf("%s", message);
+        if (!options->outfile)
+        {
+            printf("\n");
+        }
+    }
+    freeContext(&ctx);
+
+    if (options->stats)
+    {
+        printStats(options->outfile ? stderr : stdout);
+    }
+    stegFree(statuses);
+    return status == STATUS_OK ? 0 : INVALIDINPUTERROR;
+}
+
+/*
+Prints how much an image can hold, using only its headers. If a message was
+given, also prints its compressed size and whether it fits.
+
+Parameters:
+    - options (options_t*): the parsed options, infile must be set.
+    - cache (metacache_t*): the metadata cache, an unchanged image is answered
+    from it without opening the file.
+
+Returns (int):
+    0 if the image is usable (and the message fits, when one was given),
+    INVALIDINPUTERROR for an unusable image, DOESNOTFITERROR if the message
+    is too big.
+*/
+int runCapacity(options_t* options, metacache_t* cache)
+{
+    capacity_t capacity;
+    stegctx_t ctx;
+    int i, status;
+
+    initContext(&ctx);
+    metaentry_t* entry = probeMeta(cache, options->infile, &status);
+    if (status == STATUS_OK)
+    {
+        status = readStdinMessage(options, &ctx);
+    }
+    if (status == STATUS_OK && entry)
+    {
+        /* format_status holds the same checks encoding makes. */
+        status = entry->format_status;
+    }
+    if (status == STATUS_OK && entry)
+    {
+        status = headerCapacity(&entry->fh, &entry->ih, options->message, \
+            &capacity);
+    }
+    else if (status == STATUS_OK)
+    {
+        status = probeCapacity(options->infile, options->message, &capacity);
+    }
+    freeContext(&ctx);
+    if (status != STATUS_OK)
+    {
+        printf("%s\n", statusMessage(status));
+        return INVALIDINPUTERROR;
+    }
 
-/* - MAIN FUNCTION - */
-int main(int argc, char* argv[])
+    printf("Image: %dx%d, %llu channel bytes, %lu header bits\n", \
+        capacity.width, capacity.height, capacity.channel_bytes, \
+        capacity.header_bits);
+    for (i = 0; i < EMBED_MODES; i++)
+    {
+        printf("Mode %s: %lu payload bits (%lu bytes)\n", \
+            capacity.modes[i].name, capacity.modes[i].payload_bits, \
+            capacity.modes[i].payload_bytes);
+    }
+    if (entry && entry->payload_state == PAYLOAD_PRESENT)
+    {
+        printf("Payload: %lu byte message in %lu bits\n", \
+            entry->message_length, entry->payload_bits);
+    }
+    else if (entry && entry->payload_state == PAYLOAD_NONE)
+    {
+        printf("Payload: none\n");
+    }
+
+    if (options->message)
+    {
+        printf("Message: %lu bytes, %lu bits compressed with %s, %s\n", \
+            capacity.message_bytes, capacity.message_bits, \
+            codecName(capacity.codec), capacity.fits ? "fits" : "does not fit");
+    }
+
+    if (options->stats)
+    {
+        printStats(stdout);
+    }
+    return options->message && !capacity.fits ? DOESNOTFITERROR : 0;
+}
+
+/*
+Prints one line for a carrier found by runScan(). Called from the scan's
+worker threads; each line is a single printf, so lines don't interleave.
+
+Parameters:
+    - path (const char*): the image carrying a payload.
+    - header (const payloadheader_t*): its payload header.
+    - user (void*): unused.
+
+Returns:
+    void
+*/
+static void printCarrier(const char* path, const payloadheader_t* header, \
+    void* user)
 {
-    /* If no recently accessed file list exists, use a new queue.*/
-    queue_t queue;
-    if (readQueueFromFile(&queue, DATAFILE) == FILENOTFOUNDERROR)
+    printf("%s: %lu byte message in %lu bits, %s%s", path, \
+        header->message_length, header->payload_bits, \
+        codecName(header->codec), \
+        header->flags & HEADER_CHACHA20 ? ", encrypted" : "");
+    if (header->flags & HEADER_SHARDED)
     {
-        initialiseQueue(&queue); 
+        printf(", shard %d of %d (id %08lx)", header->shard_index + 1, \
+            header->shard_count, header->shard_id);
     }
+    printf("\n");
+}
 
-    /* If there are any cmd arguments passed, process them and act on them.*/
-    if (argc > 1)
+/*
+Lists the images under a directory that carry a payload, one per line, then
+a summary on stderr. Payloads scattered with a key can't be found.
+
+Parameters:
+    - options (options_t*): the parsed options, scandir must be set.
+
+Returns (int):
+    0 on success, FILENOTFOUNDERROR if the directory can't be read.
+*/
+int runScan(options_t* options)
+{
+    unsigned long files, carriers;
+
+    int status = scanDirectory(options->scandir, 0, printCarrier, NULL, \
+        &files, &carriers);
+    if (status != STATUS_OK)
     {
-        return processArgs(argc, argv, &queue);
+        fprintf(stderr, "%s\n", statusMessage(status));
+        return status == ERROR_OPEN || status == ERROR_IN_USE ? \
+            FILENOTFOUNDERROR : INVALIDINPUTERROR;
     }
 
-    /* Otherwise, run interactively, continuing indefinitely. */
-    printf("Stegano - Image steganography in C.\n");
-    while (1)
+    fprintf(stderr, "Scanned %lu files, %lu carrying a payload.\n", \
+        files, carriers);
+    if (options->stats)
     {
-        int input;
-        char inputStr[3];
+        printStats(stderr);
+    }
+    return 0;
+}
 
-        printMenu();
-        
-        /* Process user input for menu option handling. */
-        printf("Select an option: ");
-        fgets(inputStr, 3, stdin);
-        sscanf(inputStr, "%1d", &input);
-        
-        switch (input)
-        {
-            case MENUEXIT:
-                /* Save recently accessed files. */
-                writeQueueToFile(&queue, DATAFILE);
-                return 0;
-            case MENUENCODE:
-                menuEncodeSelected(&queue);
-                break;
-            case MENUDECODE:
-                menuDecodeSelected(&queue);
-                break;
-            case MENUVIEWRECENT:
-                menuViewRecentFiles(&queue);
-                break;
-            default:
-                printf("Invalid item.");
-                break;
-        }
+/*
+Runs the daemon on a Unix domain socket until interrupted.
+
+Parameters:
+    - options (options_t*): the parsed options, socket must be set.
+
+Returns (int):
+    0 once stopped, FILENOTFOUNDERROR if the socket couldn't be created.
+*/
+int runServe(options_t* options)
+{
+    fprintf(stderr, "Serving on %s, press Ctrl+C to stop.\n", options->socket);
+    int status = serveSocket(options->socket, 0);
+    if (status != STATUS_OK)
+    {
+        fprintf(stderr, "%s\n", statusMessage(status));
+        return status == ERROR_OPEN || status == ERROR_IN_USE ? \
+            FILENOTFOUNDERROR : INVALIDINPUTERROR;
     }
     return 0;
 }
 
-/* 
-Processes the commandline arguments passed to the program.
+/*
+Makes a path absolute against the working directory, since a server opens
+paths relative to its own.
 
-Should be run at the start of the program, and processes if the program should 
-run in interactive mode or not (and if not, processes what needs to happen 
-based on cmd instructions)
+Parameters:
+    - path (char*): the path given on the command line.
+    - buffer (char*): receives the absolute path, MAXFILELEN bytes long.
+
+Returns (char*):
+    path itself if it is absolute or doesn't fit, buffer otherwise.
+*/
+static char* absolutePath(char* path, char* buffer)
+{
+    if (path[0] == '/' || !getcwd(buffer, MAXFILELEN) || \
+        strlen(buffer) + strlen(path) + 2 > MAXFILELEN)
+    {
+        return path;
+    }
+    strcat(buffer, "/");
+    strcat(buffer, path);
+    return buffer;
+}
+
+/*
+Sends an encode, decode or capacity operation to a server started with
+--serve instead of running it here. An image read from stdin (-i -) is
+passed to the server as a shared memory descriptor rather than a path, and
+an image encoded to stdout (-o -) comes back in the reply. A message read
+from stdin (-m -) is read in full and sent with the request.
 
-Note that this assumes that the expected order of arguments is followed.
 Parameters:
-    - argc (int): the number of arguments passed.
-    - argv (char**): an array of pointers to where those arguments 
-    are stored in memory
-    - queue_p (queue_t*): a pointer to the queue used by the application.
+    - options (options_t*): the parsed options, socket must be set.
 
 Returns (int):
-    The status of argument processing. 0 if everything is successful, 
-    < 0 if there is an error.
+    0 on success, FILENOTFOUNDERROR if the server or a file couldn't be
+    reached, INVALIDINPUTERROR if the server reported an error.
 */
-int processArgs(int argc, char* argv[], queue_t* queue_p)
+int runClient(options_t* options)
 {
-    /* Help argument */
-    if (strcmp(argv[1], "-h") == 0)
+    char inpath[MAXFILELEN];
+    char outpath[MAXFILELEN];
+    request_t request;
+    reply_t reply;
+    stegctx_t ctx;
+
+    /* The request carries the whole message, so -m - is read first. */
+    initContext(&ctx);
+    int status = readStdinMessage(options, &ctx);
+    if (status != STATUS_OK)
     {
-        printHelp();
-        return 0;
+        fprintf(stderr, "%s\n", statusMessage(status));
+        freeContext(&ctx);
+        return FILENOTFOUNDERROR;
     }
 
-    /* stegano -e -i input.bmp -o output.bmp -m "Test Message" */
-    if (strcmp(argv[1], "-e") == 0)
+    request.op = options->mode == ARGENCODE ? REQUEST_ENCODE : \
+        options->mode == ARGDECODE ? REQUEST_DECODE : REQUEST_PROBE;
+    request.infile = NULL;
+    request.outfile = NULL;
+    request.message = options->message;
+    request.key = options->key;
+    request.passphrase = options->passphrase;
+    request.codec = options->codec;
+    request.image_fd = -1;
+    request.output_fd = -1;
+
+    if (strcmp(options->infile, STDIOFILE) == 0)
     {
-        /* Find all other arguments */
-        if (argc < 8 || \
-            !(strcmp(argv[2], "-i") == 0 && strcmp(argv[4], "-o") == 0 && \
-            strcmp(argv[6], "-m") == 0))
+        request.image_fd = sharedImageFd(STDIN_FILENO);
+        if (request.image_fd < 0)
         {
-            printf("Invalid flag, please check and try again.");
-            printHelp();
-            return INVALIDARGUMENTSERROR;
+            fprintf(stderr, "%s\n", statusMessage(request.image_fd));
+            freeContext(&ctx);
+            return FILENOTFOUNDERROR;
         }
+    }
+    else
+    {
+        request.infile = absolutePath(options->infile, inpath);
+    }
+    if (request.op == REQUEST_ENCODE && \
+        strcmp(options->outfile, STDIOFILE) != 0)
+    {
+        request.outfile = absolutePath(options->outfile, outpath);
+    }
 
-        /* Add the output file to queue. */
-        enqueue(queue_p, argv[5]);
+    int server = connectServer(options->socket);
+    status = server;
+    if (server >= 0)
+    {
+        status = sendRequest(server, &request, &reply);
+        close(server);
+    }
+    if (request.image_fd >= 0)
+    {
+        close(request.image_fd);
+    }
+    freeContext(&ctx);
+    if (status != STATUS_OK)
+    {
+        fprintf(stderr, "Couldn't reach the server at %s.\n", \
+            options->socket);
+        return FILENOTFOUNDERROR;
+    }
 
-        int validFile = checkFileType(argv[3]);
-        if (validFile == 0)
+    int result = 0;
+    if (reply.status != STATUS_OK)
+    {
+        fprintf(stderr, "%s\n", statusMessage(reply.status));
+        result = INVALIDINPUTERROR;
+    }
+    else if (request.op == REQUEST_ENCODE && !request.outfile)
+    {
+        fwrite(reply.data, 1, reply.length, stdout);
+    }
+    else if (request.op == REQUEST_DECODE && options->outfile && \
+        strcmp(options->outfile, STDIOFILE) != 0)
+    {
+        FILE* file = fopen(options->outfile, "w");
+        if (!file)
         {
-            encode(argv[3], argv[5], argv[7]);
-        }   
-        else 
+            fprintf(stderr, "Couldn't open file %s.\n", options->outfile);
+            result = FILENOTFOUNDERROR;
+        }
+        else
         {
-            return INVALIDINPUTERROR;
+            fputs((char*)reply.data, file);
+            fclose(file);
         }
-        return 0;
     }
-
-    /* stegano -d -i input.bmp [-o fileOutput.txt]*/
-    else if (strcmp(argv[1], "-d") == 0)
+    else if (request.op == REQUEST_DECODE)
     {
-        if ((argc < 4 && strcmp(argv[2], "-i") != 0) || \
-            (argc < 6 && strcmp(argv[2], "-i") != 0 && \
-            strcmp(argv[4], "-o") != 0))
+        printf("%s\n", (char*)reply.data);
+    }
+    else if (request.op == REQUEST_PROBE)
+    {
+        printf("Image: %dx%d, %lu payload bits\n", reply.width, \
+            reply.height, reply.capacity_bits);
+        if (reply.payload_state == PAYLOAD_PRESENT)
         {
-            printf("Invalid flag, please check and try again.");
-            printHelp();
-            return INVALIDARGUMENTSERROR;
+            printf("Payload: %lu byte message in %lu bits, %s\n", \
+                reply.message_length, reply.payload_bits, \
+                codecName(reply.codec));
+        }
+        else
+        {
+            printf("Payload: none\n");
         }
+    }
+
+    if (result == 0 && options->stats && request.op != REQUEST_PROBE)
+    {
+        fprintf(stderr, "Codec: %s, %lu payload bits\n", \
+            codecName(reply.codec), reply.payload_bits);
+    }
+    freeReply(&reply);
+    return result;
+}
+
+/*
+Encodes or decodes with stdin and/or stdout in place of files, streaming the
+image rather than loading it. Since stdout may carry the image, errors and
+stats go to stderr.
 
-        char message[MAXMESSAGELEN];
-        decode(argv[3], message);
+Parameters:
+    - options (options_t*): the parsed options, "-" marks stdin or stdout.
+
+Returns (int):
+    0 on success, FILENOTFOUNDERROR if a file couldn't be opened,
+    INVALIDINPUTERROR if encoding or decoding failed.
+*/
+int runStream(options_t* options)
+{
+    int infd = STDIN_FILENO;
+    int outfd = STDOUT_FILENO;
+    int status;
+    stegctx_t ctx;
+
+    if (strcmp(options->infile, STDIOFILE) != 0)
+    {
+        infd = open(options->infile, O_RDONLY);
+    }
+    if (infd < 0)
+    {
+        fprintf(stderr, "Couldn't open file %s.\n", options->infile);
+        return FILENOTFOUNDERROR;
+    }
 
-        /* Assume outfile was passed */
-        if (argc >= 5)
+    initContext(&ctx);
+    ctx.codec = options->codec;
+    ctx.matrix_k = options->matrix;
+    setScatterKey(&ctx, options->key);
+    setPassphrase(&ctx, options->passphrase);
+    ctx.memory_limit = options->max_memory;
+    if (options->mode == ARGENCODE)
+    {
+        if (strcmp(options->outfile, STDIOFILE) != 0)
         {
-            FILE* file = fopen(argv[5], "w+");
-            fprintf(file, "%s", message);
-            fclose(file);
-            enqueue(queue_p, argv[5]); /* Adds the output file to the queue. */
+            outfd = open(options->outfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
         }
-        else 
+        if (outfd < 0)
         {
-            enqueue(queue_p, argv[3]); /* Adds teh input file to the queue. */
+            fprintf(stderr, "Couldn't create file %s.\n", options->outfile);
+            freeContext(&ctx);
+            return FILENOTFOUNDERROR;
+        }
+        /* The image comes from a file here, so stdin holds the message. */
+        status = readStdinMessage(options, &ctx);
+        if (status == STATUS_OK)
+        {
+            status = encodeStream(&ctx, infd, outfd, options->message);
+        }
+        if (outfd != STDOUT_FILENO && close(outfd) != 0 && status == STATUS_OK)
+        {
+            status = ERROR_WRITE;
+        }
+    }
+    else
+    {
+        const char* message;
+        status = decodeStream(&ctx, infd, &message);
+        if (status == STATUS_OK && options->outfile && \
+            strcmp(options->outfile, STDIOFILE) != 0)
+        {
+            FILE* file = fopen(options->outfile, "w+");
+            if (!file)
+            {
+                status = ERROR_WRITE;
+            }
+            else
+            {
+                fprintf(file, "%s", message);
+                fclose(file);
+            }
+        }
+        else if (status == STATUS_OK)
+        {
+            printf("%s", message);
         }
-
-        return 0;
     }
 
-    /* If you make it here, assume that the arguments weren't valid. */
-    printHelp();
-    return INVALIDARGUMENTSERROR;
+    if (infd != STDIN_FILENO)
+    {
+        close(infd);
+    }
+    freeContext(&ctx);
+    if (status != STATUS_OK)
+    {
+        fprintf(stderr, "%s\n", statusMessage(status));
+    }
+    else if (options->stats)
+    {
+        printStats(stderr);
+    }
+    return status == STATUS_OK ? 0 : INVALIDINPUTERROR;
 }
 
 /*
@@ -178,28 +1425,73 @@ Prints the help text. This is a static string that doesn't change and lists all
 command line options and usecases.
 
 Parameters:
-    - void
+    - stream (FILE*): where to print, stderr when stdout carries data.
 
 Returns:
     void
 */
-void printHelp(void)
+void printHelp(FILE* stream)
 {
-    printf("Stegano - Image steganography in C.\n" \
+    fprintf(stream, "Stegano - Image steganography in C.\n" \
     "Options:\n" \
     "\t-e: Encode the given message into the provided input file, placing " \
     "the result into the output file. Requires -i, -o and -m flags.\n" \
     "\t-d: Decode a message hidden within the given image. Requires the -i " \
     "flag and optionally takes the -o flag to output the decoded message " \
-    "into a text file.\n" \
-    "\t-i [filename]: The input file. This must be an image in BMP format.\n" \
+    "into a text file. With several -i images, decodes them in parallel " \
+    "and prints each message after its file name.\n" \
+    "\t-i [filename]: The input file. This must be an image in BMP format. " \
+    "Use - to read the image from stdin.\n" \
     "\t-o [filename]: The output file. This can be any file type, but it's" \
     "recommended that when encoding the output file is a .bmp file and when" \
-    "decoding this is a .txt file.\n" \
-    "\t-m [message]: The message to hide in the image.\n"
+    "decoding this is a .txt file. Use - to write to stdout.\n" \
+    "\t-m [message]: The message to hide in the image. With -, the " \
+    "message is read from stdin and compressed with the adaptive codec " \
+    "as it arrives, embedding each part before reading the next. With " \
+    "-O, --shard, --capacity, --connect or -o -, - reads the whole message " \
+    "first instead, and can't be combined with -i -.\n" \
+    "\t-O [directory]: With -e and several -i images, encodes the message " \
+    "into each of them in parallel, writing the results into this " \
+    "directory under their original names.\n" \
+    "\t--shard: With -e, several -i images and -O, splits the message " \
+    "over the images in the order given instead, for messages too big " \
+    "for one image. With -d and several -i images, joins the shards " \
+    "back together in any order.\n"
+    "\t--capacity: Prints how many bits the -i image can hold, reading " \
+    "only its headers. With -m, also reports whether the message fits. " \
+    "Files seen before are answered from the cache in stegano.dat.\n" \
+    "\t--codec [name]: Payload compression when encoding: raw, rle, lz77, " \
+    "huffman, static (built-in tables for text, JSON and hex/base64), " \
+    "blocks (Huffman with a table per 64 KiB block, coded on every CPU), " \
+    "tans (table-based asymmetric numeral systems, for skewed text), " \
+    "adaptive (single pass, no stored table), " \
+    "best (the default, tries each and keeps the smallest) or fast " \
+    "(static tables only).\n" \
+    "\t--key [key]: Scatters the payload over the image in an order " \
+    "derived from key when encoding. The same key is needed to decode.\n" \
+    "\t--passphrase [passphrase]: Encrypts the payload with ChaCha20 " \
+    "when encoding, using a key derived from passphrase. The same " \
+    "passphrase is needed to decode.\n" \
+    "\t--matrix [k]: Embeds the payload with a Hamming matrix code, " \
+    "k bits in each 2^k-1 channel bytes (k from 2 to 8), changing at " \
+    "most one of them. Fewer bytes change, but more are needed.\n" \
+    "\t--scan [directory]: Lists every image under directory carrying a " \
+    "payload, reading only the few rows holding its header. Payloads " \
+    "scattered with --key can't be found.\n" \
+    "\t--serve [socket]: Runs as a daemon on a Unix domain socket, " \
+    "keeping a warm pool of workers for encode, decode and capacity " \
+    "requests until interrupted.\n" \
+    "\t--connect [socket]: Sends -e, -d or --capacity to a server started " \
+    "with --serve instead of running it here. With -i -, the image is " \
+    "passed as shared memory.\n" \
+    "\t--max-memory [MB]: Caps the memory held for an image's pixels when " \
+    "encoding or decoding a file. Larger images are processed a band of " \
+    "rows at a time. Decoding from stdin keeps at most this much of the " \
+    "image's last rows.\n" \
+    "\t-s, --stats: Prints allocation counts and peak memory use after " \
+    "encoding or decoding.\n" \
     "\t-h: Displays this help message.\n\n" \
-    "If no flags are provided, the program will run in interactive mode.\n" \
-    "Note that order matters when flags are used\n");
+    "If no flags are provided, the program will run in interactive mode.\n");
 }
 
 /*
@@ -226,12 +1518,13 @@ in interactive mode.
 
 Parameters:
     - queue_p (queue_t*): a pointer to the application's queue.
+    - images (imagecache_t*): images loaded earlier in the session.
 
 Returns (int):
     - The status of the corresponding encode function call. 0 if encoding was
     successful, < 0 if not.
 */
-int menuEncodeSelected(queue_t* queue_p)
+int menuEncodeSelected(queue_t* queue_p, imagecache_t* images)
 {
     char infile[MAXFILELEN];
     stringInput("What input file should we use (this should be a BMP image): "\
@@ -251,21 +1544,29 @@ int menuEncodeSelected(queue_t* queue_p)
         strcpy(outfile, "encoded.bmp");
     }
 
-    enqueue(queue_p, outfile);
+    rememberFile(queue_p, outfile);
 
     printf("\n");
 
-    int validFile = checkFileType(infile);
-    if (validFile == 0)
+    /* The cover's headers are validated when it is first loaded. */
+    stegctx_t ctx;
+    initContext(&ctx);
+    int status = encodeCached(&ctx, images, infile, outfile, message);
+    freeContext(&ctx);
+
+    if (status == ERROR_OPEN)
     {
-        encode(infile, outfile, message);
-    }   
-    else 
+        printf("Couldn't open image %s.\n", infile);
+    }
+    else if (status == ERROR_WRITE)
     {
-        return INVALIDINPUTERROR;
+        printf("Couldn't create file %s.\n", outfile);
     }
-    
-    return 0;
+    else if (status != STATUS_OK)
+    {
+        printf("%s\n", statusMessage(status));
+    }
+    return status == STATUS_OK ? 0 : INVALIDINPUTERROR;
 }
 
 /*
@@ -274,14 +1575,15 @@ in interactive mode.
 
 Parameters:
     - queue_p (queue_t*): a pointer to the application's queue.
+    - images (imagecache_t*): images loaded earlier in the session.
 
 Returns (int):
     - The status of the corresponding decode function call. 0 if encoding was
     successful, > 0 if not.
 */
-int menuDecodeSelected(queue_t* queue_p)
+int menuDecodeSelected(queue_t* queue_p, imagecache_t* images)
 {
-    char message[MAXMESSAGELEN];
+    const char* message = "";
 
     char infile[MAXFILELEN];
     stringInput("What input file should we use (this should be a BMP image): "\
@@ -291,9 +1593,19 @@ int menuDecodeSelected(queue_t* queue_p)
     stringInput("What should we call the new file (leave blank to display " \
         "message in the terminal): ", MAXFILELEN, outfile);
 
-    decode(infile, message);
+    stegctx_t ctx;
+    initContext(&ctx);
+    int status = decodeCached(&ctx, images, infile, &message);
 
-    if (outfile[0] == '\0')
+    if (status == ERROR_OPEN)
+    {
+        printf("Couldn't open image %s.\n", infile);
+    }
+    else if (status != STATUS_OK)
+    {
+        printf("%s\n", statusMessage(status));
+    }
+    else if (outfile[0] == '\0')
     {
         printf("Resulting Message: %s\n", message);
     }
@@ -303,16 +1615,17 @@ int menuDecodeSelected(queue_t* queue_p)
         fprintf(file, "%s", message);
         fclose(file);
     }
+    freeContext(&ctx);
 
     /* If an outfile was requested, queue it. Otherwise, queue the input file. 
     This corresponds to the most recent file accessed by the application.*/
     if (outfile[0] != '\0')
     {
-        enqueue(queue_p, outfile);
+        rememberFile(queue_p, outfile);
     }
     else
     {
-        enqueue(queue_p, infile);
+        rememberFile(queue_p, infile);
     }
 
     printf("\n");
@@ -326,21 +1639,52 @@ picked.
 
 Parameters:
     - queue_p (queue_t*): a pointer to the queue used by the application.
+    - images (imagecache_t*): the session's image cache, whose counters are
+    shown with the files.
 */
-int menuViewRecentFiles(queue_t* queue_p)
+int menuViewRecentFiles(queue_t* queue_p, imagecache_t* images)
 {
     if (isEmpty(queue_p))
     {
         printf("No Recent Files.\n");
-        return 0;
+    }
+    else
+    {
+        printf("Recent Files:\n");
+        printQueue(queue_p);
+        printf("\n");
     }
 
-    printf("Recent Files:\n");
-    printQueue(queue_p);
-    printf("\n");
+    printf("Image cache: %lu hits, %lu misses, %d images in %lu of %lu " \
+        "bytes\n", images->hits, images->misses, images->count, \
+        (unsigned long)images->used, (unsigned long)images->budget);
     return 0;
 }
 
+/*
+Reads the image cache budget for interactive mode from CACHEBUDGETENV, in MiB.
+
+Returns (size_t):
+    The budget in bytes, IMAGE_CACHE_BUDGET if the variable isn't set or
+    isn't a number.
+*/
+size_t imageCacheBudget(void)
+{
+    const char* value = getenv(CACHEBUDGETENV);
+    char* end;
+
+    if (!value || !*value)
+    {
+        return IMAGE_CACHE_BUDGET;
+    }
+    unsigned long megabytes = strtoul(value, &end, 10);
+    if (*end != '\0')
+    {
+        return IMAGE_CACHE_BUDGET;
+    }
+    return (size_t)megabytes << 20;
+}
+
 /*
 A helper function to easily get string input from the user when the program is
 running interactively. 
@@ -368,66 +1712,135 @@ void stringInput(char prompt[], int maxResponseLen, char response[])
 }
 
 /*
-Writes the elements in the application's queue into a .txt file.
-The .txt file is specified by the user
-Checks whether the queue is empty before writing into the file
+Adds a file to the recently accessed files, dropping the oldest one when the
+queue is full. Paths too long for the queue are not remembered.
+
+Parameters:
+    - queue (queue_t*): the recently accessed files.
+    - filename (char*): the file to add.
+
+Returns:
+    void
+*/
+void rememberFile(queue_t* queue, char* filename)
+{
+    if (strlen(filename) >= MAX_STRING_LENGTH)
+    {
+        return;
+    }
+    if (isFull(queue))
+    {
+        dequeue(queue);
+    }
+    enqueue(queue, filename);
+}
+
+/*
+Writes the application's queue and image metadata cache into the data file.
+The file holds DATAMAGIC and DATAVERSION, the number of queued files, each
+queued path as a length byte followed by its characters, then the cache as
+written by saveMetaCache(). It is written to a temporary file next to it and
+renamed over it, so a reader or another process writing at the same time
+never sees a partial file.
 
 Parameters:
 
 q (queue_t*): a pointer to the application's queue.
+cache (const metacache_t*): a pointer to the image metadata cache.
 filename (const char*): a pointer to the designated file
 
 Returns (int):
 
-Whether the function succesfully writes to the designated file
-0 - Unsuccessful
-1 - Successful
+0 if the file was written, FILENOTFOUNDERROR otherwise.
 */
-int writeQueueToFile(queue_t *q, const char *filename)
+int writeDataFile(queue_t *q, const metacache_t *cache, const char *filename)
 {
-    FILE *fptr = fopen(filename, "w"); /* Opens the designated file and assigns it to fptr */
-
-    if (fptr == NULL) /* Check if the file has opened succesfully */
+    char temp[MAXFILELEN];
+    if (strlen(filename) + sizeof(".XXXXXX") > sizeof(temp))
     {
-        printf("ERROR: Could not open '%s' file\n", filename);
         return FILENOTFOUNDERROR;
     }
+    strcpy(temp, filename);
+    strcat(temp, ".XXXXXX");
 
-    if (isEmpty(q)) /* Check if there is anything stored in the Queue array*/
+    int fd = mkstemp(temp); /* A new file of its own, opened 0600 */
+    FILE *fptr = fd >= 0 ? fdopen(fd, "wb") : NULL;
+
+    if (fptr == NULL) /* Check if the file has opened succesfully */
     {
-        fclose(fptr); /* Successfull, clears the existing file of all data*/
-        return 1;
+        if (fd >= 0)
+        {
+            close(fd);
+            unlink(temp);
+        }
+        return FILENOTFOUNDERROR;
     }
 
+    fwrite(DATAMAGIC, 1, strlen(DATAMAGIC), fptr);
+    fputc(DATAVERSION, fptr);
+    fputc(q->count, fptr);
+
     int i, current = q->front;     /* Initialise i (for loop), Initialise current to front of queue */
     for (i = 0; i < q->count; i++) /* Run until reaching end */
     {
-        fprintf(fptr, "%s\n", q->items[current]); /* Writes the current value into the designated file */
+        int length = (int)strlen(q->items[current]);
+        fputc(length, fptr);
+        fwrite(q->items[current], 1, length, fptr);
         current = (current + 1) % MAX_SIZE;       /* Increments current to the next position in the queue*/
     }
+    saveMetaCache(cache, fptr);
 
-    fclose(fptr); /* Close */
+    /* Only a complete file replaces the old one. */
+    int failed = ferror(fptr);
+    if (fclose(fptr) != 0 || failed || rename(temp, filename) != 0)
+    {
+        unlink(temp);
+        return FILENOTFOUNDERROR;
+    }
     return 0;
 }
 
 /*
-Reads the elements from the designated .txt file and loads the applications queue with that data
-The .txt file is specified by the user
+Reads a text data file from before the metadata cache, one queued path per
+line.
+*/
+static void readLegacyQueue(queue_t *q, FILE *fptr)
+{
+    char buffer[MAXFILELEN];
+    while (fgets(buffer, sizeof(buffer), fptr) != NULL)
+    {
+        if (isFull(q))
+        {
+            break;
+        }
+
+        buffer[strcspn(buffer, "\n")] = 0;
+
+        if (strlen(buffer) < MAX_STRING_LENGTH)
+        {
+            enqueue(q, buffer);
+        }
+    }
+}
+
+/*
+Loads the application's queue and image metadata cache from the data file
+written by writeDataFile(). An older text file only fills the queue, and a
+damaged file keeps whatever was read before the damage.
 
 Parameters:
 
 q (queue_t*): a pointer to the application's queue.
+cache (metacache_t*): a pointer to the image metadata cache.
 filename (const char*): a pointer to the designated file
 
 Returns (int):
 
-Whether the function succesfully writes to the designated file
-0 - Unsuccessful
-1 - Successful
+0 if the file was read, FILENOTFOUNDERROR if it doesn't exist.
 */
-int readQueueFromFile(queue_t *q, const char *filename)
+int readDataFile(queue_t *q, metacache_t *cache, const char *filename)
 {
-    FILE *fptr = fopen(filename, "r"); /* Opens the designated file and assigns it to fptr */
+    FILE *fptr = fopen(filename, "rb"); /* Opens the designated file and assigns it to fptr */
 
     if (fptr == NULL) /* Check if the file has opened succesfully */
     {
@@ -435,19 +1848,34 @@ int readQueueFromFile(queue_t *q, const char *filename)
     }
 
     initialiseQueue(q); /* Clears queue and reinitialises all values to = 0*/
+    initMetaCache(cache);
 
-    char buffer[MAXFILELEN];
-    while (fgets(buffer, sizeof(buffer), fptr) != NULL)
+    char magic[sizeof(DATAMAGIC)];
+    size_t got = fread(magic, 1, strlen(DATAMAGIC), fptr);
+    if (got != strlen(DATAMAGIC) || memcmp(magic, DATAMAGIC, got) != 0 || \
+        fgetc(fptr) != DATAVERSION)
     {
-        if (isFull(q))
+        rewind(fptr);
+        readLegacyQueue(q, fptr);
+        fclose(fptr);
+        return 0;
+    }
+
+    int i, count = fgetc(fptr);
+    for (i = 0; i < count && !isFull(q); i++)
+    {
+        char buffer[MAX_STRING_LENGTH];
+        int length = fgetc(fptr);
+        if (length < 0 || length >= MAX_STRING_LENGTH || \
+            fread(buffer, 1, length, fptr) != (size_t)length)
         {
-            break;
+            fclose(fptr);
+            return 0;
         }
-
-        buffer[strcspn(buffer, "\n")] = 0;
-
+        buffer[length] = '\0';
         enqueue(q, buffer);
     }
+    loadMetaCache(cache, fptr);
 
     fclose(fptr);
     return 0;
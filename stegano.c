@@ -1,7 +1,178 @@
+#define _GNU_SOURCE /*splice()*/
 #include "stegano.h"
 #include <stdio.h>
 #include <stdlib.h> /*malloc(), free()*/
-#include <string.h> /*strdup()*/
+#include <string.h> /*strcpy(), memcpy()*/
+#include <errno.h>
+#include <fcntl.h> /*splice()*/
+#include <unistd.h> /*read(), write(), lseek()*/
+#include <sys/sendfile.h> /*sendfile()*/
+#include <sys/stat.h> /*stat()*/
+#include <dirent.h> /*opendir()*/
+#include <signal.h> /*sigwait()*/
+#include <sys/mman.h> /*mmap(), memfd_create()*/
+#include <sys/socket.h> /*socket(), sendmsg()*/
+#include <sys/uio.h> /*writev()*/
+#include <sys/un.h> /*sockaddr_un*/
+#include <sys/syscall.h> /*syscall()*/
+#ifdef __linux__
+#include <linux/io_uring.h> /*io_uring_setup()*/
+#endif
+#include <pthread.h> /*pthread_create()*/
+#include <time.h> /*clock_gettime()*/
+
+/***** Memory *****/
+/* Every block is prefixed with its size so stegFree() can keep the
+   byte counters right. The union keeps the user pointer aligned the
+   same way malloc() would. */
+typedef union {
+    size_t size;
+    long double align_ld;
+    void *align_p;
+} allochead_t;
+
+static void *defaultAllocate(size_t size, void *user) {
+    (void)user;
+    return malloc(size);
+}
+
+static void defaultRelease(void *ptr, size_t size, void *user) {
+    (void)size;
+    (void)user;
+    free(ptr);
+}
+
+static allocator_t current_allocator = {defaultAllocate, defaultRelease, NULL};
+
+/* Counters are kept per thread, so operations running on other threads
+   don't mix into each other's counts. parallelFor() adds the counts of
+   its worker threads to the calling thread's. */
+static __thread allocstats_t alloc_stats;
+
+/* Replaces the allocator used for all library memory.
+ *
+ * Input:
+ *  - const allocator_t *allocator: The new allocator, or NULL to go
+ *                                  back to malloc() and free().
+ * Output:
+ *  - Function of type void.
+ */
+void setAllocator(const allocator_t *allocator) {
+    if(!allocator || !allocator->allocate || !allocator->release) {
+        current_allocator.allocate = defaultAllocate;
+        current_allocator.release = defaultRelease;
+        current_allocator.user = NULL;
+        return;
+    }
+    current_allocator = *allocator;
+}
+
+/* Allocates size bytes from the current allocator and updates this
+ * thread's current/peak byte counters.
+ *
+ * Input:
+ *  - size_t size: Number of bytes wanted.
+ * Output:
+ *  - void *: The new block, or NULL if the allocator failed.
+ */
+void *stegAlloc(size_t size) {
+    if(size > (size_t)-1 - sizeof(allochead_t)) return NULL;
+
+    allochead_t *head = current_allocator.allocate(sizeof(allochead_t) + size,
+                                                   current_allocator.user);
+    if(!head) return NULL;
+    head->size = size;
+
+    alloc_stats.current_bytes += size;
+    alloc_stats.allocations++;
+    if(alloc_stats.current_bytes > alloc_stats.peak_bytes) {
+        alloc_stats.peak_bytes = alloc_stats.current_bytes;
+    }
+    return head + 1;
+}
+
+/* Returns a block from stegAlloc() to the allocator. NULL is ignored.
+ *
+ * Input:
+ *  - void *ptr: Block to free.
+ * Output:
+ *  - Function of type void.
+ */
+void stegFree(void *ptr) {
+    if(!ptr) return;
+
+    allochead_t *head = (allochead_t *)ptr - 1;
+    size_t size = head->size;
+
+    /* A block allocated on another thread was never counted on this
+       one, so the count stops at zero. */
+    alloc_stats.current_bytes -= size < alloc_stats.current_bytes ?
+                                 size : alloc_stats.current_bytes;
+    alloc_stats.releases++;
+    current_allocator.release(head, sizeof(allochead_t) + size,
+                              current_allocator.user);
+}
+
+/* Starts counting a new operation on this thread. Bytes still held are
+ * kept, so the peak starts from what is currently allocated. */
+void resetAllocStats(void) {
+    alloc_stats.allocations = 0;
+    alloc_stats.releases = 0;
+    alloc_stats.peak_bytes = alloc_stats.current_bytes;
+}
+
+/* Returns a snapshot of this thread's allocation counters. */
+allocstats_t getAllocStats(void) {
+    return alloc_stats;
+}
+
+/* Worker threads allocate through the hook too, so the bump pointer
+   only moves by compare-and-swap. */
+static void *arenaAllocate(size_t size, void *user) {
+    arena_t *arena = user;
+    size_t used, start;
+    do {
+        used = __atomic_load_n(&arena->used, __ATOMIC_ACQUIRE);
+        /* Keeps every block on a 16 byte boundary. */
+        size_t misalign = (size_t)(arena->base + used) & 15;
+        start = used + (misalign ? 16 - misalign : 0);
+        if(start > arena->size || size > arena->size - start) return NULL;
+    } while(!__sync_bool_compare_and_swap(&arena->used, used, start + size));
+    return arena->base + start;
+}
+
+static void arenaRelease(void *ptr, size_t size, void *user) {
+    arena_t *arena = user;
+    size_t start = (unsigned char *)ptr - arena->base;
+    /* Only the most recent block can be given back, everything else
+       is released when the arena is reinitialised. */
+    __sync_bool_compare_and_swap(&arena->used, start + size, start);
+}
+
+/* Prepares an arena that hands out memory from a caller owned buffer.
+ *
+ * Input:
+ *  - arena_t *arena: Arena to set up.
+ *  - void *buffer: Backing memory, must outlive the arena.
+ *  - size_t size: Size of buffer in bytes.
+ * Output:
+ *  - Function of type void.
+ */
+void initArena(arena_t *arena, void *buffer, size_t size) {
+    arena->base = buffer;
+    arena->size = size;
+    arena->used = 0;
+}
+
+/* Wraps an arena in an allocator_t for setAllocator(). The arena may
+ * be used by several threads at once, as the library's workers do. */
+allocator_t arenaAllocator(arena_t *arena) {
+    allocator_t allocator;
+    allocator.allocate = arenaAllocate;
+    allocator.release = arenaRelease;
+    allocator.user = arena;
+    return allocator;
+}
 
 /********************************************************************/
 /* Calculates the number of padding bytes so each image row aligns.
@@ -14,7 +185,9 @@
 */
 int calcPadding(int width) {
     const int alignment = 4;
-    int row_bytes = width * RGB_PER_PIXEL;
+    /* Only the row length modulo 4 matters, which keeps this from
+       overflowing for very wide images. */
+    int row_bytes = (width % alignment) * RGB_PER_PIXEL;
 
     /* How many bytes the row is short from a multiple of 4. */
     int remainder = alignment - (row_bytes % alignment);
@@ -25,139 +198,318 @@ int calcPadding(int width) {
     return padding;
 }
 
-/* Checks whether the file is in BMP format.
+/* Checks whether the file is a BMP this program can use, with the
+ * checks of openImage().
  * 
  * Input:
  *  - char *filename: Pointer to char of filename, which is the
  *                    string that contains the file name.
  * Output:
- *  - 0: If correct file format.
- *  - 1: If open error or incorrect file format.
+ *  - STATUS_OK: If correct file format.
+ *  - ERROR_OPEN, or the openImage() status for an incorrect format.
 */
 int checkFileType(char *filename) {
-    FILE *image = fopen(filename, "rb");
-    if(!image) {
-        printf("Couldn't open file %s.\n", filename);
-        return 1;
+    imagefile_t file;
+    int status = openImage(filename, &file);
+    closeImage(&file);
+    return status;
+}
+
+/* Returns a readable description of a library status code.
+ *
+ * Input:
+ *  - int status: A status returned by a library function.
+ * Output:
+ *  - const char *: Static string describing the status.
+ */
+const char *statusMessage(int status) {
+    switch(status) {
+        case STATUS_OK: return "Success.";
+        case ERROR_OPEN: return "Couldn't open file.";
+        case ERROR_FORMAT: return "Incorrect image format. "
+                                  "Must be a 24-bit, uncompressed, bottom-up BMP.";
+        case ERROR_MEMORY: return "Memory Allocation Error.";
+        case ERROR_EMPTY: return "Message is empty.";
+        case ERROR_TOO_LARGE: return "Message is too large.";
+        case ERROR_TOO_SMALL: return "Image is too small.";
+        case ERROR_WRITE: return "Couldn't write file.";
+        case ERROR_CORRUPT: return "Invalid image data.";
+        case ERROR_PASSPHRASE: return "Message is encrypted, a passphrase is needed.";
+        case ERROR_SHARDED: return "Image holds one shard of a payload, "
+                                   "decode it with the other shards.";
+        case ERROR_MISSING_SHARD: return "A shard of the payload is missing.";
+        case ERROR_WRONG_PASSPHRASE: return "Wrong passphrase.";
+        case ERROR_STREAM_WINDOW: return "Payload reaches past the rows a stream decode may "
+                                         "hold, decode the file or raise the memory limit.";
+        case ERROR_IN_USE: return "Another server is already listening on that socket.";
+        default: return "Unknown error.";
     }
+}
 
-    /* Reads the file and image header into their respective structs. */
-    fileheader_t fh;
-    imageheader_t ih;
+/* Little endian field readers for the BMP headers. */
+static unsigned int readLE32(const unsigned char *bytes) {
+    return (unsigned int)bytes[0] | ((unsigned int)bytes[1] << 8) |
+           ((unsigned int)bytes[2] << 16) | ((unsigned int)bytes[3] << 24);
+}
 
-    fread(fh.bfType, sizeof(fh.bfType), 1, image);
-    fread(&fh.bfSize, sizeof(fh.bfSize), 1, image);
-    fread(&fh.bfReserved1, sizeof(fh.bfReserved1), 1, image);
-    fread(&fh.bfReserved2, sizeof(fh.bfReserved2), 1, image);
-    fread(&fh.bfOffBits, sizeof(fh.bfOffBits), 1, image);
-    fread(&ih, sizeof(imageheader_t), 1, image);
+static unsigned short readLE16(const unsigned char *bytes) {
+    return (unsigned short)(bytes[0] | (bytes[1] << 8));
+}
 
-    /* Checks the first 2 bytes (indices of bfType). */
-    if((fh.bfType[0] != 'B') || (fh.bfType[1] != 'M')) {
-        printf("Incorrect file format.\n");
-        return 1;
-    }
+/* Parses the file header and info header out of a raw byte buffer, so
+ * both can come from a single read.
+ *
+ * Input:
+ *  - const unsigned char bytes[]: The first BMP_HEADERS_SIZE bytes of
+ *                                 the file.
+ *  - fileheader_t *fh: Pointer to the file header to fill.
+ *  - imageheader_t *ih: Pointer to the info header to fill.
+ * Output:
+ *  - Function of type void.
+ */
+void parseHeaders(const unsigned char bytes[BMP_HEADERS_SIZE], fileheader_t *fh,
+                  imageheader_t *ih) {
+    const unsigned char *info = bytes + FILEHEADER_SIZE;
+
+    fh->bfType[0] = bytes[0];
+    fh->bfType[1] = bytes[1];
+    fh->bfSize = readLE32(bytes + 2);
+    fh->bfReserved1 = readLE16(bytes + 6);
+    fh->bfReserved2 = readLE16(bytes + 8);
+    fh->bfOffBits = readLE32(bytes + OFFSET_BYTE);
+
+    ih->biSize = readLE32(info);
+    ih->biWidth = (int)readLE32(info + 4);
+    ih->biHeight = (int)readLE32(info + 8);
+    ih->biPlanes = readLE16(info + 12);
+    ih->biBitCount = readLE16(info + 14);
+    ih->biCompression = readLE32(info + 16);
+    ih->biSizeImage = readLE32(info + 20);
+    ih->biXPelsPerMeter = (int)readLE32(info + 24);
+    ih->biYPelsPerMeter = (int)readLE32(info + 28);
+    ih->biClrUsed = readLE32(info + 32);
+    ih->biClrImportant = readLE32(info + 36);
+}
+
+/* Applies the same checks as checkFileType() to headers that have
+ * already been parsed, without printing anything.
+ *
+ * Input:
+ *  - const fileheader_t *fh: Parsed file header.
+ *  - const imageheader_t *ih: Parsed info header.
+ * Output:
+ *  - STATUS_OK: If the image can be used.
+ *  - ERROR_FORMAT: If not a 24-bit, uncompressed, bottom-up BMP.
+ */
+int validateHeaders(const fileheader_t *fh, const imageheader_t *ih) {
+    if((fh->bfType[0] != 'B') || (fh->bfType[1] != 'M')) return ERROR_FORMAT;
+    if((ih->biBitCount != 24) || (ih->biCompression != 0)) return ERROR_FORMAT;
+    if(ih->biHeight < 0 || ih->biWidth <= 0) return ERROR_FORMAT;
+    if(fh->bfOffBits < BMP_HEADERS_SIZE) return ERROR_FORMAT;
+    return STATUS_OK;
+}
 
-    /* Checks for correct 24-bit, uncompressed format. */
-    if((ih.biBitCount != 24) || (ih.biCompression != 0)) {
-        fclose(image);
-        printf("Incorrect image format. "
-               "Must be 24-bit color format and uncompressed\n");
-        return 1;
+/* Checks that the headers describe pixel rows lying inside a file (or
+ * buffer) of size bytes. A non-zero biSizeImage must cover the rows and
+ * fit in the file too, and the info header must fit before the pixels.
+ *
+ * Input:
+ *  - const fileheader_t *fh: Parsed file header, already validated.
+ *  - const imageheader_t *ih: Parsed info header, already validated.
+ *  - unsigned long long size: Bytes in the file.
+ * Output:
+ *  - STATUS_OK, or ERROR_FORMAT if anything lies outside the file.
+ */
+static int checkBounds(const fileheader_t *fh, const imageheader_t *ih,
+                       unsigned long long size) {
+    unsigned long long stride = (unsigned long long)ih->biWidth * RGB_PER_PIXEL +
+                                calcPadding(ih->biWidth);
+    unsigned long long rows = stride * ih->biHeight;
+
+    if(ih->biSize < BMP_HEADERS_SIZE - FILEHEADER_SIZE ||
+       fh->bfOffBits < FILEHEADER_SIZE + (unsigned long long)ih->biSize) {
+        return ERROR_FORMAT;
+    }
+    if(fh->bfOffBits > size || rows > size - fh->bfOffBits) return ERROR_FORMAT;
+    if(ih->biSizeImage != 0 &&
+       (ih->biSizeImage < rows || ih->biSizeImage > size - fh->bfOffBits)) {
+        return ERROR_FORMAT;
     }
+    return STATUS_OK;
+}
 
-    /* Check for correct bottom-up BMP format. */
-    if((ih.biHeight < 0)) {
-        printf("Incorrect image format. "
-            "Top-down BMP not supported.\n");
-        return 1;
+/* Reads exactly length bytes at offset.
+ *
+ * Input:
+ *  - int fd: Descriptor to read from.
+ *  - void *buffer: Destination.
+ *  - size_t length: Bytes to read.
+ *  - unsigned long long offset: Where in the file to start.
+ * Output:
+ *  - STATUS_OK, ERROR_FORMAT if the file ends first, or ERROR_OPEN.
+ */
+static int readAt(int fd, void *buffer, size_t length, unsigned long long offset) {
+    unsigned char *bytes = buffer;
+    while(length > 0) {
+        ssize_t got = pread(fd, bytes, length, (off_t)offset);
+        if(got < 0 && errno == EINTR) continue;
+        if(got < 0) return ERROR_OPEN;
+        if(got == 0) return ERROR_FORMAT;
+        bytes += got;
+        length -= (size_t)got;
+        offset += (unsigned long long)got;
     }
+    return STATUS_OK;
+}
 
-    fclose(image);
-    return 0;
+/* Opens an image file once for everything that follows: its size comes
+ * from fstat() and both headers from a single read, then the format and
+ * every offset and size in the headers are checked against the file.
+ * The handle is closed with closeImage(), also after a failure.
+ *
+ * Input:
+ *  - const char *path: The image.
+ *  - imagefile_t *file: Receives the descriptor and parsed headers.
+ * Output:
+ *  - STATUS_OK, ERROR_OPEN, or ERROR_FORMAT if the file isn't a usable
+ *    BMP or its headers point outside it.
+ */
+int openImage(const char *path, imagefile_t *file) {
+    unsigned char bytes[BMP_HEADERS_SIZE];
+    struct stat info;
+
+    file->fd = open(path, O_RDONLY);
+    if(file->fd < 0) return ERROR_OPEN;
+    if(fstat(file->fd, &info) != 0) return ERROR_OPEN;
+    file->size = (unsigned long long)info.st_size;
+
+    int status = readAt(file->fd, bytes, BMP_HEADERS_SIZE, 0);
+    if(status != STATUS_OK) return status;
+    parseHeaders(bytes, &file->fh, &file->ih);
+    status = validateHeaders(&file->fh, &file->ih);
+    if(status == STATUS_OK) status = checkBounds(&file->fh, &file->ih, file->size);
+
+    file->stride = (size_t)file->ih.biWidth * RGB_PER_PIXEL + calcPadding(file->ih.biWidth);
+    return status;
 }
 
-/* Reads the image in binary and store its information in image_t
- * struct.
- * 
+/* Closes an image opened with openImage(). */
+void closeImage(imagefile_t *file) {
+    if(file->fd >= 0) close(file->fd);
+    file->fd = -1;
+}
+
+/* Works out how many payload bits an image can hold, reading nothing
+ * but the headers. With a message, also compresses it and reports
+ * whether it would fit, without touching the pixels or writing output.
+ *
  * Input:
- *  - char *infile: Pointer to char infile, signifies the input file
- *                  to read.
+ *  - char *infile: Pointer to char infile, signifies the image to probe.
+ *  - char *message: Message to check, or NULL for capacity only.
+ *  - capacity_t *capacity: Pointer to the struct receiving the results.
  * Output:
- *  - image_t pic: Returns the instance pic of image_t struct along
- *                 with its data.
-*/
-image_t readImage(char *infile) {
-    int i, j;
+ *  - STATUS_OK, or ERROR_OPEN, ERROR_FORMAT, ERROR_MEMORY on failure.
+ */
+int probeCapacity(char *infile, char *message, capacity_t *capacity) {
+    imagefile_t file;
+
+    /* The same checks as encoding, so a file it would refuse gets no
+       capacity either. */
+    int status = openImage(infile, &file);
+    closeImage(&file);
+    if(status != STATUS_OK) return status;
+    return headerCapacity(&file.fh, &file.ih, message, capacity);
+}
 
-    FILE *image = fopen(infile, "rb");
-    /* Initialises image data to 0 to safely return the empty
-       image if opening fails. */
-    image_t pic;
-    pic.width = 0;
-    pic.height = 0;
-    pic.offset = 0;
-    pic.header = NULL;
-    pic.rgb = NULL;
-    if(!image) {
-        printf("Couldn't open image %s.\n", infile);
-        return pic;
-    }
-
-    /* Seeks specific positions in the image to find the offset, width, 
-       height, and header data. */
-    fseek(image, OFFSET_BYTE, SEEK_SET);
-    fread(&pic.offset, sizeof(pic.offset), 1, image);
-    fseek(image, WIDTH_BYTE, SEEK_SET);
-    fread(&pic.width, sizeof(pic.width), 1, image);
-    fseek(image, HEIGHT_BYTE, SEEK_SET);
-    fread(&pic.height, sizeof(pic.height), 1, image);
-
-    /* Memory allocates *header with size of offset (total size of header in bytes). */
-    pic.header = malloc(pic.offset);
-    if(!pic.header) {
-        printf("Memory Allocation Error.\n");
-        fclose(image);
-        return pic;
-    }
-    /* Skips to start to read full header and stores in struct variable. */
-    fseek(image, START_BYTE, SEEK_SET);
-    fread(pic.header, 1, pic.offset, image);
-    
-    /* Allocates memory for total RGB values. */
-    pic.rgb = malloc(pic.width * pic.height * RGB_PER_PIXEL);
-    if(!pic.rgb) {
-        printf("Memory Allocation Error.\n");
-        free(pic.header);
-        fclose(image);
-        pic.header = NULL;
-        return pic;
-    }
-
-    /* Skips to offset byte, indicator of where the RGB sequence starts. */
-    fseek(image, pic.offset, SEEK_SET);
-    /* Padding and temporary array. */
-    int padding = calcPadding(pic.width);
-    unsigned char channel[RGB_PER_PIXEL];
-
-    /* Loops through image dimensions from (height - 1), following bottom-up convention, left to right. */
-    for(i = pic.height - 1; i >= 0; i--) {
-        for(j = 0; j < pic.width; j++) {
-            /* Index for each value of each pixel. */
-            int index = i * pic.width + j;
-            fread(channel, 1, RGB_PER_PIXEL, image);
-            /* Reassigns as RGB for readability, since the initial 
-               BMP order is BGR. */
-            pic.rgb[index].red = channel[2];
-            pic.rgb[index].green = channel[1];
-            pic.rgb[index].blue = channel[0];
-        }
-        /* Moves the file pointer forward to skip padding byte(s). */
-        fseek(image, padding, SEEK_CUR);
+/* Capacity calculation behind probeCapacity(), for headers that have
+ * already been read or were cached.
+ *
+ * Input:
+ *  - const fileheader_t *fh: Parsed file header.
+ *  - const imageheader_t *ih: Parsed info header.
+ *  - char *message: Message to check, or NULL for capacity only.
+ *  - capacity_t *capacity: Pointer to the struct receiving the results.
+ * Output:
+ *  - STATUS_OK, or ERROR_FORMAT, ERROR_EMPTY, ERROR_MEMORY on failure.
+ */
+int headerCapacity(const fileheader_t *fh, const imageheader_t *ih, char *message,
+                   capacity_t *capacity) {
+    int i;
+
+    int status = validateHeaders(fh, ih);
+    if(status != STATUS_OK) return status;
+
+    capacity->width = ih->biWidth;
+    capacity->height = ih->biHeight;
+    capacity->channel_bytes = (unsigned long long)ih->biWidth * ih->biHeight * RGB_PER_PIXEL;
+    capacity->header_bits = HEADER_BITS;
+
+    /* One LSB per channel byte after the header, or k bits per 2^k - 1
+       of them with matrix embedding, up to what the 32 bit payload size
+       can describe. */
+    static const char *matrix_names[] = {"matrix2", "matrix3", "matrix4", "matrix5",
+                                         "matrix6", "matrix7", "matrix8"};
+    unsigned long long space = 0;
+    if(capacity->channel_bytes > capacity->header_bits) {
+        space = capacity->channel_bytes - capacity->header_bits;
     }
-    
-    fclose(image);
-    return pic;
+
+    capacity->modes[MODE_LSB].name = "lsb";
+    capacity->modes[MODE_LSB].payload_bits = (unsigned long)space;
+    for(i = MODE_MATRIX; i < EMBED_MODES; i++) {
+        int k = MATRIX_MIN_K + i - MODE_MATRIX;
+        capacity->modes[i].name = matrix_names[i - MODE_MATRIX];
+        capacity->modes[i].payload_bits = (unsigned long)(space / ((1U << k) - 1) * k);
+    }
+
+    for(i = 0; i < EMBED_MODES; i++) {
+        if(capacity->modes[i].payload_bits > HEADER_LENGTH_MAX) {
+            capacity->modes[i].payload_bits = HEADER_LENGTH_MAX;
+        }
+        capacity->modes[i].payload_bytes = capacity->modes[i].payload_bits / BITS_PER_BYTE;
+    }
+
+    capacity->message_bytes = 0;
+    capacity->message_bits = 0;
+    capacity->codec = CODEC_RAW;
+    capacity->fits = 0;
+    if(!message) return STATUS_OK;
+
+    capacity->message_bytes = strlen(message);
+    if(capacity->message_bytes == 0) return ERROR_EMPTY;
+
+    /* Sized exactly as encoding would, codec trial included. */
+    stegctx_t ctx;
+    initContext(&ctx);
+    status = buildPayload(&ctx, message);
+    capacity->message_bits = ctx.payload_bits;
+    capacity->codec = ctx.codec_used;
+    freeContext(&ctx);
+    if(status != STATUS_OK) return status;
+
+    capacity->fits = capacity->message_bits <= capacity->modes[MODE_LSB].payload_bits;
+    return STATUS_OK;
+}
+
+/* Makes sure a reusable buffer holds at least needed bytes. The old
+ * contents are not kept, callers refill the buffer after growing it.
+ *
+ * Input:
+ *  - void **buffer: Pointer to the buffer pointer, may point to NULL.
+ *  - size_t *capacity: Pointer to the current capacity in bytes.
+ *  - size_t needed: Number of bytes wanted.
+ * Output:
+ *  - STATUS_OK, or ERROR_MEMORY if the buffer couldn't grow.
+ */
+static int growBuffer(void **buffer, size_t *capacity, size_t needed) {
+    if(*buffer && *capacity >= needed) return STATUS_OK;
+
+    stegFree(*buffer);
+    *capacity = 0;
+    *buffer = stegAlloc(needed);
+    if(!*buffer) return ERROR_MEMORY;
+    *capacity = needed;
+    return STATUS_OK;
 }
 
 /* Calculates indices and accesses RGB channels. Changes the LSB 
@@ -165,16 +517,16 @@ image_t readImage(char *infile) {
  * 
  * Input:
  *  - image_t *pic: Pointer to struct pic.
- *  - int bit_index: Index position in the image (which pixel/channel).
+ *  - size_t bit_index: Index position in the image (which pixel/channel).
  *  - int bit: The value of the bit, 0 or 1.
  * Output:
  *  - Function of type void.
  */
-void setLSBPixel(image_t *pic, int bit_index, int bit) {
+void setLSBPixel(image_t *pic, size_t bit_index, int bit) {
     /* Pixel position increases after every 3 channels accessed. 
        Channel index always 0, 1, or 2. */
-    int pixel_index = bit_index / RGB_PER_PIXEL;
-    int channel_index = bit_index % RGB_PER_PIXEL;
+    size_t pixel_index = bit_index / RGB_PER_PIXEL;
+    int channel_index = (int)(bit_index % RGB_PER_PIXEL);
 
     /* Pointer to the channel, accessing memory address of each channel based on index. */
     unsigned char *channel;
@@ -192,16 +544,16 @@ void setLSBPixel(image_t *pic, int bit_index, int bit) {
  * 
  * Input:
  *  - image_t *pic: Pointer to struct pic.
- *  - int bit_index: Index position of the image (which pixel/channel).
+ *  - size_t bit_index: Index position of the image (which pixel/channel).
  *  - int *bit: Pointer to the integer bit, modifying the integer.
  * Output:
  *  - Function of type void.
  */
-void getLSBPixel(image_t *pic, int bit_index, int *bit) {
+void getLSBPixel(image_t *pic, size_t bit_index, int *bit) {
     /* Pixel position increases after every 3 channels accessed. 
        Channel index always 0, 1, or 2. */
-    int pixel_index = bit_index / RGB_PER_PIXEL;
-    int channel_index = bit_index % RGB_PER_PIXEL;
+    size_t pixel_index = bit_index / RGB_PER_PIXEL;
+    int channel_index = (int)(bit_index % RGB_PER_PIXEL);
 
     /* Pointer to channel, accessing memory address of each channel based on index. */
     unsigned char *channel;
@@ -213,299 +565,548 @@ void getLSBPixel(image_t *pic, int bit_index, int *bit) {
     *bit = *channel & 1;
 }
 
-/* Encodes the total bits, message length, Huffman's frequency 
- * table, and Huffman compressed message into image.
- * Creates a new image, writes the information including the modified
- * RGB values into the image.
- * 
- * encode() allocates and frees memory to compress the
- * message internally, no manual/external memory management.
- * 
+/* Frees the header and pixel data of an image and resets it to empty.
+ *
  * Input:
- *  - char *infile: Pointer to char infile, signifies the input file
- *                  to read.
- *  - char *outfile: Pointer to char outfile, signifies the output file
- *                   to write.
- *  - char *message: Pointer to char (string) message.
+ *  - image_t *pic: Pointer to struct pic.
  * Output:
  *  - Function of type void.
  */
-void encode(char *infile, char *outfile, char *message) {
-    /* Calls the readImage function with local instance pic of image_t struct. */
-    image_t pic = readImage(infile);
-    /* Stops the program if readImage returns corrupted image. */
-    if(!pic.rgb || !pic.header) {
-        printf("Failed to allocate memory.\n");
-        return;
-    }
+void freeImage(image_t *pic) {
+    stegFree(pic->header);
+    stegFree(pic->rgb);
+    pic->header = NULL;
+    pic->rgb = NULL;
+}
 
-    /* Initialising variables. */
-    int i, j;
-    int total_bits = 0;
+/* Converts padded, bottom-up BGR rows as stored in a BMP into the
+ * top-down RGB pixels of pic. pic's width and height give the number
+ * of rows and pixels to convert.
+ *
+ * Input:
+ *  - const unsigned char *rows: First row in file order.
+ *  - size_t stride: Bytes per row including padding.
+ *  - image_t *pic: Pointer to struct pic receiving the pixels.
+ * Output:
+ *  - Function of type void.
+ */
+static void rowsToPixels(const unsigned char *rows, size_t stride, image_t *pic) {
+    int i;
+    size_t j;
+    for(i = pic->height - 1; i >= 0; i--) {
+        rgb_t *pixel = pic->rgb + (size_t)i * pic->width;
+        for(j = 0; j < (size_t)pic->width; j++) {
+            pixel[j].red = rows[j * RGB_PER_PIXEL + 2];
+            pixel[j].green = rows[j * RGB_PER_PIXEL + 1];
+            pixel[j].blue = rows[j * RGB_PER_PIXEL];
+        }
+        rows += stride;
+    }
+}
 
-    /* Checks for empty string. */
-    int message_len = strlen(message);
-    if(message_len == 0) {
-        printf("Message is empty.\n");
-        free(pic.header);
-        free(pic.rgb);
-        return;
+/* Reverse of rowsToPixels(), padding bytes are written as zero.
+ *
+ * Input:
+ *  - const image_t *pic: Pointer to struct pic holding the pixels.
+ *  - unsigned char *rows: First row in file order.
+ *  - size_t stride: Bytes per row including padding.
+ * Output:
+ *  - Function of type void.
+ */
+static void pixelsToRows(const image_t *pic, unsigned char *rows, size_t stride) {
+    int i;
+    size_t j;
+    size_t row_bytes = (size_t)pic->width * RGB_PER_PIXEL;
+    for(i = pic->height - 1; i >= 0; i--) {
+        const rgb_t *pixel = pic->rgb + (size_t)i * pic->width;
+        for(j = 0; j < (size_t)pic->width; j++) {
+            rows[j * RGB_PER_PIXEL + 2] = pixel[j].red;
+            rows[j * RGB_PER_PIXEL + 1] = pixel[j].green;
+            rows[j * RGB_PER_PIXEL] = pixel[j].blue;
+        }
+        /* Zeroes the padding after each row. */
+        memset(rows + row_bytes, 0, stride - row_bytes);
+        rows += stride;
     }
+}
 
-    /* Call to compressMessage(), compress message and access total bits from the function. */
-    char *compressed = compressMessage(message, &total_bits);
-    if(!compressed) {
-        printf("Compression failed.\n");
-        free(pic.header);
-        free(pic.rgb);
-        return;
+/* Reads an image opened with openImage() into pic, reusing pic's
+ * header and RGB buffers when they are already big enough. The header
+ * takes one read and the rows are read in STREAM_CHUNK sized runs
+ * through scratch, converting each run as it arrives.
+ *
+ * Input:
+ *  - const imagefile_t *file: The open image.
+ *  - image_t *pic: Pointer to struct pic, whose buffers may be reused.
+ *  - size_t *header_capacity: Capacity of pic->header in bytes.
+ *  - size_t *rgb_capacity: Capacity of pic->rgb in bytes.
+ *  - unsigned char **scratch: Buffer for file rows, may point to NULL.
+ *  - size_t *scratch_capacity: Capacity of *scratch in bytes.
+ * Output:
+ *  - STATUS_OK, or ERROR_OPEN, ERROR_FORMAT or ERROR_MEMORY on failure.
+ */
+static int loadImage(const imagefile_t *file, image_t *pic, size_t *header_capacity,
+                     size_t *rgb_capacity, unsigned char **scratch, size_t *scratch_capacity) {
+    size_t height = (size_t)file->ih.biHeight, done = 0;
+    size_t run_rows = STREAM_CHUNK / file->stride;
+    if(run_rows == 0) run_rows = 1;
+    if(run_rows > height) run_rows = height;
+
+    pic->width = file->ih.biWidth;
+    pic->height = file->ih.biHeight;
+    pic->offset = file->fh.bfOffBits;
+    if(growBuffer((void **)&pic->header, header_capacity, pic->offset) != STATUS_OK ||
+       growBuffer((void **)&pic->rgb, rgb_capacity,
+                  (size_t)pic->width * height * sizeof(rgb_t)) != STATUS_OK ||
+       growBuffer((void **)scratch, scratch_capacity, run_rows * file->stride) != STATUS_OK) {
+        return ERROR_MEMORY;
     }
+    int status = readAt(file->fd, pic->header, pic->offset, 0);
+
+    /* File rows run bottom-up, so each run fills the rows above the last. */
+    while(status == STATUS_OK && done < height) {
+        image_t run = *pic;
+        size_t rows = height - done < run_rows ? height - done : run_rows;
+
+        status = readAt(file->fd, *scratch, rows * file->stride,
+                        pic->offset + (unsigned long long)done * file->stride);
+        run.height = (int)rows;
+        run.rgb = pic->rgb + (height - done - rows) * pic->width;
+        if(status == STATUS_OK) rowsToPixels(*scratch, file->stride, &run);
+        done += rows;
+    }
+    return status;
+}
 
-    /* printf("Compressed message: %s\n", compressed); */
+/* Reads the image in binary and store its information in image_t
+ * struct.
+ * 
+ * Input:
+ *  - char *infile: Pointer to char infile, signifies the input file
+ *                  to read.
+ * Output:
+ *  - image_t pic: Returns the instance pic of image_t struct along
+ *                 with its data, or an empty image (NULL rgb) if the
+ *                 file can't be read or isn't a usable BMP.
+*/
+image_t readImage(char *infile) {
+    /* Initialises image data to 0 to safely return the empty
+       image if opening fails. */
+    image_t pic;
+    size_t header_capacity = 0, rgb_capacity = 0;
+    pic.width = 0;
+    pic.height = 0;
+    pic.offset = 0;
+    pic.header = NULL;
+    pic.rgb = NULL;
 
-    /* Initialising essential variables. */
-    int tree_bits = BITS_PER_BYTE * 2 + MAX_MESSAGE_SIZE * BITS_PER_BYTE; /* Bits required for the Huffman tree. */
-    int required_bits = tree_bits + total_bits;
-    int max_bits = pic.width * pic.height * RGB_PER_PIXEL;
+    unsigned char *scratch = NULL;
+    size_t scratch_capacity = 0;
+    imagefile_t file;
 
-    /* Checks if image is too small (or message too large). */
-    if(total_bits > (MAX_MESSAGE_SIZE - 1) || required_bits > max_bits) {
-        if(total_bits > (MAX_MESSAGE_SIZE - 1)) printf("Message is too large.\n");
-        else printf("Image is too small.\n");
-        free(pic.header);
-        free(pic.rgb);
-        free(compressed);
-        return;
+    int status = openImage(infile, &file);
+    if(status == STATUS_OK) {
+        status = loadImage(&file, &pic, &header_capacity, &rgb_capacity, &scratch,
+                           &scratch_capacity);
     }
+    closeImage(&file);
+    stegFree(scratch);
 
-    /* Stores the total bits in the first 8 LSBs, since max string length after compression is 256. */
-    for(i = 0; i < BITS_PER_BYTE; i++) {
-        /* Performs bitwise >> and AND with 00000001, isolating each bit. */
-        int bit = (total_bits >> (7 - i)) & 1;
-        
-        /* Call to function, modifying LSB according to bit value. */
-        setLSBPixel(&pic, i, bit);
-    }
+    if(status != STATUS_OK) freeImage(&pic);
+    return pic;
+}
+
+/* Parses a BMP held in memory into pic, reusing pic's buffers when
+ * they are already big enough. Every offset is checked against length,
+ * so a truncated or hostile buffer is rejected, not read past.
+ *
+ * Input:
+ *  - const unsigned char *bmp: The BMP file contents.
+ *  - size_t length: Number of bytes in bmp.
+ *  - image_t *pic: Pointer to struct pic, whose buffers may be reused.
+ *  - size_t *header_capacity: Capacity of pic->header in bytes.
+ *  - size_t *rgb_capacity: Capacity of pic->rgb in bytes.
+ * Output:
+ *  - STATUS_OK, or ERROR_FORMAT or ERROR_MEMORY on failure.
+ */
+static int parseImageBuffer(const unsigned char *bmp, size_t length, image_t *pic,
+                            size_t *header_capacity, size_t *rgb_capacity) {
+    fileheader_t fh;
+    imageheader_t ih;
 
-    /* Set start position after first byte (dedicated for total bits). */
-    int start_meslen = BITS_PER_BYTE;
-    for(i = 0; i < BITS_PER_BYTE; i++) {
-        int bit = (message_len >> (7 - i)) & 1;
-        int j = i + start_meslen;
+    if(length < BMP_HEADERS_SIZE) return ERROR_FORMAT;
+    parseHeaders(bmp, &fh, &ih);
+    int status = validateHeaders(&fh, &ih);
+    if(status != STATUS_OK) return status;
 
-        setLSBPixel(&pic, j, bit);
-    }
+    /* Checks that the header and every padded row lie inside the buffer. */
+    status = checkBounds(&fh, &ih, length);
+    if(status != STATUS_OK) return status;
+    size_t stride = (size_t)ih.biWidth * RGB_PER_PIXEL + calcPadding(ih.biWidth);
 
-    /* Initialising and building frequency table using original message and its length. */
-    int freqTable[MAX_MESSAGE_SIZE] = {0};
-    buildFrequencyTable(message, freqTable);
+    pic->width = ih.biWidth;
+    pic->height = ih.biHeight;
+    pic->offset = fh.bfOffBits;
 
-    /* Set start position for frequency table after first 2 bytes (for total bits and message length). */
-    int start_freq = BITS_PER_BYTE * 2;
-    for(i = 0; i < MAX_MESSAGE_SIZE; i++) {
-        /* Buffer char for frequency table element. */
-        unsigned char buffer = freqTable[i];
-        for(j = 0; j < BITS_PER_BYTE; j++) {
-            /* Performs bitwise operations and set frequency index, each element takes 8 bits. */
-            int bit = (buffer >> (7 - j)) & 1;
-            int freq_index = start_freq + i * BITS_PER_BYTE + j;
-            
-            setLSBPixel(&pic, freq_index, bit);
-        }
+    if(growBuffer((void **)&pic->header, header_capacity, pic->offset) != STATUS_OK ||
+       growBuffer((void **)&pic->rgb, rgb_capacity,
+                  (size_t)pic->width * pic->height * sizeof(rgb_t)) != STATUS_OK) {
+        return ERROR_MEMORY;
     }
+    memcpy(pic->header, bmp, pic->offset);
+    rowsToPixels(bmp + pic->offset, stride, pic);
+    return STATUS_OK;
+}
 
-    /* Loops through each character in the Huffman string and alters RGB channels accordingly. */
-    for(i = 0; i < total_bits; i++) {
-        /* Starts after total bits, message length, and frequency table. */
-        int j = i + tree_bits;
-        /* Accesses each element of the Huffman compressed continuous string of 0s and 1s. */
-        char current_char = compressed[i];
-        int bit;
-        /* Checks whether the character in the string is 0, or 1. */
-        if(current_char == '1') bit = 1;
-        else bit = 0;
+/* Parses a complete BMP file held in memory into an image_t, with the
+ * same layout readImage() produces.
+ *
+ * Input:
+ *  - const unsigned char *bmp: The BMP file contents.
+ *  - size_t length: Number of bytes in bmp.
+ *  - image_t *pic: Pointer to the image to fill, freed with freeImage().
+ * Output:
+ *  - STATUS_OK, or ERROR_FORMAT or ERROR_MEMORY on failure.
+ */
+int readImageBuffer(const unsigned char *bmp, size_t length, image_t *pic) {
+    size_t header_capacity = 0, rgb_capacity = 0;
+
+    pic->width = 0;
+    pic->height = 0;
+    pic->offset = 0;
+    pic->header = NULL;
+    pic->rgb = NULL;
+
+    int status = parseImageBuffer(bmp, length, pic, &header_capacity, &rgb_capacity);
+    if(status != STATUS_OK) freeImage(pic);
+    return status;
+}
 
-        setLSBPixel(&pic, j, bit);
-    }
-    
-    /* Creates new image. */
-    FILE *newimage = fopen(outfile, "wb");
-    if(newimage == NULL) {
-        printf("Couldn't create file %s.\n", outfile);
-        free(pic.header);
-        free(pic.rgb);
-        free(compressed);
-        return;
-    }
+/* Serialises an image back into BMP bytes: the original header
+ * followed by the padded, bottom-up BGR rows. The output buffer is
+ * reused when it is already big enough.
+ *
+ * Input:
+ *  - image_t *pic: Pointer to struct pic.
+ *  - unsigned char **buffer: Pointer to the output buffer pointer.
+ *  - size_t *capacity: Capacity of *buffer in bytes.
+ *  - size_t *length: Receives the size of the BMP written.
+ * Output:
+ *  - STATUS_OK, or ERROR_MEMORY.
+ */
+static int serialiseImage(image_t *pic, unsigned char **buffer, size_t *capacity,
+                          size_t *length) {
+    int padding = calcPadding(pic->width);
+    size_t stride = (size_t)pic->width * RGB_PER_PIXEL + padding;
+    size_t total = pic->offset + stride * pic->height;
+
+    if(growBuffer((void **)buffer, capacity, total) != STATUS_OK) return ERROR_MEMORY;
+    memcpy(*buffer, pic->header, pic->offset);
+    pixelsToRows(pic, *buffer + pic->offset, stride);
+
+    *length = total;
+    return STATUS_OK;
+}
 
-    /* Writes the header data from old image. */
-    fwrite(pic.header, pic.offset, 1, newimage);
-    
-    /* Padding and temporary array. */
-    int padding = calcPadding(pic.width);
-    unsigned char pad[RGB_PER_PIXEL] = {0, 0, 0};
-    unsigned char channel[RGB_PER_PIXEL];
-
-    /* Loops bottom to top, left to right. */
-    for(i = pic.height - 1; i >= 0; i--) {
-        for(j = 0; j < pic.width; j++) {
-            /* Index for each value of each pixel. */
-            int index = i * pic.width + j;
-            channel[2] = pic.rgb[index].red;
-            channel[1] = pic.rgb[index].green;
-            channel[0] = pic.rgb[index].blue;
-            /* Writes the new RGB values into new image. */
-            fwrite(channel, 1, RGB_PER_PIXEL, newimage);
-        }
-        /* Writes padding after each row. */
-        fwrite(pad, 1, padding, newimage);
-    }
-
-    fclose(newimage);
-    free(pic.header);
-    free(pic.rgb);
-    free(compressed);
-}
-
-/* Decodes the compressed message from the image using the reversed logic
- * of encoding.
- * Rebuilds Huffman frequency table with total bits and message length
- * encoded in the image.
- * Decompresses the Huffman string, returning the original message.
- * 
- * decode() allocates and frees memory to decompress the
- * message internally, no manual or external memory management.
- * 
+/* Serialises an image into a new BMP buffer.
+ *
  * Input:
- *  - char *infile: Pointer to char infile, signifies the input file
- *                  to read.
- *  - char *outstring: Pointer to char outstring (decoded string).
+ *  - image_t *pic: Pointer to struct pic.
+ *  - unsigned char **out: Receives the new buffer, freed with stegFree().
+ *  - size_t *out_length: Receives the size of the buffer.
  * Output:
- *  - Function of type void.
+ *  - STATUS_OK, or ERROR_MEMORY.
  */
-void decode(char *infile, char *outstring) {
-    /* Calls the readImage function with local instance pic of image_t struct. */
-    image_t pic = readImage(infile);
-    /* Stops the program if readImage returns corrupted image. */
-    if(!pic.rgb || !pic.header) {
-        printf("Failed to allocate memory.\n");
-        return;
-    }
+int writeImageBuffer(image_t *pic, unsigned char **out, size_t *out_length) {
+    size_t capacity = 0;
+    *out = NULL;
+    return serialiseImage(pic, out, &capacity, out_length);
+}
 
-    /* Initialising variables. Some variables are to be received from the image. */
-    int i, j;
-    int total_bits = 0, message_len = 0;
-    int tree_bits = BITS_PER_BYTE * 2 + MAX_MESSAGE_SIZE * BITS_PER_BYTE;
-    int max_bits = pic.width * pic.height * RGB_PER_PIXEL;
-
-    /* Extracts the number of total bits in the first byte. */
-    for(i = 0; i < BITS_PER_BYTE; i++) {
-        int bit;
-        /* Calls getLSBPixel. */
-        getLSBPixel(&pic, i, &bit);
-        /* Performs bitwise << and |, extracting the 8-bit sequence. */
-        total_bits = (total_bits << 1) | bit;
-    }
-
-    /* printf("total bits: %d\n", total_bits); */
-
-    /* Safety check to make sure encoded data is valid and doesn't overflow image's capacity. */
-    if(total_bits <= 0 || tree_bits + total_bits > max_bits) {
-        printf("Invalid image data.\n");
-        free(pic.header);
-        free(pic.rgb);
-        return;
-    }
-    
-    /* Sets start position after first byte (containing total bits). 
-       Extracts message length. */
-    int start_meslen = BITS_PER_BYTE;
-    for(i = 0; i < BITS_PER_BYTE; i++) {
-        int bit;
-        /* Initialise index, calls getLSBPixel function, 
-           and performs bitwises operators, extracting the 8-bit sequence. */
-        int j = i + start_meslen;
-        getLSBPixel(&pic, j, &bit);
-        message_len = (message_len << 1) | bit;
+/* Reserves length bytes for a new output file, so the filesystem can
+ * lay it out in one piece and a full disk fails before anything is
+ * written. Filesystems without fallocate() are written as before.
+ *
+ * Input:
+ *  - int fd: Descriptor of the new file.
+ *  - unsigned long long length: Final size of the file.
+ * Output:
+ *  - STATUS_OK, or ERROR_WRITE if there's no room for the file.
+ */
+static int preallocate(int fd, unsigned long long length) {
+#ifdef __linux__
+    if(length > 0 && fallocate(fd, 0, 0, (off_t)length) != 0 &&
+       (errno == ENOSPC || errno == EFBIG)) {
+        return ERROR_WRITE;
     }
-    
-    /* printf("message len: %d\n", message_len); */
+#else
+    (void)fd;
+    (void)length;
+#endif
+    return STATUS_OK;
+}
 
-    /* Sets start position after first 2 bytes (containing total bits and message length). 
-       Extracts frequency table to rebuild. */
-    int start_freq = BITS_PER_BYTE * 2;
-    /* Initialising frequency table. */
-    int freqTable[MAX_MESSAGE_SIZE] = {0};
-    for(i = 0; i < MAX_MESSAGE_SIZE; i++) {
-        int current_freq = 0;
-        for(j = 0; j < BITS_PER_BYTE; j++) {
-            int bit;
-            int freq_index = start_freq + i * BITS_PER_BYTE + j;
-            getLSBPixel(&pic, freq_index, &bit);
-            current_freq = (current_freq << 1) | bit;
+/* Writes every byte described by iov, picking up after short writes.
+ * The iovec array is advanced in place.
+ *
+ * Input:
+ *  - int fd: Descriptor to write to.
+ *  - struct iovec *iov: Buffers to write, in order.
+ *  - int count: Number of buffers.
+ * Output:
+ *  - STATUS_OK, or ERROR_WRITE.
+ */
+static int writevFull(int fd, struct iovec *iov, int count) {
+    while(count > 0) {
+        ssize_t put = writev(fd, iov, count);
+        if(put < 0 && errno == EINTR) continue;
+        if(put <= 0) return ERROR_WRITE;
+        while(count > 0 && (size_t)put >= iov->iov_len) {
+            put -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if(count > 0) {
+            iov->iov_base = (unsigned char *)iov->iov_base + put;
+            iov->iov_len -= put;
         }
-        /* Appends the value into the frequency table. */
-        freqTable[i] = current_freq;
     }
+    return STATUS_OK;
+}
 
-    /* Allocates memory for reconstructed (compressed) string (+1 for null terminator). */
-    char *compressed = malloc(total_bits + 1);
-    if(!compressed) {
-        printf("Decompression failed.\n");
-        free(pic.header);
-        free(pic.rgb);
-        return;
+/* Writes an image out as a new BMP file. The file is preallocated,
+ * then whole padded rows are assembled WRITE_CHUNK bytes at a time in
+ * a page aligned block of scratch and written with one writev() each,
+ * the first one carrying the header along with the bottom rows.
+ *
+ * Input:
+ *  - image_t *pic: Pointer to struct pic.
+ *  - char *outfile: Pointer to char outfile, signifies the output file
+ *                   to write.
+ *  - unsigned char **scratch: Buffer for file rows, may point to NULL.
+ *  - size_t *scratch_capacity: Capacity of *scratch in bytes.
+ * Output:
+ *  - STATUS_OK, or ERROR_WRITE if the file couldn't be created or
+ *    written, ERROR_MEMORY.
+ */
+static int writeImageFile(image_t *pic, char *outfile, unsigned char **scratch,
+                          size_t *scratch_capacity) {
+    size_t height = (size_t)pic->height, done = 0;
+    size_t stride = (size_t)pic->width * RGB_PER_PIXEL + calcPadding(pic->width);
+    size_t block_rows = WRITE_CHUNK / stride;
+    if(block_rows == 0) block_rows = 1;
+    if(block_rows > height) block_rows = height;
+
+    if(growBuffer((void **)scratch, scratch_capacity,
+                  block_rows * stride + WRITE_ALIGN) != STATUS_OK) {
+        return ERROR_MEMORY;
     }
+    unsigned char *block = *scratch + (WRITE_ALIGN - (size_t)*scratch % WRITE_ALIGN) % WRITE_ALIGN;
 
-    /* Loops through each character in the Huffman string and alter RGB channels accordingly. */
-    for(i = 0; i < total_bits; i++) {
-        int j = i + tree_bits;
-        int bit;
-        getLSBPixel(&pic, j, &bit);
-        
-        /* Checks for bit value and appends to compressed array. */
-        if(bit == 1) compressed[i] = '1';
-        else compressed[i] = '0';
-    }
-
-    /* Null terminates array at correct end position. */
-    compressed[total_bits] = '\0';
-
-    /* Allocates memory for decompressed string. 
-       Reconstructs the original message with encoded frequency table and message length. */
-    char *decompressed = decompressMessage(compressed, freqTable, message_len);
-    if(!decompressed) {
-        printf("Decompression failed.\n");
-        free(pic.header);
-        free(pic.rgb);
-        free(compressed);
-        return;
+    /* Creates new image. */
+    int fd = open(outfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) return ERROR_WRITE;
+    int status = preallocate(fd, pic->offset + (unsigned long long)stride * height);
+
+    /* The header goes out with the first block. */
+    struct iovec iov[2];
+    int count = 0;
+    iov[count].iov_base = pic->header;
+    iov[count++].iov_len = pic->offset;
+
+    /* File rows run bottom-up, so each block holds the rows above the last. */
+    while(status == STATUS_OK && (done < height || count > 0)) {
+        image_t run = *pic;
+        size_t rows = height - done < block_rows ? height - done : block_rows;
+
+        run.height = (int)rows;
+        run.rgb = pic->rgb + (height - done - rows) * pic->width;
+        pixelsToRows(&run, block, stride);
+        iov[count].iov_base = block;
+        iov[count++].iov_len = rows * stride;
+        status = writevFull(fd, iov, count);
+        count = 0;
+        done += rows;
     }
 
-    /* Copies decompressed into outstring, which contains 
-       the original message before compression and encryption. */
-    strcpy(outstring, decompressed);
-
-    free(pic.header);
-    free(pic.rgb);
-    free(compressed);
-    free(decompressed);
+    if(close(fd) != 0 && status == STATUS_OK) status = ERROR_WRITE;
+    return status;
 }
 
-/*
-Builds a frequency table of all characters in the given message.
+/* Embeds the total bits, message length, Huffman's frequency table,
+ * and Huffman compressed message into an image already in memory.
+ * Only the RGB values of pic are changed. Uses a temporary context,
+ * see buildPayload() and applyPayload() to reuse one.
+ *
+ * Input:
+ *  - image_t *pic: Pointer to struct pic, the cover image.
+ *  - char *message: Pointer to char (string) message.
+ * Output:
+ *  - STATUS_OK, or ERROR_EMPTY, ERROR_MEMORY, ERROR_TOO_LARGE or
+ *    ERROR_TOO_SMALL when the message can't be embedded.
+ */
+int embedMessage(image_t *pic, char *message) {
+    stegctx_t ctx;
+    initContext(&ctx);
 
-Parameters:
-message (const char[]): 
-- input string whose character frequencies are to be counted.
+    int status = buildPayload(&ctx, message);
+    if(status == STATUS_OK) status = applyPayload(&ctx, pic);
 
-freqTable (int[256]): 
-- An integer array used to store the frequency count of each possible characters (0-255). 
-- 256 including the null terminator.
-- array should be initialized to zero before calling this function.
+    freeContext(&ctx);
+    return status;
+}
 
-Returns (void):
-- This function does not return a value.
+/* Copies a decoded message into a caller's MAX_MESSAGE_SIZE buffer,
+ * truncating longer messages. The context functions return messages of
+ * any length. */
+static void copyMessage(char *outstring, const char *message) {
+    strncpy(outstring, message, MAX_MESSAGE_SIZE - 1);
+    outstring[MAX_MESSAGE_SIZE - 1] = '\0';
+}
+
+/* Extracts and decompresses the message hidden in an image already in
+ * memory, using the reversed logic of embedMessage().
+ *
+ * Input:
+ *  - image_t *pic: Pointer to struct pic, the encoded image.
+ *  - char *outstring: Pointer to char outstring (decoded string), must
+ *                     hold MAX_MESSAGE_SIZE chars. Longer messages are
+ *                     truncated.
+ * Output:
+ *  - STATUS_OK, or ERROR_CORRUPT or ERROR_MEMORY on failure.
+ */
+int extractMessage(image_t *pic, char *outstring) {
+    stegctx_t ctx;
+    initContext(&ctx);
+
+    int status = extractPayload(&ctx, pic);
+    if(status == STATUS_OK) copyMessage(outstring, ctx.message);
+
+    freeContext(&ctx);
+    return status;
+}
+
+/* Encodes the message into a copy of the input image and writes it
+ * out as a new image. See buildPayload() for the layout.
+ * 
+ * encode() allocates and frees memory to compress the
+ * message internally, no manual/external memory management.
+ * Allocation counters are reset on entry, so getAllocStats()
+ * afterwards, on the same thread, describes this call only.
+ * 
+ * Input:
+ *  - char *infile: Pointer to char infile, signifies the input file
+ *                  to read.
+ *  - char *outfile: Pointer to char outfile, signifies the output file
+ *                   to write.
+ *  - char *message: Pointer to char (string) message.
+ * Output:
+ *  - STATUS_OK, ERROR_OPEN if infile can't be read, ERROR_WRITE if
+ *    outfile can't be created, or the status of the step that failed.
+ *    Nothing is printed; statusMessage() describes the status.
+ */
+int encode(char *infile, char *outfile, char *message) {
+    stegctx_t ctx;
+    initContext(&ctx);
+
+    int status = encodeContext(&ctx, infile, outfile, message);
+
+    freeContext(&ctx);
+    return status;
+}
+
+/* Decodes the compressed message from the image, see extractPayload().
+ * 
+ * decode() allocates and frees memory to decompress the
+ * message internally, no manual or external memory management.
+ * Allocation counters are reset on entry, as in encode().
+ * 
+ * Input:
+ *  - char *infile: Pointer to char infile, signifies the input file
+ *                  to read.
+ *  - char *outstring: Pointer to char outstring (decoded string), must
+ *                     hold MAX_MESSAGE_SIZE chars.
+ * Output:
+ *  - STATUS_OK, ERROR_OPEN if infile can't be read, or the status of
+ *    the step that failed. Nothing is printed, as in encode().
+ */
+int decode(char *infile, char *outstring) {
+    stegctx_t ctx;
+    const char *message;
+    initContext(&ctx);
+
+    int status = decodeContext(&ctx, infile, &message);
+    if(status == STATUS_OK) copyMessage(outstring, message);
+
+    freeContext(&ctx);
+    return status;
+}
+
+/* Encodes a message into a BMP held in memory and returns the encoded
+ * BMP in a new buffer. No files are touched.
+ *
+ * Input:
+ *  - const unsigned char *bmp: The cover BMP file contents.
+ *  - size_t length: Number of bytes in bmp.
+ *  - char *message: Pointer to char (string) message.
+ *  - unsigned char **out: Receives the encoded BMP, freed with stegFree().
+ *  - size_t *out_length: Receives the size of the encoded BMP.
+ * Output:
+ *  - STATUS_OK, or the status of the step that failed.
+ */
+int encodeBuffer(const unsigned char *bmp, size_t length, char *message,
+                 unsigned char **out, size_t *out_length) {
+    stegctx_t ctx;
+    const unsigned char *encoded;
+    initContext(&ctx);
+
+    int status = encodeBufferContext(&ctx, bmp, length, message, &encoded, out_length);
+    if(status == STATUS_OK) {
+        /* Hands the context's output buffer over to the caller. */
+        *out = ctx.output;
+        ctx.output = NULL;
+    }
+
+    freeContext(&ctx);
+    return status;
+}
+
+/* Decodes the message hidden in a BMP held in memory.
+ *
+ * Input:
+ *  - const unsigned char *bmp: The encoded BMP file contents.
+ *  - size_t length: Number of bytes in bmp.
+ *  - char *outstring: Receives the message, must hold MAX_MESSAGE_SIZE chars.
+ *                     Longer messages are truncated.
+ * Output:
+ *  - STATUS_OK, or the status of the step that failed.
+ */
+int decodeBuffer(const unsigned char *bmp, size_t length, char *outstring) {
+    stegctx_t ctx;
+    const char *message;
+    initContext(&ctx);
+
+    int status = decodeBufferContext(&ctx, bmp, length, &message);
+    if(status == STATUS_OK) copyMessage(outstring, message);
+
+    freeContext(&ctx);
+    return status;
+}
+
+/*
+Builds a frequency table of all characters in the given message.
+
+Parameters:
+message (const char[]): 
+- input string whose character frequencies are to be counted.
+
+freqTable (int[256]): 
+- An integer array used to store the frequency count of each possible characters (0-255). 
+- 256 including the null terminator.
+- array should be initialized to zero before calling this function.
+
+Returns (void):
+- This function does not return a value.
 - The resulting frequency counts are stored in the provided freqTable array.
 */
 void buildFrequencyTable(const char message[], int freqTable[256]){
@@ -516,6 +1117,29 @@ void buildFrequencyTable(const char message[], int freqTable[256]){
     }
 }
 
+/*
+Node storage for the huffman functions. When a pool is given nodes are taken
+from its fixed array, so building a tree allocates nothing; otherwise every node
+comes from stegAlloc() and is released with freeHuffmanTree().
+*/
+typedef struct {
+    huffmanNode_t *nodes;
+    int used;
+} nodePool_t;
+
+static huffmanNode_t* newNode(nodePool_t *pool){
+    if(pool){
+        if(pool->used >= MAX_TREE_NODES){
+            return NULL;
+        }
+        return &pool->nodes[pool->used++];
+    }
+    return stegAlloc(sizeof(huffmanNode_t));
+}
+
+static void sortedNodeList(const int freqTable[256], huffmanNode_t* nodeList[256], int *outSize, nodePool_t *pool);
+static huffmanNode_t* mergeNodes(huffmanNode_t* nodeList[256], int size, nodePool_t *pool);
+
 /*
 Creates a sorted list of huffman tree leaf nodes based on character frequencies.
 
@@ -538,13 +1162,17 @@ Returns (void):
   and the count of nodes is stored in the integer pointed to by outSize.
 */
 void createSortedNodeList(const int freqTable[256], huffmanNode_t* nodeList[256], int *outSize){
+    sortedNodeList(freqTable, nodeList, outSize, NULL);
+}
+
+static void sortedNodeList(const int freqTable[256], huffmanNode_t* nodeList[256], int *outSize, nodePool_t *pool){
     /*Create nodes for characters that appear*/
     int size = 0;
     int i;
     for(i = 0; i < 256; i++){
         if(freqTable[i] > 0){
             /*Allocate a new node for this character*/
-            huffmanNode_t* node = malloc(sizeof(huffmanNode_t));
+            huffmanNode_t* node = newNode(pool);
             if(!node){
                 *outSize = -1;
                 return;
@@ -585,6 +1213,10 @@ Returns (huffmanNode_t*):
 - Returns NULL if memory allocation fails or if the input size is zero.
 */
 huffmanNode_t* buildHuffmanTree(huffmanNode_t* nodeList[256], int size){
+    return mergeNodes(nodeList, size, NULL);
+}
+
+static huffmanNode_t* mergeNodes(huffmanNode_t* nodeList[256], int size, nodePool_t *pool){
     if(size == 0){
         return NULL;
     }
@@ -600,7 +1232,7 @@ huffmanNode_t* buildHuffmanTree(huffmanNode_t* nodeList[256], int size){
         huffmanNode_t* right = nodeList[1];
     
         /*Create parent*/
-        huffmanNode_t* parent = malloc(sizeof(huffmanNode_t));
+        huffmanNode_t* parent = newNode(pool);
         if(!parent){
             return NULL;
         }
@@ -649,7 +1281,7 @@ void freeHuffmanTree(huffmanNode_t* root){
     /*Using recursion*/
     freeHuffmanTree(root->left);
     freeHuffmanTree(root->right);
-    free(root);
+    stegFree(root);
 }
 
 /*
@@ -671,7 +1303,7 @@ depth (int):
 
 codeTable (char*[256]):
 - An array of string pointers used to store the generated binary codes for each character indexed by ASCII value.
-- Memory of each code is dynamically allocated using strdup().
+- Memory of each code is dynamically allocated using stegAlloc().
 
 codeLen (int[256]):
 - An interger array storing the length of each generated code,
@@ -692,7 +1324,7 @@ void buildCode(huffmanNode_t* node, char *path, int depth, char *codeTable[256],
             path[0] = '0';
             path[1] = '\0';
             codeLen[(unsigned char)node->ch] = 1;
-            codeTable[(unsigned char)node->ch] = malloc(2);
+            codeTable[(unsigned char)node->ch] = stegAlloc(2);
 
             if(codeTable[(unsigned char)node->ch]){
                 strcpy(codeTable[(unsigned char)node->ch], "0");
@@ -700,7 +1332,7 @@ void buildCode(huffmanNode_t* node, char *path, int depth, char *codeTable[256],
         } else{
             path[depth] = '\0'; /*End the string at current depth*/
             codeLen[(unsigned char)node->ch] = depth;
-            codeTable[(unsigned char)node->ch] = malloc(strlen(path) + 1);
+            codeTable[(unsigned char)node->ch] = stegAlloc(strlen(path) + 1);
 
             if(codeTable[(unsigned char)node->ch]){
                 strcpy(codeTable[(unsigned char)node->ch], path);
@@ -732,7 +1364,7 @@ Returns (char*):
 - Returns NULL if compression fails due to memory allocation issues or other errors.
 
 Notes:
-- The caller is responsible for freeing the returned string.
+- The caller is responsible for freeing the returned string with stegFree().
 - This function internally builds the frequency table, 
   constructs the huffman tree, and generates the huffman codes, 
   and encodes the message.
@@ -774,10 +1406,10 @@ char* compressMessage(char message[], int *out_totalBits){
     }
 
     /*Allocate memory for compressed output string*/
-    char *output = malloc(totalBits + 1);
+    char *output = stegAlloc(totalBits + 1);
     if(!output){
         for(i = 0; i < 256; i++){
-            free(codes[i]);
+            stegFree(codes[i]);
         }
         freeHuffmanTree(root);
         return NULL;
@@ -803,7 +1435,7 @@ char* compressMessage(char message[], int *out_totalBits){
     *writePos = '\0';
 
     for(i = 0; i < 256; i++){
-        free(codes[i]);
+        stegFree(codes[i]);
     }
     freeHuffmanTree(root);
     *out_totalBits = totalBits;
@@ -835,7 +1467,7 @@ Returns (char*):
   - the bitstring does not decode correctly to the expected message length.
 
 Notes:
-- The caller is responsible for freeing the returned memory.
+- The caller is responsible for freeing the returned memory with stegFree().
 - This function reconstructs the huffman tree using the frequency table,
   then traverses it according to each bit in the compressed input.
 */
@@ -847,7 +1479,7 @@ char* decompressMessage(const char compressed[], const int freqTable[256], int m
 
     /*Check for empty message*/
     if(messageLength == 0){
-        char *empty = malloc(1);
+        char *empty = stegAlloc(1);
         if(empty){
             empty[0] = '\0';
             return empty;
@@ -872,7 +1504,7 @@ char* decompressMessage(const char compressed[], const int freqTable[256], int m
     }
 
     /*Allocate memory for the decompressed output string*/
-    char *output = malloc((int)messageLength + 1);
+    char *output = stegAlloc((int)messageLength + 1);
     if(!output){
         freeHuffmanTree(root);
         return NULL;
@@ -905,7 +1537,7 @@ char* decompressMessage(const char compressed[], const int freqTable[256], int m
         }
 
         if(!currentNode){
-            free(output);
+            stegFree(output);
             freeHuffmanTree(root);
             return NULL;
         }
@@ -918,7 +1550,7 @@ char* decompressMessage(const char compressed[], const int freqTable[256], int m
 
     /*Verify that the number of decoded characters matches message length*/
     if(decodedCount != messageLength){
-        free(output);
+        stegFree(output);
         freeHuffmanTree(root);
         return NULL;
     }
@@ -929,6 +1561,5519 @@ char* decompressMessage(const char compressed[], const int freqTable[256], int m
 
 }
 
+/***** Context *****/
+/* Prepares an empty context. No memory is allocated until the first
+ * call that needs it.
+ *
+ * Input:
+ *  - stegctx_t *ctx: Pointer to the context to set up.
+ * Output:
+ *  - Function of type void.
+ */
+void initContext(stegctx_t *ctx) {
+    ctx->pic.width = 0;
+    ctx->pic.height = 0;
+    ctx->pic.offset = 0;
+    ctx->pic.header = NULL;
+    ctx->pic.rgb = NULL;
+    ctx->header_capacity = 0;
+    ctx->rgb_capacity = 0;
+    ctx->output = NULL;
+    ctx->output_capacity = 0;
+    ctx->output_length = 0;
+    ctx->bits = NULL;
+    ctx->bits_capacity = 0;
+    ctx->bit_count = 0;
+    ctx->message = NULL;
+    ctx->message_capacity = 0;
+    ctx->message_length = 0;
+    ctx->payload_bits = 0;
+    ctx->codec = CODEC_BEST;
+    ctx->codec_used = CODEC_RAW;
+    ctx->scattered = 0;
+    ctx->scatter_key = 0;
+    ctx->matrix_k = 0;
+    ctx->changed_bytes = 0;
+    ctx->slots = NULL;
+    ctx->slots_capacity = 0;
+    ctx->io_engine = IO_ENGINE_AUTO;
+    ctx->memory_limit = 0;
+    ctx->tile_blocks = NULL;
+    ctx->tile_blocks_capacity = 0;
+    ctx->encrypted = 0;
+    memset(&ctx->passkey, 0, sizeof(ctx->passkey));
+    ctx->packed.data = NULL;
+    ctx->packed.capacity = 0;
+    ctx->candidate.data = NULL;
+    ctx->candidate.capacity = 0;
+    ctx->codec_threads = 0;
+    ctx->huff_blocks = NULL;
+    ctx->huff_blocks_capacity = 0;
+    ctx->tans_chunks = NULL;
+    ctx->tans_chunks_capacity = 0;
+}
+
+/* Frees every buffer held by a context. The context can be reused
+ * after calling initContext() again.
+ *
+ * Input:
+ *  - stegctx_t *ctx: Pointer to the context.
+ * Output:
+ *  - Function of type void.
+ */
+void freeContext(stegctx_t *ctx) {
+    freeImage(&ctx->pic);
+    stegFree(ctx->output);
+    stegFree(ctx->bits);
+    stegFree(ctx->message);
+    stegFree(ctx->packed.data);
+    stegFree(ctx->candidate.data);
+    stegFree(ctx->tile_blocks);
+    stegFree(ctx->slots);
+    stegFree(ctx->huff_blocks);
+    stegFree(ctx->tans_chunks);
+    initContext(ctx);
+}
+
+/* Packed bit helpers, most significant bit of each byte first. */
+static void putBit(unsigned char *bytes, size_t index, int bit) {
+    if(bit) bytes[index / BITS_PER_BYTE] |= 0x80 >> (index % BITS_PER_BYTE);
+}
+
+static int takeBit(const unsigned char *bytes, size_t index) {
+    return (bytes[index / BITS_PER_BYTE] >> (7 - index % BITS_PER_BYTE)) & 1;
+}
+
+/* Builds the Huffman tree for a frequency table out of a node pool,
+ * such as the context's.
+ *
+ * Input:
+ *  - huffmanNode_t nodes[]: MAX_TREE_NODES nodes to build the tree in.
+ *  - const int freqTable[]: Frequency of each character.
+ * Output:
+ *  - huffmanNode_t *: The root, or NULL if the table is empty.
+ */
+static huffmanNode_t *buildPooledTree(huffmanNode_t nodes[MAX_TREE_NODES],
+                                      const int freqTable[256]) {
+    huffmanNode_t *nodeList[256];
+    nodePool_t pool;
+    int size = 0;
+
+    pool.nodes = nodes;
+    pool.used = 0;
+    sortedNodeList(freqTable, nodeList, &size, &pool);
+    if(size <= 0) return NULL;
+    return mergeNodes(nodeList, size, &pool);
+}
+
+/***** Codecs *****/
+/* Sequential reader over packed bits. Reads past the end return zeros
+ * and set overflow, so decoders check once per symbol rather than per
+ * bit. */
+typedef struct {
+    const unsigned char *data;
+    size_t count;
+    size_t pos;
+    int overflow;
+} bitreader_t;
+
+/* Clears buf and makes room for limit bits. Writing past limit drops
+ * the bits and sets overflow, which is how codec trials give up as
+ * soon as they can't win.
+ *
+ * Input:
+ *  - bitbuf_t *buf: Pointer to the buffer.
+ *  - size_t limit: Most bits the buffer will accept.
+ * Output:
+ *  - STATUS_OK, or ERROR_MEMORY.
+ */
+static int reserveBits(bitbuf_t *buf, size_t limit) {
+    size_t bytes = limit / BITS_PER_BYTE + 1;
+    if(growBuffer((void **)&buf->data, &buf->capacity, bytes) != STATUS_OK) return ERROR_MEMORY;
+    memset(buf->data, 0, bytes);
+    buf->count = 0;
+    buf->limit = limit;
+    buf->overflow = 0;
+    return STATUS_OK;
+}
+
+/* Appends the low count bits of value, most significant first. */
+static void putBits(bitbuf_t *buf, unsigned long long value, int count) {
+    if(buf->count + count > buf->limit) {
+        buf->overflow = 1;
+        return;
+    }
+    while(count-- > 0) putBit(buf->data, buf->count++, (int)(value >> count) & 1);
+}
+
+static unsigned long long getBits(bitreader_t *in, int count) {
+    unsigned long long value = 0;
+    while(count-- > 0) {
+        int bit = 0;
+        if(in->pos < in->count) bit = takeBit(in->data, in->pos++);
+        else in->overflow = 1;
+        value = (value << 1) | bit;
+    }
+    return value;
+}
+
+/* Elias gamma code for value >= 1: as many zeros as value has bits
+ * after the leading one, then value itself. Small numbers stay small. */
+static void putGamma(bitbuf_t *buf, unsigned long value) {
+    int bits = 0;
+    while((value >> bits) > 1) bits++;
+    putBits(buf, 0, bits);
+    putBits(buf, value, bits + 1);
+}
+
+static unsigned long getGamma(bitreader_t *in) {
+    int bits = 0;
+    while(getBits(in, 1) == 0) {
+        if(in->overflow || ++bits > GAMMA_MAX_BITS) {
+            in->overflow = 1;
+            return 1;
+        }
+    }
+    return (unsigned long)((1ULL << bits) | getBits(in, bits));
+}
+
+/* Raw: eight bits per byte, the fallback every other codec must beat. */
+static int rawCompress(stegctx_t *ctx, const unsigned char *data, size_t length, bitbuf_t *out) {
+    size_t i;
+    for(i = 0; i < length && !out->overflow; i++) putBits(out, data[i], BITS_PER_BYTE);
+    return STATUS_OK;
+}
+
+static int rawExpand(stegctx_t *ctx, bitreader_t *in, unsigned char *out, size_t length) {
+    size_t i;
+    for(i = 0; i < length; i++) out[i] = (unsigned char)getBits(in, BITS_PER_BYTE);
+    return in->overflow ? ERROR_CORRUPT : STATUS_OK;
+}
+
+/* Run length: each run is its byte followed by the gamma coded run
+ * length, so a lone byte costs nine bits. */
+static int rleCompress(stegctx_t *ctx, const unsigned char *data, size_t length, bitbuf_t *out) {
+    size_t i = 0;
+    while(i < length && !out->overflow) {
+        size_t run = 1;
+        while(i + run < length && data[i + run] == data[i] && run < RLE_MAX_RUN) run++;
+        putBits(out, data[i], BITS_PER_BYTE);
+        putGamma(out, run);
+        i += run;
+    }
+    return STATUS_OK;
+}
+
+static int rleExpand(stegctx_t *ctx, bitreader_t *in, unsigned char *out, size_t length) {
+    size_t i = 0;
+    while(i < length) {
+        unsigned char byte = (unsigned char)getBits(in, BITS_PER_BYTE);
+        unsigned long run = getGamma(in);
+        if(in->overflow || run > length - i) return ERROR_CORRUPT;
+        memset(out + i, byte, run);
+        i += run;
+    }
+    return STATUS_OK;
+}
+
+/* LZ77: a flag bit, then either a literal byte or a back reference of
+ * a 12 bit distance into the last LZ_WINDOW bytes and a gamma coded
+ * length. Matches are found through hash chains over 3 byte prefixes,
+ * kept in the context. */
+static unsigned lzHash(const unsigned char *p) {
+    unsigned long key = ((unsigned long)p[0] << 16) | ((unsigned long)p[1] << 8) | p[2];
+    return (unsigned)((key * 2654435761UL) >> 12) & (LZ_HASH_SIZE - 1);
+}
+
+static void lzInsert(stegctx_t *ctx, const unsigned char *data, size_t length, size_t pos) {
+    if(pos + LZ_MIN_MATCH > length) return;
+    unsigned hash = lzHash(data + pos);
+    ctx->lz_prev[pos % LZ_WINDOW] = ctx->lz_head[hash];
+    ctx->lz_head[hash] = (long)pos;
+}
+
+static int lzCompress(stegctx_t *ctx, const unsigned char *data, size_t length, bitbuf_t *out) {
+    size_t i = 0;
+    int j;
+
+    for(j = 0; j < LZ_HASH_SIZE; j++) ctx->lz_head[j] = -1;
+
+    while(i < length && !out->overflow) {
+        size_t best = 0, distance = 0;
+
+        if(i + LZ_MIN_MATCH <= length) {
+            long candidate = ctx->lz_head[lzHash(data + i)];
+            int probes = LZ_MAX_CHAIN;
+            /* Positions in the chain only get older, stop once out of the window. */
+            while(candidate >= 0 && i - (size_t)candidate <= LZ_WINDOW && probes-- > 0) {
+                size_t n = 0;
+                while(i + n < length && n < LZ_MAX_MATCH && data[candidate + n] == data[i + n]) n++;
+                if(n > best) {
+                    best = n;
+                    distance = i - (size_t)candidate;
+                }
+                candidate = ctx->lz_prev[candidate % LZ_WINDOW];
+            }
+        }
+
+        if(best >= LZ_MIN_MATCH) {
+            putBits(out, 1, 1);
+            putBits(out, distance - 1, LZ_DISTANCE_BITS);
+            putGamma(out, best - LZ_MIN_MATCH + 1);
+        } else {
+            best = 1;
+            putBits(out, 0, 1);
+            putBits(out, data[i], BITS_PER_BYTE);
+        }
+        while(best-- > 0) lzInsert(ctx, data, length, i++);
+    }
+    return STATUS_OK;
+}
+
+static int lzExpand(stegctx_t *ctx, bitreader_t *in, unsigned char *out, size_t length) {
+    size_t i = 0;
+    while(i < length) {
+        if(getBits(in, 1) == 0) {
+            out[i++] = (unsigned char)getBits(in, BITS_PER_BYTE);
+        } else {
+            size_t distance = (size_t)getBits(in, LZ_DISTANCE_BITS) + 1;
+            size_t n = getGamma(in) + LZ_MIN_MATCH - 1;
+            if(in->overflow || distance > i || n > length - i) return ERROR_CORRUPT;
+            /* Byte by byte, a match may overlap what it produces. */
+            while(n-- > 0) {
+                out[i] = out[i - distance];
+                i++;
+            }
+        }
+        if(in->overflow) return ERROR_CORRUPT;
+    }
+    return STATUS_OK;
+}
+
+/* Canonical Huffman. Only code lengths are stored; codes are handed
+ * out in order of length, then symbol, so both sides derive the same
+ * codes from the lengths alone. */
+static void treeLengths(const huffmanNode_t *node, int depth, unsigned char lengths[256]) {
+    if(!node->left && !node->right) {
+        /* A single character tree still needs one bit per character. */
+        int length = depth == 0 ? 1 : depth;
+        lengths[(unsigned char)node->ch] = length > HUFFMAN_MAX_BITS ? 0xff : length;
+        return;
+    }
+    if(node->left) treeLengths(node->left, depth + 1, lengths);
+    if(node->right) treeLengths(node->right, depth + 1, lengths);
+}
+
+static void canonicalCodes(const unsigned char lengths[256], unsigned long long codes[256]) {
+    unsigned long long next[HUFFMAN_MAX_BITS + 2];
+    int count[HUFFMAN_MAX_BITS + 1] = {0};
+    int i;
+
+    for(i = 0; i < 256; i++) count[lengths[i]]++;
+    count[0] = 0;
+    next[1] = 0;
+    for(i = 1; i <= HUFFMAN_MAX_BITS; i++) next[i + 1] = (next[i] + count[i]) << 1;
+    for(i = 0; i < 256; i++) {
+        if(lengths[i]) codes[i] = next[lengths[i]]++;
+    }
+}
+
+/* Decodes length symbols of a canonical code, walking the code one
+ * length at a time against the first code of each length. */
+static int huffmanSymbols(bitreader_t *in, const unsigned char lengths[256],
+                          unsigned char *out, size_t length) {
+    int count[HUFFMAN_MAX_BITS + 1] = {0};
+    unsigned char sorted[256];
+    int offset[HUFFMAN_MAX_BITS + 2];
+    int i;
+
+    for(i = 0; i < 256; i++) count[lengths[i]]++;
+    count[0] = 0;
+    offset[1] = 0;
+    for(i = 1; i <= HUFFMAN_MAX_BITS; i++) offset[i + 1] = offset[i] + count[i];
+    for(i = 0; i < 256; i++) {
+        if(lengths[i]) sorted[offset[lengths[i]]++] = (unsigned char)i;
+    }
+
+    size_t produced;
+    for(produced = 0; produced < length; produced++) {
+        unsigned long long code = 0, first = 0;
+        int index = 0, bits;
+        for(bits = 1; bits <= HUFFMAN_MAX_BITS; bits++) {
+            code |= getBits(in, 1);
+            if(code - first < (unsigned long long)count[bits]) break;
+            index += count[bits];
+            first = (first + count[bits]) << 1;
+            code <<= 1;
+        }
+        if(bits > HUFFMAN_MAX_BITS || in->overflow) return ERROR_CORRUPT;
+        out[produced] = sorted[index + (int)(code - first)];
+    }
+    return STATUS_OK;
+}
+
+/* Huffman: symbol count, then a symbol and 6 bit length per symbol
+ * used, then the canonical codes. */
+static int huffmanCompress(stegctx_t *ctx, const unsigned char *data, size_t length, bitbuf_t *out) {
+    int freqTable[256] = {0};
+    unsigned char lengths[256] = {0};
+    unsigned long long codes[256];
+    size_t i;
+    int symbols = 0;
+
+    for(i = 0; i < length; i++) freqTable[data[i]]++;
+    huffmanNode_t *root = buildPooledTree(ctx->nodes, freqTable);
+    if(!root) return ERROR_MEMORY;
+    treeLengths(root, 0, lengths);
+
+    for(i = 0; i < 256; i++) {
+        if(lengths[i] == 0xff) return ERROR_TOO_LARGE;
+        if(lengths[i]) symbols++;
+    }
+    canonicalCodes(lengths, codes);
+
+    putBits(out, symbols - 1, BITS_PER_BYTE);
+    for(i = 0; i < 256; i++) {
+        if(!lengths[i]) continue;
+        putBits(out, i, BITS_PER_BYTE);
+        putBits(out, lengths[i], HUFFMAN_LENGTH_BITS);
+    }
+    for(i = 0; i < length && !out->overflow; i++) putBits(out, codes[data[i]], lengths[data[i]]);
+    return STATUS_OK;
+}
+
+static int huffmanExpand(stegctx_t *ctx, bitreader_t *in, unsigned char *out, size_t length) {
+    unsigned char lengths[256] = {0};
+    int i, symbols = (int)getBits(in, BITS_PER_BYTE) + 1;
+
+    for(i = 0; i < symbols; i++) {
+        int symbol = (int)getBits(in, BITS_PER_BYTE);
+        lengths[symbol] = (unsigned char)getBits(in, HUFFMAN_LENGTH_BITS);
+        if(lengths[symbol] > HUFFMAN_MAX_BITS) return ERROR_CORRUPT;
+    }
+    if(in->overflow) return ERROR_CORRUPT;
+    return huffmanSymbols(in, lengths, out, length);
+}
+
+/* Static Huffman: code lengths for common payloads, compiled in so
+ * only a table id is stored and no frequency table or tree is built.
+ * Derived from the GPL-3 text, JSON schemas and test data, and random
+ * hex and base64; every byte has a code so any message can be coded.
+ * Ids are never reused, a revised table gets a new id. */
+static const unsigned char staticLengths[STATIC_TABLES][256] = {
+    /* English text */
+    {
+        15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+        15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+         3, 15,  9, 15, 15, 15, 15, 10, 10,  9, 15, 15,  7, 10,  7, 11,
+        11, 10, 11, 12, 12, 12, 12, 12, 13, 13, 12, 11, 12, 15, 12, 15,
+        15,  8, 11,  9,  9,  8, 10,  9, 10,  8, 14, 13,  8, 10,  8,  9,
+         8, 13,  8,  8,  8,  9, 11, 10, 13,  9, 15, 15, 15, 15, 15, 15,
+        13,  4,  7,  5,  5,  3,  6,  6,  5,  4, 10,  8,  5,  6,  4,  4,
+         6, 10,  4,  5,  4,  6,  7,  6,  9,  6, 11, 15, 15, 15, 15, 15,
+        15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+        15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+        15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+        15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+        15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+        15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+        15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+        15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 14
+    },
+    /* JSON */
+    {
+        18, 18, 18, 18, 18, 18, 18, 18, 18, 18, 18, 18, 18, 18, 18, 18,
+        18, 18, 18, 18, 18, 18, 18, 18, 18, 18, 18, 18, 18, 18, 18, 18,
+         3, 13,  3,  9, 10,  8, 12, 11, 11, 11, 12, 12,  5,  9,  7,  6,
+         8,  9,  9, 10, 11, 10, 11, 10, 10, 10,  5, 12, 14, 12, 14, 10,
+        11, 10, 10, 10, 10, 10, 10, 13, 13,  9, 16, 18, 12, 12, 13, 10,
+        11, 18, 10, 10,  9, 11, 12, 14, 15, 15, 16,  9,  9,  9, 13, 11,
+         8,  5,  6,  6,  6,  4,  6,  7,  5,  5, 10,  9,  5,  6,  5,  4,
+         5,  9,  5,  4,  4,  6,  8,  8,  8,  7, 12,  7, 13,  7, 13, 18,
+        16, 18, 17, 17, 18, 17, 18, 17, 18, 18, 18, 17, 18, 17, 17, 17,
+        15, 17, 17, 18, 17, 17, 18, 18, 18, 18, 18, 18, 18, 16, 18, 16,
+        16, 18, 18, 18, 18, 16, 18, 17, 17, 17, 18, 18, 17, 16, 17, 18,
+        18, 16, 17, 18, 18, 18, 18, 18, 17, 18, 18, 16, 14, 15, 18, 17,
+        18, 18, 16, 15, 17, 18, 18, 18, 18, 18, 18, 18, 18, 18, 17, 18,
+        18, 18, 18, 18, 18, 18, 18, 18, 18, 18, 18, 18, 18, 18, 18, 18,
+        18, 18, 16, 17, 16, 16, 18, 18, 18, 18, 18, 18, 18, 18, 18, 14,
+        15, 18, 18, 18, 18, 18, 18, 18, 18, 18, 18, 18, 18, 18, 18, 18
+    },
+    /* Hex and base64 */
+    {
+        16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16,
+        16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16,
+        16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16,  7, 16, 16, 16,  7,
+         4,  5,  4,  4,  5,  5,  5,  5,  4,  5, 16, 16, 16, 15, 16, 16,
+        16,  7,  7,  7,  7,  7,  7,  7,  7,  7,  8,  7,  7,  7,  7,  7,
+         7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7, 16, 16, 16, 16, 16,
+        16,  5,  5,  5,  5,  5,  5,  7,  7,  7,  7,  7,  7,  7,  7,  7,
+         7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7, 16, 16, 16, 16, 16,
+        16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16,
+        16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16,
+        16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16,
+        16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16, 16,
+        16, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+        15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+        15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15,
+        15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15
+    }
+};
+
+/* Static Huffman: the 8 bit id of the table giving the fewest bits,
+ * then the canonical codes from that table. */
+static int staticCompress(stegctx_t *ctx, const unsigned char *data, size_t length, bitbuf_t *out) {
+    unsigned long long codes[256];
+    size_t histogram[256] = {0};
+    unsigned long long best_bits = 0;
+    int best = 0;
+    size_t i;
+    int table;
+
+    for(i = 0; i < length; i++) histogram[data[i]]++;
+    for(table = 0; table < STATIC_TABLES; table++) {
+        unsigned long long bits = 0;
+        for(i = 0; i < 256; i++) bits += (unsigned long long)histogram[i] * staticLengths[table][i];
+        if(table == 0 || bits < best_bits) {
+            best_bits = bits;
+            best = table;
+        }
+    }
+
+    const unsigned char *lengths = staticLengths[best];
+    canonicalCodes(lengths, codes);
+    putBits(out, best, BITS_PER_BYTE);
+    for(i = 0; i < length && !out->overflow; i++) putBits(out, codes[data[i]], lengths[data[i]]);
+    return STATUS_OK;
+}
+
+static int staticExpand(stegctx_t *ctx, bitreader_t *in, unsigned char *out, size_t length) {
+    int table = (int)getBits(in, BITS_PER_BYTE);
+    if(table >= STATIC_TABLES || in->overflow) return ERROR_CORRUPT;
+    return huffmanSymbols(in, staticLengths[table], out, length);
+}
+
+static int parallelFor(int count, int threads, void (*work)(int, int, void *), void *user);
+
+/* Symbol sets, as stored by the block and tANS codecs: the count less
+ * one in a byte, then the symbols as a byte each or, past
+ * SYMBOL_MAP_SYMBOLS, as a 256 bit map. */
+static unsigned long long symbolSetBits(int symbols) {
+    return BITS_PER_BYTE + (symbols > SYMBOL_MAP_SYMBOLS ? 256 : symbols * BITS_PER_BYTE);
+}
+
+static void putSymbolSet(bitbuf_t *out, const unsigned char used[256]) {
+    int i, symbols = 0;
+    for(i = 0; i < 256; i++) {
+        if(used[i]) symbols++;
+    }
+    putBits(out, symbols - 1, BITS_PER_BYTE);
+    for(i = 0; i < 256; i++) {
+        if(symbols > SYMBOL_MAP_SYMBOLS) putBits(out, used[i] != 0, 1);
+        else if(used[i]) putBits(out, i, BITS_PER_BYTE);
+    }
+}
+
+/* Reads a symbol set, setting used[i] to 1 for each symbol in it.
+ * Returns the number of symbols, or 0 if the set is damaged. */
+static int getSymbolSet(bitreader_t *in, unsigned char used[256]) {
+    int i, listed = 0;
+    int symbols = (int)getBits(in, BITS_PER_BYTE) + 1;
+
+    memset(used, 0, 256);
+    if(symbols > SYMBOL_MAP_SYMBOLS) {
+        for(i = 0; i < 256; i++) used[i] = (unsigned char)getBits(in, 1);
+    } else {
+        for(i = 0; i < symbols; i++) used[getBits(in, BITS_PER_BYTE)] = 1;
+    }
+    for(i = 0; i < 256; i++) listed += used[i];
+    return listed == symbols && !in->overflow ? symbols : 0;
+}
+
+/* Block Huffman: the message in HUFFMAN_BLOCK_BYTES blocks, each with
+ * its own canonical code, so mixed content gets codes fitted to each
+ * part. An index of each block's coded size in 32 bits comes first,
+ * padded to a byte, and every block starts on a byte boundary, so the
+ * blocks are planned, coded and decoded in parallel with each thread
+ * touching only its own bytes. A block holds its symbol set, a 6 bit
+ * length per symbol, then the codes. */
+typedef struct {
+    huffblock_t *blocks;
+    const unsigned char *input;
+    unsigned char *output;
+    size_t length;
+} blockjob_t;
+
+/* Message bytes in a block, the last one may be short. */
+static size_t blockLength(size_t length, int block) {
+    size_t start = (size_t)block * HUFFMAN_BLOCK_BYTES;
+    return length - start < HUFFMAN_BLOCK_BYTES ? length - start : HUFFMAN_BLOCK_BYTES;
+}
+
+static unsigned long long blockTableBits(int symbols) {
+    return symbolSetBits(symbols) + symbols * HUFFMAN_LENGTH_BITS;
+}
+
+/* Builds one block's code from its own frequencies and sizes it. */
+static void planBlock(int index, int worker, void *user) {
+    blockjob_t *job = user;
+    huffblock_t *block = &job->blocks[index];
+    const unsigned char *data = job->input + (size_t)index * HUFFMAN_BLOCK_BYTES;
+    size_t length = blockLength(job->length, index), i;
+    huffmanNode_t nodes[MAX_TREE_NODES];
+    int freqTable[256] = {0};
+    unsigned long long bits = 0;
+    int symbols = 0;
+
+    for(i = 0; i < length; i++) freqTable[data[i]]++;
+    memset(block->lengths, 0, sizeof(block->lengths));
+    huffmanNode_t *root = buildPooledTree(nodes, freqTable);
+    if(!root) {
+        block->status = ERROR_MEMORY;
+        return;
+    }
+    treeLengths(root, 0, block->lengths);
+
+    for(i = 0; i < 256; i++) {
+        if(block->lengths[i] == 0xff) {
+            block->status = ERROR_TOO_LARGE;
+            return;
+        }
+        if(block->lengths[i]) symbols++;
+        bits += (unsigned long long)freqTable[i] * block->lengths[i];
+    }
+    bits += blockTableBits(symbols);
+    block->bytes = (size_t)((bits + BITS_PER_BYTE - 1) / BITS_PER_BYTE);
+    block->status = STATUS_OK;
+}
+
+/* Writes one planned block at its offset in job->output. */
+static void codeBlock(int index, int worker, void *user) {
+    blockjob_t *job = user;
+    huffblock_t *block = &job->blocks[index];
+    const unsigned char *data = job->input + (size_t)index * HUFFMAN_BLOCK_BYTES;
+    size_t length = blockLength(job->length, index), i;
+    unsigned long long codes[256];
+    bitbuf_t out;
+
+    out.data = job->output + block->offset;
+    out.capacity = block->bytes;
+    out.count = 0;
+    out.limit = block->bytes * BITS_PER_BYTE;
+    out.overflow = 0;
+    canonicalCodes(block->lengths, codes);
+
+    putSymbolSet(&out, block->lengths);
+    for(i = 0; i < 256; i++) {
+        if(block->lengths[i]) putBits(&out, block->lengths[i], HUFFMAN_LENGTH_BITS);
+    }
+    for(i = 0; i < length; i++) putBits(&out, codes[data[i]], block->lengths[data[i]]);
+}
+
+/* Reads one block's table and decodes it into job->output. */
+static void expandBlock(int index, int worker, void *user) {
+    blockjob_t *job = user;
+    huffblock_t *block = &job->blocks[index];
+    bitreader_t in;
+    int i;
+
+    in.data = job->input + block->offset;
+    in.count = block->bytes * BITS_PER_BYTE;
+    in.pos = 0;
+    in.overflow = 0;
+
+    /* Symbols are marked first, their lengths follow in symbol order. */
+    if(!getSymbolSet(&in, block->lengths)) {
+        block->status = ERROR_CORRUPT;
+        return;
+    }
+    for(i = 0; i < 256; i++) {
+        if(!block->lengths[i]) continue;
+        block->lengths[i] = (unsigned char)getBits(&in, HUFFMAN_LENGTH_BITS);
+        if(block->lengths[i] == 0 || block->lengths[i] > HUFFMAN_MAX_BITS) {
+            block->status = ERROR_CORRUPT;
+            return;
+        }
+    }
+    if(in.overflow) {
+        block->status = ERROR_CORRUPT;
+        return;
+    }
+    block->status = huffmanSymbols(&in, block->lengths,
+                                   job->output + (size_t)index * HUFFMAN_BLOCK_BYTES,
+                                   blockLength(job->length, index));
+}
+
+static int blocksCompress(stegctx_t *ctx, const unsigned char *data, size_t length, bitbuf_t *out) {
+    int count = (int)((length + HUFFMAN_BLOCK_BYTES - 1) / HUFFMAN_BLOCK_BYTES), i;
+    unsigned long long total = 0;
+    blockjob_t job;
+
+    if(growBuffer((void **)&ctx->huff_blocks, &ctx->huff_blocks_capacity,
+                  count * sizeof(huffblock_t)) != STATUS_OK) {
+        return ERROR_MEMORY;
+    }
+    job.blocks = ctx->huff_blocks;
+    job.input = data;
+    job.length = length;
+    parallelFor(count, ctx->codec_threads, planBlock, &job);
+    for(i = 0; i < count; i++) {
+        if(job.blocks[i].status != STATUS_OK) return job.blocks[i].status;
+        job.blocks[i].offset = (size_t)total;
+        total += job.blocks[i].bytes;
+    }
+
+    /* Sized up front, so a losing trial stops before coding anything. */
+    size_t start = out->count + (size_t)count * HUFFMAN_BLOCK_INDEX_BITS;
+    start = (start + BITS_PER_BYTE - 1) / BITS_PER_BYTE * BITS_PER_BYTE;
+    if(start + total * BITS_PER_BYTE > out->limit) {
+        out->overflow = 1;
+        return STATUS_OK;
+    }
+    for(i = 0; i < count; i++) putBits(out, job.blocks[i].bytes, HUFFMAN_BLOCK_INDEX_BITS);
+    putBits(out, 0, (int)(start - out->count));
+
+    job.output = out->data + start / BITS_PER_BYTE;
+    parallelFor(count, ctx->codec_threads, codeBlock, &job);
+    out->count = start + (size_t)total * BITS_PER_BYTE;
+    return STATUS_OK;
+}
+
+static int blocksExpand(stegctx_t *ctx, bitreader_t *in, unsigned char *out, size_t length) {
+    int count = (int)((length + HUFFMAN_BLOCK_BYTES - 1) / HUFFMAN_BLOCK_BYTES), i;
+    unsigned long long total = 0;
+    blockjob_t job;
+
+    if(growBuffer((void **)&ctx->huff_blocks, &ctx->huff_blocks_capacity,
+                  count * sizeof(huffblock_t)) != STATUS_OK) {
+        return ERROR_MEMORY;
+    }
+    job.blocks = ctx->huff_blocks;
+    for(i = 0; i < count; i++) {
+        job.blocks[i].bytes = (size_t)getBits(in, HUFFMAN_BLOCK_INDEX_BITS);
+        job.blocks[i].offset = (size_t)total;
+        total += job.blocks[i].bytes;
+    }
+    in->pos = (in->pos + BITS_PER_BYTE - 1) / BITS_PER_BYTE * BITS_PER_BYTE;
+    if(in->overflow || in->pos > in->count ||
+       total > (in->count - in->pos) / BITS_PER_BYTE) {
+        return ERROR_CORRUPT;
+    }
+
+    job.input = in->data + in->pos / BITS_PER_BYTE;
+    job.output = out;
+    job.length = length;
+    parallelFor(count, ctx->codec_threads, expandBlock, &job);
+    for(i = 0; i < count; i++) {
+        if(job.blocks[i].status != STATUS_OK) return job.blocks[i].status;
+    }
+    in->pos += (size_t)total * BITS_PER_BYTE;
+    return STATUS_OK;
+}
+
+/* tANS: table-driven asymmetric numeral systems. Symbol counts are
+ * scaled to a table of 2^log states, which is stored as log, the
+ * symbol set and a gamma coded count per symbol but the last (the
+ * counts sum to the table size). Unlike Huffman, a symbol can cost a
+ * fraction of a bit. The encoder works through the message backwards
+ * and the decoder forwards, so the state the encoder ends on is
+ * stored after the table, padded to a byte, then each symbol's bits in
+ * message order. Both directions are one table lookup per symbol, with
+ * the bit count worked out arithmetically rather than by branching. */
+typedef struct {
+    unsigned char symbol;
+    unsigned char bits;
+    unsigned short base;
+} tansentry_t;
+
+/* Picks a table no bigger than the message needs, with at least a
+ * state per symbol. */
+static int tansLog(size_t length) {
+    int log = TANS_MAX_LOG;
+    while(log > TANS_MIN_LOG && ((size_t)1 << (log - 1)) >= length) log--;
+    return log;
+}
+
+/* Scales the counts of the symbols used to sum to 2^log, each at least
+ * one, rounding to nearest and settling the difference on the most
+ * frequent symbols. */
+static void normalizeCounts(const size_t freq[256], size_t total, int log,
+                            unsigned short norm[256]) {
+    long remaining = 1L << log;
+    int i, largest = 0;
+
+    for(i = 0; i < 256; i++) {
+        norm[i] = 0;
+        if(!freq[i]) continue;
+        unsigned long long scaled = ((unsigned long long)freq[i] << log) + total / 2;
+        norm[i] = (unsigned short)(scaled / total ? scaled / total : 1);
+        remaining -= norm[i];
+        if(freq[i] > freq[largest]) largest = i;
+    }
+    while(remaining < 0) {
+        int most = 0;
+        for(i = 1; i < 256; i++) {
+            if(norm[i] > norm[most]) most = i;
+        }
+        norm[most]--;
+        remaining++;
+    }
+    norm[largest] += (unsigned short)remaining;
+}
+
+/* Spreads each symbol's states over the table with an odd step, so
+ * every symbol's states are scattered and each slot is hit once. */
+static void spreadSymbols(const unsigned short norm[256], int log, unsigned char spread[]) {
+    size_t size = (size_t)1 << log, mask = size - 1;
+    size_t step = (size >> 1) + (size >> 3) + 3, pos = 0;
+    int i, j;
+
+    for(i = 0; i < 256; i++) {
+        for(j = 0; j < norm[i]; j++) {
+            spread[pos] = (unsigned char)i;
+            pos = (pos + step) & mask;
+        }
+    }
+}
+
+static int highBit(unsigned long value) {
+    int bit = 0;
+    while(value >> (bit + 1)) bit++;
+    return bit;
+}
+
+static int tansCompress(stegctx_t *ctx, const unsigned char *data, size_t length, bitbuf_t *out) {
+    size_t freq[256] = {0};
+    unsigned short norm[256], next_state[1 << TANS_MAX_LOG];
+    unsigned char spread[1 << TANS_MAX_LOG], used[256];
+    unsigned long delta_bits[256];
+    long delta_state[256];
+    size_t i;
+    int s, log = tansLog(length), last = 0;
+
+    for(i = 0; i < length; i++) freq[data[i]]++;
+    normalizeCounts(freq, length, log, norm);
+    spreadSymbols(norm, log, spread);
+
+    /* next_state lists each symbol's states in order, starting at
+       delta_state + count. From state x a symbol of count n sheds the
+       bits that bring x into [n, 2n): one less than the most when x is
+       below n shifted by the most, which the high half of x +
+       delta_bits gives without a branch. */
+    unsigned long size = 1UL << log, cumulative = 0, occurrence[256];
+    for(s = 0; s < 256; s++) {
+        used[s] = norm[s] != 0;
+        if(!norm[s]) continue;
+        last = s;
+        int shed = log - highBit(norm[s]);
+        delta_bits[s] = ((unsigned long)shed << 16) - ((unsigned long)norm[s] << shed);
+        delta_state[s] = (long)cumulative - norm[s];
+        occurrence[s] = cumulative;
+        cumulative += norm[s];
+    }
+    for(i = 0; i < size; i++) next_state[occurrence[spread[i]]++] = (unsigned short)(size + i);
+
+    if(growBuffer((void **)&ctx->tans_chunks, &ctx->tans_chunks_capacity,
+                  length * sizeof(unsigned short)) != STATUS_OK) {
+        return ERROR_MEMORY;
+    }
+
+    /* Each symbol's bits are kept as value << 4 | count. */
+    unsigned long state = size, bits = log;
+    for(i = length; i-- > 0;) {
+        s = data[i];
+        unsigned long shed = (state + delta_bits[s]) >> 16;
+        ctx->tans_chunks[i] = (unsigned short)(((state & ((1UL << shed) - 1)) << 4) | shed);
+        bits += shed;
+        state = next_state[(long)(state >> shed) + delta_state[s]];
+    }
+
+    putBits(out, log, TANS_LOG_BITS);
+    putSymbolSet(out, used);
+    for(s = 0; s < last; s++) {
+        if(norm[s]) putGamma(out, norm[s]);
+    }
+    putBits(out, state - size, log);
+    putBits(out, 0, (BITS_PER_BYTE - out->count % BITS_PER_BYTE) % BITS_PER_BYTE);
+    /* Near-constant messages can cost almost nothing per byte, more
+       than decoders accept, see MAX_EXPANSION. */
+    if((out->count + bits - log) * MAX_EXPANSION < length) return ERROR_TOO_LARGE;
+    if(out->overflow || out->count + bits - log > out->limit) {
+        out->overflow = 1;
+        return STATUS_OK;
+    }
+
+    /* Whole bytes from here, the buffer is zeroed by reserveBits(). */
+    unsigned char *dst = out->data + out->count / BITS_PER_BYTE;
+    unsigned long long held = 0;
+    int pending = 0;
+    for(i = 0; i < length; i++) {
+        int count = ctx->tans_chunks[i] & 0xf;
+        held = (held << count) | (ctx->tans_chunks[i] >> 4);
+        pending += count;
+        while(pending >= BITS_PER_BYTE) {
+            pending -= BITS_PER_BYTE;
+            *dst++ = (unsigned char)(held >> pending);
+        }
+    }
+    if(pending) *dst = (unsigned char)(held << (BITS_PER_BYTE - pending));
+    out->count += bits - log;
+    return STATUS_OK;
+}
+
+static int tansExpand(stegctx_t *ctx, bitreader_t *in, unsigned char *out, size_t length) {
+    tansentry_t table[1 << TANS_MAX_LOG];
+    unsigned char spread[1 << TANS_MAX_LOG], used[256];
+    unsigned short norm[256];
+    unsigned long next[256];
+    int s, last = -1;
+    size_t i;
+
+    int log = (int)getBits(in, TANS_LOG_BITS);
+    if(log < TANS_MIN_LOG || log > TANS_MAX_LOG || !getSymbolSet(in, used)) return ERROR_CORRUPT;
+    unsigned long size = 1UL << log, total = 0;
+    for(s = 0; s < 256; s++) {
+        norm[s] = 0;
+        if(used[s]) last = s;
+    }
+    for(s = 0; s < last; s++) {
+        if(!used[s]) continue;
+        unsigned long count = getGamma(in);
+        if(in->overflow || count >= size - total) return ERROR_CORRUPT;
+        norm[s] = (unsigned short)count;
+        total += count;
+    }
+    norm[last] = (unsigned short)(size - total);
+
+    spreadSymbols(norm, log, spread);
+    for(s = 0; s < 256; s++) next[s] = norm[s];
+    for(i = 0; i < size; i++) {
+        unsigned long state = next[spread[i]]++;
+        int shed = log - highBit(state);
+        table[i].symbol = spread[i];
+        table[i].bits = (unsigned char)shed;
+        table[i].base = (unsigned short)((state << shed) - size);
+    }
+
+    unsigned long state = (unsigned long)getBits(in, log);
+    in->pos = (in->pos + BITS_PER_BYTE - 1) / BITS_PER_BYTE * BITS_PER_BYTE;
+    if(in->overflow || in->pos > in->count) return ERROR_CORRUPT;
+
+    /* Reads ahead a byte at a time, keeping at least log bits held. */
+    const unsigned char *src = in->data + in->pos / BITS_PER_BYTE;
+    const unsigned char *end = in->data + (in->count + BITS_PER_BYTE - 1) / BITS_PER_BYTE;
+    unsigned long long held = 0;
+    int pending = 0;
+    for(i = 0; i < length; i++) {
+        const tansentry_t *entry = &table[state];
+        while(pending < log && src < end) {
+            held = (held << BITS_PER_BYTE) | *src++;
+            pending += BITS_PER_BYTE;
+        }
+        if(pending < entry->bits) return ERROR_CORRUPT;
+        out[i] = entry->symbol;
+        pending -= entry->bits;
+        state = entry->base + (unsigned long)((held >> pending) & ((1UL << entry->bits) - 1));
+    }
+    /* The encoder started from the first state. */
+    if(state != 0) return ERROR_CORRUPT;
+    in->pos = (size_t)(src - in->data) * BITS_PER_BYTE - pending;
+    return STATUS_OK;
+}
+
+/* Adaptive: a binary arithmetic coder over the bits of each byte,
+ * most significant first, with a probability per node of the 255 node
+ * bit tree. Probabilities start even and move towards each bit coded,
+ * so nothing is stored ahead of the codes and the coder never needs
+ * more than the byte in hand: bytes are coded as they arrive, see
+ * encodeMessageFd(). The range is 32 bits and a byte is emitted
+ * whenever its top byte is settled. */
+typedef struct {
+    unsigned int low;
+    unsigned int high;
+    unsigned int probs[256];
+} adaptive_t;
+
+static void adaptiveStart(adaptive_t *coder) {
+    int i;
+    coder->low = 0;
+    coder->high = 0xffffffffU;
+    for(i = 0; i < 256; i++) coder->probs[i] = 1U << (ADAPTIVE_PROB_BITS - 1);
+}
+
+/* Narrows the range to bit's share at node, given the split point mid,
+ * and moves node's probability towards bit. */
+static void adaptiveNarrow(adaptive_t *coder, int node, unsigned int mid, int bit) {
+    unsigned int *prob = &coder->probs[node];
+    if(bit) {
+        coder->high = mid;
+        *prob += ((1U << ADAPTIVE_PROB_BITS) - *prob) >> ADAPTIVE_RATE;
+    } else {
+        coder->low = mid + 1;
+        *prob -= *prob >> ADAPTIVE_RATE;
+    }
+}
+
+/* Last value of the range's lower part, where a 1 bit at node goes. */
+static unsigned int adaptiveSplit(const adaptive_t *coder, int node) {
+    return coder->low + ((coder->high - coder->low) >> ADAPTIVE_PROB_BITS) * coder->probs[node];
+}
+
+static int adaptiveSettled(const adaptive_t *coder) {
+    return ((coder->low ^ coder->high) & 0xff000000U) == 0;
+}
+
+static void adaptiveShift(adaptive_t *coder) {
+    coder->low <<= BITS_PER_BYTE;
+    coder->high = (coder->high << BITS_PER_BYTE) | 0xff;
+}
+
+static void adaptiveEncode(adaptive_t *coder, int byte, bitbuf_t *out) {
+    int i, node = 1;
+    for(i = BITS_PER_BYTE - 1; i >= 0; i--) {
+        int bit = (byte >> i) & 1;
+        adaptiveNarrow(coder, node, adaptiveSplit(coder, node), bit);
+        node = node * 2 + bit;
+        while(adaptiveSettled(coder)) {
+            putBits(out, coder->high >> 24, BITS_PER_BYTE);
+            adaptiveShift(coder);
+        }
+    }
+}
+
+/* Ends the codes with one byte: high's top byte followed by the zeros
+ * a decoder reads past the end lies inside the final range. */
+static void adaptiveFinish(adaptive_t *coder, bitbuf_t *out) {
+    putBits(out, coder->high >> 24, BITS_PER_BYTE);
+}
+
+/* The next code byte, zero past the end. */
+static unsigned int adaptiveByte(bitreader_t *in) {
+    if(in->pos + BITS_PER_BYTE > in->count) return 0;
+    return (unsigned int)getBits(in, BITS_PER_BYTE);
+}
+
+static int adaptiveCompress(stegctx_t *ctx, const unsigned char *data, size_t length, bitbuf_t *out) {
+    adaptive_t coder;
+    size_t i;
+
+    adaptiveStart(&coder);
+    for(i = 0; i < length && !out->overflow; i++) adaptiveEncode(&coder, data[i], out);
+    adaptiveFinish(&coder, out);
+    return STATUS_OK;
+}
+
+static int adaptiveExpand(stegctx_t *ctx, bitreader_t *in, unsigned char *out, size_t length) {
+    adaptive_t coder;
+    unsigned int value = 0;
+    size_t i;
+    int j;
+
+    adaptiveStart(&coder);
+    for(j = 0; j < 4; j++) value = (value << BITS_PER_BYTE) | adaptiveByte(in);
+    for(i = 0; i < length; i++) {
+        int node = 1;
+        for(j = 0; j < BITS_PER_BYTE; j++) {
+            unsigned int mid = adaptiveSplit(&coder, node);
+            int bit = value <= mid;
+            adaptiveNarrow(&coder, node, mid, bit);
+            node = node * 2 + bit;
+            while(adaptiveSettled(&coder)) {
+                adaptiveShift(&coder);
+                value = (value << BITS_PER_BYTE) | adaptiveByte(in);
+            }
+        }
+        out[i] = (unsigned char)(node - 256);
+    }
+    return STATUS_OK;
+}
+
+typedef struct {
+    const char *name;
+    int (*compress)(stegctx_t *ctx, const unsigned char *data, size_t length, bitbuf_t *out);
+    int (*expand)(stegctx_t *ctx, bitreader_t *in, unsigned char *out, size_t length);
+} codec_t;
+
+/* Indexed by the codec id stored in the header. */
+static const codec_t codecs[CODEC_COUNT] = {
+    {"raw", rawCompress, rawExpand},
+    {"rle", rleCompress, rleExpand},
+    {"lz77", lzCompress, lzExpand},
+    {"huffman", huffmanCompress, huffmanExpand},
+    {"static", staticCompress, staticExpand},
+    {"blocks", blocksCompress, blocksExpand},
+    {"tans", tansCompress, tansExpand},
+    {"adaptive", adaptiveCompress, adaptiveExpand}
+};
+
+/* Returns the name of a codec id, as stored in the header.
+ *
+ * Input:
+ *  - int codec: Codec id, or CODEC_LEGACY.
+ * Output:
+ *  - The name, "unknown" for ids this build doesn't know.
+ */
+const char *codecName(int codec) {
+    if(codec == CODEC_LEGACY) return "legacy";
+    if(codec == CODEC_BEST) return "best";
+    if(codec == CODEC_FAST) return "fast";
+    if(codec < 0 || codec >= CODEC_COUNT) return "unknown";
+    return codecs[codec].name;
+}
+
+/* Looks up a codec by name, including "best" and "fast".
+ *
+ * Input:
+ *  - const char *name: Codec name.
+ * Output:
+ *  - The codec id, CODEC_BEST or CODEC_FAST, or ERROR_FORMAT if unknown.
+ */
+int codecId(const char *name) {
+    int i;
+    if(strcmp(name, "best") == 0) return CODEC_BEST;
+    if(strcmp(name, "fast") == 0) return CODEC_FAST;
+    for(i = 0; i < CODEC_COUNT; i++) {
+        if(strcmp(name, codecs[i].name) == 0) return i;
+    }
+    return ERROR_FORMAT;
+}
+
+/* Compresses data into ctx->packed with ctx->codec. With CODEC_BEST
+ * every codec is tried, each stopping as soon as it can't beat the
+ * smallest so far; CODEC_FAST goes straight to the static tables.
+ *
+ * Input:
+ *  - stegctx_t *ctx: Pointer to the context.
+ *  - const unsigned char *data: Bytes to compress.
+ *  - size_t length: Number of bytes.
+ * Output:
+ *  - STATUS_OK with ctx->codec_used set, or the codec's error.
+ */
+static int compressPayload(stegctx_t *ctx, const unsigned char *data, size_t length) {
+    int codec = ctx->codec;
+    int status;
+
+    if(codec == CODEC_FAST) codec = CODEC_STATIC;
+    if(codec >= CODEC_COUNT) return ERROR_FORMAT;
+
+    if(codec >= 0) {
+        /* No codec spends more than HUFFMAN_MAX_BITS on a byte, so a
+           forced codec never overflows. */
+        status = reserveBits(&ctx->packed, length * HUFFMAN_MAX_BITS + HUFFMAN_TABLE_BITS);
+        if(status == STATUS_OK) status = codecs[codec].compress(ctx, data, length, &ctx->packed);
+        /* Very skewed input can need Huffman codes over HUFFMAN_MAX_BITS. */
+        if(status == ERROR_TOO_LARGE) {
+            codec = CODEC_RAW;
+            status = reserveBits(&ctx->packed, length * BITS_PER_BYTE);
+            if(status == STATUS_OK) status = rawCompress(ctx, data, length, &ctx->packed);
+        }
+        ctx->codec_used = codec;
+        return status;
+    }
+
+    status = reserveBits(&ctx->packed, length * BITS_PER_BYTE);
+    if(status != STATUS_OK) return status;
+    rawCompress(ctx, data, length, &ctx->packed);
+    ctx->codec_used = CODEC_RAW;
+
+    for(codec = CODEC_RAW + 1; codec < CODEC_COUNT; codec++) {
+        status = reserveBits(&ctx->candidate, ctx->packed.count - 1);
+        if(status != STATUS_OK) return status;
+        status = codecs[codec].compress(ctx, data, length, &ctx->candidate);
+        if(status == ERROR_MEMORY) return status;
+        if(status != STATUS_OK || ctx->candidate.overflow) continue;
+
+        bitbuf_t smaller = ctx->candidate;
+        ctx->candidate = ctx->packed;
+        ctx->packed = smaller;
+        ctx->codec_used = codec;
+    }
+    return STATUS_OK;
+}
+
+/* splitmix64, the PRNG behind the round keys and round function. */
+static unsigned long long splitMix(unsigned long long *state) {
+    unsigned long long z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+/* ChaCha20 (RFC 8439). The keystream is generated CHACHA_LANES blocks
+ * at a time with the 16 state words held in vectors, one lane per
+ * block, so the compiler can use SIMD registers for every round.
+ * Compilers without vector extensions get one block per call. */
+#ifdef __GNUC__
+#define CHACHA_LANES 4
+typedef unsigned int lanes_t __attribute__((vector_size(CHACHA_LANES * 4)));
+#else
+#define CHACHA_LANES 1
+typedef unsigned int lanes_t;
+#endif
+
+typedef union {
+    lanes_t v;
+    unsigned int w[CHACHA_LANES];
+} lanebuf_t;
+
+#define ROTATE(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define QUARTER(a, b, c, d) \
+    a += b; d ^= a; d = ROTATE(d, 16); \
+    c += d; b ^= c; b = ROTATE(b, 12); \
+    a += b; d ^= a; d = ROTATE(d, 8); \
+    c += d; b ^= c; b = ROTATE(b, 7);
+
+/* Computes CHACHA_LANES consecutive keystream blocks starting at block
+ * counter, written one after another into out. */
+static void chachaBlocks(const unsigned int key[CHACHA_KEY_WORDS],
+                         const unsigned char nonce[CHACHA_NONCE_BYTES],
+                         unsigned int counter, unsigned char *out) {
+    static const unsigned int constants[4] = {0x61707865, 0x3320646e, 0x79622d32, 0x6b206574};
+    lanebuf_t state[16];
+    lanes_t x[16];
+    int i, lane;
+
+    for(lane = 0; lane < CHACHA_LANES; lane++) {
+        for(i = 0; i < 4; i++) state[i].w[lane] = constants[i];
+        for(i = 0; i < CHACHA_KEY_WORDS; i++) state[4 + i].w[lane] = key[i];
+        state[12].w[lane] = counter + lane;
+        for(i = 0; i < 3; i++) state[13 + i].w[lane] = readLE32(nonce + 4 * i);
+    }
+    for(i = 0; i < 16; i++) x[i] = state[i].v;
+
+    for(i = 0; i < CHACHA_DOUBLE_ROUNDS; i++) {
+        QUARTER(x[0], x[4], x[8], x[12]);
+        QUARTER(x[1], x[5], x[9], x[13]);
+        QUARTER(x[2], x[6], x[10], x[14]);
+        QUARTER(x[3], x[7], x[11], x[15]);
+        QUARTER(x[0], x[5], x[10], x[15]);
+        QUARTER(x[1], x[6], x[11], x[12]);
+        QUARTER(x[2], x[7], x[8], x[13]);
+        QUARTER(x[3], x[4], x[9], x[14]);
+    }
+
+    for(i = 0; i < 16; i++) {
+        lanebuf_t word;
+        word.v = x[i] + state[i].v;
+        for(lane = 0; lane < CHACHA_LANES; lane++) {
+            unsigned char *p = out + lane * CHACHA_BLOCK + 4 * i;
+            p[0] = (unsigned char)word.w[lane];
+            p[1] = (unsigned char)(word.w[lane] >> 8);
+            p[2] = (unsigned char)(word.w[lane] >> 16);
+            p[3] = (unsigned char)(word.w[lane] >> 24);
+        }
+    }
+}
+
+/* Encrypts or decrypts length bytes in place, the part of the stream
+ * starting offset bytes in (a multiple of CHACHA_BLOCK). The block
+ * counter starts at 1 as in RFC 8439. */
+static void chachaXorAt(const unsigned int key[CHACHA_KEY_WORDS],
+                        const unsigned char nonce[CHACHA_NONCE_BYTES],
+                        unsigned char *data, size_t length, size_t offset) {
+    unsigned char stream[CHACHA_LANES * CHACHA_BLOCK];
+    unsigned int counter = 1 + (unsigned int)(offset / CHACHA_BLOCK);
+    size_t i, done = 0;
+
+    while(done < length) {
+        size_t chunk = length - done < sizeof(stream) ? length - done : sizeof(stream);
+        chachaBlocks(key, nonce, counter, stream);
+        for(i = 0; i < chunk; i++) data[done + i] ^= stream[i];
+        counter += CHACHA_LANES;
+        done += chunk;
+    }
+}
+
+static void chachaXor(const unsigned int key[CHACHA_KEY_WORDS],
+                      const unsigned char nonce[CHACHA_NONCE_BYTES],
+                      unsigned char *data, size_t length) {
+    chachaXorAt(key, nonce, data, length, 0);
+}
+
+/* Fills a nonce from /dev/urandom, or from the clock, process id and a
+ * counter if it can't be read. A nonce only has to be unique per key. */
+static void makeNonce(unsigned char nonce[CHACHA_NONCE_BYTES]) {
+    static unsigned long long calls = 0;
+    int fd = open("/dev/urandom", O_RDONLY);
+    if(fd >= 0) {
+        ssize_t got = read(fd, nonce, CHACHA_NONCE_BYTES);
+        close(fd);
+        if(got == CHACHA_NONCE_BYTES) return;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    unsigned long long state = ((unsigned long long)now.tv_sec << 32) ^ now.tv_nsec ^
+                               ((unsigned long long)getpid() << 16) ^
+                               __sync_add_and_fetch(&calls, 1);
+    unsigned long long a = splitMix(&state), b = splitMix(&state);
+    int i;
+    for(i = 0; i < CHACHA_NONCE_BYTES; i++) {
+        nonce[i] = (unsigned char)(i < 8 ? a >> (8 * i) : b >> (8 * (i - 8)));
+    }
+}
+
+/* SHA-256 (FIPS 180-4), for the HMAC behind the key derivation and the
+ * payload tag. Words are big endian. */
+static const unsigned int sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define SHA_ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static unsigned int readBE32(const unsigned char *bytes) {
+    return ((unsigned int)bytes[0] << 24) | ((unsigned int)bytes[1] << 16) |
+           ((unsigned int)bytes[2] << 8) | (unsigned int)bytes[3];
+}
+
+static void writeBE32(unsigned char *bytes, unsigned int value) {
+    bytes[0] = (unsigned char)(value >> 24);
+    bytes[1] = (unsigned char)(value >> 16);
+    bytes[2] = (unsigned char)(value >> 8);
+    bytes[3] = (unsigned char)value;
+}
+
+static void sha256Block(unsigned int h[8], const unsigned char block[SHA256_BLOCK]) {
+    unsigned int w[64], v[8];
+    int i;
+
+    for(i = 0; i < 16; i++) w[i] = readBE32(block + 4 * i);
+    for(i = 16; i < 64; i++) {
+        unsigned int s0 = SHA_ROTR(w[i - 15], 7) ^ SHA_ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        unsigned int s1 = SHA_ROTR(w[i - 2], 17) ^ SHA_ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    for(i = 0; i < 8; i++) v[i] = h[i];
+    for(i = 0; i < 64; i++) {
+        unsigned int s1 = SHA_ROTR(v[4], 6) ^ SHA_ROTR(v[4], 11) ^ SHA_ROTR(v[4], 25);
+        unsigned int choice = (v[4] & v[5]) ^ (~v[4] & v[6]);
+        unsigned int t1 = v[7] + s1 + choice + sha256_k[i] + w[i];
+        unsigned int s0 = SHA_ROTR(v[0], 2) ^ SHA_ROTR(v[0], 13) ^ SHA_ROTR(v[0], 22);
+        unsigned int majority = (v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]);
+        v[7] = v[6];
+        v[6] = v[5];
+        v[5] = v[4];
+        v[4] = v[3] + t1;
+        v[3] = v[2];
+        v[2] = v[1];
+        v[1] = v[0];
+        v[0] = t1 + s0 + majority;
+    }
+    for(i = 0; i < 8; i++) h[i] += v[i];
+}
+
+static void sha256Start(sha256_t *sha) {
+    static const unsigned int initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(sha->h, initial, sizeof(initial));
+    sha->fill = 0;
+    sha->length = 0;
+}
+
+static void sha256Add(sha256_t *sha, const unsigned char *data, size_t length) {
+    sha->length += length;
+    while(length > 0) {
+        size_t chunk = SHA256_BLOCK - sha->fill;
+        if(chunk > length) chunk = length;
+        memcpy(sha->block + sha->fill, data, chunk);
+        sha->fill += chunk;
+        data += chunk;
+        length -= chunk;
+        if(sha->fill == SHA256_BLOCK) {
+            sha256Block(sha->h, sha->block);
+            sha->fill = 0;
+        }
+    }
+}
+
+static void sha256Finish(sha256_t *sha, unsigned char digest[SHA256_BYTES]) {
+    unsigned long long bits = sha->length * BITS_PER_BYTE;
+    int i;
+
+    sha->block[sha->fill++] = 0x80;
+    if(sha->fill > SHA256_BLOCK - 8) {
+        memset(sha->block + sha->fill, 0, SHA256_BLOCK - sha->fill);
+        sha256Block(sha->h, sha->block);
+        sha->fill = 0;
+    }
+    memset(sha->block + sha->fill, 0, SHA256_BLOCK - 8 - sha->fill);
+    for(i = 0; i < 8; i++) sha->block[SHA256_BLOCK - 1 - i] = (unsigned char)(bits >> (8 * i));
+    sha256Block(sha->h, sha->block);
+    for(i = 0; i < 8; i++) writeBE32(digest + 4 * i, sha->h[i]);
+}
+
+/* Keys HMAC-SHA256 (RFC 2104): inner and outer receive the hash states
+ * after the key XORed with the inner and outer pads, so every HMAC
+ * with the key starts from a copy of them. */
+static void hmacKey(const unsigned char *key, size_t length, sha256_t *inner, sha256_t *outer) {
+    unsigned char pad[SHA256_BLOCK];
+    unsigned char digest[SHA256_BYTES];
+    size_t i;
+
+    /* Keys longer than a block are hashed first. */
+    if(length > SHA256_BLOCK) {
+        sha256Start(inner);
+        sha256Add(inner, key, length);
+        sha256Finish(inner, digest);
+        key = digest;
+        length = SHA256_BYTES;
+    }
+    memset(pad, 0x36, sizeof(pad));
+    for(i = 0; i < length; i++) pad[i] ^= key[i];
+    sha256Start(inner);
+    sha256Add(inner, pad, sizeof(pad));
+    memset(pad, 0x5c, sizeof(pad));
+    for(i = 0; i < length; i++) pad[i] ^= key[i];
+    sha256Start(outer);
+    sha256Add(outer, pad, sizeof(pad));
+    memset(pad, 0, sizeof(pad));
+    memset(digest, 0, sizeof(digest));
+}
+
+/* Completes an HMAC begun from a copy of hmacKey()'s inner state. */
+static void hmacFinish(sha256_t *sha, const sha256_t *outer, unsigned char mac[SHA256_BYTES]) {
+    unsigned char digest[SHA256_BYTES];
+    sha256Finish(sha, digest);
+    *sha = *outer;
+    sha256Add(sha, digest, sizeof(digest));
+    sha256Finish(sha, mac);
+}
+
+/* Derives the cipher and MAC keys for one payload from the passphrase
+ * and the payload's nonce, or reuses them if the nonce is the last one
+ * seen. PBKDF2-HMAC-SHA256 (RFC 8018) salted with the nonce gives a
+ * master key, which HKDF-Expand (RFC 5869) splits into the two keys, so
+ * every payload has its own keys even with the same passphrase.
+ *
+ * Input:
+ *  - passkey_t *key: Passphrase state from setPassphrase().
+ *  - const unsigned char *nonce: The payload's nonce, CHACHA_NONCE_BYTES long.
+ * Output:
+ *  - Function of type void, the keys are left in key.
+ */
+static void derivePayloadKeys(passkey_t *key, const unsigned char nonce[CHACHA_NONCE_BYTES]) {
+    static const unsigned char info[] = "stegano payload keys";
+    static const unsigned char block_index[4] = {0, 0, 0, 1};
+    unsigned char u[SHA256_BYTES], master[SHA256_BYTES], okm[2 * SHA256_BYTES];
+    unsigned char counter;
+    sha256_t sha, inner, outer;
+    int i, j;
+
+    if(key->derived && memcmp(key->salt, nonce, CHACHA_NONCE_BYTES) == 0) return;
+
+    /* PBKDF2, one block: U1 = HMAC(P, salt || 1), Ui = HMAC(P, Ui-1). */
+    sha = key->inner;
+    sha256Add(&sha, nonce, CHACHA_NONCE_BYTES);
+    sha256Add(&sha, block_index, sizeof(block_index));
+    hmacFinish(&sha, &key->outer, u);
+    memcpy(master, u, sizeof(master));
+    for(i = 1; i < PASSPHRASE_ITERATIONS; i++) {
+        sha = key->inner;
+        sha256Add(&sha, u, sizeof(u));
+        hmacFinish(&sha, &key->outer, u);
+        for(j = 0; j < SHA256_BYTES; j++) master[j] ^= u[j];
+    }
+
+    /* HKDF-Expand: T(n) = HMAC(master, T(n-1) || info || n). */
+    hmacKey(master, sizeof(master), &inner, &outer);
+    for(counter = 1; counter <= 2; counter++) {
+        sha = inner;
+        if(counter > 1) sha256Add(&sha, okm + (counter - 2) * SHA256_BYTES, SHA256_BYTES);
+        sha256Add(&sha, info, sizeof(info) - 1);
+        sha256Add(&sha, &counter, 1);
+        hmacFinish(&sha, &outer, okm + (counter - 1) * SHA256_BYTES);
+    }
+
+    for(i = 0; i < CHACHA_KEY_WORDS; i++) key->cipher_key[i] = readLE32(okm + 4 * i);
+    memcpy(key->mac_key, okm + SHA256_BYTES, SHA256_BYTES);
+    memcpy(key->salt, nonce, CHACHA_NONCE_BYTES);
+    key->derived = 1;
+
+    memset(u, 0, sizeof(u));
+    memset(master, 0, sizeof(master));
+    memset(okm, 0, sizeof(okm));
+    memset(&inner, 0, sizeof(inner));
+    memset(&outer, 0, sizeof(outer));
+}
+
+/* The cipher key for a header's payload: the derived key for
+ * authenticated payloads, the old format's key otherwise. */
+static const unsigned int *payloadKey(passkey_t *key, const payloadheader_t *header) {
+    if(!(header->flags & HEADER_AUTHENTICATED)) return key->legacy_key;
+    derivePayloadKeys(key, header->nonce);
+    return key->cipher_key;
+}
+
+/* Computes the tag of an authenticated payload: HMAC-SHA256 with the
+ * payload's MAC key over the encrypted payload bits, then the version,
+ * codec, flags (bar HEADER_SHARDED), lengths and nonce, truncated to
+ * HEADER_TAG_BYTES. Shards carry the tag of the whole payload. Bits
+ * past the end of the payload don't count.
+ *
+ * Input:
+ *  - passkey_t *key: Passphrase state from setPassphrase().
+ *  - const payloadheader_t *header: Header of the whole payload.
+ *  - const unsigned char *payload: The encrypted payload bits.
+ *  - unsigned char *tag: Receives HEADER_TAG_BYTES bytes.
+ * Output:
+ *  - Function of type void.
+ */
+static void payloadTag(passkey_t *key, const payloadheader_t *header,
+                       const unsigned char *payload, unsigned char tag[HEADER_TAG_BYTES]) {
+    unsigned char fields[3 + 8 + CHACHA_NONCE_BYTES], mac[SHA256_BYTES];
+    size_t whole = header->payload_bits / BITS_PER_BYTE;
+    int extra = (int)(header->payload_bits % BITS_PER_BYTE);
+    sha256_t sha, inner, outer;
+
+    derivePayloadKeys(key, header->nonce);
+    hmacKey(key->mac_key, SHA256_BYTES, &inner, &outer);
+    sha = inner;
+    sha256Add(&sha, payload, whole);
+    if(extra) {
+        unsigned char last = payload[whole] & (unsigned char)(0xff << (BITS_PER_BYTE - extra));
+        sha256Add(&sha, &last, 1);
+    }
+
+    fields[0] = (unsigned char)header->version;
+    fields[1] = (unsigned char)header->codec;
+    fields[2] = (unsigned char)(header->flags & ~HEADER_SHARDED);
+    writeBE32(fields + 3, (unsigned int)header->message_length);
+    writeBE32(fields + 7, (unsigned int)header->payload_bits);
+    memcpy(fields + 11, header->nonce, CHACHA_NONCE_BYTES);
+    sha256Add(&sha, fields, sizeof(fields));
+    hmacFinish(&sha, &outer, mac);
+    memcpy(tag, mac, HEADER_TAG_BYTES);
+}
+
+/* Checks an authenticated payload's tag, in time independent of where
+ * it differs. */
+static int checkTag(passkey_t *key, const payloadheader_t *header, const unsigned char *payload) {
+    unsigned char tag[HEADER_TAG_BYTES];
+    unsigned char diff = 0;
+    int i;
+
+    payloadTag(key, header, payload, tag);
+    for(i = 0; i < HEADER_TAG_BYTES; i++) diff |= tag[i] ^ header->tag[i];
+    return diff ? ERROR_WRONG_PASSPHRASE : STATUS_OK;
+}
+
+/* Sets the passphrase payloads are encrypted with, or turns encryption
+ * off. The passphrase keys HMAC-SHA256 for derivePayloadKeys(), which
+ * salts it with each payload's nonce. The key of payloads written before
+ * payloads were authenticated is derived too: the passphrase absorbed
+ * 32 bytes at a time, each chunk followed by a ChaCha20 block, then
+ * stretched by LEGACY_PASSPHRASE_ROUNDS more blocks. The same
+ * passphrase is needed to decode.
+ *
+ * Input:
+ *  - stegctx_t *ctx: Pointer to the context.
+ *  - const char *passphrase: Passphrase, or NULL for no encryption.
+ * Output:
+ *  - Function of type void.
+ */
+void setPassphrase(stegctx_t *ctx, const char *passphrase) {
+    static const unsigned char label[CHACHA_NONCE_BYTES] = "stegano-kdf";
+    unsigned char block[CHACHA_LANES * CHACHA_BLOCK];
+    unsigned int *key = ctx->passkey.legacy_key;
+    size_t i = 0, length;
+    unsigned int round = 0;
+    int j;
+
+    ctx->encrypted = passphrase != NULL;
+    memset(&ctx->passkey, 0, sizeof(ctx->passkey));
+    if(!passphrase) return;
+
+    length = strlen(passphrase);
+    hmacKey((const unsigned char *)passphrase, length, &ctx->passkey.inner,
+            &ctx->passkey.outer);
+    do {
+        for(j = 0; j < CHACHA_KEY_WORDS * 4 && i < length; j++, i++) {
+            key[j / 4] ^= (unsigned int)(unsigned char)passphrase[i] << (8 * (j % 4));
+        }
+        chachaBlocks(key, label, round++, block);
+        for(j = 0; j < CHACHA_KEY_WORDS; j++) key[j] = readLE32(block + 4 * j);
+    } while(i < length);
+
+    /* The length goes in last so zero padding can't make two
+       passphrases equal. */
+    key[0] ^= (unsigned int)length;
+    while(round < LEGACY_PASSPHRASE_ROUNDS) {
+        chachaBlocks(key, label, round++, block);
+        for(j = 0; j < CHACHA_KEY_WORDS; j++) key[j] = readLE32(block + 4 * j);
+    }
+    memset(block, 0, sizeof(block));
+}
+
+/* CRC32C (Castagnoli, reflected polynomial 0x82F63B78) over the header
+ * and payload. x86-64 CPUs with SSE4.2 compute it eight bytes per
+ * instruction; everything else uses slicing-by-8 tables built on first
+ * use. */
+#define CRC32C_POLY 0x82F63B78U
+
+static unsigned int crc_tables[8][256];
+static int crc_hardware = 0;
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void initCrc(void) {
+    int i, j;
+    for(i = 0; i < 256; i++) {
+        unsigned int crc = (unsigned int)i;
+        for(j = 0; j < BITS_PER_BYTE; j++) crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+        crc_tables[0][i] = crc;
+    }
+    for(i = 0; i < 256; i++) {
+        for(j = 1; j < 8; j++) {
+            unsigned int prev = crc_tables[j - 1][i];
+            crc_tables[j][i] = (prev >> 8) ^ crc_tables[0][prev & 0xff];
+        }
+    }
+#if defined(__GNUC__) && defined(__x86_64__)
+    crc_hardware = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static unsigned int crcHardware(unsigned int crc, const unsigned char *data, size_t length) {
+    unsigned long long word, wide = crc;
+    for(; length >= 8; data += 8, length -= 8) {
+        memcpy(&word, data, 8);
+        wide = __builtin_ia32_crc32di(wide, word);
+    }
+    crc = (unsigned int)wide;
+    for(; length > 0; data++, length--) crc = __builtin_ia32_crc32qi(crc, *data);
+    return crc;
+}
+#endif
+
+static unsigned int crcSoftware(unsigned int crc, const unsigned char *data, size_t length) {
+    for(; length >= 8; data += 8, length -= 8) {
+        unsigned int low = crc ^ readLE32(data), high = readLE32(data + 4);
+        crc = crc_tables[7][low & 0xff] ^ crc_tables[6][(low >> 8) & 0xff] ^
+              crc_tables[5][(low >> 16) & 0xff] ^ crc_tables[4][low >> 24] ^
+              crc_tables[3][high & 0xff] ^ crc_tables[2][(high >> 8) & 0xff] ^
+              crc_tables[1][(high >> 16) & 0xff] ^ crc_tables[0][high >> 24];
+    }
+    for(; length > 0; data++, length--) crc = (crc >> 8) ^ crc_tables[0][(crc ^ *data) & 0xff];
+    return crc;
+}
+
+/* Continues a CRC32C, start with crc 0. */
+static unsigned int crc32c(unsigned int crc, const unsigned char *data, size_t length) {
+    pthread_once(&crc_once, initCrc);
+    crc = ~crc;
+#if defined(__GNUC__) && defined(__x86_64__)
+    if(crc_hardware) return ~crcHardware(crc, data, length);
+#endif
+    return ~crcSoftware(crc, data, length);
+}
+
+/* Writes the payload header, see buildPayload(). */
+static void putHeader(bitbuf_t *buf, const payloadheader_t *header) {
+    putBits(buf, HEADER_MAGIC_0, BITS_PER_BYTE);
+    putBits(buf, HEADER_MAGIC_1, BITS_PER_BYTE);
+    putBits(buf, header->version, BITS_PER_BYTE);
+    putBits(buf, header->codec, BITS_PER_BYTE);
+    putBits(buf, header->flags, BITS_PER_BYTE);
+    putBits(buf, header->message_length, HEADER_LENGTH_BITS);
+    putBits(buf, header->payload_bits, HEADER_LENGTH_BITS);
+    if(header->version != HEADER_VERSION_NO_CRC) putBits(buf, header->crc, HEADER_CRC_BITS);
+    if(header->flags & HEADER_SHARDED) {
+        putBits(buf, header->shard_id, HEADER_SHARD_ID_BITS);
+        putBits(buf, header->shard_index, HEADER_SHARD_INDEX_BITS);
+        putBits(buf, header->shard_count, HEADER_SHARD_INDEX_BITS);
+    }
+    if(header->flags & HEADER_CHACHA20) {
+        int i;
+        for(i = 0; i < CHACHA_NONCE_BYTES; i++) putBits(buf, header->nonce[i], BITS_PER_BYTE);
+    }
+    if(header->flags & HEADER_AUTHENTICATED) {
+        int i;
+        for(i = 0; i < HEADER_TAG_BYTES; i++) putBits(buf, header->tag[i], BITS_PER_BYTE);
+    }
+}
+
+/* Bits taken by a header with the given version and flags. */
+static size_t headerBits(int version, int flags) {
+    return (version == HEADER_VERSION_NO_CRC ? HEADER_V1_BITS : HEADER_BITS) +
+           (flags & HEADER_SHARDED ? HEADER_SHARD_BITS : 0) +
+           (flags & HEADER_CHACHA20 ? HEADER_NONCE_BITS : 0) +
+           (flags & HEADER_AUTHENTICATED ? HEADER_TAG_BITS : 0);
+}
+
+/* Bit offset of the nonce in a header, which the tag follows. */
+static size_t nonceOffset(int version, int flags) {
+    return headerBits(version, flags & ~(HEADER_CHACHA20 | HEADER_AUTHENTICATED));
+}
+
+/* Matrix embedding code size named by header flags, 0 for none. */
+static int matrixK(int flags) {
+    return (flags & HEADER_MATRIX_MASK) >> HEADER_MATRIX_SHIFT;
+}
+
+/* Channel bytes taken by payload_bits bits after the header. */
+static size_t payloadSlots(int flags, size_t payload_bits) {
+    int k = matrixK(flags);
+    if(k == 0) return payload_bits;
+    return (payload_bits + k - 1) / k * (((size_t)1 << k) - 1);
+}
+
+/* Payload bits that fit in slots channel bytes after the header. */
+static size_t payloadRoom(int flags, size_t slots) {
+    int k = matrixK(flags);
+    if(k == 0) return slots;
+    return slots / (((size_t)1 << k) - 1) * k;
+}
+
+/* Channel bytes a bitstream from layoutPayload(), count bits long,
+ * takes in the image. The version and flags are its third and fifth
+ * bytes. */
+static size_t embeddedBits(const unsigned char *stream, size_t count) {
+    size_t header_bits = headerBits(stream[2], stream[4]);
+    return header_bits + payloadSlots(stream[4], count - header_bits);
+}
+
+/* CRC32C of a header, with its CRC field as zero, followed by bits
+ * payload bits. Bits past the end of the payload don't count. */
+static unsigned int payloadCrc(const payloadheader_t *header, const unsigned char *payload,
+                               size_t bits) {
+    unsigned char bytes[HEADER_MAX_BITS / BITS_PER_BYTE];
+    payloadheader_t blank = *header;
+    bitbuf_t buf;
+
+    blank.crc = 0;
+    buf.data = bytes;
+    buf.capacity = sizeof(bytes);
+    buf.count = 0;
+    buf.limit = sizeof(bytes) * BITS_PER_BYTE;
+    buf.overflow = 0;
+    memset(bytes, 0, sizeof(bytes));
+    putHeader(&buf, &blank);
+
+    unsigned int crc = crc32c(0, bytes, buf.count / BITS_PER_BYTE);
+    crc = crc32c(crc, payload, bits / BITS_PER_BYTE);
+    if(bits % BITS_PER_BYTE) {
+        unsigned char last = payload[bits / BITS_PER_BYTE] &
+                             (0xff << (BITS_PER_BYTE - bits % BITS_PER_BYTE));
+        crc = crc32c(crc, &last, 1);
+    }
+    return crc;
+}
+
+/* Compresses message into ctx->packed, encrypting it if the context
+ * has a passphrase, and fills in the header fields describing it. The
+ * CRC is left to the caller, see buildPayload().
+ *
+ * Input:
+ *  - stegctx_t *ctx: Pointer to the context.
+ *  - char *message: Pointer to char (string) message.
+ *  - payloadheader_t *header: Receives the header.
+ * Output:
+ *  - STATUS_OK, or ERROR_EMPTY, ERROR_TOO_LARGE or ERROR_MEMORY.
+ */
+static int packMessage(stegctx_t *ctx, char *message, payloadheader_t *header) {
+    /* Checks for empty string. */
+    size_t message_len = strlen(message);
+    if(message_len == 0) return ERROR_EMPTY;
+    if(message_len > HEADER_LENGTH_MAX) return ERROR_TOO_LARGE;
+
+    int status = compressPayload(ctx, (const unsigned char *)message, message_len);
+    if(status != STATUS_OK) return status;
+    if(ctx->packed.count > HEADER_LENGTH_MAX) return ERROR_TOO_LARGE;
+
+    header->version = HEADER_VERSION;
+    header->codec = ctx->codec_used;
+    header->flags = (ctx->scattered ? HEADER_SCATTERED : 0) |
+                    (ctx->encrypted ? HEADER_CHACHA20 | HEADER_AUTHENTICATED : 0);
+    if(ctx->matrix_k >= MATRIX_MIN_K) {
+        int k = ctx->matrix_k < MATRIX_MAX_K ? ctx->matrix_k : MATRIX_MAX_K;
+        header->flags |= k << HEADER_MATRIX_SHIFT;
+    }
+    header->message_length = message_len;
+    header->payload_bits = ctx->packed.count;
+    header->shard_id = 0;
+    header->shard_index = 0;
+    header->shard_count = 1;
+
+    /* Encrypted in place, the packed bits aren't needed in the clear. */
+    if(ctx->encrypted) {
+        makeNonce(header->nonce);
+        chachaXor(payloadKey(&ctx->passkey, header), header->nonce, ctx->packed.data,
+                  (ctx->packed.count + BITS_PER_BYTE - 1) / BITS_PER_BYTE);
+        payloadTag(&ctx->passkey, header, ctx->packed.data, header->tag);
+    }
+    ctx->payload_bits = ctx->packed.count;
+    ctx->message_length = message_len;
+    return STATUS_OK;
+}
+
+/* Lays out a header followed by its payload bits as one packed
+ * bitstream, growing *bits to fit.
+ *
+ * Input:
+ *  - const payloadheader_t *header: The header, naming payload_bits.
+ *  - const unsigned char *payload: The payload bits.
+ *  - unsigned char **bits: Pointer to the stream buffer pointer.
+ *  - size_t *capacity: Capacity of *bits in bytes.
+ *  - size_t *bit_count: Receives the length of the stream in bits.
+ * Output:
+ *  - STATUS_OK, or ERROR_MEMORY.
+ */
+static int layoutPayload(const payloadheader_t *header, const unsigned char *payload,
+                         unsigned char **bits, size_t *capacity, size_t *bit_count) {
+    bitbuf_t stream;
+    size_t header_bits = headerBits(header->version, header->flags);
+
+    *bit_count = header_bits + header->payload_bits;
+    size_t bytes = (*bit_count + BITS_PER_BYTE - 1) / BITS_PER_BYTE;
+    if(growBuffer((void **)bits, capacity, bytes) != STATUS_OK) return ERROR_MEMORY;
+    memset(*bits, 0, bytes);
+
+    /* The header is a whole number of bytes, so the payload is copied
+       in behind it. */
+    stream.data = *bits;
+    stream.capacity = bytes;
+    stream.count = 0;
+    stream.limit = header_bits;
+    stream.overflow = 0;
+    putHeader(&stream, header);
+    memcpy(*bits + header_bits / BITS_PER_BYTE, payload,
+           (header->payload_bits + BITS_PER_BYTE - 1) / BITS_PER_BYTE);
+    return STATUS_OK;
+}
+
+/* Compresses the message and lays out everything that goes into the
+ * image as one packed bitstream in ctx->bits:
+ *  - 16 bits: magic, 'S' 'G'.
+ *  - 8 bits: format version, HEADER_VERSION.
+ *  - 8 bits: codec id.
+ *  - 8 bits: flags, HEADER_SCATTERED if written in keyed order,
+ *    HEADER_CHACHA20 if the payload is encrypted, HEADER_SHARDED if
+ *    it's one piece of a payload split over several images,
+ *    HEADER_AUTHENTICATED if a tag follows the nonce (set with
+ *    HEADER_CHACHA20 by every encrypting encoder, and refused
+ *    without it), and the matrix embedding code size in the top
+ *    nibble.
+ *  - 32 bits: message length in bytes.
+ *  - 32 bits: payload bits that follow.
+ *  - 32 bits: CRC32C of the header (this field as zero) and the
+ *    payload bits as embedded, so decoders reject damaged or foreign
+ *    data before expanding it.
+ *  - 64 bits: payload id, shard index and shard count, only with
+ *    HEADER_SHARDED, see encodeSharded().
+ *  - 96 bits: ChaCha20 nonce, only with HEADER_CHACHA20. It also
+ *    salts the passphrase's key derivation.
+ *  - 64 bits: tag, only with HEADER_AUTHENTICATED: truncated
+ *    HMAC-SHA256 of the encrypted payload and the version, codec,
+ *    flags, lengths and nonce, see payloadTag(). Decoders check it
+ *    before decrypting, so a wrong passphrase or tampering is caught.
+ *  - payload bits: the message as coded by the codec, then encrypted
+ *    if the context has a passphrase. With matrix embedding these are
+ *    carried as syndromes of the channel bytes after the header, see
+ *    matrixEncode(), the header itself is always one bit per byte.
+ * The third byte of the old format is the frequency of '\0', always 0,
+ * so the version byte tells the two apart. Version 1 headers are the
+ * same without the CRC. The stream only depends on
+ * the message (and a fresh nonce), so it can be built once and applied
+ * to any number of images with applyPayload().
+ *
+ * Input:
+ *  - stegctx_t *ctx: Pointer to the context receiving the bitstream.
+ *  - char *message: Pointer to char (string) message.
+ * Output:
+ *  - STATUS_OK, or ERROR_EMPTY, ERROR_TOO_LARGE or ERROR_MEMORY.
+ */
+int buildPayload(stegctx_t *ctx, char *message) {
+    payloadheader_t header;
+
+    int status = packMessage(ctx, message, &header);
+    if(status != STATUS_OK) return status;
+    header.crc = payloadCrc(&header, ctx->packed.data, ctx->packed.count);
+    return layoutPayload(&header, ctx->packed.data, &ctx->bits, &ctx->bits_capacity,
+                         &ctx->bit_count);
+}
+
+/* Embedding order. Without a key, payload bit i goes into channel byte
+ * i. With one, the channel bytes are split into SCATTER_BLOCK byte
+ * blocks (a cache line's worth) and whole blocks are shuffled by a
+ * keyed Feistel permutation, with the bits inside a block XOR-shuffled
+ * by a per-block mask. Each block is still read or written
+ * sequentially, so scattering costs one cache miss per block rather
+ * than one per bit. */
+typedef struct {
+    int keyed;
+    size_t bits;
+    size_t blocks;
+    int half_bits;
+    unsigned long long round_keys[SCATTER_ROUNDS];
+} scatter_t;
+
+static unsigned long long roundFunction(unsigned long long value, unsigned long long key) {
+    unsigned long long state = value ^ key;
+    return splitMix(&state);
+}
+
+/* Sets up the order for an image with channel_bytes channel bytes. */
+static void initScatter(scatter_t *order, const stegctx_t *ctx, size_t channel_bytes) {
+    unsigned long long state = ctx->scatter_key;
+    int i;
+
+    order->keyed = ctx->scattered;
+    order->bits = channel_bytes;
+    if(!order->keyed) return;
+
+    order->blocks = channel_bytes / SCATTER_BLOCK;
+    order->bits = order->blocks * SCATTER_BLOCK;
+    order->half_bits = 1;
+    while(order->blocks > (size_t)1 << (2 * order->half_bits)) order->half_bits++;
+    for(i = 0; i < SCATTER_ROUNDS; i++) order->round_keys[i] = splitMix(&state);
+}
+
+/* Maps a logical block to its place in the image. The Feistel network
+ * permutes [0, 4^half_bits), and values past the last block are walked
+ * through it again until they land on one. */
+static size_t scatterBlock(const scatter_t *order, size_t block) {
+    unsigned long long mask = (1ULL << order->half_bits) - 1;
+    unsigned long long value = block;
+    int i;
+
+    do {
+        unsigned long long left = value >> order->half_bits, right = value & mask;
+        for(i = 0; i < SCATTER_ROUNDS; i++) {
+            unsigned long long next = left ^ (roundFunction(right, order->round_keys[i]) & mask);
+            left = right;
+            right = next;
+        }
+        value = (left << order->half_bits) | right;
+    } while(value >= order->blocks);
+    return (size_t)value;
+}
+
+/* XOR mask shuffling the bits within a logical block. */
+static size_t blockMask(const scatter_t *order, size_t block) {
+    if(!order->keyed) return 0;
+    return (size_t)roundFunction(block, order->round_keys[0]) & (SCATTER_BLOCK - 1);
+}
+
+/* First channel byte and XOR mask of the block holding bit. */
+static size_t blockStart(const scatter_t *order, size_t bit, size_t *offset_mask) {
+    size_t block = bit / SCATTER_BLOCK;
+    *offset_mask = blockMask(order, block);
+    if(!order->keyed) return block * SCATTER_BLOCK;
+    return scatterBlock(order, block) * SCATTER_BLOCK;
+}
+
+/* Writes count packed bits into the LSBs of the channel bytes the order
+ * assigns to bits [start, start + count), returning how many of those
+ * bytes changed. */
+static size_t scatterBits(image_t *pic, const scatter_t *order, size_t start, size_t count,
+                          const unsigned char *bits) {
+    unsigned char *channels = (unsigned char *)pic->rgb;
+    size_t i = 0, changed = 0;
+
+    while(i < count) {
+        size_t mask, bit = start + i;
+        size_t base = blockStart(order, bit, &mask);
+        size_t offset = bit % SCATTER_BLOCK;
+        for(; offset < SCATTER_BLOCK && i < count; offset++, i++) {
+            unsigned char *channel = channels + base + (offset ^ mask);
+            unsigned char value = (unsigned char)((*channel & ~1) | takeBit(bits, i));
+            changed += value != *channel;
+            *channel = value;
+        }
+    }
+    return changed;
+}
+
+/* Reads count LSBs in the order's positions into packed bits. */
+static void gatherBits(image_t *pic, const scatter_t *order, size_t start, size_t count,
+                       unsigned char *bits) {
+    const unsigned char *channels = (const unsigned char *)pic->rgb;
+    size_t i = 0;
+
+    memset(bits, 0, (count + BITS_PER_BYTE - 1) / BITS_PER_BYTE);
+    while(i < count) {
+        size_t mask, bit = start + i;
+        size_t base = blockStart(order, bit, &mask);
+        size_t offset = bit % SCATTER_BLOCK;
+        for(; offset < SCATTER_BLOCK && i < count; offset++, i++) {
+            putBit(bits, i, channels[base + (offset ^ mask)] & 1);
+        }
+    }
+}
+
+/* Matrix embedding over blocks Hamming blocks of cover LSBs, each of
+ * n = 2^k - 1 bits. A block's syndrome is the XOR of the (1 based)
+ * positions of its set bits; flipping the bit at position syndrome ^
+ * message makes the syndrome equal the k message bits, so at most one
+ * bit per block changes. The message is payload bits [first, first +
+ * blocks * k), those from count on taken as zero. */
+static void matrixEncode(unsigned char *cover, size_t blocks, int k,
+                         const unsigned char *payload, size_t first, size_t count) {
+    size_t n = ((size_t)1 << k) - 1, block, i;
+    int j;
+
+    for(block = 0; block < blocks; block++) {
+        size_t base = block * n, syndrome = 0;
+        for(i = 0; i < n; i++) {
+            if(takeBit(cover, base + i)) syndrome ^= i + 1;
+        }
+        for(j = 0; j < k; j++, first++) {
+            syndrome ^= (size_t)(first < count && takeBit(payload, first)) << (k - 1 - j);
+        }
+        if(syndrome) {
+            size_t flip = base + syndrome - 1;
+            cover[flip / BITS_PER_BYTE] ^= 0x80 >> (flip % BITS_PER_BYTE);
+        }
+    }
+}
+
+/* Reverses matrixEncode(), writing the syndromes of blocks cover blocks
+ * into payload bits [first, count), which must be zeroed. */
+static void matrixDecode(const unsigned char *cover, size_t blocks, int k,
+                         unsigned char *payload, size_t first, size_t count) {
+    size_t n = ((size_t)1 << k) - 1, block, i;
+    int j;
+
+    for(block = 0; block < blocks; block++) {
+        size_t base = block * n, syndrome = 0;
+        for(i = 0; i < n; i++) {
+            if(takeBit(cover, base + i)) syndrome ^= i + 1;
+        }
+        for(j = 0; j < k && first < count; j++, first++) {
+            putBit(payload, first, (int)(syndrome >> (k - 1 - j)) & 1);
+        }
+    }
+}
+
+/* Matrix embeds count payload bits with code size k into the channel
+ * bytes from slot on in the order, MATRIX_CHUNK_BITS bytes' worth of
+ * blocks at a time, returning how many bytes changed. */
+static size_t scatterMatrix(image_t *pic, const scatter_t *order, size_t slot, int k,
+                            const unsigned char *payload, size_t count) {
+    unsigned char cover[MATRIX_CHUNK_BITS / BITS_PER_BYTE];
+    size_t n = ((size_t)1 << k) - 1, run_blocks = MATRIX_CHUNK_BITS / n;
+    size_t blocks = (count + k - 1) / k, done = 0, changed = 0;
+
+    while(done < blocks) {
+        size_t run = blocks - done < run_blocks ? blocks - done : run_blocks;
+        gatherBits(pic, order, slot + done * n, run * n, cover);
+        matrixEncode(cover, run, k, payload, done * k, count);
+        changed += scatterBits(pic, order, slot + done * n, run * n, cover);
+        done += run;
+    }
+    return changed;
+}
+
+/* Reverses scatterMatrix() into payload, which must be zeroed. */
+static void gatherMatrix(image_t *pic, const scatter_t *order, size_t slot, int k,
+                         unsigned char *payload, size_t count) {
+    unsigned char cover[MATRIX_CHUNK_BITS / BITS_PER_BYTE];
+    size_t n = ((size_t)1 << k) - 1, run_blocks = MATRIX_CHUNK_BITS / n;
+    size_t blocks = (count + k - 1) / k, done = 0;
+
+    while(done < blocks) {
+        size_t run = blocks - done < run_blocks ? blocks - done : run_blocks;
+        gatherBits(pic, order, slot + done * n, run * n, cover);
+        matrixDecode(cover, run, k, payload, done * k, count);
+        done += run;
+    }
+}
+
+/* Derives the scatter key from a passphrase, or turns scattering off.
+ * The same key is needed to decode.
+ *
+ * Input:
+ *  - stegctx_t *ctx: Pointer to the context.
+ *  - const char *key: Passphrase, or NULL for the plain order.
+ * Output:
+ *  - Function of type void.
+ */
+void setScatterKey(stegctx_t *ctx, const char *key) {
+    /* FNV-1a, then mixed so similar keys give unrelated orders. */
+    unsigned long long hash = 0xcbf29ce484222325ULL;
+    ctx->scattered = key != NULL;
+    if(!key) return;
+    for(; *key; key++) hash = (hash ^ (unsigned char)*key) * 0x100000001b3ULL;
+    ctx->scatter_key = splitMix(&hash);
+}
+
+/* Writes a bitstream from layoutPayload(), count bits long, into an
+ * image in the context's order, matrix embedding the payload if its
+ * header says so. changed, if not NULL, receives how many channel
+ * bytes changed. */
+static int applyBits(const stegctx_t *ctx, image_t *pic, const unsigned char *bits,
+                     size_t count, size_t *changed) {
+    scatter_t order;
+    size_t header_bits = headerBits(bits[2], bits[4]), flipped;
+    int k = matrixK(bits[4]);
+
+    initScatter(&order, ctx, (size_t)pic->width * pic->height * RGB_PER_PIXEL);
+    if(embeddedBits(bits, count) > order.bits) return ERROR_TOO_SMALL;
+
+    if(k == 0) {
+        flipped = scatterBits(pic, &order, 0, count, bits);
+    } else {
+        flipped = scatterBits(pic, &order, 0, header_bits, bits);
+        flipped += scatterMatrix(pic, &order, header_bits, k, bits + header_bits / BITS_PER_BYTE,
+                                 count - header_bits);
+    }
+    if(changed) *changed = flipped;
+    return STATUS_OK;
+}
+
+/* Writes the bitstream from buildPayload() into the LSBs of an image,
+ * in the order given by the context's scatter key. The context is only
+ * read, so several threads may apply the same payload to different
+ * images.
+ *
+ * Input:
+ *  - const stegctx_t *ctx: Pointer to the context holding the bitstream.
+ *  - image_t *pic: Pointer to struct pic, the cover image.
+ * Output:
+ *  - STATUS_OK, or ERROR_TOO_SMALL if the image can't hold it.
+ */
+int applyPayload(const stegctx_t *ctx, image_t *pic) {
+    return applyBits(ctx, pic, ctx->bits, ctx->bit_count, NULL);
+}
+
+/* applyPayload() into ctx->pic, recording the bytes changed. */
+static int embedPayload(stegctx_t *ctx) {
+    return applyBits(ctx, &ctx->pic, ctx->bits, ctx->bit_count, &ctx->changed_bytes);
+}
+
+/* Reads a number stored MSB first in count LSBs starting at start. */
+static unsigned long readLSBNumber(image_t *pic, size_t start, int count) {
+    unsigned long value = 0;
+    int i, bit;
+    for(i = 0; i < count; i++) {
+        getLSBPixel(pic, start + i, &bit);
+        value = (value << 1) | bit;
+    }
+    return value;
+}
+
+/* Checks the first HEADER_BITS bits of a payload, gathered in the
+ * given order, and fills in header from them. The shard fields and
+ * nonce aren't read, see parseShard(). */
+static int parseHeader(const unsigned char bytes[], const scatter_t *order,
+                       payloadheader_t *header) {
+    bitreader_t in;
+
+    header->shard_id = 0;
+    header->shard_index = 0;
+    header->shard_count = 1;
+    if(bytes[2] == 0 && !order->keyed) {
+        /* Old format: total bits and message length, then the table. */
+        if(order->bits < TREE_BITS || bytes[0] == 0) return ERROR_CORRUPT;
+        if(TREE_BITS + (size_t)bytes[0] > order->bits) return ERROR_CORRUPT;
+        header->version = 0;
+        header->codec = CODEC_LEGACY;
+        header->flags = 0;
+        header->message_length = bytes[1];
+        header->payload_bits = bytes[0];
+        return STATUS_OK;
+    }
+
+    in.data = bytes;
+    in.count = HEADER_BITS;
+    in.pos = BITS_PER_BYTE * 3;
+    in.overflow = 0;
+    if(bytes[0] != HEADER_MAGIC_0 || bytes[1] != HEADER_MAGIC_1 ||
+       (bytes[2] != HEADER_VERSION && bytes[2] != HEADER_VERSION_NO_CRC)) {
+        return ERROR_CORRUPT;
+    }
+    header->version = bytes[2];
+    header->codec = (int)getBits(&in, BITS_PER_BYTE);
+    header->flags = (int)getBits(&in, BITS_PER_BYTE);
+    header->message_length = (unsigned long)getBits(&in, HEADER_LENGTH_BITS);
+    header->payload_bits = (unsigned long)getBits(&in, HEADER_LENGTH_BITS);
+    header->crc = 0;
+    if(header->version != HEADER_VERSION_NO_CRC) {
+        header->crc = (unsigned long)getBits(&in, HEADER_CRC_BITS);
+    }
+
+    /* No codec gets anywhere near MAX_EXPANSION bytes per bit, so a
+       larger length is noise rather than a reason to allocate. A
+       shard only holds part of the payload, so its length is checked
+       once the shards are put back together. */
+    size_t header_bits = headerBits(header->version, header->flags);
+    int k = matrixK(header->flags);
+    if(header->codec >= CODEC_COUNT || (header->flags & ~HEADER_KNOWN_FLAGS) ||
+       ((header->flags & HEADER_AUTHENTICATED) && !(header->flags & HEADER_CHACHA20)) ||
+       (k != 0 && (k < MATRIX_MIN_K || k > MATRIX_MAX_K)) ||
+       !(header->flags & HEADER_SCATTERED) != !order->keyed ||
+       header->message_length == 0 || header_bits > order->bits ||
+       payloadSlots(header->flags, header->payload_bits) > order->bits - header_bits ||
+       (!(header->flags & HEADER_SHARDED) &&
+        header->message_length / MAX_EXPANSION > header->payload_bits)) {
+        return ERROR_CORRUPT;
+    }
+    return STATUS_OK;
+}
+
+/* Fills in and checks the shard fields of a header from their
+ * HEADER_SHARD_BITS bits. */
+static int parseShard(const unsigned char bytes[], payloadheader_t *header) {
+    bitreader_t in;
+
+    in.data = bytes;
+    in.count = HEADER_SHARD_BITS;
+    in.pos = 0;
+    in.overflow = 0;
+    header->shard_id = (unsigned long)getBits(&in, HEADER_SHARD_ID_BITS);
+    header->shard_index = (int)getBits(&in, HEADER_SHARD_INDEX_BITS);
+    header->shard_count = (int)getBits(&in, HEADER_SHARD_INDEX_BITS);
+    return header->shard_count > 0 && header->shard_index < header->shard_count ?
+           STATUS_OK : ERROR_CORRUPT;
+}
+
+/* Reads the payload header in the given order, see readPayloadHeader(). */
+static int readHeader(image_t *pic, const scatter_t *order, payloadheader_t *header) {
+    unsigned char bytes[HEADER_BITS / BITS_PER_BYTE];
+
+    if(order->bits < HEADER_BITS) return ERROR_CORRUPT;
+    gatherBits(pic, order, 0, HEADER_BITS, bytes);
+    int status = parseHeader(bytes, order, header);
+    if(status == STATUS_OK && (header->flags & HEADER_SHARDED)) {
+        gatherBits(pic, order, headerBits(header->version, 0), HEADER_SHARD_BITS, bytes);
+        status = parseShard(bytes, header);
+    }
+    if(status == STATUS_OK && (header->flags & HEADER_CHACHA20)) {
+        gatherBits(pic, order, nonceOffset(header->version, header->flags),
+                   HEADER_NONCE_BITS, header->nonce);
+    }
+    if(status == STATUS_OK && (header->flags & HEADER_AUTHENTICATED)) {
+        gatherBits(pic, order, nonceOffset(header->version, header->flags) + HEADER_NONCE_BITS,
+                   HEADER_TAG_BITS, header->tag);
+    }
+    return status;
+}
+
+/* Reads and checks the payload header from the LSBs of an image,
+ * without touching the payload. Images in the old format report
+ * version 0 and CODEC_LEGACY. Scattered payloads need their key, so
+ * they are reported as missing.
+ *
+ * Input:
+ *  - image_t *pic: Pointer to struct pic, the encoded image.
+ *  - payloadheader_t *header: Receives the header.
+ * Output:
+ *  - STATUS_OK, or ERROR_CORRUPT if no valid header is present.
+ */
+int readPayloadHeader(image_t *pic, payloadheader_t *header) {
+    scatter_t order;
+    order.keyed = 0;
+    order.bits = (size_t)pic->width * pic->height * RGB_PER_PIXEL;
+    return readHeader(pic, &order, header);
+}
+
+/* Decodes an image in the old format: the frequency table is read from
+ * the LSBs, the Huffman tree rebuilt in the node pool and walked bit by
+ * bit straight from the image into ctx->message. */
+static int extractLegacy(stegctx_t *ctx, image_t *pic, const payloadheader_t *header) {
+    int i;
+    int freqTable[MAX_MESSAGE_SIZE];
+    int total_bits = (int)header->payload_bits;
+    int message_len = (int)header->message_length;
+
+    for(i = 0; i < MAX_MESSAGE_SIZE; i++) {
+        freqTable[i] = (int)readLSBNumber(pic, BITS_PER_BYTE * 2 + i * BITS_PER_BYTE, BITS_PER_BYTE);
+    }
+
+    if(growBuffer((void **)&ctx->message, &ctx->message_capacity, message_len + 1) != STATUS_OK) {
+        return ERROR_MEMORY;
+    }
+    ctx->message[0] = '\0';
+    ctx->bit_count = TREE_BITS + total_bits;
+    ctx->payload_bits = total_bits;
+    ctx->message_length = message_len;
+    ctx->codec_used = CODEC_LEGACY;
+    if(message_len == 0) return STATUS_OK;
+
+    huffmanNode_t *root = buildPooledTree(ctx->nodes, freqTable);
+    if(!root) return ERROR_CORRUPT;
+
+    /* Handles single-node tree case. */
+    int decodedCount = 0;
+    if(!root->left && !root->right) {
+        for(decodedCount = 0; decodedCount < message_len; decodedCount++) {
+            ctx->message[decodedCount] = root->ch;
+        }
+    } else {
+        huffmanNode_t *currentNode = root;
+        for(i = 0; i < total_bits && decodedCount < message_len; i++) {
+            int bit;
+            getLSBPixel(pic, TREE_BITS + i, &bit);
+            currentNode = bit ? currentNode->right : currentNode->left;
+            if(!currentNode) return ERROR_CORRUPT;
+
+            if(!currentNode->left && !currentNode->right) {
+                ctx->message[decodedCount++] = currentNode->ch;
+                currentNode = root;
+            }
+        }
+    }
+
+    /* Verifies that the number of decoded characters matches message length. */
+    if(decodedCount != message_len) return ERROR_CORRUPT;
+    ctx->message[decodedCount] = '\0';
+    return STATUS_OK;
+}
+
+/* Decrypts and expands payload bits gathered into ctx->packed into
+ * ctx->message, with the codec the header names. */
+static int expandPacked(stegctx_t *ctx, const payloadheader_t *header) {
+    bitreader_t in;
+
+    /* A tag that doesn't match after the CRC did means the payload was
+       encrypted with another passphrase. */
+    if(header->flags & HEADER_AUTHENTICATED) {
+        int status = checkTag(&ctx->passkey, header, ctx->packed.data);
+        if(status != STATUS_OK) return status;
+    }
+    if(header->flags & HEADER_CHACHA20) {
+        chachaXor(payloadKey(&ctx->passkey, header), header->nonce, ctx->packed.data,
+                  (header->payload_bits + BITS_PER_BYTE - 1) / BITS_PER_BYTE);
+    }
+
+    if(growBuffer((void **)&ctx->message, &ctx->message_capacity,
+                  header->message_length + 1) != STATUS_OK) {
+        return ERROR_MEMORY;
+    }
+    ctx->bit_count = headerBits(header->version, header->flags) + header->payload_bits;
+    ctx->payload_bits = header->payload_bits;
+    ctx->message_length = header->message_length;
+    ctx->codec_used = header->codec;
+
+    in.data = ctx->packed.data;
+    in.count = ctx->packed.count;
+    in.pos = 0;
+    in.overflow = 0;
+    int status = codecs[header->codec].expand(ctx, &in, (unsigned char *)ctx->message,
+                                              header->message_length);
+    ctx->message[status == STATUS_OK ? header->message_length : 0] = '\0';
+    return status;
+}
+
+/* Checks the CRC of payload bits gathered into ctx->packed, then
+ * expands them, see expandPacked(). */
+static int expandPayload(stegctx_t *ctx, const payloadheader_t *header) {
+    /* Checked before decryption or the codec see anything. */
+    if(header->version != HEADER_VERSION_NO_CRC &&
+       payloadCrc(header, ctx->packed.data, header->payload_bits) != header->crc) {
+        return ERROR_CORRUPT;
+    }
+    return expandPacked(ctx, header);
+}
+
+/* Reads the header of an image, trying the plain order too when the
+ * context has a key, and gathers its payload bits into ctx->packed.
+ * Images in the old format only have their header read. */
+static int gatherPayload(stegctx_t *ctx, image_t *pic, payloadheader_t *header) {
+    scatter_t order;
+
+    /* With a key, images written without one still decode. */
+    initScatter(&order, ctx, (size_t)pic->width * pic->height * RGB_PER_PIXEL);
+    int status = readHeader(pic, &order, header);
+    if(status != STATUS_OK && order.keyed) {
+        order.keyed = 0;
+        order.bits = (size_t)pic->width * pic->height * RGB_PER_PIXEL;
+        status = readHeader(pic, &order, header);
+    }
+    if(status != STATUS_OK || header->version == 0) return status;
+
+    if((header->flags & HEADER_CHACHA20) && !ctx->encrypted) return ERROR_PASSPHRASE;
+
+    status = reserveBits(&ctx->packed, header->payload_bits);
+    if(status != STATUS_OK) return status;
+    if(matrixK(header->flags)) {
+        gatherMatrix(pic, &order, headerBits(header->version, header->flags),
+                     matrixK(header->flags), ctx->packed.data, header->payload_bits);
+    } else {
+        gatherBits(pic, &order, headerBits(header->version, header->flags), header->payload_bits,
+                   ctx->packed.data);
+    }
+    ctx->packed.count = header->payload_bits;
+    return STATUS_OK;
+}
+
+/* Reverses buildPayload()/applyPayload(): reads the header from the
+ * LSBs, gathers the payload bits and expands them with the codec the
+ * header names into ctx->message. Images written before codecs were
+ * added decode as well.
+ *
+ * Input:
+ *  - stegctx_t *ctx: Pointer to the context receiving the message.
+ *  - image_t *pic: Pointer to struct pic, the encoded image.
+ * Output:
+ *  - STATUS_OK, or ERROR_CORRUPT or ERROR_MEMORY on failure.
+ */
+int extractPayload(stegctx_t *ctx, image_t *pic) {
+    payloadheader_t header;
+
+    int status = gatherPayload(ctx, pic, &header);
+    if(status != STATUS_OK) return status;
+    if(header.version == 0) return extractLegacy(ctx, pic, &header);
+    if(header.flags & HEADER_SHARDED) return ERROR_SHARDED;
+    return expandPayload(ctx, &header);
+}
+
+/* Tells whether an open image's pixels exceed ctx->memory_limit. */
+static int needsTiles(const stegctx_t *ctx, const imagefile_t *file) {
+    return ctx->memory_limit != 0 &&
+           (unsigned long long)file->ih.biWidth * file->ih.biHeight * sizeof(rgb_t) > ctx->memory_limit;
+}
+
+/* Banded versions, see encodeTiled() and decodeTiled(). */
+static int encodeTiles(stegctx_t *ctx, const imagefile_t *file, char *outfile, char *message);
+static int decodeTiles(stegctx_t *ctx, const imagefile_t *file, const char **outstring);
+
+/* Encodes a message into an image file using the context's buffers.
+ * Once the buffers have grown to fit, repeated calls allocate nothing.
+ *
+ * Input:
+ *  - stegctx_t *ctx: Pointer to the context.
+ *  - char *infile: Pointer to char infile, the cover image to read.
+ *  - char *outfile: Pointer to char outfile, the image to write.
+ *  - char *message: Pointer to char (string) message.
+ * Output:
+ *  - STATUS_OK, or the status of the step that failed.
+ */
+int encodeContext(stegctx_t *ctx, char *infile, char *outfile, char *message) {
+    imagefile_t file;
+    resetAllocStats();
+
+    int status = openImage(infile, &file);
+    if(status == STATUS_OK && needsTiles(ctx, &file)) {
+        status = encodeTiles(ctx, &file, outfile, message);
+        closeImage(&file);
+        return status;
+    }
+    if(status == STATUS_OK) {
+        status = loadImage(&file, &ctx->pic, &ctx->header_capacity, &ctx->rgb_capacity,
+                           &ctx->output, &ctx->output_capacity);
+    }
+    closeImage(&file);
+    if(status == STATUS_OK) status = buildPayload(ctx, message);
+    if(status == STATUS_OK) status = embedPayload(ctx);
+    if(status == STATUS_OK) {
+        status = writeImageFile(&ctx->pic, outfile, &ctx->output, &ctx->output_capacity);
+    }
+    return status;
+}
+
+/* Decodes the message in an image file using the context's buffers.
+ *
+ * Input:
+ *  - stegctx_t *ctx: Pointer to the context.
+ *  - char *infile: Pointer to char infile, the encoded image to read.
+ *  - const char **outstring: Receives the message, owned by the context
+ *                            and valid until its next call.
+ * Output:
+ *  - STATUS_OK, or the status of the step that failed.
+ */
+int decodeContext(stegctx_t *ctx, char *infile, const char **outstring) {
+    imagefile_t file;
+    resetAllocStats();
+
+    int status = openImage(infile, &file);
+    if(status == STATUS_OK && needsTiles(ctx, &file)) {
+        status = decodeTiles(ctx, &file, outstring);
+        closeImage(&file);
+        return status;
+    }
+    if(status == STATUS_OK) {
+        status = loadImage(&file, &ctx->pic, &ctx->header_capacity, &ctx->rgb_capacity,
+                           &ctx->output, &ctx->output_capacity);
+    }
+    closeImage(&file);
+    if(status == STATUS_OK) status = extractPayload(ctx, &ctx->pic);
+    if(status == STATUS_OK) *outstring = ctx->message;
+    return status;
+}
+
+/* Reads all of msgfd into ctx->message, for encodes that need the
+ * whole message before embedding.
+ *
+ * Input:
+ *  - stegctx_t *ctx: Pointer to the context, its message is replaced.
+ *  - int msgfd: Descriptor to read until end of file.
+ * Output:
+ *  - STATUS_OK, ERROR_OPEN if msgfd can't be read, or ERROR_MEMORY.
+ */
+int readMessageFd(stegctx_t *ctx, int msgfd) {
+    size_t length = 0;
+
+    for(;;) {
+        /* growBuffer() drops the contents, so this copies them over. */
+        if(!ctx->message || ctx->message_capacity < length + STREAM_CHUNK + 1) {
+            size_t capacity = 2 * (length + STREAM_CHUNK + 1);
+            char *grown = stegAlloc(capacity);
+            if(!grown) return ERROR_MEMORY;
+            if(length) memcpy(grown, ctx->message, length);
+            stegFree(ctx->message);
+            ctx->message = grown;
+            ctx->message_capacity = capacity;
+        }
+        ssize_t got = read(msgfd, ctx->message + length, STREAM_CHUNK);
+        if(got < 0 && errno == EINTR) continue;
+        if(got < 0) return ERROR_OPEN;
+        if(got == 0) break;
+        length += (size_t)got;
+    }
+    ctx->message[length] = '\0';
+    return STATUS_OK;
+}
+
+/* Encrypts and embeds the coded payload bytes [*embedded, ready) from
+ * ctx->packed, after the header's bits. */
+static void embedCoded(stegctx_t *ctx, const scatter_t *order, const payloadheader_t *header,
+                       size_t *embedded, size_t ready) {
+    unsigned char *bytes = ctx->packed.data + *embedded;
+    if(ready <= *embedded) return;
+    if(ctx->encrypted) {
+        chachaXorAt(payloadKey(&ctx->passkey, header), header->nonce, bytes,
+                    ready - *embedded, *embedded);
+    }
+    ctx->changed_bytes += scatterBits(&ctx->pic, order,
+                                      headerBits(header->version, header->flags) +
+                                      *embedded * BITS_PER_BYTE,
+                                      (ready - *embedded) * BITS_PER_BYTE, bytes);
+    *embedded = ready;
+}
+
+/* Codes msgfd's bytes with the adaptive codec as they arrive, embedding
+ * each batch of finished payload bytes before reading more, then fills
+ * in and embeds the header. */
+static int streamMessage(stegctx_t *ctx, int msgfd, payloadheader_t *header) {
+    scatter_t order;
+    adaptive_t coder;
+    size_t length = 0, embedded = 0;
+    unsigned char buffer[MESSAGE_CHUNK];
+
+    header->version = HEADER_VERSION;
+    header->codec = CODEC_ADAPTIVE;
+    header->flags = (ctx->scattered ? HEADER_SCATTERED : 0) |
+                    (ctx->encrypted ? HEADER_CHACHA20 | HEADER_AUTHENTICATED : 0);
+    header->shard_id = 0;
+    header->shard_index = 0;
+    header->shard_count = 1;
+    if(ctx->encrypted) makeNonce(header->nonce);
+
+    size_t header_bits = headerBits(header->version, header->flags);
+    initScatter(&order, ctx, (size_t)ctx->pic.width * ctx->pic.height * RGB_PER_PIXEL);
+    if(header_bits > order.bits) return ERROR_TOO_SMALL;
+    size_t room = order.bits - header_bits;
+    if(room > HEADER_LENGTH_MAX) room = HEADER_LENGTH_MAX;
+    if(reserveBits(&ctx->packed, room) != STATUS_OK) return ERROR_MEMORY;
+
+    ctx->changed_bytes = 0;
+    adaptiveStart(&coder);
+    for(;;) {
+        ssize_t got = read(msgfd, buffer, sizeof(buffer));
+        if(got < 0 && errno == EINTR) continue;
+        if(got < 0) return ERROR_OPEN;
+        if(got == 0) break;
+
+        ssize_t i;
+        for(i = 0; i < got; i++) adaptiveEncode(&coder, buffer[i], &ctx->packed);
+        length += (size_t)got;
+        if(ctx->packed.overflow) return ERROR_TOO_SMALL;
+        if(length > HEADER_LENGTH_MAX) return ERROR_TOO_LARGE;
+
+        /* Encryption goes a keystream block at a time. */
+        size_t ready = ctx->packed.count / BITS_PER_BYTE;
+        if(ctx->encrypted) ready -= ready % CHACHA_BLOCK;
+        embedCoded(ctx, &order, header, &embedded, ready);
+    }
+    if(length == 0) return ERROR_EMPTY;
+    adaptiveFinish(&coder, &ctx->packed);
+    if(ctx->packed.overflow) return ERROR_TOO_SMALL;
+    embedCoded(ctx, &order, header, &embedded, ctx->packed.count / BITS_PER_BYTE);
+
+    /* The header goes in last, once the sizes, tag and CRC are known. */
+    unsigned char bytes[HEADER_MAX_BITS / BITS_PER_BYTE];
+    bitbuf_t buf;
+    header->message_length = length;
+    header->payload_bits = ctx->packed.count;
+    if(ctx->encrypted) payloadTag(&ctx->passkey, header, ctx->packed.data, header->tag);
+    header->crc = payloadCrc(header, ctx->packed.data, ctx->packed.count);
+    buf.data = bytes;
+    buf.capacity = sizeof(bytes);
+    buf.count = 0;
+    buf.limit = header_bits;
+    buf.overflow = 0;
+    memset(bytes, 0, sizeof(bytes));
+    putHeader(&buf, header);
+    ctx->changed_bytes += scatterBits(&ctx->pic, &order, 0, header_bits, bytes);
+
+    ctx->codec_used = CODEC_ADAPTIVE;
+    ctx->payload_bits = ctx->packed.count;
+    ctx->message_length = length;
+    ctx->bit_count = header_bits + ctx->packed.count;
+    return STATUS_OK;
+}
+
+/* Encodes a message read from a descriptor, such as a pipe or socket,
+ * into an image file. With the adaptive codec each byte is coded as it
+ * arrives and coded bytes are embedded as they're finished, so the
+ * message is never held whole and embedding overlaps its arrival. The
+ * header, which needs the final sizes and CRC, is embedded last.
+ * Matrix embedding and images over ctx->memory_limit need the whole
+ * payload first, so for those the message is read in full and passed
+ * to encodeContext() with the adaptive codec.
+ *
+ * Input:
+ *  - stegctx_t *ctx: Pointer to the context.
+ *  - char *infile: Pointer to char infile, the cover image to read.
+ *  - char *outfile: Pointer to char outfile, the image to write.
+ *  - int msgfd: Descriptor to read the message from until end of file.
+ * Output:
+ *  - STATUS_OK, ERROR_OPEN if msgfd can't be read, or the status of the
+ *    step that failed.
+ */
+int encodeMessageFd(stegctx_t *ctx, char *infile, char *outfile, int msgfd) {
+    imagefile_t file;
+    payloadheader_t header;
+    resetAllocStats();
+
+    int status = openImage(infile, &file);
+    if(status == STATUS_OK && (ctx->matrix_k || needsTiles(ctx, &file))) {
+        int codec = ctx->codec;
+        closeImage(&file);
+        status = readMessageFd(ctx, msgfd);
+        ctx->codec = CODEC_ADAPTIVE;
+        if(status == STATUS_OK) status = encodeContext(ctx, infile, outfile, ctx->message);
+        ctx->codec = codec;
+        return status;
+    }
+    if(status == STATUS_OK) {
+        status = loadImage(&file, &ctx->pic, &ctx->header_capacity, &ctx->rgb_capacity,
+                           &ctx->output, &ctx->output_capacity);
+    }
+    closeImage(&file);
+    if(status == STATUS_OK) status = streamMessage(ctx, msgfd, &header);
+    if(status == STATUS_OK) {
+        status = writeImageFile(&ctx->pic, outfile, &ctx->output, &ctx->output_capacity);
+    }
+    return status;
+}
+
+/* Buffer version of encodeContext(), no filesystem access.
+ *
+ * Input:
+ *  - stegctx_t *ctx: Pointer to the context.
+ *  - const unsigned char *bmp: The cover BMP file contents.
+ *  - size_t length: Number of bytes in bmp.
+ *  - char *message: Pointer to char (string) message.
+ *  - const unsigned char **out: Receives the encoded BMP, owned by the
+ *                               context and valid until its next call.
+ *  - size_t *out_length: Receives the size of the encoded BMP.
+ * Output:
+ *  - STATUS_OK, or the status of the step that failed.
+ */
+int encodeBufferContext(stegctx_t *ctx, const unsigned char *bmp, size_t length,
+                        char *message, const unsigned char **out, size_t *out_length) {
+    resetAllocStats();
+
+    int status = parseImageBuffer(bmp, length, &ctx->pic, &ctx->header_capacity,
+                                  &ctx->rgb_capacity);
+    if(status == STATUS_OK) status = buildPayload(ctx, message);
+    if(status == STATUS_OK) status = embedPayload(ctx);
+    if(status == STATUS_OK) {
+        status = serialiseImage(&ctx->pic, &ctx->output, &ctx->output_capacity,
+                                &ctx->output_length);
+    }
+    if(status == STATUS_OK) {
+        *out = ctx->output;
+        *out_length = ctx->output_length;
+    }
+    return status;
+}
+
+/* Buffer version of decodeContext(), no filesystem access.
+ *
+ * Input:
+ *  - stegctx_t *ctx: Pointer to the context.
+ *  - const unsigned char *bmp: The encoded BMP file contents.
+ *  - size_t length: Number of bytes in bmp.
+ *  - const char **outstring: Receives the message, owned by the context.
+ * Output:
+ *  - STATUS_OK, or the status of the step that failed.
+ */
+int decodeBufferContext(stegctx_t *ctx, const unsigned char *bmp, size_t length,
+                        const char **outstring) {
+    resetAllocStats();
+
+    int status = parseImageBuffer(bmp, length, &ctx->pic, &ctx->header_capacity,
+                                  &ctx->rgb_capacity);
+    if(status == STATUS_OK) status = extractPayload(ctx, &ctx->pic);
+    if(status == STATUS_OK) *outstring = ctx->message;
+    return status;
+}
+
+/***** Streams *****/
+/* Reads exactly length bytes, stopping early only at end of input.
+ *
+ * Input:
+ *  - int fd: Descriptor to read from.
+ *  - void *buffer: Destination.
+ *  - size_t length: Bytes wanted.
+ * Output:
+ *  - STATUS_OK, or ERROR_FORMAT if the input ended first, ERROR_OPEN
+ *    if reading failed.
+ */
+static int readFull(int fd, void *buffer, size_t length) {
+    unsigned char *bytes = buffer;
+    while(length > 0) {
+        ssize_t got = read(fd, bytes, length);
+        if(got < 0 && errno == EINTR) continue;
+        if(got < 0) return ERROR_OPEN;
+        if(got == 0) return ERROR_FORMAT;
+        bytes += got;
+        length -= got;
+    }
+    return STATUS_OK;
+}
+
+/* Writes exactly length bytes.
+ *
+ * Input:
+ *  - int fd: Descriptor to write to.
+ *  - const void *buffer: Source.
+ *  - size_t length: Bytes to write.
+ * Output:
+ *  - STATUS_OK, or ERROR_WRITE.
+ */
+static int writeFull(int fd, const void *buffer, size_t length) {
+    const unsigned char *bytes = buffer;
+    while(length > 0) {
+        ssize_t put = write(fd, bytes, length);
+        if(put < 0 && errno == EINTR) continue;
+        if(put <= 0) return ERROR_WRITE;
+        bytes += put;
+        length -= put;
+    }
+    return STATUS_OK;
+}
+
+/* Copies length bytes from infd to outfd. splice() moves the data
+ * without a trip through user space when either end is a pipe, and
+ * sendfile() covers a regular input file. Anything else falls back to
+ * read()/write() through the scratch buffer.
+ *
+ * Input:
+ *  - int infd, int outfd: Source and destination descriptors.
+ *  - size_t length: Bytes to copy.
+ *  - unsigned char *scratch: Buffer for the fallback path.
+ *  - size_t scratch_size: Size of scratch, at least one byte.
+ * Output:
+ *  - STATUS_OK, or ERROR_FORMAT, ERROR_OPEN or ERROR_WRITE.
+ */
+static int copyBytes(int infd, int outfd, size_t length, unsigned char *scratch,
+                     size_t scratch_size) {
+    int use_splice = 1, use_sendfile = 1;
+
+    while(length > 0) {
+        size_t chunk = length < STREAM_CHUNK ? length : STREAM_CHUNK;
+        ssize_t moved = -1;
+
+        if(use_splice) {
+            moved = splice(infd, NULL, outfd, NULL, chunk, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if(moved < 0 && errno != EINTR) use_splice = 0;
+        } else if(use_sendfile) {
+            moved = sendfile(outfd, infd, NULL, chunk);
+            if(moved < 0 && errno != EINTR) use_sendfile = 0;
+        } else {
+            if(chunk > scratch_size) chunk = scratch_size;
+            int status = readFull(infd, scratch, chunk);
+            if(status == STATUS_OK) status = writeFull(outfd, scratch, chunk);
+            if(status != STATUS_OK) return status;
+            moved = chunk;
+        }
+
+        if(moved == 0) return ERROR_FORMAT;
+        if(moved > 0) length -= moved;
+    }
+    return STATUS_OK;
+}
+
+/* Skips length bytes of input, seeking when the descriptor allows it.
+ *
+ * Input:
+ *  - int fd: Descriptor to skip forward in.
+ *  - size_t length: Bytes to skip.
+ *  - unsigned char *scratch: Buffer for discarded data.
+ *  - size_t scratch_size: Size of scratch.
+ * Output:
+ *  - STATUS_OK, or ERROR_FORMAT or ERROR_OPEN.
+ */
+static int skipBytes(int fd, size_t length, unsigned char *scratch, size_t scratch_size) {
+    if(lseek(fd, (off_t)length, SEEK_CUR) >= 0) return STATUS_OK;
+
+    while(length > 0) {
+        size_t chunk = length < scratch_size ? length : scratch_size;
+        int status = readFull(fd, scratch, chunk);
+        if(status != STATUS_OK) return status;
+        length -= chunk;
+    }
+    return STATUS_OK;
+}
+
+/* Reads and checks the BMP headers from a stream into ctx->pic, leaving
+ * the stream positioned at the first pixel row.
+ *
+ * Input:
+ *  - stegctx_t *ctx: Pointer to the context receiving the header.
+ *  - int infd: Descriptor to read from.
+ *  - size_t *stride: Receives the bytes per row including padding.
+ * Output:
+ *  - STATUS_OK, or ERROR_FORMAT, ERROR_OPEN or ERROR_MEMORY.
+ */
+static int readStreamHeader(stegctx_t *ctx, int infd, size_t *stride) {
+    unsigned char bytes[BMP_HEADERS_SIZE];
+    fileheader_t fh;
+    imageheader_t ih;
+
+    int status = readFull(infd, bytes, BMP_HEADERS_SIZE);
+    if(status != STATUS_OK) return status;
+    parseHeaders(bytes, &fh, &ih);
+    status = validateHeaders(&fh, &ih);
+    if(status != STATUS_OK) return status;
+
+    ctx->pic.width = ih.biWidth;
+    ctx->pic.height = ih.biHeight;
+    ctx->pic.offset = fh.bfOffBits;
+    if(growBuffer((void **)&ctx->pic.header, &ctx->header_capacity, fh.bfOffBits) != STATUS_OK) {
+        return ERROR_MEMORY;
+    }
+    memcpy(ctx->pic.header, bytes, BMP_HEADERS_SIZE);
+
+    *stride = (size_t)ih.biWidth * RGB_PER_PIXEL + calcPadding(ih.biWidth);
+    return readFull(infd, ctx->pic.header + BMP_HEADERS_SIZE, fh.bfOffBits - BMP_HEADERS_SIZE);
+}
+
+/* Loads the top rows of the image, which are the last rows in the
+ * file, from a block of raw rows into ctx->pic. ctx->pic.height is set
+ * to rows, so pic only describes those rows afterwards.
+ *
+ * Input:
+ *  - stegctx_t *ctx: Pointer to the context.
+ *  - int rows: Number of rows in ctx->output.
+ *  - size_t stride: Bytes per row including padding.
+ * Output:
+ *  - STATUS_OK, or ERROR_MEMORY.
+ */
+static int loadCarrierRows(stegctx_t *ctx, int rows, size_t stride) {
+    ctx->pic.height = rows;
+    if(growBuffer((void **)&ctx->pic.rgb, &ctx->rgb_capacity,
+                  (size_t)ctx->pic.width * rows * sizeof(rgb_t)) != STATUS_OK) {
+        return ERROR_MEMORY;
+    }
+    rowsToPixels(ctx->output, stride, &ctx->pic);
+    return STATUS_OK;
+}
+
+/* Encodes a message while streaming a BMP from infd to outfd. The
+ * payload sits in the top rows of the image, which are the last rows
+ * of the file, so every row before them is copied straight through
+ * (with splice() where possible) and only the carrier rows are held in
+ * memory. Memory use depends on the message, not on the image size,
+ * except with a scatter key, where every row is a carrier.
+ *
+ * Input:
+ *  - stegctx_t *ctx: Pointer to the context.
+ *  - int infd: Descriptor of the cover BMP, e.g. 0 for stdin.
+ *  - int outfd: Descriptor for the encoded BMP, e.g. 1 for stdout.
+ *  - char *message: Pointer to char (string) message.
+ * Output:
+ *  - STATUS_OK, or the status of the step that failed.
+ */
+int encodeStream(stegctx_t *ctx, int infd, int outfd, char *message) {
+    size_t stride;
+    resetAllocStats();
+
+    int status = readStreamHeader(ctx, infd, &stride);
+    if(status == STATUS_OK) status = buildPayload(ctx, message);
+    if(status != STATUS_OK) return status;
+
+    /* A scattered payload can land anywhere, so every row carries. */
+    size_t row_bits = (size_t)ctx->pic.width * RGB_PER_PIXEL;
+    size_t carrier_rows = (embeddedBits(ctx->bits, ctx->bit_count) + row_bits - 1) / row_bits;
+    if(carrier_rows > (size_t)ctx->pic.height) return ERROR_TOO_SMALL;
+    if(ctx->scattered) carrier_rows = ctx->pic.height;
+
+    /* The scratch buffer holds the carrier rows, and doubles as the
+       copy buffer when splice() isn't available. */
+    size_t carrier_bytes = carrier_rows * stride;
+    size_t scratch = carrier_bytes > STREAM_CHUNK ? carrier_bytes : STREAM_CHUNK;
+    if(growBuffer((void **)&ctx->output, &ctx->output_capacity, scratch) != STATUS_OK) {
+        return ERROR_MEMORY;
+    }
+
+    int height = ctx->pic.height;
+    status = writeFull(outfd, ctx->pic.header, ctx->pic.offset);
+    if(status == STATUS_OK) {
+        status = copyBytes(infd, outfd, (height - carrier_rows) * stride,
+                           ctx->output, ctx->output_capacity);
+    }
+    if(status == STATUS_OK) status = readFull(infd, ctx->output, carrier_bytes);
+    if(status == STATUS_OK) status = loadCarrierRows(ctx, (int)carrier_rows, stride);
+    if(status == STATUS_OK) status = embedPayload(ctx);
+    if(status == STATUS_OK) {
+        pixelsToRows(&ctx->pic, ctx->output, stride);
+        status = writeFull(outfd, ctx->output, carrier_bytes);
+    }
+    return status;
+}
+
+/* Checks that a payload read from a stream lies within the carrier rows
+ * loaded into ctx->pic, of an image height rows high. */
+static int checkStreamWindow(stegctx_t *ctx, int height) {
+    payloadheader_t header;
+    size_t kept = (size_t)ctx->pic.width * ctx->pic.height * RGB_PER_PIXEL, needed;
+    int rows = ctx->pic.height;
+
+    /* The header sits in the first rows, but is checked against the
+       whole image. */
+    ctx->pic.height = height;
+    int status = readPayloadHeader(&ctx->pic, &header);
+    ctx->pic.height = rows;
+    if(status != STATUS_OK) return status;
+
+    needed = header.version == 0 ? TREE_BITS + header.payload_bits :
+             headerBits(header.version, header.flags) +
+             payloadSlots(header.flags, header.payload_bits);
+    return needed > kept ? ERROR_STREAM_WINDOW : STATUS_OK;
+}
+
+/* Decodes a message from a BMP read from a stream. The payload's size
+ * is only known from its header, in the last rows of the file, so the
+ * trailing rows are kept as they arrive: all of them, or as many as
+ * ctx->memory_limit allows. Rows before those are skipped. Payloads
+ * reaching past the rows kept fail with ERROR_STREAM_WINDOW.
+ *
+ * Input:
+ *  - stegctx_t *ctx: Pointer to the context.
+ *  - int infd: Descriptor of the encoded BMP, e.g. 0 for stdin.
+ *  - const char **outstring: Receives the message, owned by the context.
+ * Output:
+ *  - STATUS_OK, or the status of the step that failed.
+ */
+int decodeStream(stegctx_t *ctx, int infd, const char **outstring) {
+    size_t stride;
+    resetAllocStats();
+
+    int status = readStreamHeader(ctx, infd, &stride);
+    if(status != STATUS_OK) return status;
+    int height = ctx->pic.height;
+
+    /* With a memory limit, at least what the old format can need is
+       kept. A scattered payload can land anywhere, so every row is. */
+    size_t row_bits = (size_t)ctx->pic.width * RGB_PER_PIXEL;
+    size_t carrier_rows = height;
+    if(ctx->memory_limit && !ctx->scattered) {
+        size_t limit_rows = ctx->memory_limit / ((size_t)ctx->pic.width * sizeof(rgb_t));
+        size_t min_rows = (TREE_BITS + MAX_MESSAGE_SIZE - 1 + row_bits - 1) / row_bits;
+        if(limit_rows < min_rows) limit_rows = min_rows;
+        if(limit_rows < carrier_rows) carrier_rows = limit_rows;
+    }
+
+    size_t carrier_bytes = carrier_rows * stride;
+    size_t scratch = carrier_bytes > STREAM_CHUNK ? carrier_bytes : STREAM_CHUNK;
+    if(growBuffer((void **)&ctx->output, &ctx->output_capacity, scratch) != STATUS_OK) {
+        return ERROR_MEMORY;
+    }
+
+    status = skipBytes(infd, (height - carrier_rows) * stride,
+                       ctx->output, ctx->output_capacity);
+    if(status == STATUS_OK) status = readFull(infd, ctx->output, carrier_bytes);
+    if(status == STATUS_OK) status = loadCarrierRows(ctx, (int)carrier_rows, stride);
+    if(status == STATUS_OK && carrier_rows < (size_t)height) {
+        status = checkStreamWindow(ctx, height);
+    }
+    if(status == STATUS_OK) status = extractPayload(ctx, &ctx->pic);
+    if(status == STATUS_OK) *outstring = ctx->message;
+    return status;
+}
+
+/***** Metadata cache *****/
+/* Prepares an empty metadata cache.
+ *
+ * Input:
+ *  - metacache_t *cache: Pointer to the cache.
+ * Output:
+ *  - Function of type void.
+ */
+void initMetaCache(metacache_t *cache) {
+    cache->count = 0;
+    cache->clock = 0;
+    cache->hits = 0;
+    cache->misses = 0;
+    cache->dirty = 0;
+}
+
+/* Copies the identity fields of entry out of a stat() result. */
+static void fillIdentity(const struct stat *info, metaentry_t *entry) {
+    entry->size = (unsigned long long)info->st_size;
+    entry->mtime_sec = (long long)info->st_mtim.tv_sec;
+    entry->mtime_nsec = (long)info->st_mtim.tv_nsec;
+    entry->inode = (unsigned long long)info->st_ino;
+    entry->device = (unsigned long long)info->st_dev;
+}
+
+/* Fills in the identity fields of entry from stat(). Size, mtime,
+ * inode and device together catch rewrites, renames over the path and
+ * touch without content changes.
+ *
+ * Input:
+ *  - const char *path: File to stat.
+ *  - metaentry_t *entry: Entry receiving the identity.
+ * Output:
+ *  - STATUS_OK, or ERROR_OPEN if the file can't be stat'ed.
+ */
+static int statIdentity(const char *path, metaentry_t *entry) {
+    struct stat info;
+    if(stat(path, &info) != 0) return ERROR_OPEN;
+    fillIdentity(&info, entry);
+    return STATUS_OK;
+}
+
+static int sameIdentity(const metaentry_t *a, const metaentry_t *b) {
+    return a->size == b->size && a->mtime_sec == b->mtime_sec &&
+           a->mtime_nsec == b->mtime_nsec && a->inode == b->inode &&
+           a->device == b->device;
+}
+
+/* Looks up a path, dropping its entry if the file changed since it was
+ * cached.
+ *
+ * Input:
+ *  - metacache_t *cache: Pointer to the cache.
+ *  - const char *path: File to look up.
+ * Output:
+ *  - metaentry_t *: The entry, or NULL on a miss.
+ */
+metaentry_t *lookupMeta(metacache_t *cache, const char *path) {
+    metaentry_t current;
+    int i;
+
+    if(statIdentity(path, &current) != STATUS_OK) return NULL;
+
+    for(i = 0; i < cache->count; i++) {
+        metaentry_t *entry = &cache->entries[i];
+        if(strcmp(entry->path, path) != 0) continue;
+
+        if(!sameIdentity(entry, &current)) {
+            /* Stale, the last entry takes its slot. */
+            *entry = cache->entries[--cache->count];
+            cache->dirty = 1;
+            return NULL;
+        }
+        entry->last_used = ++cache->clock;
+        return entry;
+    }
+    return NULL;
+}
+
+/* Returns the slot for a new entry, evicting the least recently used
+ * one when the cache is full. */
+static metaentry_t *newMetaEntry(metacache_t *cache) {
+    int i, oldest = 0;
+    if(cache->count < MAX_META_ENTRIES) return &cache->entries[cache->count++];
+
+    for(i = 1; i < cache->count; i++) {
+        if(cache->entries[i].last_used < cache->entries[oldest].last_used) oldest = i;
+    }
+    return &cache->entries[oldest];
+}
+
+/* Returns the cached metadata for a file, reading its headers (one
+ * small read, no pixels) and adding an entry on a miss.
+ *
+ * Input:
+ *  - metacache_t *cache: Pointer to the cache.
+ *  - const char *path: File to probe.
+ *  - int *status: Receives STATUS_OK, or ERROR_OPEN if the file can't
+ *                 be read. An unusable BMP is still cached, with the
+ *                 openImage() checks' result in format_status.
+ * Output:
+ *  - metaentry_t *: The entry, or NULL if the file couldn't be read or
+ *                   the path is too long to cache.
+ */
+metaentry_t *probeMeta(metacache_t *cache, const char *path, int *status) {
+    metaentry_t *entry = lookupMeta(cache, path);
+    *status = STATUS_OK;
+    if(entry) {
+        cache->hits++;
+        return entry;
+    }
+    cache->misses++;
+
+    if(strlen(path) >= MAX_PATH_LENGTH) return NULL;
+
+    /* One open, with the identity taken from the open file. */
+    metaentry_t fresh;
+    struct stat info;
+    memset(&fresh, 0, sizeof(fresh));
+    int fd = open(path, O_RDONLY);
+    if(fd < 0 || fstat(fd, &info) != 0) {
+        if(fd >= 0) close(fd);
+        *status = ERROR_OPEN;
+        return NULL;
+    }
+    fillIdentity(&info, &fresh);
+    int got = readAt(fd, fresh.headers, BMP_HEADERS_SIZE, 0);
+    close(fd);
+
+    strcpy(fresh.path, path);
+    fresh.format_status = ERROR_FORMAT;
+    if(got == STATUS_OK) {
+        parseHeaders(fresh.headers, &fresh.fh, &fresh.ih);
+        fresh.format_status = validateHeaders(&fresh.fh, &fresh.ih);
+        if(fresh.format_status == STATUS_OK) {
+            fresh.format_status = checkBounds(&fresh.fh, &fresh.ih, fresh.size);
+        }
+    }
+    fresh.payload_state = PAYLOAD_UNKNOWN;
+    fresh.last_used = ++cache->clock;
+
+    entry = newMetaEntry(cache);
+    *entry = fresh;
+    cache->dirty = 1;
+    return entry;
+}
+
+/* Records what a decode or encode found out about a file's payload.
+ *
+ * Input:
+ *  - metacache_t *cache: Pointer to the cache.
+ *  - const char *path: The file that was decoded or written.
+ *  - int state: PAYLOAD_NONE or PAYLOAD_PRESENT.
+ *  - unsigned long payload_bits: Compressed payload bits, if present.
+ *  - unsigned long message_length: Message length in bytes, if present.
+ * Output:
+ *  - Function of type void.
+ */
+void recordPayload(metacache_t *cache, const char *path, int state,
+                   unsigned long payload_bits, unsigned long message_length) {
+    int status;
+    metaentry_t *entry = probeMeta(cache, path, &status);
+    if(!entry) return;
+
+    if(entry->payload_state != state || entry->payload_bits != payload_bits ||
+       entry->message_length != message_length) {
+        cache->dirty = 1;
+    }
+    entry->payload_state = state;
+    entry->payload_bits = payload_bits;
+    entry->message_length = message_length;
+}
+
+/* Little endian writers and readers for the cache file. */
+static void putLE(FILE *file, unsigned long long value, int bytes) {
+    int i;
+    for(i = 0; i < bytes; i++) fputc((int)((value >> (8 * i)) & 0xff), file);
+}
+
+static int getLE(FILE *file, unsigned long long *value, int bytes) {
+    int i;
+    *value = 0;
+    for(i = 0; i < bytes; i++) {
+        int c = fgetc(file);
+        if(c == EOF) return ERROR_FORMAT;
+        *value |= (unsigned long long)c << (8 * i);
+    }
+    return STATUS_OK;
+}
+
+/* Writes the cache in its compact binary form: a 16 bit entry count,
+ * then per entry the path, file identity, raw BMP headers and payload
+ * summary. Parsed headers aren't stored, they come back from the raw
+ * bytes on load.
+ *
+ * Input:
+ *  - const metacache_t *cache: Pointer to the cache.
+ *  - FILE *file: File open for binary writing.
+ * Output:
+ *  - STATUS_OK, or ERROR_WRITE.
+ */
+int saveMetaCache(const metacache_t *cache, FILE *file) {
+    int i;
+    putLE(file, cache->count, 2);
+    for(i = 0; i < cache->count; i++) {
+        const metaentry_t *entry = &cache->entries[i];
+        size_t length = strlen(entry->path);
+
+        putLE(file, length, 2);
+        fwrite(entry->path, 1, length, file);
+        putLE(file, entry->size, 8);
+        putLE(file, (unsigned long long)entry->mtime_sec, 8);
+        putLE(file, (unsigned long long)entry->mtime_nsec, 4);
+        putLE(file, entry->inode, 8);
+        putLE(file, entry->device, 8);
+        fwrite(entry->headers, 1, BMP_HEADERS_SIZE, file);
+        putLE(file, (unsigned long long)(entry->format_status == STATUS_OK), 1);
+        putLE(file, entry->payload_state, 1);
+        putLE(file, entry->payload_bits, 4);
+        putLE(file, entry->message_length, 4);
+        putLE(file, entry->last_used, 4);
+    }
+    return ferror(file) ? ERROR_WRITE : STATUS_OK;
+}
+
+/* Reads a cache written by saveMetaCache(). A truncated or damaged
+ * cache keeps the entries read so far, nothing in it is trusted beyond
+ * what stat() confirms on lookup.
+ *
+ * Input:
+ *  - metacache_t *cache: Pointer to the cache to fill.
+ *  - FILE *file: File positioned at the start of the cache.
+ * Output:
+ *  - STATUS_OK, or ERROR_FORMAT if the data ended early.
+ */
+int loadMetaCache(metacache_t *cache, FILE *file) {
+    unsigned long long count, value;
+    int i;
+
+    initMetaCache(cache);
+    if(getLE(file, &count, 2) != STATUS_OK) return ERROR_FORMAT;
+    if(count > MAX_META_ENTRIES) count = MAX_META_ENTRIES;
+
+    for(i = 0; i < (int)count; i++) {
+        metaentry_t *entry = &cache->entries[cache->count];
+        unsigned long long length;
+
+        if(getLE(file, &length, 2) != STATUS_OK || length >= MAX_PATH_LENGTH) return ERROR_FORMAT;
+        if(fread(entry->path, 1, length, file) != length) return ERROR_FORMAT;
+        entry->path[length] = '\0';
+
+        int status = getLE(file, &entry->size, 8);
+        if(status == STATUS_OK) status = getLE(file, &value, 8);
+        if(status == STATUS_OK) {
+            entry->mtime_sec = (long long)value;
+            status = getLE(file, &value, 4);
+        }
+        if(status == STATUS_OK) {
+            entry->mtime_nsec = (long)value;
+            status = getLE(file, &entry->inode, 8);
+        }
+        if(status == STATUS_OK) status = getLE(file, &entry->device, 8);
+        if(status != STATUS_OK) return status;
+        if(fread(entry->headers, 1, BMP_HEADERS_SIZE, file) != BMP_HEADERS_SIZE) return ERROR_FORMAT;
+
+        if(getLE(file, &value, 1) != STATUS_OK) return ERROR_FORMAT;
+        parseHeaders(entry->headers, &entry->fh, &entry->ih);
+        entry->format_status = value ? validateHeaders(&entry->fh, &entry->ih) : ERROR_FORMAT;
+        if(entry->format_status == STATUS_OK) {
+            entry->format_status = checkBounds(&entry->fh, &entry->ih, entry->size);
+        }
+        if(getLE(file, &value, 1) != STATUS_OK) return ERROR_FORMAT;
+        entry->payload_state = (int)value;
+        if(getLE(file, &value, 4) != STATUS_OK) return ERROR_FORMAT;
+        entry->payload_bits = (unsigned long)value;
+        if(getLE(file, &value, 4) != STATUS_OK) return ERROR_FORMAT;
+        entry->message_length = (unsigned long)value;
+        if(getLE(file, &value, 4) != STATUS_OK) return ERROR_FORMAT;
+        entry->last_used = (unsigned long)value;
+
+        if(entry->last_used > cache->clock) cache->clock = entry->last_used;
+        cache->count++;
+    }
+    return STATUS_OK;
+}
+
+/***** Image cache *****/
+/* Prepares an empty image cache.
+ *
+ * Input:
+ *  - imagecache_t *cache: Pointer to the cache.
+ *  - size_t budget: Most bytes of pixels and headers to keep loaded.
+ * Output:
+ *  - Function of type void.
+ */
+void initImageCache(imagecache_t *cache, size_t budget) {
+    cache->count = 0;
+    cache->budget = budget;
+    cache->used = 0;
+    cache->clock = 0;
+    cache->hits = 0;
+    cache->misses = 0;
+}
+
+/* Drops the entry at index, the last entry takes its slot. */
+static void dropImage(imagecache_t *cache, int index) {
+    imageentry_t *entry = &cache->entries[index];
+    cache->used -= entry->bytes;
+    freeImage(&entry->pic);
+    *entry = cache->entries[--cache->count];
+}
+
+/* Frees every image held by the cache.
+ *
+ * Input:
+ *  - imagecache_t *cache: Pointer to the cache.
+ * Output:
+ *  - Function of type void.
+ */
+void freeImageCache(imagecache_t *cache) {
+    while(cache->count > 0) dropImage(cache, cache->count - 1);
+}
+
+/* Finds a loaded image whose file still has the cached size and mtime.
+ * A stale entry for the path is dropped. */
+static imageentry_t *findImage(imagecache_t *cache, const char *path) {
+    metaentry_t current;
+    int i;
+
+    if(statIdentity(path, &current) != STATUS_OK) return NULL;
+
+    for(i = 0; i < cache->count; i++) {
+        imageentry_t *entry = &cache->entries[i];
+        if(strcmp(entry->path, path) != 0) continue;
+
+        if(entry->size != current.size || entry->mtime_sec != current.mtime_sec ||
+           entry->mtime_nsec != current.mtime_nsec) {
+            dropImage(cache, i);
+            return NULL;
+        }
+        entry->last_used = ++cache->clock;
+        return entry;
+    }
+    return NULL;
+}
+
+/* Copies pic into the cache under path, evicting least recently used
+ * images until it fits the budget. Images larger than the whole budget
+ * are not cached. */
+static void storeImage(imagecache_t *cache, const char *path, const image_t *pic) {
+    metaentry_t current;
+    size_t rgb_bytes = (size_t)pic->width * pic->height * sizeof(rgb_t);
+    size_t bytes = pic->offset + rgb_bytes;
+    int i;
+
+    if(bytes > cache->budget || strlen(path) >= MAX_PATH_LENGTH) return;
+    if(statIdentity(path, &current) != STATUS_OK) return;
+
+    /* Replaces any older copy of the same path. */
+    for(i = 0; i < cache->count; i++) {
+        if(strcmp(cache->entries[i].path, path) == 0) {
+            dropImage(cache, i);
+            break;
+        }
+    }
+    while(cache->count > 0 &&
+          (cache->used + bytes > cache->budget || cache->count == MAX_IMAGE_ENTRIES)) {
+        int oldest = 0;
+        for(i = 1; i < cache->count; i++) {
+            if(cache->entries[i].last_used < cache->entries[oldest].last_used) oldest = i;
+        }
+        dropImage(cache, oldest);
+    }
+
+    imageentry_t *entry = &cache->entries[cache->count];
+    entry->pic = *pic;
+    entry->pic.header = stegAlloc(pic->offset);
+    entry->pic.rgb = stegAlloc(rgb_bytes);
+    if(!entry->pic.header || !entry->pic.rgb) {
+        freeImage(&entry->pic);
+        return;
+    }
+    memcpy(entry->pic.header, pic->header, pic->offset);
+    memcpy(entry->pic.rgb, pic->rgb, rgb_bytes);
+
+    strcpy(entry->path, path);
+    entry->size = current.size;
+    entry->mtime_sec = current.mtime_sec;
+    entry->mtime_nsec = current.mtime_nsec;
+    entry->bytes = bytes;
+    entry->last_used = ++cache->clock;
+    cache->used += bytes;
+    cache->count++;
+}
+
+/* Gets the image at path into the context, from the cache when it's
+ * loaded and unchanged, otherwise from disk with its headers validated.
+ * On a miss the loaded image is added to the cache. */
+static int loadCachedImage(stegctx_t *ctx, imagecache_t *cache, char *path) {
+    imageentry_t *entry = findImage(cache, path);
+    if(entry) {
+        cache->hits++;
+        const image_t *pic = &entry->pic;
+        size_t rgb_bytes = (size_t)pic->width * pic->height * sizeof(rgb_t);
+        if(growBuffer((void **)&ctx->pic.header, &ctx->header_capacity, pic->offset) != STATUS_OK ||
+           growBuffer((void **)&ctx->pic.rgb, &ctx->rgb_capacity, rgb_bytes) != STATUS_OK) {
+            return ERROR_MEMORY;
+        }
+        ctx->pic.width = pic->width;
+        ctx->pic.height = pic->height;
+        ctx->pic.offset = pic->offset;
+        memcpy(ctx->pic.header, pic->header, pic->offset);
+        memcpy(ctx->pic.rgb, pic->rgb, rgb_bytes);
+        return STATUS_OK;
+    }
+    cache->misses++;
+
+    imagefile_t file;
+    int status = openImage(path, &file);
+    if(status == STATUS_OK) {
+        status = loadImage(&file, &ctx->pic, &ctx->header_capacity, &ctx->rgb_capacity,
+                           &ctx->output, &ctx->output_capacity);
+    }
+    closeImage(&file);
+    if(status == STATUS_OK) storeImage(cache, path, &ctx->pic);
+    return status;
+}
+
+/* encodeContext() through an image cache: a cover that's loaded and
+ * unchanged isn't read again, and the encoded image is cached under
+ * outfile so verifying it doesn't read it back either.
+ *
+ * Input:
+ *  - stegctx_t *ctx: Pointer to the context.
+ *  - imagecache_t *cache: Pointer to the image cache.
+ *  - char *infile: The cover image.
+ *  - char *outfile: The image to write.
+ *  - char *message: Pointer to char (string) message.
+ * Output:
+ *  - STATUS_OK, or the status of the step that failed.
+ */
+int encodeCached(stegctx_t *ctx, imagecache_t *cache, char *infile, char *outfile,
+                 char *message) {
+    resetAllocStats();
+
+    int status = loadCachedImage(ctx, cache, infile);
+    if(status == STATUS_OK) status = buildPayload(ctx, message);
+    if(status == STATUS_OK) status = embedPayload(ctx);
+    if(status == STATUS_OK) {
+        status = writeImageFile(&ctx->pic, outfile, &ctx->output, &ctx->output_capacity);
+    }
+    if(status == STATUS_OK) storeImage(cache, outfile, &ctx->pic);
+    return status;
+}
+
+/* decodeContext() through an image cache.
+ *
+ * Input:
+ *  - stegctx_t *ctx: Pointer to the context.
+ *  - imagecache_t *cache: Pointer to the image cache.
+ *  - char *infile: The encoded image.
+ *  - const char **outstring: Receives the message, owned by the context
+ *                            and valid until its next call.
+ * Output:
+ *  - STATUS_OK, or the status of the step that failed.
+ */
+int decodeCached(stegctx_t *ctx, imagecache_t *cache, char *infile,
+                 const char **outstring) {
+    resetAllocStats();
+
+    int status = loadCachedImage(ctx, cache, infile);
+    if(status == STATUS_OK) status = extractPayload(ctx, &ctx->pic);
+    if(status == STATUS_OK) *outstring = ctx->message;
+    return status;
+}
+
+/***** Parallel *****/
+typedef struct {
+    int count;
+    int next;
+    int worker;
+    void (*work)(int item, int worker, void *user);
+    void *user;
+    /* Allocation counters of each started thread, see parallelFor(). */
+    allocstats_t stats[MAX_THREADS];
+} parallel_t;
+
+/* Runs items until none are left, returns the worker index used. */
+static int runItems(parallel_t *job) {
+    int worker = __sync_fetch_and_add(&job->worker, 1);
+    int item;
+    while((item = __sync_fetch_and_add(&job->next, 1)) < job->count) {
+        job->work(item, worker, job->user);
+    }
+    return worker;
+}
+
+/* Entry point of a started thread. Its counters start from zero and
+ * are handed back to parallelFor() when it is done. */
+static void *parallelWorker(void *arg) {
+    parallel_t *job = arg;
+    job->stats[runItems(job)] = alloc_stats;
+    return NULL;
+}
+
+/* Clamps a requested thread count to the CPUs, MAX_THREADS and the
+ * number of items.
+ *
+ * Input:
+ *  - int threads: Requested threads, 0 for one per online CPU.
+ *  - int count: Number of items to share out.
+ * Output:
+ *  - The thread count to use, at least 1.
+ */
+int parallelThreads(int threads, int count) {
+    if(threads <= 0) threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if(threads > MAX_THREADS) threads = MAX_THREADS;
+    if(threads > count) threads = count;
+    return threads < 1 ? 1 : threads;
+}
+
+/* Runs work(item, worker, user) for every item in [0, count) on up to
+ * threads threads, the calling thread included. Items are handed out
+ * one at a time so uneven items balance themselves; worker is the
+ * index of the thread running the item, for per-thread state.
+ *
+ * Input:
+ *  - int count: Number of items.
+ *  - int threads: Thread count, 0 for one per online CPU.
+ *  - void (*work)(int, int, void *): Function run for each item.
+ *  - void *user: Passed to work.
+ * Output:
+ *  - Number of threads used, at least 1.
+ */
+static int parallelFor(int count, int threads, void (*work)(int, int, void *), void *user) {
+    pthread_t ids[MAX_THREADS];
+    parallel_t job;
+    size_t peak = alloc_stats.peak_bytes, workers_peak = 0;
+    int i, started = 0;
+
+    job.count = count;
+    job.next = 0;
+    job.worker = 0;
+    job.work = work;
+    job.user = user;
+    memset(job.stats, 0, sizeof(job.stats));
+
+    /* Threads that fail to start leave their share to the others. */
+    threads = parallelThreads(threads, count);
+    for(i = 1; i < threads; i++) {
+        if(pthread_create(&ids[started], NULL, parallelWorker, &job) == 0) started++;
+    }
+    alloc_stats.peak_bytes = alloc_stats.current_bytes;
+    runItems(&job);
+    for(i = 0; i < started; i++) pthread_join(ids[i], NULL);
+
+    /* Adds the started threads' counts to this thread's. Their peaks may
+       have coincided, so the combined peak is their sum on top of this
+       thread's own. */
+    for(i = 0; i < MAX_THREADS; i++) {
+        alloc_stats.current_bytes += job.stats[i].current_bytes;
+        alloc_stats.allocations += job.stats[i].allocations;
+        alloc_stats.releases += job.stats[i].releases;
+        workers_peak += job.stats[i].peak_bytes;
+    }
+    alloc_stats.peak_bytes += workers_peak;
+    if(alloc_stats.peak_bytes < peak) alloc_stats.peak_bytes = peak;
+    return started + 1;
+}
+
+/***** I/O engine *****/
+/* Batches of whole-file reads and writes. The io_uring engine keeps up
+ * to a ring's worth in flight from one thread; the pread engine runs
+ * them one after another and relies on the readahead hints given when
+ * the files are opened. */
+#ifdef __linux__
+static long uringSetup(unsigned entries, struct io_uring_params *params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static long uringEnter(int fd, unsigned submit, unsigned wait) {
+    return syscall(__NR_io_uring_enter, fd, submit, wait, IORING_ENTER_GETEVENTS, NULL, 0);
+}
+
+static int initUring(ioengine_t *engine) {
+    struct io_uring_params params;
+
+    memset(&params, 0, sizeof(params));
+    int fd = (int)uringSetup(IO_QUEUE_DEPTH, &params);
+    if(fd < 0) return ERROR_OPEN;
+
+    engine->ring_fd = fd;
+    engine->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    engine->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    engine->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    /* Newer kernels map both rings with one call. */
+    if(params.features & IORING_FEAT_SINGLE_MMAP) {
+        if(engine->cq_ring_size > engine->sq_ring_size) engine->sq_ring_size = engine->cq_ring_size;
+        engine->cq_ring_size = 0;
+    }
+
+    engine->sq_ring = mmap(NULL, engine->sq_ring_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    engine->cq_ring = engine->cq_ring_size == 0 ? engine->sq_ring :
+                      mmap(NULL, engine->cq_ring_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    engine->sqes = mmap(NULL, engine->sqes_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if(engine->sq_ring == MAP_FAILED || engine->cq_ring == MAP_FAILED ||
+       engine->sqes == MAP_FAILED) {
+        freeIoEngine(engine);
+        return ERROR_MEMORY;
+    }
+
+    unsigned char *sq = engine->sq_ring, *cq = engine->cq_ring;
+    engine->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    engine->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    engine->sq_array = (unsigned *)(sq + params.sq_off.array);
+    engine->cq_head = (unsigned *)(cq + params.cq_off.head);
+    engine->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    engine->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    engine->cqes = cq + params.cq_off.cqes;
+    engine->depth = (int)params.sq_entries;
+    engine->kind = IO_ENGINE_URING;
+    return STATUS_OK;
+}
+#endif
+
+/* Finishes a request with blocking calls, for the pread engine and for
+ * kernels whose io_uring lacks plain read and write. */
+static void syncRequest(iorequest_t *request) {
+    while(request->done < request->length) {
+        ssize_t moved = request->write ?
+            pwrite(request->fd, request->buffer + request->done, request->length - request->done,
+                   (off_t)(request->offset + request->done)) :
+            pread(request->fd, request->buffer + request->done, request->length - request->done,
+                  (off_t)(request->offset + request->done));
+        if(moved < 0 && errno == EINTR) continue;
+        if(moved <= 0) {
+            request->status = moved == 0 ? ERROR_FORMAT : request->write ? ERROR_WRITE : ERROR_OPEN;
+            return;
+        }
+        request->done += (size_t)moved;
+    }
+    request->status = STATUS_OK;
+}
+
+/* Sets up an engine. IO_ENGINE_AUTO picks io_uring when the kernel
+ * allows it and falls back to pread/pwrite otherwise.
+ *
+ * Input:
+ *  - ioengine_t *engine: Pointer to the engine to set up.
+ *  - int kind: IO_ENGINE_AUTO, IO_ENGINE_URING or IO_ENGINE_PREAD.
+ * Output:
+ *  - STATUS_OK, or ERROR_OPEN if io_uring was asked for and is missing.
+ */
+int initIoEngine(ioengine_t *engine, int kind) {
+    memset(engine, 0, sizeof(*engine));
+    engine->ring_fd = -1;
+    engine->kind = IO_ENGINE_PREAD;
+    engine->depth = 1;
+#ifdef __linux__
+    if(kind != IO_ENGINE_PREAD) {
+        int status = initUring(engine);
+        if(status == STATUS_OK || kind == IO_ENGINE_URING) return status;
+    }
+#else
+    if(kind == IO_ENGINE_URING) return ERROR_OPEN;
+#endif
+    return STATUS_OK;
+}
+
+/* Releases an engine's ring, if it has one. */
+void freeIoEngine(ioengine_t *engine) {
+    if(engine->sqes && engine->sqes != MAP_FAILED) munmap(engine->sqes, engine->sqes_size);
+    if(engine->cq_ring_size && engine->cq_ring && engine->cq_ring != MAP_FAILED) {
+        munmap(engine->cq_ring, engine->cq_ring_size);
+    }
+    if(engine->sq_ring && engine->sq_ring != MAP_FAILED) munmap(engine->sq_ring, engine->sq_ring_size);
+    if(engine->ring_fd >= 0) close(engine->ring_fd);
+    initIoEngine(engine, IO_ENGINE_PREAD);
+}
+
+const char *ioEngineName(int kind) {
+    return kind == IO_ENGINE_URING ? "io_uring" : kind == IO_ENGINE_PREAD ? "pread" : "auto";
+}
+
+#ifdef __linux__
+/* Puts the rest of a request in the submission queue at tail. */
+static void queueUring(ioengine_t *engine, unsigned tail, iorequest_t *request) {
+    unsigned index = tail & *engine->sq_mask;
+    struct io_uring_sqe *sqe = (struct io_uring_sqe *)engine->sqes + index;
+    size_t left = request->length - request->done;
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = request->write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = request->fd;
+    sqe->addr = (unsigned long long)(size_t)(request->buffer + request->done);
+    sqe->len = left > IO_MAX_TRANSFER ? IO_MAX_TRANSFER : (unsigned)left;
+    sqe->off = request->offset + request->done;
+    sqe->user_data = (unsigned long long)(size_t)request;
+    engine->sq_array[index] = index;
+}
+
+static int runUring(ioengine_t *engine, iorequest_t *requests, int count) {
+    unsigned tail = *engine->sq_tail, unsubmitted = 0;
+    int next = 0, in_flight = 0;
+
+    while(next < count || in_flight > 0 || unsubmitted > 0) {
+        /* Tops the ring up, skipping requests that already failed. */
+        while(next < count && in_flight + (int)unsubmitted < engine->depth) {
+            iorequest_t *request = &requests[next++];
+            if(request->status != STATUS_OK) continue;
+            if(request->done == request->length) continue;
+            queueUring(engine, tail++, request);
+            unsubmitted++;
+        }
+        __atomic_store_n(engine->sq_tail, tail, __ATOMIC_RELEASE);
+        if(in_flight == 0 && unsubmitted == 0) break;
+
+        long submitted = uringEnter(engine->ring_fd, unsubmitted, 1);
+        if(submitted < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) return ERROR_OPEN;
+        if(submitted > 0) {
+            unsubmitted -= (unsigned)submitted;
+            in_flight += (int)submitted;
+        }
+
+        unsigned head = *engine->cq_head;
+        unsigned ready = __atomic_load_n(engine->cq_tail, __ATOMIC_ACQUIRE);
+        for(; head != ready; head++) {
+            struct io_uring_cqe *cqe = (struct io_uring_cqe *)engine->cqes + (head & *engine->cq_mask);
+            iorequest_t *request = (iorequest_t *)(size_t)cqe->user_data;
+            int result = cqe->res;
+            in_flight--;
+
+            if(result == -EINVAL || result == -EOPNOTSUPP) {
+                syncRequest(request);
+            } else if(result == -EINTR || result == -EAGAIN) {
+                queueUring(engine, tail++, request);
+                unsubmitted++;
+            } else if(result <= 0) {
+                request->status = result == 0 ? ERROR_FORMAT :
+                                  request->write ? ERROR_WRITE : ERROR_OPEN;
+            } else {
+                /* Short transfers go straight back in for the rest. */
+                request->done += (size_t)result;
+                if(request->done < request->length) {
+                    queueUring(engine, tail++, request);
+                    unsubmitted++;
+                }
+            }
+        }
+        __atomic_store_n(engine->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return STATUS_OK;
+}
+#endif
+
+/* Runs a batch of reads and writes to completion. Each request's
+ * status tells how it went; ERROR_FORMAT means a read hit the end of
+ * the file early.
+ *
+ * Input:
+ *  - ioengine_t *engine: Pointer to an engine from initIoEngine().
+ *  - iorequest_t *requests: The requests, with status STATUS_OK and
+ *    done 0 for those to run.
+ *  - int count: Number of requests.
+ * Output:
+ *  - STATUS_OK, or ERROR_OPEN if the ring itself failed.
+ */
+int runIo(ioengine_t *engine, iorequest_t *requests, int count) {
+    int i;
+#ifdef __linux__
+    if(engine->kind == IO_ENGINE_URING) return runUring(engine, requests, count);
+#endif
+    for(i = 0; i < count; i++) {
+        if(requests[i].status == STATUS_OK) syncRequest(&requests[i]);
+    }
+    return STATUS_OK;
+}
+
+/* Opens a file and fills in a request for all of it, hinting the
+ * kernel to start reading it in. The buffer grows to fit. */
+static int queueRead(const char *path, iorequest_t *request, unsigned char **buffer,
+                     size_t *capacity) {
+    struct stat info;
+
+    memset(request, 0, sizeof(*request));
+    request->fd = open(path, O_RDONLY);
+    if(request->fd < 0) return request->status = ERROR_OPEN;
+    if(fstat(request->fd, &info) != 0 || info.st_size < BMP_HEADERS_SIZE) {
+        return request->status = ERROR_FORMAT;
+    }
+    posix_fadvise(request->fd, 0, info.st_size, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(request->fd, 0, info.st_size, POSIX_FADV_WILLNEED);
+    if(growBuffer((void **)buffer, capacity, (size_t)info.st_size) != STATUS_OK) {
+        return request->status = ERROR_MEMORY;
+    }
+    request->buffer = *buffer;
+    request->length = (size_t)info.st_size;
+    return STATUS_OK;
+}
+
+/* Creates a file and fills in a request writing length bytes to it. */
+static int queueWrite(const char *path, iorequest_t *request, unsigned char *buffer,
+                      size_t length) {
+    memset(request, 0, sizeof(*request));
+    request->write = 1;
+    request->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(request->fd < 0 || preallocate(request->fd, length) != STATUS_OK) {
+        return request->status = ERROR_WRITE;
+    }
+    request->buffer = buffer;
+    request->length = length;
+    return STATUS_OK;
+}
+
+static void closeRequests(iorequest_t *requests, int count) {
+    int i;
+    for(i = 0; i < count; i++) {
+        if(requests[i].fd >= 0) close(requests[i].fd);
+        requests[i].fd = -1;
+    }
+}
+
+/***** Tiles *****/
+/* Images bigger than ctx->memory_limit are encoded and decoded a band
+ * of rows at a time, so memory follows the limit and the payload, not
+ * the image. Bands hold a whole number of scatter blocks, so no block
+ * of a keyed order straddles two of them, and only bands holding
+ * payload bits are converted to pixels at all. */
+typedef struct {
+    int fd;
+    int height;
+    size_t stride;
+    size_t band_rows;
+    size_t band_channels;
+    size_t bands;
+    unsigned long long offset;
+} tiles_t;
+
+/* Sets up banded access to an open image, reading its header into
+ * ctx->pic and sizing the bands so a band's file rows (in ctx->output)
+ * and its pixels (in ctx->pic.rgb) fit within ctx->memory_limit.
+ *
+ * Input:
+ *  - stegctx_t *ctx: Pointer to the context.
+ *  - tiles_t *tiles: Receives the layout.
+ *  - const imagefile_t *file: The image, from openImage().
+ * Output:
+ *  - STATUS_OK, ERROR_OPEN, ERROR_FORMAT, or ERROR_MEMORY if not even
+ *    the smallest band fits the limit.
+ */
+static int openTiles(stegctx_t *ctx, tiles_t *tiles, const imagefile_t *file) {
+    int width = file->ih.biWidth;
+
+    tiles->fd = file->fd;
+    tiles->height = file->ih.biHeight;
+    tiles->offset = file->fh.bfOffBits;
+    tiles->stride = file->stride;
+
+    /* Bands are a multiple of the fewest rows holding whole blocks. */
+    size_t unit = SCATTER_BLOCK, odd_width = (size_t)width;
+    while(unit > 1 && odd_width % 2 == 0) {
+        unit /= 2;
+        odd_width /= 2;
+    }
+    size_t row_cost = tiles->stride + (size_t)width * sizeof(rgb_t);
+    tiles->band_rows = ctx->memory_limit / row_cost / unit * unit;
+    if(tiles->band_rows == 0) return ERROR_MEMORY;
+    if(tiles->band_rows > (size_t)tiles->height) tiles->band_rows = tiles->height;
+    tiles->band_channels = tiles->band_rows * width * RGB_PER_PIXEL;
+    tiles->bands = tiles->band_rows ? (tiles->height + tiles->band_rows - 1) / tiles->band_rows : 0;
+
+    ctx->pic.width = width;
+    ctx->pic.height = 0;
+    ctx->pic.offset = file->fh.bfOffBits;
+    if(growBuffer((void **)&ctx->pic.header, &ctx->header_capacity, ctx->pic.offset) != STATUS_OK ||
+       growBuffer((void **)&ctx->output, &ctx->output_capacity,
+                  tiles->band_rows * tiles->stride) != STATUS_OK ||
+       growBuffer((void **)&ctx->pic.rgb, &ctx->rgb_capacity,
+                  tiles->band_rows * width * sizeof(rgb_t)) != STATUS_OK) {
+        return ERROR_MEMORY;
+    }
+    return readAt(tiles->fd, ctx->pic.header, ctx->pic.offset, 0);
+}
+
+/* Reads a band's rows into ctx->output. Bands count from the top of
+ * the image, so the last band comes first in the file. */
+static int readBand(stegctx_t *ctx, const tiles_t *tiles, size_t band, size_t *rows) {
+    size_t top = band * tiles->band_rows;
+    *rows = tiles->height - top < tiles->band_rows ? tiles->height - top : tiles->band_rows;
+
+    unsigned long long first_row = tiles->height - top - *rows;
+    return readAt(tiles->fd, ctx->output, *rows * tiles->stride,
+                  tiles->offset + first_row * tiles->stride);
+}
+
+/* Reads a band and converts it into ctx->pic. */
+static int loadBand(stegctx_t *ctx, const tiles_t *tiles, size_t band) {
+    size_t rows;
+    int status = readBand(ctx, tiles, band, &rows);
+    if(status != STATUS_OK) return status;
+
+    ctx->pic.height = (int)rows;
+    rowsToPixels(ctx->output, tiles->stride, &ctx->pic);
+    return STATUS_OK;
+}
+
+static int compareBlocks(const void *a, const void *b) {
+    size_t left = ((const tileblock_t *)a)->place, right = ((const tileblock_t *)b)->place;
+    return left < right ? -1 : left > right;
+}
+
+/* Lists where the blocks holding bits [start, start + count) of a keyed
+ * order lie, sorted by position in the image. */
+static int listBlocks(stegctx_t *ctx, const scatter_t *order, size_t start, size_t count,
+                      size_t *entries) {
+    size_t block, first = start / SCATTER_BLOCK;
+
+    *entries = count ? (start + count - 1) / SCATTER_BLOCK - first + 1 : 0;
+    if(growBuffer((void **)&ctx->tile_blocks, &ctx->tile_blocks_capacity,
+                  *entries * sizeof(tileblock_t) + 1) != STATUS_OK) {
+        return ERROR_MEMORY;
+    }
+    for(block = 0; block < *entries; block++) {
+        ctx->tile_blocks[block].block = first + block;
+        ctx->tile_blocks[block].place = scatterBlock(order, first + block);
+    }
+    qsort(ctx->tile_blocks, *entries, sizeof(tileblock_t), compareBlocks);
+    return STATUS_OK;
+}
+
+/* Moves one bit between a channel's LSB and packed bits. */
+static int moveBit(unsigned char *channel, unsigned char *bits, size_t index, int store) {
+    unsigned char value = *channel;
+    if(!store) {
+        putBit(bits, index, value & 1);
+        return 0;
+    }
+    *channel = (unsigned char)((value & ~1) | takeBit(bits, index));
+    return *channel != value;
+}
+
+/* Moves the bits [start, start + count) lying in the band in ctx->pic,
+ * whose first channel byte is first in the whole image, into the band
+ * (store set) or out of it. blocks are the band's entries from
+ * listBlocks(), for a keyed order. Returns the channel bytes changed. */
+static size_t bandBits(stegctx_t *ctx, const scatter_t *order, const tileblock_t *blocks,
+                     size_t entries, size_t first, size_t start, size_t count,
+                     unsigned char *bits, int store) {
+    unsigned char *channels = (unsigned char *)ctx->pic.rgb;
+    size_t length = (size_t)ctx->pic.width * ctx->pic.height * RGB_PER_PIXEL;
+    size_t i, offset, changed = 0;
+
+    if(!order->keyed) {
+        /* Bit i of the payload is in channel byte i. */
+        size_t from = first > start ? first : start;
+        size_t to = first + length < start + count ? first + length : start + count;
+        for(i = from; i < to; i++) changed += moveBit(channels + i - first, bits, i - start, store);
+        return changed;
+    }
+    for(i = 0; i < entries; i++) {
+        size_t mask = blockMask(order, blocks[i].block);
+        unsigned char *base = channels + blocks[i].place * SCATTER_BLOCK - first;
+        for(offset = 0; offset < SCATTER_BLOCK; offset++) {
+            size_t bit = blocks[i].block * SCATTER_BLOCK + offset;
+            if(bit >= start && bit - start < count) {
+                changed += moveBit(base + (offset ^ mask), bits, bit - start, store);
+            }
+        }
+    }
+    return changed;
+}
+
+/* Zeroes the padding after each of rows file rows, as pixelsToRows()
+ * does, for bands copied through unconverted. */
+static void clearPadding(unsigned char *rows, size_t count, size_t stride, int width) {
+    size_t row_bytes = (size_t)width * RGB_PER_PIXEL;
+    if(stride == row_bytes) return;
+    for(; count > 0; count--, rows += stride) memset(rows + row_bytes, 0, stride - row_bytes);
+}
+
+/* Runs bandBits() on every band holding part of bits [start, start +
+ * count), in file order. With outfd >= 0 the bits are stored, every
+ * band is written to outfd after the header, changed or not, and the
+ * bytes changed are added to ctx->changed_bytes. Otherwise they are
+ * gathered, reading only the bands that hold them.
+ *
+ * Input:
+ *  - stegctx_t *ctx: Pointer to the context.
+ *  - const tiles_t *tiles: The open image.
+ *  - const scatter_t *order: Order of the payload bits.
+ *  - size_t start, count: The bits to move.
+ *  - unsigned char *bits: Packed bits, count of them.
+ *  - int outfd: Descriptor for the encoded image, or -1 to gather.
+ * Output:
+ *  - STATUS_OK, or ERROR_MEMORY, ERROR_OPEN, ERROR_FORMAT or ERROR_WRITE.
+ */
+static int walkBands(stegctx_t *ctx, const tiles_t *tiles, const scatter_t *order,
+                     size_t start, size_t count, unsigned char *bits, int outfd) {
+    size_t band = tiles->bands, end = 0;
+    int status = STATUS_OK;
+
+    if(outfd < 0) memset(bits, 0, (count + BITS_PER_BYTE - 1) / BITS_PER_BYTE);
+    if(order->keyed) status = listBlocks(ctx, order, start, count, &end);
+
+    while(band-- > 0 && status == STATUS_OK) {
+        size_t rows, from = end;
+        size_t first = band * tiles->band_channels;
+
+        /* The band's blocks are the last of those not yet used. */
+        while(from > 0 && ctx->tile_blocks[from - 1].place * SCATTER_BLOCK >= first) from--;
+        int touched = order->keyed ? from < end :
+                      first < start + count && first + tiles->band_channels > start;
+        if(!touched && outfd < 0) continue;
+
+        status = readBand(ctx, tiles, band, &rows);
+        if(status != STATUS_OK) break;
+        if(touched) {
+            ctx->pic.height = (int)rows;
+            rowsToPixels(ctx->output, tiles->stride, &ctx->pic);
+            ctx->changed_bytes += bandBits(ctx, order, ctx->tile_blocks + from, end - from,
+                                           first, start, count, bits, outfd >= 0);
+            if(outfd >= 0) pixelsToRows(&ctx->pic, ctx->output, tiles->stride);
+        } else {
+            clearPadding(ctx->output, rows, tiles->stride, ctx->pic.width);
+        }
+        if(outfd >= 0) status = writeFull(outfd, ctx->output, rows * tiles->stride);
+        end = from;
+    }
+    return status;
+}
+
+/* Reads the payload header of a banded image in the given order. */
+static int readTiledHeader(stegctx_t *ctx, const tiles_t *tiles, const scatter_t *order,
+                           payloadheader_t *header) {
+    unsigned char bytes[HEADER_BITS / BITS_PER_BYTE];
+
+    if(order->bits < HEADER_BITS) return ERROR_CORRUPT;
+    int status = walkBands(ctx, tiles, order, 0, HEADER_BITS, bytes, -1);
+    if(status == STATUS_OK) status = parseHeader(bytes, order, header);
+    if(status == STATUS_OK && (header->flags & HEADER_SHARDED)) {
+        status = walkBands(ctx, tiles, order, headerBits(header->version, 0),
+                           HEADER_SHARD_BITS, bytes, -1);
+        if(status == STATUS_OK) status = parseShard(bytes, header);
+    }
+    if(status == STATUS_OK && (header->flags & HEADER_CHACHA20)) {
+        status = walkBands(ctx, tiles, order, nonceOffset(header->version, header->flags),
+                           HEADER_NONCE_BITS, header->nonce, -1);
+    }
+    if(status == STATUS_OK && (header->flags & HEADER_AUTHENTICATED)) {
+        status = walkBands(ctx, tiles, order,
+                           nonceOffset(header->version, header->flags) + HEADER_NONCE_BITS,
+                           HEADER_TAG_BITS, header->tag, -1);
+    }
+    return status;
+}
+
+/* Opens the output of a banded encode. The input is read while the
+ * output is written, so writing over it is refused rather than
+ * truncating it first. */
+static int openTiledOutput(const imagefile_t *file, const char *outfile, int *outfd) {
+    struct stat in, out;
+
+    *outfd = open(outfile, O_WRONLY | O_CREAT, 0644);
+    if(*outfd < 0) return ERROR_WRITE;
+    if(fstat(file->fd, &in) != 0 || fstat(*outfd, &out) != 0 ||
+       (in.st_dev == out.st_dev && in.st_ino == out.st_ino) || ftruncate(*outfd, 0) != 0) {
+        return ERROR_WRITE;
+    }
+    return STATUS_OK;
+}
+
+/* Matrix codes the payload in ctx->bits for a banded image: the cover
+ * LSBs it's carried in are gathered into ctx->slots behind a copy of
+ * the header and coded in place, ready to be stored by walkBands(). */
+static int matrixSlots(stegctx_t *ctx, const tiles_t *tiles, const scatter_t *order) {
+    size_t header_bits = headerBits(ctx->bits[2], ctx->bits[4]);
+    size_t embedded = embeddedBits(ctx->bits, ctx->bit_count);
+    int k = matrixK(ctx->bits[4]);
+
+    if(growBuffer((void **)&ctx->slots, &ctx->slots_capacity,
+                  (embedded + BITS_PER_BYTE - 1) / BITS_PER_BYTE) != STATUS_OK) {
+        return ERROR_MEMORY;
+    }
+    memcpy(ctx->slots, ctx->bits, header_bits / BITS_PER_BYTE);
+    unsigned char *cover = ctx->slots + header_bits / BITS_PER_BYTE;
+    int status = walkBands(ctx, tiles, order, header_bits, embedded - header_bits, cover, -1);
+    if(status == STATUS_OK) {
+        matrixEncode(cover, (embedded - header_bits) / (((size_t)1 << k) - 1), k,
+                     ctx->bits + header_bits / BITS_PER_BYTE, 0, ctx->bit_count - header_bits);
+    }
+    return status;
+}
+
+/* encodeTiled() on an image that's already open. */
+static int encodeTiles(stegctx_t *ctx, const imagefile_t *file, char *outfile, char *message) {
+    tiles_t tiles;
+    scatter_t order;
+    size_t embedded = 0;
+    int outfd = -1;
+
+    int status = openTiles(ctx, &tiles, file);
+    if(status == STATUS_OK) status = buildPayload(ctx, message);
+    if(status == STATUS_OK) {
+        initScatter(&order, ctx, (size_t)ctx->pic.width * tiles.height * RGB_PER_PIXEL);
+        embedded = embeddedBits(ctx->bits, ctx->bit_count);
+        if(embedded > order.bits) status = ERROR_TOO_SMALL;
+    }
+    int matrix = status == STATUS_OK && matrixK(ctx->bits[4]);
+    if(matrix) status = matrixSlots(ctx, &tiles, &order);
+    if(status == STATUS_OK) status = openTiledOutput(file, outfile, &outfd);
+    if(status == STATUS_OK) {
+        status = preallocate(outfd, ctx->pic.offset + (unsigned long long)tiles.stride * tiles.height);
+    }
+    if(status == STATUS_OK) status = writeFull(outfd, ctx->pic.header, ctx->pic.offset);
+    ctx->changed_bytes = 0;
+    if(status == STATUS_OK) {
+        status = walkBands(ctx, &tiles, &order, 0, embedded, matrix ? ctx->slots : ctx->bits,
+                           outfd);
+    }
+
+    if(outfd >= 0 && close(outfd) != 0 && status == STATUS_OK) status = ERROR_WRITE;
+    return status;
+}
+
+/* decodeTiled() on an image that's already open. */
+static int decodeTiles(stegctx_t *ctx, const imagefile_t *file, const char **outstring) {
+    tiles_t tiles;
+    scatter_t order;
+    payloadheader_t header;
+
+    int status = openTiles(ctx, &tiles, file);
+    size_t channels = (size_t)ctx->pic.width * tiles.height * RGB_PER_PIXEL;
+    if(status == STATUS_OK) {
+        /* With a key, images written without one still decode. */
+        initScatter(&order, ctx, channels);
+        status = readTiledHeader(ctx, &tiles, &order, &header);
+        if(status != STATUS_OK && order.keyed) {
+            order.keyed = 0;
+            order.bits = channels;
+            status = readTiledHeader(ctx, &tiles, &order, &header);
+        }
+    }
+
+    if(status == STATUS_OK && header.version == 0) {
+        /* The old format sits in the first rows, so in the first band. */
+        if(tiles.band_channels < TREE_BITS + header.payload_bits) status = ERROR_MEMORY;
+        if(status == STATUS_OK) status = loadBand(ctx, &tiles, 0);
+        if(status == STATUS_OK) status = extractLegacy(ctx, &ctx->pic, &header);
+    } else if(status == STATUS_OK) {
+        if(header.flags & HEADER_SHARDED) status = ERROR_SHARDED;
+        if((header.flags & HEADER_CHACHA20) && !ctx->encrypted) status = ERROR_PASSPHRASE;
+        size_t header_bits = headerBits(header.version, header.flags);
+        size_t slots = payloadSlots(header.flags, header.payload_bits);
+        int k = matrixK(header.flags);
+        if(status == STATUS_OK) status = reserveBits(&ctx->packed, header.payload_bits);
+        if(status == STATUS_OK && k) {
+            /* The cover LSBs are gathered first, then their syndromes read. */
+            status = growBuffer((void **)&ctx->slots, &ctx->slots_capacity,
+                                (slots + BITS_PER_BYTE - 1) / BITS_PER_BYTE);
+            if(status == STATUS_OK) {
+                status = walkBands(ctx, &tiles, &order, header_bits, slots, ctx->slots, -1);
+            }
+            if(status == STATUS_OK) {
+                matrixDecode(ctx->slots, slots / (((size_t)1 << k) - 1), k, ctx->packed.data, 0,
+                             header.payload_bits);
+            }
+        } else if(status == STATUS_OK) {
+            status = walkBands(ctx, &tiles, &order, header_bits, header.payload_bits,
+                               ctx->packed.data, -1);
+        }
+        ctx->packed.count = header.payload_bits;
+        if(status == STATUS_OK) status = expandPayload(ctx, &header);
+    }
+
+    if(status == STATUS_OK) *outstring = ctx->message;
+    return status;
+}
+
+/* Encodes a message into an image file holding only a band of rows in
+ * memory at a time, sized by ctx->memory_limit, which must be set. The
+ * output is the same as encodeContext() gives, but can't replace the
+ * input file. Besides the band, a keyed order needs 16 bytes per 64
+ * payload bits to sort its blocks.
+ *
+ * Input:
+ *  - stegctx_t *ctx: Pointer to the context.
+ *  - char *infile: Pointer to char infile, the cover image to read.
+ *  - char *outfile: Pointer to char outfile, the image to write.
+ *  - char *message: Pointer to char (string) message.
+ * Output:
+ *  - STATUS_OK, or the status of the step that failed. ERROR_MEMORY
+ *    if memory_limit can't hold a band.
+ */
+int encodeTiled(stegctx_t *ctx, char *infile, char *outfile, char *message) {
+    imagefile_t file;
+    resetAllocStats();
+
+    int status = openImage(infile, &file);
+    if(status == STATUS_OK) status = encodeTiles(ctx, &file, outfile, message);
+    closeImage(&file);
+    return status;
+}
+
+/* Decodes the message in an image file holding only a band of rows in
+ * memory at a time, see encodeTiled(). Only the bands holding the
+ * header and payload are read.
+ *
+ * Input:
+ *  - stegctx_t *ctx: Pointer to the context.
+ *  - char *infile: Pointer to char infile, the encoded image to read.
+ *  - const char **outstring: Receives the message, owned by the context.
+ * Output:
+ *  - STATUS_OK, or the status of the step that failed.
+ */
+int decodeTiled(stegctx_t *ctx, char *infile, const char **outstring) {
+    imagefile_t file;
+    resetAllocStats();
+
+    int status = openImage(infile, &file);
+    if(status == STATUS_OK) status = decodeTiles(ctx, &file, outstring);
+    closeImage(&file);
+    return status;
+}
+
+/***** Fan-out *****/
+/* Batch operations take the files IO_BATCH at a time: a batch is read
+ * through the I/O engine in one go, processed in parallel with one
+ * context per thread, and its outputs written together with the next
+ * batch's reads, so the disk always has a batch's worth in flight. */
+typedef struct {
+    unsigned char *input;
+    size_t input_capacity;
+    size_t input_length;
+    unsigned char *output;
+    size_t output_capacity;
+    size_t output_length;
+    char *message;
+    size_t message_capacity;
+} ioslot_t;
+
+/* One piece of a sharded payload: the bitstream embedded in its cover
+ * when encoding, the header and payload bits read back when decoding. */
+typedef struct {
+    payloadheader_t header;
+    unsigned char *bits;
+    size_t capacity;
+    size_t bit_count;
+} shard_t;
+
+typedef struct {
+    /* Holds the payload when encoding, the keys when decoding. */
+    const stegctx_t *ctx;
+    char **infiles;
+    char **outfiles;
+    int *statuses;
+    /* One per file when sharding, replacing ctx's payload. */
+    shard_t *shards;
+    int first;
+    stegctx_t *workers;
+    ioslot_t slots[IO_BATCH];
+    iorequest_t requests[2 * IO_BATCH];
+} batch_t;
+
+/* Reads one shard from an image into shard, checking its CRC. */
+static int gatherShard(stegctx_t *ctx, image_t *pic, shard_t *shard) {
+    payloadheader_t *header = &shard->header;
+
+    int status = gatherPayload(ctx, pic, header);
+    if(status != STATUS_OK) return status;
+    if(!(header->flags & HEADER_SHARDED) ||
+       payloadCrc(header, ctx->packed.data, header->payload_bits) != header->crc) {
+        return ERROR_CORRUPT;
+    }
+
+    size_t bytes = (header->payload_bits + BITS_PER_BYTE - 1) / BITS_PER_BYTE;
+    if(growBuffer((void **)&shard->bits, &shard->capacity, bytes) != STATUS_OK) {
+        return ERROR_MEMORY;
+    }
+    memcpy(shard->bits, ctx->packed.data, bytes);
+    shard->bit_count = header->payload_bits;
+    return STATUS_OK;
+}
+
+/* Embeds into, or extracts from, one file of the current batch. */
+static void batchItem(int index, int worker, void *user) {
+    batch_t *job = user;
+    int item = job->first + index;
+    ioslot_t *slot = &job->slots[index];
+    stegctx_t *state = &job->workers[worker];
+
+    if(job->statuses[item] != STATUS_OK) return;
+    int status = parseImageBuffer(slot->input, slot->input_length, &state->pic,
+                                  &state->header_capacity, &state->rgb_capacity);
+    if(job->outfiles) {
+        if(status == STATUS_OK && job->shards) {
+            status = applyBits(job->ctx, &state->pic, job->shards[item].bits,
+                               job->shards[item].bit_count, NULL);
+        } else if(status == STATUS_OK) {
+            status = applyPayload(job->ctx, &state->pic);
+        }
+        if(status == STATUS_OK) {
+            status = serialiseImage(&state->pic, &slot->output, &slot->output_capacity,
+                                    &slot->output_length);
+        }
+    } else if(job->shards) {
+        if(status == STATUS_OK) status = gatherShard(state, &state->pic, &job->shards[item]);
+    } else {
+        if(status == STATUS_OK) status = extractPayload(state, &state->pic);
+        if(status == STATUS_OK && growBuffer((void **)&slot->message, &slot->message_capacity,
+                                             state->message_length + 1) != STATUS_OK) {
+            status = ERROR_MEMORY;
+        }
+        if(status == STATUS_OK) memcpy(slot->message, state->message, state->message_length + 1);
+    }
+    job->statuses[item] = status;
+}
+
+/* Queues the reads of the batch starting at first after count other
+ * requests, returning the new request count. */
+static int queueBatchReads(batch_t *job, int first, int total, int count) {
+    int i;
+    for(i = 0; i < IO_BATCH && first + i < total; i++, count++) {
+        ioslot_t *slot = &job->slots[i];
+        queueRead(job->infiles[first + i], &job->requests[count], &slot->input,
+                  &slot->input_capacity);
+        job->requests[count].tag = first + i;
+        slot->input_length = job->requests[count].length;
+    }
+    return count;
+}
+
+/* Runs queued requests, recording each one's status for its file. */
+static int finishRequests(batch_t *job, ioengine_t *engine, int count) {
+    int i;
+    int status = runIo(engine, job->requests, count);
+    for(i = 0; i < count; i++) {
+        int *file_status = &job->statuses[job->requests[i].tag];
+        if(*file_status == STATUS_OK || !job->requests[i].write) {
+            *file_status = status != STATUS_OK ? status : job->requests[i].status;
+        }
+    }
+    closeRequests(job->requests, count);
+    return status;
+}
+
+/* The batch pipeline behind encodeMany(), decodeMany() and the
+ * sharded versions. With outfiles, ctx's payload, or each file's shard,
+ * is embedded into each file. Without, each file is decoded and
+ * decoded() called in file order, or its shard read into shards. */
+static int runBatches(const stegctx_t *ctx, char **infiles, char **outfiles, int count,
+                      int *statuses, int threads, shard_t *shards,
+                      void (*decoded)(int item, const char *message, void *user), void *user) {
+    ioengine_t engine;
+    batch_t *job;
+    int i, first;
+
+    int status = initIoEngine(&engine, ctx->io_engine);
+    if(status != STATUS_OK) return status;
+    threads = parallelThreads(threads, count < IO_BATCH ? count : IO_BATCH);
+    job = stegAlloc(sizeof(batch_t));
+    if(job) job->workers = stegAlloc(threads * sizeof(stegctx_t));
+    if(!job || !job->workers) {
+        stegFree(job);
+        freeIoEngine(&engine);
+        return ERROR_MEMORY;
+    }
+
+    memset(job->slots, 0, sizeof(job->slots));
+    for(i = 0; i < threads; i++) {
+        stegctx_t *worker = &job->workers[i];
+        initContext(worker);
+        worker->scattered = ctx->scattered;
+        worker->scatter_key = ctx->scatter_key;
+        worker->encrypted = ctx->encrypted;
+        worker->passkey = ctx->passkey;
+        /* The batch already has a thread per CPU. */
+        worker->codec_threads = 1;
+    }
+    job->ctx = ctx;
+    job->infiles = infiles;
+    job->outfiles = outfiles;
+    job->statuses = statuses;
+    job->shards = shards;
+    for(i = 0; i < count; i++) statuses[i] = STATUS_OK;
+
+    status = finishRequests(job, &engine, queueBatchReads(job, 0, count, 0));
+    for(first = 0; first < count && status == STATUS_OK; first += IO_BATCH) {
+        int size = count - first < IO_BATCH ? count - first : IO_BATCH;
+        job->first = first;
+        parallelFor(size, threads, batchItem, job);
+
+        int queued = 0;
+        for(i = 0; i < size && outfiles; i++) {
+            if(statuses[first + i] != STATUS_OK) continue;
+            queueWrite(outfiles[first + i], &job->requests[queued], job->slots[i].output,
+                       job->slots[i].output_length);
+            job->requests[queued++].tag = first + i;
+        }
+        for(i = 0; i < size && decoded; i++) {
+            if(statuses[first + i] == STATUS_OK) decoded(first + i, job->slots[i].message, user);
+        }
+        queued = queueBatchReads(job, first + IO_BATCH, count, queued);
+        status = finishRequests(job, &engine, queued);
+    }
+
+    for(i = 0; i < IO_BATCH; i++) {
+        stegFree(job->slots[i].input);
+        stegFree(job->slots[i].output);
+        stegFree(job->slots[i].message);
+    }
+    for(i = 0; i < threads; i++) freeContext(&job->workers[i]);
+    stegFree(job->workers);
+    stegFree(job);
+    freeIoEngine(&engine);
+    return status;
+}
+
+/* Encodes one message into many covers. The message is compressed and
+ * its bitstream built once in ctx, then applied to the covers in
+ * batches: each batch is read through the I/O engine chosen by
+ * ctx->io_engine, embedded in parallel and written back while the next
+ * batch is read. With a custom allocator, it must be safe to call from
+ * several threads.
+ *
+ * Input:
+ *  - stegctx_t *ctx: Pointer to the context holding the payload.
+ *  - char *message: Pointer to char (string) message.
+ *  - char **infiles: The cover images.
+ *  - char **outfiles: Where to write each encoded cover.
+ *  - int count: Number of covers.
+ *  - int *statuses: Receives the status of each cover.
+ *  - int threads: Thread count, 0 for one per online CPU.
+ * Output:
+ *  - STATUS_OK if the payload was built, statuses then tell which
+ *    covers failed. Otherwise the buildPayload() error, and no cover is
+ *    touched.
+ */
+int encodeMany(stegctx_t *ctx, char *message, char **infiles, char **outfiles,
+               int count, int *statuses, int threads) {
+    resetAllocStats();
+
+    int status = buildPayload(ctx, message);
+    if(status != STATUS_OK || count <= 0) return status;
+    return runBatches(ctx, infiles, outfiles, count, statuses, threads, NULL, NULL, NULL);
+}
+
+/* Decodes many images, reading them in batches through the I/O engine
+ * chosen by ctx->io_engine and decoding each batch in parallel, with
+ * ctx's scatter key and passphrase. decoded() is called from the
+ * calling thread, in file order, for each image that decodes.
+ *
+ * Input:
+ *  - stegctx_t *ctx: Pointer to the context holding the keys.
+ *  - char **infiles: The images.
+ *  - int count: Number of images.
+ *  - int *statuses: Receives the status of each image.
+ *  - int threads: Thread count, 0 for one per online CPU.
+ *  - void (*decoded)(int, const char *, void *): Gets each message.
+ *  - void *user: Passed to decoded.
+ * Output:
+ *  - STATUS_OK, statuses then tell which images failed, or
+ *    ERROR_MEMORY or ERROR_OPEN if the batch couldn't run.
+ */
+int decodeMany(stegctx_t *ctx, char **infiles, int count, int *statuses, int threads,
+               void (*decoded)(int item, const char *message, void *user), void *user) {
+    resetAllocStats();
+    if(count <= 0) return STATUS_OK;
+    return runBatches(ctx, infiles, NULL, count, statuses, threads, NULL, decoded, user);
+}
+
+/* Shares out total_bytes of payload over covers in proportion to the
+ * bytes each has room for, so every cover carries about the same
+ * fraction of its capacity. */
+static void shareBytes(const unsigned long long *room, unsigned long long *shares, int count,
+                       unsigned long long total_bytes) {
+    unsigned long long sum = 0, given = 0;
+    int i;
+
+    for(i = 0; i < count; i++) sum += room[i];
+    for(i = 0; i < count; i++) {
+        shares[i] = (unsigned long long)((double)total_bytes * room[i] / sum);
+        if(shares[i] > room[i]) shares[i] = room[i];
+        if(shares[i] > total_bytes - given) shares[i] = total_bytes - given;
+        given += shares[i];
+    }
+    /* Rounding leaves a few bytes over, given to covers with room. */
+    for(i = 0; i < count && given < total_bytes; i++) {
+        unsigned long long extra = room[i] - shares[i];
+        if(extra > total_bytes - given) extra = total_bytes - given;
+        shares[i] += extra;
+        given += extra;
+    }
+}
+
+/* Splits the payload in ctx->packed into one shard per cover, after
+ * the header's fields have been filled in by packMessage(). */
+static int buildShards(const stegctx_t *ctx, const payloadheader_t *header,
+                       const unsigned long long *shares, shard_t *shards, int count) {
+    unsigned char id[CHACHA_NONCE_BYTES];
+    size_t offset = 0, total_bytes = (header->payload_bits + BITS_PER_BYTE - 1) / BITS_PER_BYTE;
+    int i;
+
+    /* Tells shards of this payload from those of any other. */
+    makeNonce(id);
+    for(i = 0; i < count; i++) {
+        shard_t *shard = &shards[i];
+        shard->header = *header;
+        shard->header.flags |= HEADER_SHARDED;
+        shard->header.shard_id = readLE32(id);
+        shard->header.shard_index = i;
+        shard->header.shard_count = count;
+
+        /* Shards hold whole bytes, bar the one ending the payload. */
+        shard->header.payload_bits = shares[i] * BITS_PER_BYTE;
+        if(shares[i] > 0 && offset + shares[i] == total_bytes) {
+            shard->header.payload_bits -= total_bytes * BITS_PER_BYTE - header->payload_bits;
+        }
+        shard->header.crc = payloadCrc(&shard->header, ctx->packed.data + offset,
+                                       shard->header.payload_bits);
+        if(layoutPayload(&shard->header, ctx->packed.data + offset, &shard->bits,
+                         &shard->capacity, &shard->bit_count) != STATUS_OK) {
+            return ERROR_MEMORY;
+        }
+        offset += shares[i];
+    }
+    return STATUS_OK;
+}
+
+/* Bytes of payload a cover has room for as a shard. */
+static int shardRoom(const char *path, int flags, unsigned long long *room) {
+    imagefile_t file;
+
+    int status = openImage(path, &file);
+    if(status == STATUS_OK) {
+        unsigned long long channels = (unsigned long long)file.ih.biWidth *
+                                      file.ih.biHeight * RGB_PER_PIXEL;
+        size_t header_bits = headerBits(HEADER_VERSION, flags | HEADER_SHARDED);
+        *room = channels > header_bits ? payloadRoom(flags, channels - header_bits) : 0;
+        if(*room > HEADER_LENGTH_MAX) *room = HEADER_LENGTH_MAX;
+        *room /= BITS_PER_BYTE;
+    }
+    closeImage(&file);
+    return status;
+}
+
+static void freeShards(shard_t *shards, int count) {
+    int i;
+    for(i = 0; shards && i < count; i++) stegFree(shards[i].bits);
+    stegFree(shards);
+}
+
+/* Encodes one message split over several covers, for payloads too big
+ * for any one of them. The message is compressed (and encrypted) once,
+ * then the payload is cut into one shard per cover, in the order given,
+ * sized to each cover's capacity. Every shard carries a header with
+ * HEADER_SHARDED, a random payload id, its index and the shard count,
+ * and a CRC of its own bits. The covers are then encoded in parallel
+ * through the same batch pipeline as encodeMany().
+ *
+ * Input:
+ *  - stegctx_t *ctx: Pointer to the context.
+ *  - char *message: Pointer to char (string) message.
+ *  - char **infiles: The cover images, at most MAX_SHARDS.
+ *  - char **outfiles: Where to write each encoded cover.
+ *  - int count: Number of covers.
+ *  - int *statuses: Receives the status of each cover.
+ *  - int threads: Thread count, 0 for one per online CPU.
+ * Output:
+ *  - STATUS_OK if every shard was written. Otherwise the first failing
+ *    status, statuses telling which covers failed: ERROR_TOO_SMALL if
+ *    the covers together can't hold the payload, ERROR_TOO_LARGE for
+ *    more than MAX_SHARDS covers, or the buildPayload() errors. No
+ *    cover is written unless they can all be opened and hold the
+ *    payload.
+ */
+int encodeSharded(stegctx_t *ctx, char *message, char **infiles, char **outfiles,
+                  int count, int *statuses, int threads) {
+    payloadheader_t header;
+    unsigned long long room_total = 0;
+    int i;
+    resetAllocStats();
+
+    for(i = 0; i < count; i++) statuses[i] = STATUS_OK;
+    if(count <= 0) return ERROR_TOO_SMALL;
+    if(count > MAX_SHARDS) return ERROR_TOO_LARGE;
+    shard_t *shards = stegAlloc(count * sizeof(shard_t));
+    unsigned long long *room = stegAlloc(count * 2 * sizeof(unsigned long long));
+    if(!shards || !room) {
+        stegFree(shards);
+        stegFree(room);
+        return ERROR_MEMORY;
+    }
+    memset(shards, 0, count * sizeof(shard_t));
+
+    /* Every cover is checked, so statuses name each one that's unusable. */
+    int status = packMessage(ctx, message, &header), packed = status;
+    for(i = 0; i < count; i++) {
+        room[i] = 0;
+        statuses[i] = packed == STATUS_OK ? shardRoom(infiles[i], header.flags, &room[i]) :
+                      STATUS_OK;
+        if(status == STATUS_OK) status = statuses[i];
+        room_total += room[i];
+    }
+    if(status == STATUS_OK &&
+       room_total < (header.payload_bits + BITS_PER_BYTE - 1) / BITS_PER_BYTE) {
+        status = ERROR_TOO_SMALL;
+    }
+    if(status == STATUS_OK) {
+        shareBytes(room, room + count, count,
+                   (header.payload_bits + BITS_PER_BYTE - 1) / BITS_PER_BYTE);
+        status = buildShards(ctx, &header, room + count, shards, count);
+    }
+    if(status == STATUS_OK) {
+        status = runBatches(ctx, infiles, outfiles, count, statuses, threads, shards, NULL, NULL);
+    }
+    for(i = 0; i < count && status == STATUS_OK; i++) status = statuses[i];
+
+    freeShards(shards, count);
+    stegFree(room);
+    return status;
+}
+
+/* Tells whether two shards belong to the same payload. */
+static int sameShardSet(const payloadheader_t *a, const payloadheader_t *b) {
+    return a->shard_id == b->shard_id && a->shard_count == b->shard_count &&
+           a->version == b->version && a->codec == b->codec && a->flags == b->flags &&
+           a->message_length == b->message_length &&
+           (!(a->flags & HEADER_CHACHA20) || memcmp(a->nonce, b->nonce, CHACHA_NONCE_BYTES) == 0);
+}
+
+/* Puts the shards read by decodeSharded() back together in index order
+ * in ctx->packed and expands them into ctx->message. Shards of another
+ * payload, or repeats, are marked ERROR_CORRUPT in statuses. */
+static int joinShards(stegctx_t *ctx, shard_t *shards, int *statuses, int count) {
+    const payloadheader_t *set = NULL;
+    size_t total = 0, offset = 0;
+    int i;
+
+    /* The first shard read names the payload the others must match. */
+    for(i = 0; i < count; i++) {
+        if(statuses[i] != STATUS_OK) continue;
+        if(!set) set = &shards[i].header;
+        else if(!sameShardSet(set, &shards[i].header)) statuses[i] = ERROR_CORRUPT;
+    }
+    if(!set) return ERROR_MISSING_SHARD;
+
+    int *order = stegAlloc(set->shard_count * sizeof(int));
+    if(!order) return ERROR_MEMORY;
+    for(i = 0; i < set->shard_count; i++) order[i] = -1;
+    for(i = 0; i < count; i++) {
+        if(statuses[i] != STATUS_OK) continue;
+        if(order[shards[i].header.shard_index] >= 0) statuses[i] = ERROR_CORRUPT;
+        else order[shards[i].header.shard_index] = i;
+    }
+
+    int status = STATUS_OK;
+    for(i = 0; i < set->shard_count && status == STATUS_OK; i++) {
+        if(order[i] < 0) status = ERROR_MISSING_SHARD;
+        else total += shards[order[i]].bit_count;
+    }
+    if(status == STATUS_OK && (total > HEADER_LENGTH_MAX ||
+                               set->message_length / MAX_EXPANSION > total)) {
+        status = ERROR_CORRUPT;
+    }
+    if(status == STATUS_OK) status = reserveBits(&ctx->packed, total);
+
+    /* Every shard but the last holding bits ends on a byte boundary. */
+    for(i = 0; i < set->shard_count && status == STATUS_OK; i++) {
+        const shard_t *shard = &shards[order[i]];
+        if(shard->bit_count == 0) continue;
+        if(offset % BITS_PER_BYTE != 0) {
+            status = ERROR_CORRUPT;
+            break;
+        }
+        memcpy(ctx->packed.data + offset / BITS_PER_BYTE, shard->bits,
+               (shard->bit_count + BITS_PER_BYTE - 1) / BITS_PER_BYTE);
+        offset += shard->bit_count;
+    }
+    stegFree(order);
+    if(status != STATUS_OK) return status;
+
+    payloadheader_t whole = *set;
+    whole.payload_bits = total;
+    ctx->packed.count = total;
+    return expandPacked(ctx, &whole);
+}
+
+/* Decodes a payload written by encodeSharded(). The images are read
+ * and their shards gathered in parallel through the batch pipeline,
+ * each checked against its own CRC, then put back together by shard
+ * index, whatever order the files are given in.
+ *
+ * Input:
+ *  - stegctx_t *ctx: Pointer to the context holding the keys.
+ *  - char **infiles: The images holding the shards.
+ *  - int count: Number of images.
+ *  - int *statuses: Receives the status of each image.
+ *  - int threads: Thread count, 0 for one per online CPU.
+ *  - const char **outstring: Receives the message, owned by the context
+ *                            and valid until its next call.
+ * Output:
+ *  - STATUS_OK, or ERROR_MISSING_SHARD if any shard couldn't be read
+ *    (statuses then tell why for each image), ERROR_CORRUPT if the
+ *    shards don't expand, ERROR_MEMORY or ERROR_OPEN.
+ */
+int decodeSharded(stegctx_t *ctx, char **infiles, int count, int *statuses, int threads,
+                  const char **outstring) {
+    int i;
+    resetAllocStats();
+
+    for(i = 0; i < count; i++) statuses[i] = STATUS_OK;
+    if(count <= 0) return ERROR_MISSING_SHARD;
+    shard_t *shards = stegAlloc(count * sizeof(shard_t));
+    if(!shards) return ERROR_MEMORY;
+    memset(shards, 0, count * sizeof(shard_t));
+
+    int status = runBatches(ctx, infiles, NULL, count, statuses, threads, shards, NULL, NULL);
+    if(status == STATUS_OK) status = joinShards(ctx, shards, statuses, count);
+    if(status == STATUS_OK) *outstring = ctx->message;
+    freeShards(shards, count);
+    return status;
+}
+
+/***** Scanning *****/
+/* Files found under the scanned directory. */
+typedef struct {
+    char **paths;
+    int count;
+    int capacity;
+} pathlist_t;
+
+/* Per-thread buffers for the rows read from each file. */
+typedef struct {
+    image_t pic;
+    size_t rgb_capacity;
+    unsigned char *rows;
+    size_t rows_capacity;
+} scanworker_t;
+
+typedef struct {
+    pathlist_t *files;
+    scanworker_t *workers;
+    void (*found)(const char *path, const payloadheader_t *header, void *user);
+    void *user;
+    unsigned long carriers;
+} scan_t;
+
+static int addPath(pathlist_t *list, char *path) {
+    if(list->count == list->capacity) {
+        int capacity = list->capacity ? list->capacity * 2 : 256;
+        char **paths = stegAlloc(capacity * sizeof(char *));
+        if(!paths) return ERROR_MEMORY;
+        if(list->count) memcpy(paths, list->paths, list->count * sizeof(char *));
+        stegFree(list->paths);
+        list->paths = paths;
+        list->capacity = capacity;
+    }
+    list->paths[list->count++] = path;
+    return STATUS_OK;
+}
+
+/* Collects every regular file under dir. Symbolic links to files are
+ * kept, links to directories are not followed so cycles can't occur,
+ * and subdirectories that can't be opened are skipped. */
+static int listFiles(const char *dir, pathlist_t *list) {
+    struct dirent *entry;
+    int status = STATUS_OK;
+
+    DIR *handle = opendir(dir);
+    if(!handle) return ERROR_OPEN;
+
+    while(status == STATUS_OK && (entry = readdir(handle)) != NULL) {
+        if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+
+        char *path = stegAlloc(strlen(dir) + strlen(entry->d_name) + 2);
+        if(!path) {
+            status = ERROR_MEMORY;
+            break;
+        }
+        sprintf(path, "%s/%s", dir, entry->d_name);
+
+        /* d_type saves a stat() per file where the filesystem fills it in. */
+        int type = entry->d_type;
+        struct stat info;
+        if(type == DT_UNKNOWN && lstat(path, &info) == 0) {
+            type = S_ISDIR(info.st_mode) ? DT_DIR : S_ISLNK(info.st_mode) ? DT_LNK : DT_REG;
+        }
+        if(type == DT_LNK) type = stat(path, &info) == 0 && S_ISREG(info.st_mode) ? DT_REG : DT_UNKNOWN;
+
+        if(type == DT_DIR) {
+            status = listFiles(path, list);
+            if(status == ERROR_OPEN) status = STATUS_OK;
+            stegFree(path);
+        } else if(type == DT_REG) {
+            status = addPath(list, path);
+            if(status != STATUS_OK) stegFree(path);
+        } else {
+            stegFree(path);
+        }
+    }
+    closedir(handle);
+    return status;
+}
+
+/* Checks one file for a payload header, reading as little as possible:
+ * one pread() for the BMP headers and one for the top rows, which hold
+ * the payload header and are the last rows in the file. Only payloads
+ * written without a scatter key can be found. */
+static int probeFile(const char *path, scanworker_t *state, payloadheader_t *header) {
+    unsigned char bytes[BMP_HEADERS_SIZE];
+    fileheader_t fh;
+    imageheader_t ih;
+    scatter_t order;
+    int i;
+
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) return ERROR_OPEN;
+
+    int status = ERROR_FORMAT;
+    if(pread(fd, bytes, BMP_HEADERS_SIZE, 0) == BMP_HEADERS_SIZE) {
+        parseHeaders(bytes, &fh, &ih);
+        status = validateHeaders(&fh, &ih);
+    }
+
+    /* Enough rows for the largest header, or the old format's table. */
+    size_t wanted = HEADER_MAX_BITS;
+    if(wanted < TREE_BITS) wanted = TREE_BITS;
+    size_t stride = 0, rows = 0;
+    if(status == STATUS_OK) {
+        stride = (size_t)ih.biWidth * RGB_PER_PIXEL + calcPadding(ih.biWidth);
+        rows = (wanted + (size_t)ih.biWidth * RGB_PER_PIXEL - 1) / ((size_t)ih.biWidth * RGB_PER_PIXEL);
+        if(rows > (size_t)ih.biHeight) rows = ih.biHeight;
+        status = growBuffer((void **)&state->rows, &state->rows_capacity, rows * stride);
+    }
+    if(status == STATUS_OK) {
+        off_t start = (off_t)fh.bfOffBits + (off_t)(ih.biHeight - rows) * stride;
+        if(pread(fd, state->rows, rows * stride, start) != (ssize_t)(rows * stride)) {
+            status = ERROR_CORRUPT;
+        }
+    }
+    close(fd);
+    if(status != STATUS_OK) return status;
+
+    state->pic.width = ih.biWidth;
+    state->pic.height = (int)rows;
+    if(growBuffer((void **)&state->pic.rgb, &state->rgb_capacity,
+                  (size_t)ih.biWidth * rows * sizeof(rgb_t)) != STATUS_OK) {
+        return ERROR_MEMORY;
+    }
+    rowsToPixels(state->rows, stride, &state->pic);
+
+    /* The order covers the whole image so sizes are checked against it,
+       though only the rows read are touched. */
+    order.keyed = 0;
+    order.bits = (size_t)ih.biWidth * ih.biHeight * RGB_PER_PIXEL;
+    status = readHeader(&state->pic, &order, header);
+    if(status != STATUS_OK || header->version != 0) return status;
+
+    /* The old format has no magic, so its frequencies must add up to
+       the message length. */
+    unsigned long total = 0;
+    for(i = 0; i < MAX_MESSAGE_SIZE; i++) {
+        total += readLSBNumber(&state->pic, BITS_PER_BYTE * 2 + i * BITS_PER_BYTE, BITS_PER_BYTE);
+    }
+    return total == header->message_length && total > 0 ? STATUS_OK : ERROR_CORRUPT;
+}
+
+static void scanFile(int item, int worker, void *user) {
+    scan_t *job = user;
+    payloadheader_t header;
+
+    if(probeFile(job->files->paths[item], &job->workers[worker], &header) != STATUS_OK) return;
+    __sync_add_and_fetch(&job->carriers, 1);
+    job->found(job->files->paths[item], &header, job->user);
+}
+
+/* Finds the images under a directory that carry a payload. Each file
+ * costs two small reads: its BMP headers, then the rows holding the
+ * payload header, which is validated without reading the payload.
+ * Files are shared out over a thread pool; found() is called from the
+ * pool's threads, once per carrier, in no particular order.
+ *
+ * Input:
+ *  - const char *dir: Directory to scan, subdirectories included.
+ *  - int threads: Thread count, 0 for SCAN_THREADS_PER_CPU per CPU.
+ *  - void (*found)(...): Called with each carrier's path and header.
+ *  - void *user: Passed to found.
+ *  - unsigned long *files: Receives the number of files checked.
+ *  - unsigned long *carriers: Receives the number of carriers found.
+ * Output:
+ *  - STATUS_OK, ERROR_OPEN if dir can't be read, or ERROR_MEMORY.
+ */
+int scanDirectory(const char *dir, int threads,
+                  void (*found)(const char *path, const payloadheader_t *header, void *user),
+                  void *user, unsigned long *files, unsigned long *carriers) {
+    pathlist_t list;
+    scan_t job;
+    int i;
+
+    list.paths = NULL;
+    list.count = 0;
+    list.capacity = 0;
+    *files = 0;
+    *carriers = 0;
+
+    /* Reads dominate, so more threads than CPUs keep the disk busy. */
+    if(threads <= 0) threads = parallelThreads(0, MAX_THREADS) * SCAN_THREADS_PER_CPU;
+
+    int status = listFiles(dir, &list);
+    if(status == STATUS_OK && list.count > 0) {
+        threads = parallelThreads(threads, list.count);
+        job.workers = stegAlloc(threads * sizeof(scanworker_t));
+        if(!job.workers) status = ERROR_MEMORY;
+    }
+    if(status == STATUS_OK && list.count > 0) {
+        for(i = 0; i < threads; i++) {
+            job.workers[i].pic.header = NULL;
+            job.workers[i].pic.rgb = NULL;
+            job.workers[i].rgb_capacity = 0;
+            job.workers[i].rows = NULL;
+            job.workers[i].rows_capacity = 0;
+        }
+        job.files = &list;
+        job.found = found;
+        job.user = user;
+        job.carriers = 0;
+        parallelFor(list.count, threads, scanFile, &job);
+
+        for(i = 0; i < threads; i++) {
+            freeImage(&job.workers[i].pic);
+            stegFree(job.workers[i].rows);
+        }
+        stegFree(job.workers);
+        *files = list.count;
+        *carriers = job.carriers;
+    }
+
+    for(i = 0; i < list.count; i++) stegFree(list.paths[i]);
+    stegFree(list.paths);
+    return status;
+}
+
+/***** Server *****/
+/* Requests and replies are frames: a 32 bit little-endian body length,
+ * then the body, with every number 32 bit little-endian. A request
+ * body holds the operation, flags (REQUEST_IMAGE_FD, REQUEST_OUTPUT_FD)
+ * and codec, then five strings: input path, output path, message,
+ * scatter key and passphrase. Each string is its length, its bytes and
+ * a NUL; empty means not given. Descriptors flagged in a request are
+ * sent with its first bytes as SCM_RIGHTS, the input image first.
+ * A reply body holds the status, codec, payload bits, width, height,
+ * payload capacity in bits, payload state, header flags and message
+ * length, then a data string: the decoded message, or the encoded
+ * image when it wasn't written to a file or descriptor. */
+#define REQUEST_FIXED_BYTES 12
+#define REQUEST_STRINGS 5
+#define REPLY_FIXED_BYTES 36
+#define MAX_FRAME_FDS 2
+
+/* One thread of the server's pool, with its own warm buffers. */
+typedef struct {
+    stegctx_t ctx;
+    imagecache_t cache;
+    unsigned char *frame;
+    size_t frame_capacity;
+    int listen_fd;
+    volatile int conn;
+    volatile int *stopping;
+    pthread_t id;
+} serveworker_t;
+
+static void storeLE32(unsigned char *bytes, unsigned long value) {
+    bytes[0] = (unsigned char)value;
+    bytes[1] = (unsigned char)(value >> 8);
+    bytes[2] = (unsigned char)(value >> 16);
+    bytes[3] = (unsigned char)(value >> 24);
+}
+
+/* Appends a protocol string, NULL being the same as empty. */
+static size_t storeString(unsigned char *bytes, const char *string, size_t length) {
+    storeLE32(bytes, length);
+    if(length) memcpy(bytes + 4, string, length);
+    bytes[4 + length] = '\0';
+    return 4 + length + 1;
+}
+
+/* Reads a protocol string at *pos, returning NULL if it is empty and
+ * setting *status if it runs past the body or lacks its NUL. */
+static const char *takeString(const unsigned char *body, size_t length, size_t *pos,
+                              size_t *string_length, int *status) {
+    *string_length = 0;
+    if(length - *pos < 5) {
+        *status = ERROR_CORRUPT;
+        return NULL;
+    }
+    size_t size = readLE32(body + *pos);
+    if(size > length - *pos - 5 || body[*pos + 4 + size] != '\0') {
+        *status = ERROR_CORRUPT;
+        return NULL;
+    }
+    const char *string = (const char *)body + *pos + 4;
+    *pos += 4 + size + 1;
+    *string_length = size;
+    return size ? string : NULL;
+}
+
+/* Receives one frame into a growing buffer, with any descriptors sent
+ * alongside it. Descriptors beyond MAX_FRAME_FDS are closed.
+ * ERROR_FORMAT means the peer closed the connection between frames. */
+static int receiveFrame(int conn, unsigned char **frame, size_t *capacity, size_t *length,
+                        int fds[MAX_FRAME_FDS], int *fd_count) {
+    unsigned char prefix[4];
+    struct msghdr message;
+    struct iovec part;
+    struct cmsghdr *control;
+    union {
+        struct cmsghdr align;
+        char bytes[CMSG_SPACE(MAX_FRAME_FDS * sizeof(int))];
+    } ancillary;
+    ssize_t got;
+
+    *fd_count = 0;
+    memset(&message, 0, sizeof(message));
+    part.iov_base = prefix;
+    part.iov_len = sizeof(prefix);
+    message.msg_iov = &part;
+    message.msg_iovlen = 1;
+    message.msg_control = ancillary.bytes;
+    message.msg_controllen = sizeof(ancillary.bytes);
+    do {
+        got = recvmsg(conn, &message, MSG_CMSG_CLOEXEC);
+    } while(got < 0 && errno == EINTR);
+    if(got <= 0) return got == 0 ? ERROR_FORMAT : ERROR_OPEN;
+
+    for(control = CMSG_FIRSTHDR(&message); control; control = CMSG_NXTHDR(&message, control)) {
+        if(control->cmsg_level != SOL_SOCKET || control->cmsg_type != SCM_RIGHTS) continue;
+        int i, count = (int)((control->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+        for(i = 0; i < count; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(control) + i * sizeof(int), sizeof(int));
+            if(*fd_count < MAX_FRAME_FDS) fds[(*fd_count)++] = fd;
+            else close(fd);
+        }
+    }
+
+    int status = STATUS_OK;
+    if(got < (ssize_t)sizeof(prefix)) status = readFull(conn, prefix + got, sizeof(prefix) - got);
+    if(status == STATUS_OK) {
+        *length = readLE32(prefix);
+        if(*length > MAX_FRAME_BYTES) status = ERROR_TOO_LARGE;
+    }
+    if(status == STATUS_OK && growBuffer((void **)frame, capacity, *length + 1) != STATUS_OK) {
+        status = ERROR_MEMORY;
+    }
+    if(status == STATUS_OK) status = readFull(conn, *frame, *length);
+    if(status != STATUS_OK) {
+        while(*fd_count > 0) close(fds[--*fd_count]);
+    }
+    return status;
+}
+
+/* Sends prefix and body as one frame, with fd_count descriptors. */
+static int sendFrame(int conn, const unsigned char *body, size_t length, const int *fds,
+                     int fd_count) {
+    unsigned char prefix[4];
+    struct msghdr message;
+    struct iovec parts[2];
+    union {
+        struct cmsghdr align;
+        char bytes[CMSG_SPACE(MAX_FRAME_FDS * sizeof(int))];
+    } ancillary;
+    ssize_t put;
+
+    storeLE32(prefix, length);
+    memset(&message, 0, sizeof(message));
+    parts[0].iov_base = prefix;
+    parts[0].iov_len = sizeof(prefix);
+    parts[1].iov_base = (void *)body;
+    parts[1].iov_len = length;
+    message.msg_iov = parts;
+    message.msg_iovlen = 2;
+    if(fd_count > 0) {
+        memset(&ancillary, 0, sizeof(ancillary));
+        message.msg_control = ancillary.bytes;
+        message.msg_controllen = CMSG_SPACE(fd_count * sizeof(int));
+        struct cmsghdr *control = CMSG_FIRSTHDR(&message);
+        control->cmsg_level = SOL_SOCKET;
+        control->cmsg_type = SCM_RIGHTS;
+        control->cmsg_len = CMSG_LEN(fd_count * sizeof(int));
+        memcpy(CMSG_DATA(control), fds, fd_count * sizeof(int));
+    }
+    do {
+        put = sendmsg(conn, &message, MSG_NOSIGNAL);
+    } while(put < 0 && errno == EINTR);
+    if(put < 0) return ERROR_WRITE;
+
+    /* Whatever didn't fit goes after it, the descriptors already went. */
+    size_t sent = (size_t)put;
+    if(sent < sizeof(prefix)) {
+        if(writeFull(conn, prefix + sent, sizeof(prefix) - sent) != STATUS_OK) return ERROR_WRITE;
+        sent = sizeof(prefix);
+    }
+    return writeFull(conn, body + (sent - sizeof(prefix)), length - (sent - sizeof(prefix)));
+}
+
+/* Loads the request's image into the worker's context, from a passed
+ * descriptor or through the worker's image cache. The client keeps its
+ * end of a descriptor, so it is only mapped once sealed against
+ * shrinking and writes; truncating a mapped file would SIGBUS the
+ * server. Anything else is read into the output buffer instead. */
+static int loadRequestImage(serveworker_t *worker, const char *infile, int image_fd) {
+    stegctx_t *ctx = &worker->ctx;
+    struct stat info;
+    int status;
+
+    if(image_fd < 0) {
+        if(!infile) return ERROR_OPEN;
+        return loadCachedImage(ctx, &worker->cache, (char *)infile);
+    }
+
+    if(fstat(image_fd, &info) != 0) return ERROR_OPEN;
+    if(info.st_size < BMP_HEADERS_SIZE) return ERROR_FORMAT;
+    size_t size = (size_t)info.st_size;
+    int seals = fcntl(image_fd, F_GET_SEALS);
+    if(seals >= 0 && (seals & (F_SEAL_SHRINK | F_SEAL_WRITE)) == (F_SEAL_SHRINK | F_SEAL_WRITE)) {
+        void *bytes = mmap(NULL, size, PROT_READ, MAP_PRIVATE, image_fd, 0);
+        if(bytes == MAP_FAILED) return ERROR_OPEN;
+        status = parseImageBuffer(bytes, size, &ctx->pic, &ctx->header_capacity,
+                                  &ctx->rgb_capacity);
+        munmap(bytes, size);
+        return status;
+    }
+
+    if(growBuffer((void **)&ctx->output, &ctx->output_capacity, size) != STATUS_OK) {
+        return ERROR_MEMORY;
+    }
+    status = readAt(image_fd, ctx->output, size, 0);
+    if(status != STATUS_OK) return status;
+    return parseImageBuffer(ctx->output, size, &ctx->pic, &ctx->header_capacity,
+                            &ctx->rgb_capacity);
+}
+
+/* Runs one request and fills in the reply. Returned data points into
+ * the worker's context. */
+static void runRequest(serveworker_t *worker, int op, const char *infile, const char *outfile,
+                       const char *message, int image_fd, int output_fd, reply_t *reply) {
+    stegctx_t *ctx = &worker->ctx;
+    capacity_t capacity;
+    payloadheader_t header;
+    fileheader_t fh;
+    imageheader_t ih;
+
+    int status = loadRequestImage(worker, infile, image_fd);
+    if(status != STATUS_OK) {
+        reply->status = status;
+        return;
+    }
+
+    if(op == REQUEST_ENCODE) {
+        if(!message) status = ERROR_EMPTY;
+        if(status == STATUS_OK) status = buildPayload(ctx, (char *)message);
+        if(status == STATUS_OK) status = embedPayload(ctx);
+        if(status == STATUS_OK && outfile) {
+            status = writeImageFile(&ctx->pic, (char *)outfile, &ctx->output,
+                                    &ctx->output_capacity);
+            if(status == STATUS_OK) storeImage(&worker->cache, outfile, &ctx->pic);
+        } else if(status == STATUS_OK) {
+            status = serialiseImage(&ctx->pic, &ctx->output, &ctx->output_capacity,
+                                    &ctx->output_length);
+            if(status == STATUS_OK && output_fd >= 0) {
+                if(ftruncate(output_fd, (off_t)ctx->output_length) != 0 ||
+                   lseek(output_fd, 0, SEEK_SET) != 0 ||
+                   writeFull(output_fd, ctx->output, ctx->output_length) != STATUS_OK) {
+                    status = ERROR_WRITE;
+                }
+            } else if(status == STATUS_OK) {
+                reply->data = ctx->output;
+                reply->length = ctx->output_length;
+            }
+        }
+        reply->codec = ctx->codec_used;
+        reply->payload_bits = ctx->payload_bits;
+    } else if(op == REQUEST_DECODE) {
+        status = extractPayload(ctx, &ctx->pic);
+        if(status == STATUS_OK) {
+            reply->data = (unsigned char *)ctx->message;
+            reply->length = ctx->message_length;
+            reply->codec = ctx->codec_used;
+            reply->payload_bits = ctx->payload_bits;
+        }
+    } else if(op == REQUEST_PROBE) {
+        parseHeaders(ctx->pic.header, &fh, &ih);
+        status = headerCapacity(&fh, &ih, NULL, &capacity);
+        if(status == STATUS_OK) {
+            reply->width = capacity.width;
+            reply->height = capacity.height;
+            reply->capacity_bits = capacity.modes[MODE_LSB].payload_bits;
+
+            /* Keyed payloads are found with the request's key. */
+            scatter_t order;
+            initScatter(&order, ctx, capacity.channel_bytes);
+            int found = readHeader(&ctx->pic, &order, &header) == STATUS_OK;
+            if(!found && order.keyed) found = readPayloadHeader(&ctx->pic, &header) == STATUS_OK;
+            reply->payload_state = found ? PAYLOAD_PRESENT : PAYLOAD_NONE;
+            if(found) {
+                reply->codec = header.codec;
+                reply->flags = header.flags;
+                reply->payload_bits = header.payload_bits;
+                reply->message_length = header.message_length;
+            }
+        }
+    } else {
+        status = ERROR_FORMAT;
+    }
+    reply->status = status;
+}
+
+/* Reads one request from a connection, runs it and sends the reply.
+ * Anything but STATUS_OK ends the connection. */
+static int serveRequest(serveworker_t *worker, int conn) {
+    unsigned char fixed[4 + REPLY_FIXED_BYTES + 4];
+    size_t length, pos = REQUEST_FIXED_BYTES, sizes[REQUEST_STRINGS];
+    const char *strings[REQUEST_STRINGS];
+    int fds[MAX_FRAME_FDS], fd_count, i;
+    reply_t reply;
+
+    int status = receiveFrame(conn, &worker->frame, &worker->frame_capacity, &length, fds,
+                              &fd_count);
+    if(status != STATUS_OK) return status;
+    if(length < REQUEST_FIXED_BYTES) status = ERROR_CORRUPT;
+    for(i = 0; i < REQUEST_STRINGS && status == STATUS_OK; i++) {
+        strings[i] = takeString(worker->frame, length, &pos, &sizes[i], &status);
+    }
+
+    /* The descriptors flagged are taken in order from those sent. */
+    int op = 0, flags = 0, image_fd = -1, output_fd = -1, next = 0;
+    if(status == STATUS_OK) {
+        op = worker->frame[0];
+        flags = worker->frame[1];
+        worker->ctx.codec = (int)readLE32(worker->frame + 4);
+        if((flags & REQUEST_IMAGE_FD) && next < fd_count) image_fd = fds[next++];
+        if((flags & REQUEST_OUTPUT_FD) && next < fd_count) output_fd = fds[next++];
+        if(((flags & REQUEST_IMAGE_FD) && image_fd < 0) ||
+           ((flags & REQUEST_OUTPUT_FD) && output_fd < 0)) {
+            status = ERROR_OPEN;
+        }
+    }
+
+    memset(&reply, 0, sizeof(reply));
+    reply.codec = CODEC_RAW;
+    reply.payload_state = PAYLOAD_UNKNOWN;
+    if(status == STATUS_OK) {
+        setScatterKey(&worker->ctx, strings[3]);
+        setPassphrase(&worker->ctx, strings[4]);
+        runRequest(worker, op, strings[0], strings[1], strings[2], image_fd, output_fd, &reply);
+        setPassphrase(&worker->ctx, NULL);
+    } else {
+        reply.status = status;
+    }
+    while(fd_count > 0) close(fds[--fd_count]);
+
+    /* The frame length, fixed part and data length go out first, the
+       data itself straight from the context. */
+    storeLE32(fixed, REPLY_FIXED_BYTES + 4 + reply.length + 1);
+    storeLE32(fixed + 4, (unsigned long)reply.status);
+    storeLE32(fixed + 8, (unsigned long)reply.codec);
+    storeLE32(fixed + 12, reply.payload_bits);
+    storeLE32(fixed + 16, (unsigned long)reply.width);
+    storeLE32(fixed + 20, (unsigned long)reply.height);
+    storeLE32(fixed + 24, reply.capacity_bits);
+    storeLE32(fixed + 28, (unsigned long)reply.payload_state);
+    storeLE32(fixed + 32, (unsigned long)reply.flags);
+    storeLE32(fixed + 36, reply.message_length);
+    storeLE32(fixed + 4 + REPLY_FIXED_BYTES, reply.length);
+    if(writeFull(conn, fixed, sizeof(fixed)) != STATUS_OK ||
+       (reply.length && writeFull(conn, reply.data, reply.length) != STATUS_OK) ||
+       writeFull(conn, "", 1) != STATUS_OK) {
+        return ERROR_WRITE;
+    }
+    return status == ERROR_CORRUPT || status == ERROR_TOO_LARGE ? status : STATUS_OK;
+}
+
+/* Checks a connection's peer credentials. Requests name files the
+ * server reads and writes as its own user, so only that user and root
+ * may send them, whatever the socket's mode ends up being.
+ *
+ * Input:
+ *  - int conn: An accepted connection.
+ * Output:
+ *  - 1 if the peer may send requests, else 0.
+ */
+static int trustedPeer(int conn) {
+    struct ucred cred;
+    socklen_t length = sizeof(cred);
+    if(getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &length) != 0) return 0;
+    return cred.uid == geteuid() || cred.uid == 0;
+}
+
+static void *serveWorker(void *arg) {
+    serveworker_t *worker = arg;
+    for(;;) {
+        int conn = accept(worker->listen_fd, NULL, NULL);
+        if(conn < 0 && (errno == EINTR || errno == ECONNABORTED) && !*worker->stopping) continue;
+        if(conn < 0 || *worker->stopping) {
+            if(conn >= 0) close(conn);
+            break;
+        }
+        if(!trustedPeer(conn)) {
+            close(conn);
+            continue;
+        }
+        worker->conn = conn;
+        while(serveRequest(worker, conn) == STATUS_OK) {}
+        worker->conn = -1;
+        close(conn);
+    }
+    return NULL;
+}
+
+/* Runs a server on a Unix domain socket until SIGINT or SIGTERM. A
+ * pool of threads accepts connections, each thread with its own
+ * context and image cache, so buffers stay allocated and images stay
+ * loaded between requests. A connection can send any number of
+ * requests, see the protocol above and sendRequest(). The socket is
+ * created 0600 and peers running as another user are turned away.
+ * SIGPIPE is ignored so a client going away can't stop the server.
+ *
+ * Input:
+ *  - const char *path: Socket path. A stale socket there is replaced.
+ *  - int threads: Pool size, 0 for SERVE_THREADS_PER_CPU per CPU.
+ * Output:
+ *  - STATUS_OK once stopped, ERROR_IN_USE if a server is listening on
+ *    path, ERROR_OPEN if the socket couldn't be set up, or
+ *    ERROR_MEMORY.
+ */
+int serveSocket(const char *path, int threads) {
+    struct sockaddr_un address;
+    struct stat info;
+    sigset_t signals, previous;
+    volatile int stopping = 0;
+    int i, started = 0, signal_number;
+
+    if(strlen(path) >= sizeof(address.sun_path)) return ERROR_OPEN;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(listen_fd < 0) return ERROR_OPEN;
+    /* A socket left by a server that died is replaced, one that still
+       accepts connections belongs to a running server and is kept. */
+    if(lstat(path, &info) == 0 && S_ISSOCK(info.st_mode)) {
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int live = probe >= 0 &&
+                   connect(probe, (struct sockaddr *)&address, sizeof(address)) == 0;
+        if(probe >= 0) close(probe);
+        if(live) {
+            close(listen_fd);
+            return ERROR_IN_USE;
+        }
+        unlink(path);
+    }
+    /* Only the owner may connect: the socket is created 0600, before
+       the pool starts, so the umask change can't race another thread. */
+    mode_t mask = umask(0177);
+    int bound = bind(listen_fd, (struct sockaddr *)&address, sizeof(address));
+    umask(mask);
+    if(bound != 0 || listen(listen_fd, SERVE_BACKLOG) != 0) {
+        close(listen_fd);
+        return ERROR_OPEN;
+    }
+
+    if(threads <= 0) threads = parallelThreads(0, MAX_THREADS) * SERVE_THREADS_PER_CPU;
+    if(threads > MAX_THREADS) threads = MAX_THREADS;
+    serveworker_t *workers = stegAlloc(threads * sizeof(serveworker_t));
+    if(!workers) {
+        close(listen_fd);
+        unlink(path);
+        return ERROR_MEMORY;
+    }
+
+    /* Only this thread takes the stop signals, the pool inherits the
+       blocked mask. */
+    signal(SIGPIPE, SIG_IGN);
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, &previous);
+
+    for(i = 0; i < threads; i++) {
+        serveworker_t *worker = &workers[started];
+        initContext(&worker->ctx);
+        worker->ctx.codec_threads = 1;
+        initImageCache(&worker->cache, IMAGE_CACHE_BUDGET / threads);
+        worker->frame = NULL;
+        worker->frame_capacity = 0;
+        worker->listen_fd = listen_fd;
+        worker->conn = -1;
+        worker->stopping = &stopping;
+        if(pthread_create(&worker->id, NULL, serveWorker, worker) == 0) started++;
+    }
+
+    if(started > 0) sigwait(&signals, &signal_number);
+
+    /* Wakes the pool out of accept() and any idle connection. */
+    stopping = 1;
+    shutdown(listen_fd, SHUT_RDWR);
+    for(i = 0; i < started; i++) {
+        int conn = workers[i].conn;
+        if(conn >= 0) shutdown(conn, SHUT_RDWR);
+    }
+    for(i = 0; i < started; i++) {
+        pthread_join(workers[i].id, NULL);
+        freeContext(&workers[i].ctx);
+        freeImageCache(&workers[i].cache);
+        stegFree(workers[i].frame);
+    }
+    stegFree(workers);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    close(listen_fd);
+    unlink(path);
+    return started > 0 ? STATUS_OK : ERROR_MEMORY;
+}
+
+/* Connects to a server started with serveSocket().
+ *
+ * Input:
+ *  - const char *path: The server's socket path.
+ * Output:
+ *  - The connected descriptor, or ERROR_OPEN.
+ */
+int connectServer(const char *path) {
+    struct sockaddr_un address;
+
+    if(strlen(path) >= sizeof(address.sun_path)) return ERROR_OPEN;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd < 0) return ERROR_OPEN;
+    if(connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+        close(fd);
+        return ERROR_OPEN;
+    }
+    return fd;
+}
+
+/* Sends one request to a server and waits for its reply. Paths are
+ * opened by the server, so relative ones resolve against its working
+ * directory. An image passed as image_fd (e.g. a memfd) is mapped by
+ * the server rather than copied through the socket.
+ *
+ * Input:
+ *  - int server: Descriptor from connectServer().
+ *  - const request_t *request: The request.
+ *  - reply_t *reply: Receives the reply; free it with freeReply().
+ * Output:
+ *  - STATUS_OK if a reply arrived, reply->status then holds the
+ *    request's own status. Otherwise ERROR_WRITE, ERROR_OPEN,
+ *    ERROR_CORRUPT or ERROR_MEMORY.
+ */
+int sendRequest(int server, const request_t *request, reply_t *reply) {
+    const char *strings[REQUEST_STRINGS];
+    size_t sizes[REQUEST_STRINGS], length = REQUEST_FIXED_BYTES, pos;
+    int fds[MAX_FRAME_FDS], fd_count = 0, i;
+
+    memset(reply, 0, sizeof(*reply));
+    strings[0] = request->infile;
+    strings[1] = request->outfile;
+    strings[2] = request->message;
+    strings[3] = request->key;
+    strings[4] = request->passphrase;
+    for(i = 0; i < REQUEST_STRINGS; i++) {
+        sizes[i] = strings[i] ? strlen(strings[i]) : 0;
+        length += 4 + sizes[i] + 1;
+    }
+    if(length > MAX_FRAME_BYTES) return ERROR_TOO_LARGE;
+
+    unsigned char *body = stegAlloc(length);
+    if(!body) return ERROR_MEMORY;
+    memset(body, 0, REQUEST_FIXED_BYTES);
+    body[0] = (unsigned char)request->op;
+    if(request->image_fd >= 0) {
+        body[1] |= REQUEST_IMAGE_FD;
+        fds[fd_count++] = request->image_fd;
+    }
+    if(request->output_fd >= 0) {
+        body[1] |= REQUEST_OUTPUT_FD;
+        fds[fd_count++] = request->output_fd;
+    }
+    storeLE32(body + 4, (unsigned long)request->codec);
+    for(pos = REQUEST_FIXED_BYTES, i = 0; i < REQUEST_STRINGS; i++) {
+        pos += storeString(body + pos, strings[i], sizes[i]);
+    }
+    int status = sendFrame(server, body, length, fds, fd_count);
+    stegFree(body);
+    if(status != STATUS_OK) return status;
+
+    unsigned char *frame = NULL;
+    size_t capacity = 0, data_length;
+    status = receiveFrame(server, &frame, &capacity, &length, fds, &fd_count);
+    while(status == STATUS_OK && fd_count > 0) close(fds[--fd_count]);
+    pos = REPLY_FIXED_BYTES;
+    if(status == STATUS_OK && length < REPLY_FIXED_BYTES) status = ERROR_CORRUPT;
+    if(status == STATUS_OK) takeString(frame, length, &pos, &data_length, &status);
+    if(status == STATUS_OK) {
+        reply->status = (int)readLE32(frame);
+        reply->codec = (int)readLE32(frame + 4);
+        reply->payload_bits = readLE32(frame + 8);
+        reply->width = (int)readLE32(frame + 12);
+        reply->height = (int)readLE32(frame + 16);
+        reply->capacity_bits = readLE32(frame + 20);
+        reply->payload_state = (int)readLE32(frame + 24);
+        reply->flags = (int)readLE32(frame + 28);
+        reply->message_length = readLE32(frame + 32);
+
+        /* The data is moved to the front of the frame, which the reply
+           then owns, NUL included. */
+        memmove(frame, frame + REPLY_FIXED_BYTES + 4, data_length + 1);
+        reply->data = frame;
+        reply->length = data_length;
+        return STATUS_OK;
+    }
+    stegFree(frame);
+    return status == ERROR_FORMAT ? ERROR_CORRUPT : status;
+}
+
+/* Frees the data held by a reply from sendRequest(). */
+void freeReply(reply_t *reply) {
+    stegFree(reply->data);
+    reply->data = NULL;
+    reply->length = 0;
+}
+
+/* Copies everything readable from infd into a new memfd, for passing an
+ * image to a server as image_fd, then seals it so the server can map
+ * it. With infd -1 the memfd is left empty and unsealed, for use as
+ * output_fd.
+ *
+ * Input:
+ *  - int infd: Descriptor to copy from, or -1.
+ * Output:
+ *  - The memfd, or ERROR_OPEN, ERROR_WRITE.
+ */
+int sharedImageFd(int infd) {
+    unsigned char chunk[STREAM_CHUNK / 16];
+    ssize_t got;
+
+    int fd = memfd_create("stegano-image", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if(fd < 0) return ERROR_OPEN;
+    if(infd < 0) return fd;
+    while((got = read(infd, chunk, sizeof(chunk))) != 0) {
+        if(got < 0 && errno == EINTR) continue;
+        if(got < 0 || writeFull(fd, chunk, (size_t)got) != STATUS_OK) {
+            close(fd);
+            return ERROR_WRITE;
+        }
+    }
+    /* Sealed, the server can map the image instead of copying it. */
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+    return fd;
+}
+
 /*Set all values to 0 in Struct */
 void initialiseQueue(queue_t *q)
 {
@@ -17,6 +17,240 @@
 
 #define MAX_MESSAGE_SIZE 256
 
+#define INFOHEADER_SIZE 40
+#define BMP_HEADERS_SIZE (FILEHEADER_SIZE + INFOHEADER_SIZE)
+
+/* Bits taken by total bits, message length and the frequency table,
+   stored ahead of the compressed message. */
+#define TREE_BITS (BITS_PER_BYTE * 2 + MAX_MESSAGE_SIZE * BITS_PER_BYTE)
+
+/* Payload header: magic, version, codec, flags, message length,
+   payload bits and CRC32C, all whole bytes. Version 1 headers have no
+   CRC. */
+#define HEADER_MAGIC_0 'S'
+#define HEADER_MAGIC_1 'G'
+#define HEADER_VERSION 2
+#define HEADER_VERSION_NO_CRC 1
+#define HEADER_LENGTH_BITS 32
+#define HEADER_LENGTH_MAX 0xffffffffUL
+#define HEADER_CRC_BITS 32
+#define HEADER_V1_BITS (BITS_PER_BYTE * 5 + HEADER_LENGTH_BITS * 2)
+#define HEADER_BITS (HEADER_V1_BITS + HEADER_CRC_BITS)
+
+/* Header flags. */
+#define HEADER_SCATTERED 0x01
+#define HEADER_CHACHA20 0x02
+#define HEADER_SHARDED 0x04
+#define HEADER_AUTHENTICATED 0x08
+#define HEADER_MATRIX_MASK 0xf0
+#define HEADER_KNOWN_FLAGS (HEADER_SCATTERED | HEADER_CHACHA20 | HEADER_SHARDED | \
+                            HEADER_AUTHENTICATED | HEADER_MATRIX_MASK)
+
+/* Matrix embedding: with a code size k in the top nibble of the flags,
+   the payload after the header is carried k bits at a time in blocks of
+   2^k - 1 channel bytes as a Hamming syndrome, changing at most one
+   byte per block. Blocks are coded MATRIX_CHUNK_BITS channel bytes at
+   a time. */
+#define HEADER_MATRIX_SHIFT 4
+#define MATRIX_MIN_K 2
+#define MATRIX_MAX_K 8
+#define MATRIX_CHUNK_BITS (1 << 15)
+
+/* Sharded payloads: payload id, shard index and shard count, stored
+   after the CRC with HEADER_SHARDED. */
+#define HEADER_SHARD_ID_BITS 32
+#define HEADER_SHARD_INDEX_BITS 16
+#define HEADER_SHARD_BITS (HEADER_SHARD_ID_BITS + HEADER_SHARD_INDEX_BITS * 2)
+#define MAX_SHARDS ((1 << HEADER_SHARD_INDEX_BITS) - 1)
+
+/* Keyed embedding order: channel bytes per shuffled block (one cache
+   line), and Feistel rounds of the block permutation. */
+#define SCATTER_BLOCK 64
+#define SCATTER_ROUNDS 4
+
+/* Payload encryption: ChaCha20 with a 256 bit key derived from a
+   passphrase and a 96 bit nonce stored after the header. With
+   HEADER_AUTHENTICATED the nonce also salts the key derivation
+   (PBKDF2-HMAC-SHA256, PASSPHRASE_ITERATIONS rounds) and is followed
+   by a 64 bit HMAC-SHA256 tag of the payload, which tells a wrong
+   passphrase from a right one. Without it the key is the old unsalted
+   one, LEGACY_PASSPHRASE_ROUNDS ChaCha20 blocks over the passphrase. */
+#define CHACHA_KEY_WORDS 8
+#define CHACHA_NONCE_BYTES 12
+#define CHACHA_BLOCK 64
+#define CHACHA_DOUBLE_ROUNDS 10
+#define HEADER_NONCE_BITS (CHACHA_NONCE_BYTES * BITS_PER_BYTE)
+#define SHA256_BYTES 32
+#define SHA256_BLOCK 64
+#define PASSPHRASE_ITERATIONS 4096
+#define LEGACY_PASSPHRASE_ROUNDS 4096
+#define HEADER_TAG_BYTES 8
+#define HEADER_TAG_BITS (HEADER_TAG_BYTES * BITS_PER_BYTE)
+
+/* Largest payload header, with every optional field. */
+#define HEADER_MAX_BITS (HEADER_BITS + HEADER_SHARD_BITS + HEADER_NONCE_BITS + HEADER_TAG_BITS)
+
+/* Payload codecs, the id is stored in the header. CODEC_LEGACY marks
+   images in the format from before codecs, which can't be written. */
+#define CODEC_RAW 0
+#define CODEC_RLE 1
+#define CODEC_LZ77 2
+#define CODEC_HUFFMAN 3
+#define CODEC_STATIC 4
+#define CODEC_BLOCKS 5
+#define CODEC_TANS 6
+#define CODEC_ADAPTIVE 7
+#define CODEC_COUNT 8
+#define CODEC_LEGACY 255
+/* Codec choices besides a fixed id: try them all and keep the fewest
+   bits, or use the static tables without trying the rest. */
+#define CODEC_BEST -1
+#define CODEC_FAST -2
+
+/* Built-in tables of CODEC_STATIC, the id is stored in its stream. */
+#define STATIC_ENGLISH 0
+#define STATIC_JSON 1
+#define STATIC_HEX_BASE64 2
+#define STATIC_TABLES 3
+
+/* Codec parameters. */
+#define GAMMA_MAX_BITS 32
+#define RLE_MAX_RUN 4096
+#define LZ_WINDOW (1 << LZ_DISTANCE_BITS)
+#define LZ_DISTANCE_BITS 12
+#define LZ_HASH_SIZE 4096
+#define LZ_MIN_MATCH 3
+#define LZ_MAX_MATCH 258
+#define LZ_MAX_CHAIN 32
+#define HUFFMAN_MAX_BITS 48
+#define HUFFMAN_LENGTH_BITS 6
+#define HUFFMAN_TABLE_BITS (BITS_PER_BYTE + 256 * (BITS_PER_BYTE + HUFFMAN_LENGTH_BITS))
+/* Block Huffman: message bytes per block and bits of each block's size
+   in the index. */
+#define HUFFMAN_BLOCK_BYTES (64 << 10)
+#define HUFFMAN_BLOCK_INDEX_BITS 32
+/* Symbol count above which a stored symbol set is a 256 bit map
+   instead of one byte per symbol. */
+#define SYMBOL_MAP_SYMBOLS 32
+/* tANS: smallest and largest state table, as powers of two, and the
+   bits storing the one used. */
+#define TANS_MIN_LOG 5
+#define TANS_MAX_LOG 11
+#define TANS_LOG_BITS 4
+/* Adaptive arithmetic coder: bits of each probability, and how fast
+   probabilities follow the input (a 1/16 step per bit). */
+#define ADAPTIVE_PROB_BITS 12
+#define ADAPTIVE_RATE 4
+/* Most message bytes any codec packs into one payload bit. */
+#define MAX_EXPANSION 128
+
+/* Status codes returned by the library, 0 on success. */
+#define STATUS_OK 0
+#define ERROR_OPEN -10
+#define ERROR_FORMAT -11
+#define ERROR_MEMORY -12
+#define ERROR_EMPTY -13
+#define ERROR_TOO_LARGE -14
+#define ERROR_TOO_SMALL -15
+#define ERROR_WRITE -16
+#define ERROR_CORRUPT -17
+#define ERROR_PASSPHRASE -18
+#define ERROR_SHARDED -19
+#define ERROR_MISSING_SHARD -20
+#define ERROR_STREAM_WINDOW -21
+#define ERROR_WRONG_PASSPHRASE -22
+#define ERROR_IN_USE -23
+
+/* Largest Huffman tree over 256 characters, and its deepest code. */
+#define MAX_TREE_NODES (2 * 256 - 1)
+#define MAX_CODE_BITS 256
+
+/* Largest single copy when streaming between descriptors. */
+#define STREAM_CHUNK (1 << 20)
+/* Largest read of a message streamed in by encodeMessageFd(); what's
+   read is embedded before the next read. */
+#define MESSAGE_CHUNK (16 << 10)
+
+/* Bytes of rows assembled per write when saving an image, and the
+   alignment of the buffer they're assembled in. */
+#define WRITE_CHUNK (4 << 20)
+#define WRITE_ALIGN 4096
+
+/* Metadata cache size, and the longest path it stores. */
+#define MAX_META_ENTRIES 256
+#define MAX_PATH_LENGTH 256
+
+/* Image cache slots, and the default memory budget for loaded images. */
+#define MAX_IMAGE_ENTRIES 16
+#define IMAGE_CACHE_BUDGET (64 << 20)
+
+/* Most threads a parallel operation starts. */
+#define MAX_THREADS 64
+
+/* Directory scans are I/O bound, so they default to more threads than
+   CPUs. */
+#define SCAN_THREADS_PER_CPU 4
+
+/* I/O engines for batch operations, see initIoEngine(). */
+#define IO_ENGINE_AUTO 0
+#define IO_ENGINE_URING 1
+#define IO_ENGINE_PREAD 2
+#define IO_QUEUE_DEPTH 64
+#define IO_MAX_TRANSFER (1U << 30)
+/* Files read, processed and written together by batch operations. */
+#define IO_BATCH 16
+
+/* Server requests, see serveSocket(). */
+#define REQUEST_ENCODE 1
+#define REQUEST_DECODE 2
+#define REQUEST_PROBE 3
+/* Request flags: the input image, or the output, is a passed descriptor. */
+#define REQUEST_IMAGE_FD 0x01
+#define REQUEST_OUTPUT_FD 0x02
+#define MAX_FRAME_BYTES (64 << 20)
+#define SERVE_BACKLOG 64
+#define SERVE_THREADS_PER_CPU 2
+
+/* What the metadata cache knows about an image's payload. */
+#define PAYLOAD_UNKNOWN 0
+#define PAYLOAD_NONE 1
+#define PAYLOAD_PRESENT 2
+
+/* Embedding modes, each has its own capacity. MODE_MATRIX is matrix
+   embedding with MATRIX_MIN_K, followed by one mode per larger k. */
+#define MODE_LSB 0
+#define MODE_MATRIX 1
+#define EMBED_MODES (MODE_MATRIX + MATRIX_MAX_K - MATRIX_MIN_K + 1)
+
+/***** Memory *****/
+/* Allocation hook used for every allocation the library makes.
+   release() is given the size that was originally requested, so
+   arenas and pools don't have to track it themselves. Worker threads
+   (encodeMany(), scanDirectory(), the blocks codec, serveSocket())
+   call it too, so it must be thread-safe. */
+typedef struct {
+    void *(*allocate)(size_t size, void *user);
+    void (*release)(void *ptr, size_t size, void *user);
+    void *user;
+} allocator_t;
+
+/* Allocation counters of one thread since its last resetAllocStats()
+   call, including work it ran on other threads through the library. */
+typedef struct {
+    size_t current_bytes;
+    size_t peak_bytes;
+    unsigned long allocations;
+    unsigned long releases;
+} allocstats_t;
+
+/* Fixed buffer bump allocator, can be plugged in with arenaAllocator().
+   Thread-safe. */
+typedef struct {
+    unsigned char *base;
+    size_t size;
+    size_t used;
+} arena_t;
+
 /***** Encode, decode *****/
 typedef struct {
     unsigned char bfType[BFTYPE_SIZE];
@@ -52,6 +286,91 @@ typedef struct {
     rgb_t *rgb;
 } image_t;
 
+/* An image file opened and checked once by openImage(). Loaders take
+   the handle rather than opening the path again. */
+typedef struct {
+    int fd;
+    fileheader_t fh;
+    imageheader_t ih;
+    size_t stride;
+    unsigned long long size;
+} imagefile_t;
+
+/* Capacity of an image for one embedding mode. */
+typedef struct {
+    const char *name;
+    unsigned long payload_bits;
+    unsigned long payload_bytes;
+} modecapacity_t;
+
+/* Result of probeCapacity(). The message fields are only filled in
+   when a message is given. */
+typedef struct {
+    int width;
+    int height;
+    unsigned long long channel_bytes;
+    unsigned long header_bits;
+    modecapacity_t modes[EMBED_MODES];
+    unsigned long message_bytes;
+    unsigned long message_bits;
+    int codec;
+    int fits;
+} capacity_t;
+
+/* Cached facts about one image file. The identity fields are checked
+   with stat() on every lookup and the entry is dropped when any differ. */
+typedef struct {
+    char path[MAX_PATH_LENGTH];
+    unsigned long long size;
+    long long mtime_sec;
+    long mtime_nsec;
+    unsigned long long inode;
+    unsigned long long device;
+    /* Raw and parsed BMP headers, and the openImage() checks on them. */
+    unsigned char headers[BMP_HEADERS_SIZE];
+    fileheader_t fh;
+    imageheader_t ih;
+    int format_status;
+    /* Payload summary, filled in once the file is decoded or written. */
+    int payload_state;
+    unsigned long payload_bits;
+    unsigned long message_length;
+    unsigned long last_used;
+} metaentry_t;
+
+/* Least recently used table of metaentry_t, persisted in stegano.dat. */
+typedef struct {
+    metaentry_t entries[MAX_META_ENTRIES];
+    int count;
+    unsigned long clock;
+    unsigned long hits;
+    unsigned long misses;
+    int dirty; /* Set when an entry is added, dropped or updated. */
+} metacache_t;
+
+/* A loaded image kept in memory, valid while its file's size and mtime
+   are unchanged. */
+typedef struct {
+    char path[MAX_PATH_LENGTH];
+    unsigned long long size;
+    long long mtime_sec;
+    long mtime_nsec;
+    image_t pic;
+    size_t bytes;
+    unsigned long last_used;
+} imageentry_t;
+
+/* Least recently used set of loaded images within a byte budget. */
+typedef struct {
+    imageentry_t entries[MAX_IMAGE_ENTRIES];
+    int count;
+    size_t budget;
+    size_t used;
+    unsigned long clock;
+    unsigned long hits;
+    unsigned long misses;
+} imagecache_t;
+
 /* QUEUE */
 typedef struct Queue
 {
@@ -61,34 +380,455 @@ typedef struct Queue
     int count;
 } queue_t;
 
+/* Packed bits, most significant bit of each byte first. Writes past
+   limit set overflow instead of growing the buffer. */
+typedef struct {
+    unsigned char *data;
+    size_t capacity;
+    size_t count;
+    size_t limit;
+    int overflow;
+} bitbuf_t;
+
+/* Payload header as stored in the image, see buildPayload(). */
+typedef struct {
+    int version;
+    int codec;
+    int flags;
+    unsigned long message_length;
+    unsigned long payload_bits;
+    /* CRC32C of the header and payload as embedded, from version 2. */
+    unsigned long crc;
+    /* Only present with HEADER_SHARDED, the payload bits are then the
+       shard_index'th piece of a payload split over shard_count images. */
+    unsigned long shard_id;
+    int shard_index;
+    int shard_count;
+    /* Only present with HEADER_CHACHA20. */
+    unsigned char nonce[CHACHA_NONCE_BYTES];
+    /* Only present with HEADER_AUTHENTICATED. */
+    unsigned char tag[HEADER_TAG_BYTES];
+} payloadheader_t;
+
+/* SHA-256 state: chaining words, a partly filled block and the bytes
+   hashed so far. */
+typedef struct {
+    unsigned int h[8];
+    unsigned char block[SHA256_BLOCK];
+    size_t fill;
+    unsigned long long length;
+} sha256_t;
+
+/* Passphrase state, see setPassphrase(). HMAC-SHA256 keyed with the
+   passphrase is kept as the hash states after its inner and outer key
+   blocks, so the passphrase itself isn't kept. The keys derived from it
+   are cached for the last nonce they were salted with. */
+typedef struct {
+    sha256_t inner;
+    sha256_t outer;
+    unsigned int legacy_key[CHACHA_KEY_WORDS];
+    int derived;
+    unsigned char salt[CHACHA_NONCE_BYTES];
+    unsigned int cipher_key[CHACHA_KEY_WORDS];
+    unsigned char mac_key[SHA256_BYTES];
+} passkey_t;
+
+/* One block of the block Huffman codec: its code lengths, and its
+   size and offset in bytes within the coded blocks. */
+typedef struct {
+    unsigned char lengths[256];
+    size_t bytes;
+    size_t offset;
+    int status;
+} huffblock_t;
+
+/* Where one block of a keyed order lies, for banded access. */
+typedef struct {
+    size_t place;
+    size_t block;
+} tileblock_t;
+
+/* One whole read or write for runIo(). tag is left to the caller. */
+typedef struct {
+    int fd;
+    int write;
+    unsigned char *buffer;
+    size_t length;
+    unsigned long long offset;
+    size_t done;
+    int status;
+    int tag;
+} iorequest_t;
+
+/* An I/O engine, io_uring or pread/pwrite. The ring fields are only
+   used by io_uring. */
+typedef struct {
+    int kind;
+    int depth;
+    int ring_fd;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    void *sqes;
+    size_t sqes_size;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    void *cqes;
+} ioengine_t;
+
+/* A request to a server, see sendRequest(). Strings may be NULL. */
+typedef struct {
+    int op;
+    const char *infile;
+    const char *outfile;
+    const char *message;
+    const char *key;
+    const char *passphrase;
+    int codec;
+    /* BMP bytes in a file or memfd instead of infile, -1 for none. */
+    int image_fd;
+    /* Receives the encoded BMP instead of outfile, -1 for none. */
+    int output_fd;
+} request_t;
+
+/* A server's reply. data holds the decoded message, or the encoded
+   image if no output was given, and is NUL-terminated. The probe
+   fields are only set for REQUEST_PROBE. */
+typedef struct {
+    int status;
+    int codec;
+    unsigned long payload_bits;
+    int width;
+    int height;
+    unsigned long capacity_bits;
+    int payload_state;
+    int flags;
+    unsigned long message_length;
+    unsigned char *data;
+    size_t length;
+} reply_t;
+
 typedef struct huffmanNode{
     char ch;
     int freq;
     struct huffmanNode *left, *right;
 } huffmanNode_t;
 
+/* Reusable encoder/decoder state. Buffers only grow, so once they fit
+   the images being processed, calls through a context allocate nothing.
+   A context must not be used by two threads at once. */
+typedef struct {
+    image_t pic;
+    size_t header_capacity;
+    size_t rgb_capacity;
+    /* Encoded BMP produced by encodeBufferContext(). */
+    unsigned char *output;
+    size_t output_capacity;
+    size_t output_length;
+    /* Header and compressed message, packed MSB first. */
+    unsigned char *bits;
+    size_t bits_capacity;
+    size_t bit_count;
+    /* Last decoded message. */
+    char *message;
+    size_t message_capacity;
+    /* Length of the last message built or decoded. */
+    size_t message_length;
+    /* Codec to encode with (a codec id, CODEC_BEST or CODEC_FAST), the
+       codec of the last payload and its size without the header. */
+    int codec;
+    int codec_used;
+    size_t payload_bits;
+    /* Keyed embedding order, see setScatterKey(). */
+    int scattered;
+    unsigned long long scatter_key;
+    /* Matrix embedding code size k, from MATRIX_MIN_K to MATRIX_MAX_K,
+       or 0 for one payload bit per channel byte. Channel bytes the last
+       encode changed, and for banded images the cover LSBs being coded. */
+    int matrix_k;
+    size_t changed_bytes;
+    unsigned char *slots;
+    size_t slots_capacity;
+    /* I/O engine for batch operations, an IO_ENGINE_* value. */
+    int io_engine;
+    /* Most bytes of pixels encodeContext() and decodeContext() hold at
+       once, 0 for no limit. Bigger images go through encodeTiled() and
+       decodeTiled(), which keep a band of rows and sort keyed blocks
+       in tile_blocks. */
+    size_t memory_limit;
+    tileblock_t *tile_blocks;
+    size_t tile_blocks_capacity;
+    /* Payload cipher keys, see setPassphrase(). */
+    int encrypted;
+    passkey_t passkey;
+    /* Coded payload, and the codec trial being compared against it. */
+    bitbuf_t packed;
+    bitbuf_t candidate;
+    /* Threads the block Huffman codec codes blocks on, 0 for one per
+       online CPU, and its per-block state. */
+    int codec_threads;
+    huffblock_t *huff_blocks;
+    size_t huff_blocks_capacity;
+    /* tANS output per symbol, see tansCompress(). */
+    unsigned short *tans_chunks;
+    size_t tans_chunks_capacity;
+    /* Huffman tree nodes, rebuilt in place on every call. */
+    huffmanNode_t nodes[MAX_TREE_NODES];
+    /* LZ77 hash chains. */
+    long lz_head[LZ_HASH_SIZE];
+    long lz_prev[LZ_WINDOW];
+} stegctx_t;
+
+/*** Memory ***/
+/* Replaces the allocator used by the library, NULL restores malloc/free.
+   Must be called before any library memory is allocated. */
+void setAllocator(const allocator_t *allocator);
+
+/* Allocates memory through the current allocator and records it. */
+void *stegAlloc(size_t size);
+
+/* Frees memory returned by stegAlloc() or any library function. */
+void stegFree(void *ptr);
+
+/* Starts a new operation on this thread: clears the counts and sets
+   peak to current. */
+void resetAllocStats(void);
+
+/* Returns this thread's allocation counters for the current operation. */
+allocstats_t getAllocStats(void);
+
+/* Prepares an arena over a caller owned buffer. */
+void initArena(arena_t *arena, void *buffer, size_t size);
+
+/* Returns an allocator that hands out memory from the given arena. */
+allocator_t arenaAllocator(arena_t *arena);
+/***************************************/
+
+/* Returns a readable description of a library status code. */
+const char *statusMessage(int status);
+
 /* Calculates padding needed for each row in the image */
 int calcPadding(int width);
 
-/* Checks for correct BMP file type and format */
+/* Checks for correct BMP file type and format, returns a status code. */
 int checkFileType(char *filename);
 
+/* Opens an image file, reading and checking its headers in one read. */
+int openImage(const char *path, imagefile_t *file);
+
+/* Closes an image opened by openImage(). */
+void closeImage(imagefile_t *file);
+
+/* Parses the file and info headers from the first BMP_HEADERS_SIZE bytes. */
+void parseHeaders(const unsigned char bytes[BMP_HEADERS_SIZE], fileheader_t *fh,
+                  imageheader_t *ih);
+
+/* Checks parsed headers for a 24-bit, uncompressed, bottom-up BMP. */
+int validateHeaders(const fileheader_t *fh, const imageheader_t *ih);
+
+/* Reads only the BMP headers and works out how much fits in the image.
+   If message is not NULL it is compressed and checked against the space. */
+int probeCapacity(char *infile, char *message, capacity_t *capacity);
+
+/* probeCapacity() for headers that were already read. */
+int headerCapacity(const fileheader_t *fh, const imageheader_t *ih, char *message,
+                   capacity_t *capacity);
+
 /*** Encode, decode helper functions ***/
-/* Read image, check for correct file format */
+/* Read image, check for correct file format. Empty on failure. */
 image_t readImage(char *infile);
 
 /* Set LSB of RGB channel to 0 or 1. */
-void setLSBPixel(image_t *pic, int bit_index, int bit);
+void setLSBPixel(image_t *pic, size_t bit_index, int bit);
 
 /* Extract LSB of RGB channel. */
-void getLSBPixel(image_t *pic, int bit_index, int *bit);
+void getLSBPixel(image_t *pic, size_t bit_index, int *bit);
+/***************************************/
+
+/* Frees the header and pixels of an image. */
+void freeImage(image_t *pic);
+
+/* Embed message into an image in memory, returns a status code. */
+int embedMessage(image_t *pic, char *message);
+
+/* Extract message from an image in memory, returns a status code. */
+int extractMessage(image_t *pic, char *outstring);
+
+/* Encode message into image, returns a status code. */
+int encode(char *infile, char *outfile, char *message);
+
+/* Decode message from image, returns a status code. */
+int decode(char *infile, char *outstring);
+
+/*** In-memory buffers, no filesystem access ***/
+/* Parse a BMP held in memory into an image. */
+int readImageBuffer(const unsigned char *bmp, size_t length, image_t *pic);
+
+/* Serialise an image into a new BMP buffer, freed with stegFree(). */
+int writeImageBuffer(image_t *pic, unsigned char **out, size_t *out_length);
+
+/* Encode message into a BMP buffer, returning a new encoded buffer. */
+int encodeBuffer(const unsigned char *bmp, size_t length, char *message,
+                 unsigned char **out, size_t *out_length);
+
+/* Decode message from a BMP buffer. */
+int decodeBuffer(const unsigned char *bmp, size_t length, char *outstring);
+/***************************************/
+
+/*** Reusable context ***/
+/* Prepare an empty context, nothing is allocated yet. */
+void initContext(stegctx_t *ctx);
+
+/* Free every buffer held by the context. */
+void freeContext(stegctx_t *ctx);
+
+/* Compress message into the context's header and payload bitstream. */
+int buildPayload(stegctx_t *ctx, char *message);
+
+/* Write the context's bitstream into an image's LSBs. */
+int applyPayload(const stegctx_t *ctx, image_t *pic);
+
+/* Read and decompress the message from an image into ctx->message. */
+int extractPayload(stegctx_t *ctx, image_t *pic);
+
+/* Scatter the payload in an order derived from key, NULL for none. */
+void setScatterKey(stegctx_t *ctx, const char *key);
+
+/* Encrypt payloads with a key derived from passphrase, NULL for none. */
+void setPassphrase(stegctx_t *ctx, const char *passphrase);
+
+/* Read and check only the payload header of an encoded image. */
+int readPayloadHeader(image_t *pic, payloadheader_t *header);
+
+/* Name of a codec id, and the id for a name (or CODEC_BEST/CODEC_FAST). */
+const char *codecName(int codec);
+int codecId(const char *name);
+
+/* Encode/decode files through a context's pooled buffers. */
+int encodeContext(stegctx_t *ctx, char *infile, char *outfile, char *message);
+int decodeContext(stegctx_t *ctx, char *infile, const char **outstring);
+
+/* Reads msgfd to its end into ctx->message, NUL terminated. */
+int readMessageFd(stegctx_t *ctx, int msgfd);
+
+/* Encodes a message read from msgfd into a file as it arrives, with
+   CODEC_ADAPTIVE, embedding each coded byte before the next is read. */
+int encodeMessageFd(stegctx_t *ctx, char *infile, char *outfile, int msgfd);
+
+/* Encode/decode BMP buffers through a context. Results are owned by the
+   context and valid until its next call. */
+int encodeBufferContext(stegctx_t *ctx, const unsigned char *bmp, size_t length,
+                        char *message, const unsigned char **out, size_t *out_length);
+int decodeBufferContext(stegctx_t *ctx, const unsigned char *bmp, size_t length,
+                        const char **outstring);
+
+/* Encode/decode a BMP streamed through file descriptors, e.g. stdin and
+   stdout. Only the rows carrying the payload are held in memory. */
+int encodeStream(stegctx_t *ctx, int infd, int outfd, char *message);
+int decodeStream(stegctx_t *ctx, int infd, const char **outstring);
+
+/* Encode/decode files a band of rows at a time, within ctx->memory_limit.
+   encodeContext()/decodeContext() switch to these for bigger images. */
+int encodeTiled(stegctx_t *ctx, char *infile, char *outfile, char *message);
+int decodeTiled(stegctx_t *ctx, char *infile, const char **outstring);
+/***************************************/
+
+/*** Metadata cache ***/
+/* Prepare an empty metadata cache. */
+void initMetaCache(metacache_t *cache);
+
+/* Find a path's entry if the file is unchanged, otherwise NULL. */
+metaentry_t *lookupMeta(metacache_t *cache, const char *path);
+
+/* Find a path's entry, reading only its headers on a miss. */
+metaentry_t *probeMeta(metacache_t *cache, const char *path, int *status);
+
+/* Remember whether a file carries a payload, and its size. */
+void recordPayload(metacache_t *cache, const char *path, int state,
+                   unsigned long payload_bits, unsigned long message_length);
+
+/* Write/read the cache in its binary form. */
+int saveMetaCache(const metacache_t *cache, FILE *file);
+int loadMetaCache(metacache_t *cache, FILE *file);
+/***************************************/
+
+/*** Image cache ***/
+/* Prepare an empty image cache holding at most budget bytes. */
+void initImageCache(imagecache_t *cache, size_t budget);
+
+/* Free every image held by the cache. */
+void freeImageCache(imagecache_t *cache);
+
+/* encodeContext()/decodeContext() reading images through the cache. */
+int encodeCached(stegctx_t *ctx, imagecache_t *cache, char *infile, char *outfile,
+                 char *message);
+int decodeCached(stegctx_t *ctx, imagecache_t *cache, char *infile,
+                 const char **outstring);
+/***************************************/
+
+/*** Fan-out, one message into many covers ***/
+/* Threads a parallel operation over count items would use. */
+int parallelThreads(int threads, int count);
+
+/* Compress message once and embed it into every cover in parallel. */
+int encodeMany(stegctx_t *ctx, char *message, char **infiles, char **outfiles,
+               int count, int *statuses, int threads);
+
+/* Decode many images in parallel, passing each message to decoded(). */
+int decodeMany(stegctx_t *ctx, char **infiles, int count, int *statuses, int threads,
+               void (*decoded)(int item, const char *message, void *user), void *user);
+
+/* Split one message's payload over covers, in order, encoding them in parallel. */
+int encodeSharded(stegctx_t *ctx, char *message, char **infiles, char **outfiles,
+                  int count, int *statuses, int threads);
+
+/* Decode every shard of a payload in parallel and reassemble the message. */
+int decodeSharded(stegctx_t *ctx, char **infiles, int count, int *statuses, int threads,
+                  const char **outstring);
+/***************************************/
+
+/*** I/O engine ***/
+/* Set up an engine, IO_ENGINE_AUTO prefers io_uring. */
+int initIoEngine(ioengine_t *engine, int kind);
+
+/* Run a batch of requests to completion. */
+int runIo(ioengine_t *engine, iorequest_t *requests, int count);
+
+/* Release an engine. */
+void freeIoEngine(ioengine_t *engine);
+
+/* Name of an IO_ENGINE_* value. */
+const char *ioEngineName(int kind);
 /***************************************/
 
-/* Encode message into image */
-void encode(char *infile, char *outfile, char *message);
+/*** Scanning ***/
+/* Call found() for every image under dir carrying a payload header. */
+int scanDirectory(const char *dir, int threads,
+                  void (*found)(const char *path, const payloadheader_t *header, void *user),
+                  void *user, unsigned long *files, unsigned long *carriers);
+/***************************************/
+
+/*** Server ***/
+/* Serve requests on a Unix domain socket until SIGINT or SIGTERM. */
+int serveSocket(const char *path, int threads);
+
+/* Connect to a server, returning the descriptor. */
+int connectServer(const char *path);
 
-/* Decode message from image */
-void decode(char *infile, char *outstring);
+/* Send one request and wait for the reply. */
+int sendRequest(int server, const request_t *request, reply_t *reply);
+
+/* Free the data held by a reply. */
+void freeReply(reply_t *reply);
+
+/* Copy a descriptor's contents into a new memfd, -1 for an empty one. */
+int sharedImageFd(int infd);
+/***************************************/
 
 /* Prepare the given queue to be used initially. */
 void initialiseQueue(queue_t *q);